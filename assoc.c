@@ -31,6 +31,7 @@
 
 #include "assoc.h"
 #include "memcached.h"
+#include "trace.h"
 
 /*
  * Since the hash function does bit manipulation, it needs to know
@@ -491,18 +492,21 @@ void assoc_init(void) {
     memset(primary_hashtable, 0, hash_size);
 }
 
-item *assoc_find(const char *key, const size_t nkey) {
-    uint32_t hv = hash(key, nkey, 0);
-    item_ptr_t iptr;
+/* returns the bucket a key with hash value hv is in. */
+static item_ptr_t* assoc_bucket(const uint32_t hv) {
     unsigned int oldbucket;
 
     if (expanding &&
         (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
     {
-        iptr = old_hashtable[oldbucket];
+        return &old_hashtable[oldbucket];
     } else {
-        iptr = primary_hashtable[hv & hashmask(hashpower)];
+        return &primary_hashtable[hv & hashmask(hashpower)];
     }
+}
+
+item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
+    item_ptr_t iptr = *assoc_bucket(hv);
 
     while (iptr) {
         if (item_key_compare(ITEM(iptr), key, nkey) == 0) {
@@ -513,21 +517,19 @@ item *assoc_find(const char *key, const size_t nkey) {
     return 0;
 }
 
+/* starts loading the hash bucket for hash value hv into the cache, so that a
+   later assoc_find doesn't wait on it. */
+void assoc_prefetch(const uint32_t hv) {
+#if defined(__GNUC__)
+    __builtin_prefetch(assoc_bucket(hv));
+#endif /* #if defined(__GNUC__) */
+}
+
 /* returns the address of the item pointer before the key.  if *item == 0,
    the item wasn't found */
 
 static item_ptr_t* _hashitem_before (const char *key, const size_t nkey) {
-    uint32_t hv = hash(key, nkey, 0);
-    item_ptr_t* pos;
-    unsigned int oldbucket;
-
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
-    } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
-    }
+    item_ptr_t* pos = assoc_bucket(hash(key, nkey, 0));
 
     while (*pos && item_key_compare(ITEM(*pos), key, nkey)) {
         pos = ITEM_h_next_p(ITEM(*pos));
@@ -554,9 +556,7 @@ static item_ptr_t* _hashitem_before_item (item* it) {
     char key_temp[KEY_MAX_LENGTH];
 #endif /* #if defined(USE_FLAT_ALLOCATOR) */
     const char* key;
-    uint32_t hv;
     item_ptr_t* pos;
-    unsigned int oldbucket;
 
 #if defined(USE_FLAT_ALLOCATOR)
     key = item_key_copy(it, key_temp);
@@ -564,15 +564,7 @@ static item_ptr_t* _hashitem_before_item (item* it) {
 #if defined(USE_SLAB_ALLOCATOR)
     key = ITEM_key(it);
 #endif /* #if defined(USE_SLAB_ALLOCATOR) */
-    hv = hash(key, ITEM_nkey(it), 0);
-
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
-    } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
-    }
+    pos = assoc_bucket(hash(key, ITEM_nkey(it), 0));
 
     while (*pos && (ITEM(*pos) != it)) {
         pos = ITEM_h_next_p(ITEM(*pos));
@@ -590,6 +582,7 @@ static void assoc_expand(void) {
         if (settings.verbose > 1)
             fprintf(stderr, "Hash table expansion starting\n");
         hashpower++;
+        TRACE_ASSOC_EXPAND_START(hashpower, hash_items);
         expanding = true;
         expand_bucket = 0;
         do_assoc_move_next_bucket();
@@ -643,36 +636,48 @@ void do_assoc_move_next_bucket(void) {
             pool_free(old_hashtable,
                       (hashsize(hashpower - 1) * sizeof(item_ptr_t)),
                       ASSOC_POOL);
+            TRACE_ASSOC_EXPAND_DONE(hashpower, hash_items);
             if (settings.verbose > 1)
                 fprintf(stderr, "Hash table expansion done\n");
         }
     }
 }
 
-/* Note: this isn't an assoc_update.  The key must not already exist to call this */
-int assoc_insert(item *it, const char* key) {
-    uint32_t hv;
-    unsigned int oldbucket;
+/* returns the link in the hash chain for hv that points at the item linked
+ * under key, or the link that ends the chain if there is none.  it stays
+ * good until the chain is next changed. */
+item_ptr_t* assoc_find_slot(const char *key, const size_t nkey, const uint32_t hv) {
+    item_ptr_t* pos = assoc_bucket(hv);
 
-    assert(assoc_find(key, ITEM_nkey(it)) == 0);  /* shouldn't have duplicately named things defined */
+    while (*pos && item_key_compare(ITEM(*pos), key, nkey)) {
+        pos = ITEM_h_next_p(ITEM(*pos));
+    }
+    return pos;
+}
 
-    hv = hash(key, ITEM_nkey(it), 0);
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        ITEM_set_h_next(it, old_hashtable[oldbucket]);
-        old_hashtable[oldbucket] = ITEM_PTR(it);
-    } else {
-        ITEM_set_h_next(it, primary_hashtable[hv & hashmask(hashpower)]);
-        primary_hashtable[hv & hashmask(hashpower)] = ITEM_PTR(it);
+/* links it into the hash table at slot, which assoc_find_slot returned for
+ * its key.  an item already linked there is replaced, and returned so that
+ * the caller can unlink it from everything else.  returns NULL if the key
+ * was not in the table. */
+item *assoc_link_slot(item_ptr_t* slot, item *it) {
+    if (*slot) {
+        item *old_it = ITEM(*slot);
+
+        ITEM_set_h_next(it, ITEM_PTR_h_next(*slot));
+        ITEM_set_h_next(old_it, NULL_ITEM_PTR);
+        *slot = ITEM_PTR(it);
+        return old_it;
     }
 
+    ITEM_set_h_next(it, NULL_ITEM_PTR);
+    *slot = ITEM_PTR(it);
+
     hash_items++;
     if (! expanding && hash_items > (hashsize(hashpower) * 3) / 2) {
         assoc_expand();
     }
 
-    return 1;
+    return NULL;
 }
 
 
@@ -702,6 +707,64 @@ void assoc_delete(const char *key, const size_t nkey) {
     assert(*before != 0);
 }
 
+static void assoc_visit_chain(item_ptr_t iptr, item_visitor_t visit, void* arg) {
+#if defined(USE_FLAT_ALLOCATOR)
+    char key_temp[KEY_MAX_LENGTH];
+#endif /* #if defined(USE_FLAT_ALLOCATOR) */
+    const char* key;
+
+    for (; ITEM_PTR_IS_NULL(iptr); iptr = ITEM_PTR_h_next(iptr)) {
+#if defined(USE_FLAT_ALLOCATOR)
+        key = item_key_copy(ITEM(iptr), key_temp);
+#endif /* #if defined(USE_FLAT_ALLOCATOR) */
+#if defined(USE_SLAB_ALLOCATOR)
+        key = ITEM_key(ITEM(iptr));
+#endif /* #if defined(USE_SLAB_ALLOCATOR) */
+        visit(ITEM(iptr), key, arg);
+    }
+}
+
+/*
+ * visits the items in the next slice of buckets of a walk over the hash
+ * table, so that the walk can let go of the cache lock between slices.  the
+ * cursor counts the buckets of the table as it was when the walk started.
+ * the table only ever grows, so the items of cursor bucket b are the ones in
+ * buckets b, b + 2^p, b + 2 * 2^p... of the current table, or of the old one
+ * for the buckets an expansion hasn't moved yet.  an item that stays in the
+ * cache throughout the walk is visited exactly once.
+ *
+ * returns true once the walk is over.  visit must not link or unlink items.
+ */
+bool do_assoc_walk(assoc_cursor_t* cursor, const uint32_t buckets,
+                   item_visitor_t visit, void* arg) {
+    uint32_t bucket, ix, end, step;
+
+    if (cursor->hashpower == 0) {
+        cursor->hashpower = expanding ? hashpower - 1 : hashpower;
+        cursor->next = 0;
+    }
+    step = hashsize(cursor->hashpower);
+    end = cursor->next + buckets;
+    if (end > step) {
+        end = step;
+    }
+
+    for (bucket = cursor->next; bucket < end; bucket++) {
+        for (ix = bucket; ix < hashsize(hashpower); ix += step) {
+            assoc_visit_chain(primary_hashtable[ix], visit, arg);
+        }
+        if (expanding) {
+            for (ix = bucket; ix < hashsize(hashpower - 1); ix += step) {
+                if (ix >= expand_bucket) {
+                    assoc_visit_chain(old_hashtable[ix], visit, arg);
+                }
+            }
+        }
+    }
+    cursor->next = end;
+    return end == step;
+}
+
 /* marks all items whose keys match a regular expression as expired. */
 int do_assoc_expire_regex(char *pattern) {
 #ifdef HAVE_REGEX_H
@@ -758,6 +821,7 @@ int do_assoc_expire_regex(char *pattern) {
             }
         }
     }
+    do_victim_expire_regex(&regex);
     return 1; /* success */
 #else
     return 0;
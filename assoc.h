@@ -6,11 +6,22 @@
 
 /* associative array */
 void assoc_init(void);
-item *assoc_find(const char *key, const size_t nkey);
-int assoc_insert(item *item, const char* key);
+item *assoc_find(const char *key, const size_t nkey, const uint32_t hv);
+void assoc_prefetch(const uint32_t hv);
+item_ptr_t* assoc_find_slot(const char *key, const size_t nkey, const uint32_t hv);
+item *assoc_link_slot(item_ptr_t* slot, item *it);
 void assoc_update(item* old_it, item *it);
 void assoc_delete(const char *key, const size_t nkey);
 void do_assoc_move_next_bucket(void);
 uint32_t hash( const void *key, size_t length, const uint32_t initval);
 int do_assoc_expire_regex(char *pattern);
+
+/* where a walk over the hash table has got to; zero it to start one. */
+typedef struct {
+    unsigned int hashpower;
+    uint32_t next;
+} assoc_cursor_t;
+
+DECL_MT_FUNC(bool, assoc_walk, (assoc_cursor_t* cursor, const uint32_t buckets,
+                                item_visitor_t visit, void* arg));
 #endif /* #if !defined(_assoc_h_) */
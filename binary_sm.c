@@ -35,6 +35,7 @@
 #include "items.h"
 #include "memcached.h"
 #include "stats.h"
+#include "trace.h"
 
 #if defined(USE_SLAB_ALLOCATOR)
 #include "slabs_items_support.h"
@@ -83,6 +84,7 @@ static inline bp_handler_res_t handle_header_size_known(conn* c);
 static inline bp_handler_res_t handle_direct_receive(conn* c);
 static inline bp_handler_res_t handle_process(conn* c);
 static inline bp_handler_res_t handle_writing(conn* c);
+static inline bp_handler_res_t handle_error(conn* c);
 
 // prototypes for handlers of various commands/command classes.
 static void handle_echo_cmd(conn* c);
@@ -91,8 +93,12 @@ static void handle_get_cmd(conn* c);
 static void handle_update_cmd(conn* c);
 static void handle_delete_cmd(conn* c);
 static void handle_arith_cmd(conn* c);
+static void handle_flush_all_cmd(conn* c);
+static void handle_flush_regex_cmd(conn* c);
 
 static void* allocate_reply_header(conn* c, size_t size, void* req);
+static void finish_reply(conn* c);
+static inline bool udp_replies_pending(conn* c);
 
 /**
  * when libevent tells us that a socket has data to read, we read it and process
@@ -212,6 +218,10 @@ static inline void binary_sm(conn* c) {
                 result = handle_writing(c);
                 break;
 
+            case conn_bp_error:
+                result = handle_error(c);
+                break;
+
             case conn_closing:
                 if (c->udp) {
                     conn_cleanup(c);
@@ -225,6 +235,10 @@ static inline void binary_sm(conn* c) {
                  assert(0);
         }
 
+        if (prev_state != c->state && prev_state != conn_closing) {
+            TRACE_CONN_STATE(c->sfd, prev_state, c->state);
+        }
+
         if (prev_state == conn_bp_writing &&
             c->state == conn_bp_header_size_unknown) {
             /* in between requests.  shrink connection buffers. */
@@ -368,6 +382,19 @@ static inline bp_handler_res_t handle_header_size_unknown(conn* c)
 
         bp_get_req_cmd_info(basic_header->cmd, &c->bp_info);
         c->state = conn_bp_header_size_known;
+    } else if (c->udp) {
+        // the datagram is used up; a stray byte left over can't be a request.
+        // send the replies to all the requests it held before reading the
+        // next one.
+        c->rbytes = 0;
+        if (udp_replies_pending(c)) {
+            c->state = conn_bp_writing;
+            if (build_udp_headers(c)) {
+                bp_write_err_msg(c, "out of memory");
+            }
+        } else {
+            retval.try_buffer_read = 1;
+        }
     } else {
         retval.try_buffer_read = 1;
     }
@@ -458,6 +485,11 @@ static inline bp_handler_res_t handle_header_size_known(conn* c)
         } else {
             c->state = conn_bp_process;
         }
+    } else if (c->udp) {
+        // requests can't be split across datagrams, so the end of this one
+        // is a truncated request.  drop it.
+        c->rbytes = 0;
+        c->state = conn_bp_header_size_unknown;
     } else {
         retval.try_buffer_read = 1;
     }
@@ -591,6 +623,7 @@ static inline bp_handler_res_t handle_direct_receive(conn* c)
                         c->riov_left <= IOV_MAX ? c->riov_left : IOV_MAX);
 
     if (res > 0) {
+        c->traffic.bytes_read += res;
         STATS_LOCK(stats);
         stats->bytes_read += res;
         STATS_UNLOCK(stats);
@@ -637,6 +670,8 @@ static inline bp_handler_res_t handle_process(conn* c)
 {
     bp_handler_res_t retval = {0, 0};
 
+    c->traffic.cmds++;
+
     // if we haven't set up the msghdrs structure to hold the outbound messages,
     // do so now.
     if (c->msgused == 0) {
@@ -696,10 +731,13 @@ static inline bp_handler_res_t handle_process(conn* c)
 
         // these commands go as a number_req and return as an empty_rep.
         case BP_FLUSH_ALL_CMD:
+            handle_flush_all_cmd(c);
+            break;
 
         // these commands go as a string_req and return as an empty_rep.
         case BP_FLUSH_REGEX_CMD:
-            assert(0);
+            handle_flush_regex_cmd(c);
+            break;
 
         // these commands go as a string_req and return as a string_rep.
         case BP_STATS_CMD:
@@ -749,6 +787,27 @@ static inline bp_handler_res_t handle_writing(conn* c)
 }
 
 
+/**
+ * sends the error reply queued by bp_write_err_msg(..).  the request that
+ * failed may not have been read in full, so whatever follows it in the
+ * datagram is dropped, and a tcp connection is closed.
+ */
+static inline bp_handler_res_t handle_error(conn* c)
+{
+    bp_handler_res_t retval = handle_writing(c);
+
+    if (c->state == conn_bp_header_size_unknown) {
+        if (c->udp) {
+            c->rbytes = 0;
+        } else {
+            c->state = conn_closing;
+        }
+    }
+
+    return retval;
+}
+
+
 static void handle_echo_cmd(conn* c)
 {
     empty_rep_t* rep;
@@ -768,11 +827,7 @@ static void handle_echo_cmd(conn* c)
         return;
     }
 
-    if (c->udp && build_udp_headers(c)) {
-        bp_write_err_msg(c, "out of memory");
-        return;
-    }
-    c->state = conn_bp_writing;
+    finish_reply(c);
 }
 
 
@@ -796,11 +851,7 @@ static void handle_version_cmd(conn* c)
         return;
     }
 
-    if (c->udp && build_udp_headers(c)) {
-        bp_write_err_msg(c, "out of memory");
-        return;
-    }
-    c->state = conn_bp_writing;
+    finish_reply(c);
 }
 
 
@@ -813,9 +864,15 @@ static void handle_get_cmd(conn* c)
         (sizeof(key_req_t) - BINARY_PROTOCOL_REQUEST_HEADER_SZ);
 
     // find the desired item.
-    it = item_get(c->bp_key, nkey);
+    it = item_get_promote(c->bp_key, nkey);
 
     // handle the counters.  do this all together because lock/unlock is costly.
+    c->traffic.get_cmds++;
+    if (it) {
+        c->traffic.get_hits++;
+    } else {
+        c->traffic.get_misses++;
+    }
     STATS_LOCK(stats);
     stats->get_cmds ++;
     if (it) {
@@ -861,6 +918,7 @@ static void handle_get_cmd(conn* c)
             }
         }
         *(c->ilist + c->ileft) = it;
+        c->ileft ++;
         item_update(it);
 
         STATS_LOCK(stats);
@@ -901,12 +959,7 @@ static void handle_get_cmd(conn* c)
     if (c->u.key_req.cmd == BP_GETQ_CMD) {
         c->state = conn_bp_header_size_unknown;
     } else {
-        c->state = conn_bp_writing;
-
-        if (c->udp && build_udp_headers(c)) {
-            bp_write_err_msg(c, "out of memory");
-            return;
-        }
+        finish_reply(c);
     }
 }
 
@@ -923,6 +976,7 @@ static void handle_update_cmd(conn* c)
         return;
     }
 
+    c->traffic.set_cmds++;
     STATS_LOCK(stats);
     stats->set_cmds ++;
     STATS_UNLOCK(stats);
@@ -956,6 +1010,7 @@ static void handle_update_cmd(conn* c)
         fprintf(stderr, ">%d received key %*s\n", c->sfd, c->u.key_value_req.keylen, c->bp_key);
     }
     if (store_item(it, comm, c->bp_key)) {
+        mirror_store(c->bp_key, ITEM_nkey(it));
         rep->status = mcc_res_stored;
     } else {
         rep->status = mcc_res_notstored;
@@ -986,14 +1041,18 @@ static void handle_delete_cmd(conn* c)
     size_t nkey = c->u.key_number_req.keylen;
     time_t exptime = ntohl(c->u.key_number_req.number);
 
+    c->traffic.delete_cmds++;
     if (settings.detail_enabled) {
         stats_prefix_record_delete(c->bp_key, nkey);
     }
-
     it = item_get(c->bp_key, nkey);
+    if (it == NULL) {
+        /* it may have been evicted; make sure a get doesn't bring it back.
+         * that is still a miss, as it is for the ascii delete. */
+        victim_delete(c->bp_key, nkey);
+    }
 
-    if (it ||
-        c->u.key_number_req.cmd == BP_DELETE_CMD) {
+    if (it || c->u.key_number_req.cmd == BP_DELETE_CMD) {
         if ((rep = ALLOCATE_REPLY_HEADER(c, empty_rep_t, &c->u.key_number_req)) == NULL) {
             bp_write_err_msg(c, "out of memory");
             return;
@@ -1030,6 +1089,7 @@ static void handle_delete_cmd(conn* c)
     } else {
         rep->status = mcc_res_notfound;
     }
+    mirror_delete(c->bp_key, nkey, exptime);
 
     if (add_iov(c, rep, sizeof(empty_rep_t), true)) {
         bp_write_err_msg(c, "couldn't build response");
@@ -1039,12 +1099,7 @@ static void handle_delete_cmd(conn* c)
     if (c->u.key_number_req.cmd == BP_DELETEQ_CMD) {
         c->state = conn_bp_header_size_unknown;
     } else {
-        c->state = conn_bp_writing;
-
-        if (c->udp && build_udp_headers(c)) {
-            bp_write_err_msg(c, "out of memory");
-            return;
-        }
+        finish_reply(c);
     }
 }
 
@@ -1058,6 +1113,7 @@ static void handle_arith_cmd(conn* c)
     uint32_t delta;
     static char temp[32];
 
+    c->traffic.arith_cmds++;
     it = item_get(c->bp_key, nkey);
 
     if ((rep = ALLOCATE_REPLY_HEADER(c, number_rep_t, &c->u.key_number_req)) == NULL) {
@@ -1084,6 +1140,7 @@ static void handle_arith_cmd(conn* c)
             }
         } else {
             // stored.
+            mirror_store(c->bp_key, nkey);
             rep->value = val;
             rep->status = mcc_res_stored;
         }
@@ -1104,12 +1161,74 @@ static void handle_arith_cmd(conn* c)
         bp_write_err_msg(c, "couldn't build response");
     }
 
-    c->state = conn_bp_writing;
+    finish_reply(c);
+}
+
+
+static void handle_flush_all_cmd(conn* c)
+{
+    empty_rep_t* rep;
+    time_t exptime = ntohl(c->u.number_req.number);
+
+    if ((rep = ALLOCATE_REPLY_HEADER(c, empty_rep_t, &c->u.number_req)) == NULL) {
+        bp_write_err_msg(c, "out of memory");
+        return;
+    }
+
+    set_current_time();
+    if (exptime == 0) {
+        settings.oldest_live = current_time - 1;
+    } else {
+        settings.oldest_live = realtime(exptime) - 1;
+    }
+    item_flush_expired();
+    mirror_flush_all(exptime);
+
+    rep->status = mcc_res_ok;
+    rep->body_length = htonl(sizeof(*rep) - BINARY_PROTOCOL_REPLY_HEADER_SZ);
+
+    if (add_iov(c, rep, sizeof(empty_rep_t), true)) {
+        bp_write_err_msg(c, "couldn't build response");
+        return;
+    }
+
+    finish_reply(c);
+}
 
-    if (c->udp && build_udp_headers(c)) {
+
+static void handle_flush_regex_cmd(conn* c)
+{
+    empty_rep_t* rep;
+    size_t str_size = ntohl(c->u.string_req.body_length) -
+        (sizeof(string_req_t) - BINARY_PROTOCOL_REQUEST_HEADER_SZ);
+    bool deleted;
+
+    if (c->bp_string == NULL) {
         bp_write_err_msg(c, "out of memory");
         return;
     }
+
+    deleted = assoc_expire_regex(c->bp_string);
+    if (deleted) {
+        mirror_flush_regex(c->bp_string);
+    }
+    pool_free(c->bp_string, str_size + 1, CONN_BUFFER_BP_STRING_POOL);
+    c->bp_string = NULL;
+
+    if ((rep = ALLOCATE_REPLY_HEADER(c, empty_rep_t, &c->u.string_req)) == NULL) {
+        bp_write_err_msg(c, "out of memory");
+        return;
+    }
+
+    rep->status = deleted ? mcc_res_deleted : mcc_res_local_error;
+    rep->body_length = htonl(sizeof(*rep) - BINARY_PROTOCOL_REPLY_HEADER_SZ);
+
+    if (add_iov(c, rep, sizeof(empty_rep_t), true)) {
+        bp_write_err_msg(c, "couldn't build response");
+        return;
+    }
+
+    finish_reply(c);
 }
 
 
@@ -1137,6 +1256,32 @@ static void* allocate_reply_header(conn* c, size_t size, void* req)
 }
 
 
+/**
+ * called once the reply to a non-quiet request is queued.  a udp datagram may
+ * hold more requests after this one; their replies are packed into the same
+ * outbound datagrams, which are sent once the datagram is used up.
+ */
+static void finish_reply(conn* c)
+{
+    if (c->udp) {
+        c->state = conn_bp_header_size_unknown;
+    } else {
+        c->state = conn_bp_writing;
+    }
+}
+
+
+/**
+ * returns true if replies to requests in the current udp datagram have been
+ * queued but not sent.
+ */
+static inline bool udp_replies_pending(conn* c)
+{
+    return c->msgused > 1 ||
+        (c->msgused == 1 && c->msgbytes > UDP_HEADER_SIZE);
+}
+
+
 void bp_write_err_msg(conn* c, const char* str) {
     string_rep_t* rep;
 
@@ -1148,7 +1293,8 @@ void bp_write_err_msg(conn* c, const char* str) {
     rep->opaque = 0;
     rep->body_length = htonl(strlen(str) + (sizeof(*rep) - BINARY_PROTOCOL_REPLY_HEADER_SZ));
 
-    if (add_iov(c, c->wbuf, sizeof(string_rep_t), true) ||
+    if ((c->msgused == 0 && add_msghdr(c) != 0) ||
+        add_iov(c, c->wbuf, sizeof(string_rep_t), true) ||
         (c->udp && build_udp_headers(c))) {
         if (settings.verbose > 0) {
             fprintf(stderr, "Couldn't build response\n");
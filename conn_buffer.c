@@ -8,6 +8,7 @@
 #include "memcached.h"
 
 #include "conn_buffer.h"
+#include "trace.h"
 
 // this will enable the rigorous checking of the free list following any
 // free list operation.  this could be expensive and is probably generally
@@ -20,12 +21,6 @@
 // conn_buffer system.
 // #define CONN_BUFFER_CORRUPTION_DETECTION
 
-#define HEAP_ENTRY_TO_INDEX(level, nth)  ((1 << (level)) + (nth) - 1)
-#define HEAP_PARENT(index)               ((((index) + 1) >> 1) - 1)
-#define HEAP_LEFT_CHILD(index)           ((((index) + 1) << 1) - 1 + 0)
-#define HEAP_RIGHT_CHILD(index)          ((((index) + 1) << 1) - 1 + 1)
-
-
 #ifdef CONN_BUFFER_CORRUPTION_DETECTION
 static const bool detect_corruption = true;
 #else
@@ -41,50 +36,29 @@ static struct {
 
 CB_STATIC int cb_freelist_check(conn_buffer_group_t* cbg) {
 #if defined(FREELIST_CHECK)
-    size_t i, found_entries, rsize_total;
-    bool end_found = false;
+    size_t size_class, found_entries, rsize_total;
 
     /* num free buffers agrees with reality? */
-    for (i = 0, found_entries = 0, rsize_total = 0;
-         i < cbg->free_buffer_list_capacity;
-         i ++) {
-        size_t left_child, right_child;
-
-        if (cbg->free_buffers[i] == NULL) {
-            end_found = true;
-            continue;
+    for (size_class = 0, found_entries = 0, rsize_total = 0;
+         size_class < CONN_BUFFER_SIZE_CLASSES;
+         size_class ++) {
+        conn_buffer_t* iter;
+        size_t class_entries = 0;
+
+        for (iter = cbg->free_lists[size_class];
+             iter != NULL;
+             iter = iter->next) {
+            assert(iter->signature == CONN_BUFFER_SIGNATURE);
+            assert(iter->in_freelist == true);
+            assert(iter->used == false);
+            assert(iter->size_class == size_class);
+            class_entries ++;
+
+            rsize_total += iter->max_rusage;
         }
 
-        assert(end_found == false);
-        assert(cbg->free_buffers[i]->signature == CONN_BUFFER_SIGNATURE);
-        assert(cbg->free_buffers[i]->in_freelist == true);
-        assert(cbg->free_buffers[i]->used == false);
-        found_entries ++;
-
-        rsize_total += cbg->free_buffers[i]->max_rusage;
-
-        left_child = HEAP_LEFT_CHILD(i);
-        right_child = HEAP_RIGHT_CHILD(i);
-
-        if (left_child < cbg->num_free_buffers) {
-            /* valid left child */
-            assert(cbg->free_buffers[left_child] != NULL);
-            assert(cbg->free_buffers[left_child]->signature == CONN_BUFFER_SIGNATURE);
-            assert(cbg->free_buffers[left_child]->in_freelist == true);
-            assert(cbg->free_buffers[left_child]->used == false);
-
-            assert(cbg->free_buffers[i]->max_rusage >= cbg->free_buffers[left_child]->max_rusage);
-        }
-
-        if (right_child < cbg->num_free_buffers) {
-            /* valid right child */
-            assert(cbg->free_buffers[right_child] != NULL);
-            assert(cbg->free_buffers[right_child]->signature == CONN_BUFFER_SIGNATURE);
-            assert(cbg->free_buffers[right_child]->in_freelist == true);
-            assert(cbg->free_buffers[right_child]->used == false);
-
-            assert(cbg->free_buffers[i]->max_rusage >= cbg->free_buffers[right_child]->max_rusage);
-        }
+        assert(class_entries == cbg->num_free[size_class]);
+        found_entries += class_entries;
     }
 
     assert(found_entries == cbg->num_free_buffers);
@@ -104,143 +78,75 @@ static size_t round_up_to_page(size_t bytes) {
 }
 
 
-static void add_conn_buffer_to_freelist(conn_buffer_group_t* cbg, conn_buffer_t* buffer) {
-    size_t index;
+/* returns the smallest size class with room for bytes of data, or
+ * CONN_BUFFER_SIZE_CLASSES if none is big enough. */
+static size_t size_class_for(size_t bytes) {
+    size_t size_class;
+
+    for (size_class = 0;
+         size_class < CONN_BUFFER_SIZE_CLASSES &&
+             CONN_BUFFER_CLASS_SIZE(size_class) - CONN_BUFFER_HEADER_SZ < bytes;
+         size_class ++) {
+        ;
+    }
+
+    return size_class;
+}
 
+
+static void add_conn_buffer_to_freelist(conn_buffer_group_t* cbg, conn_buffer_t* buffer) {
     assert(cb_freelist_check(cbg) == 0);
     (void) cb_freelist_check;      /* dummy rvalue to avoid compiler warning. */
 
     assert(buffer->signature == CONN_BUFFER_SIGNATURE);
     assert(buffer->in_freelist == false);
     assert(buffer->used == false);
-
-    if (cbg->num_free_buffers >= cbg->free_buffer_list_capacity) {
-        if (cbg->free_buffers == NULL) {
-            cbg->free_buffer_list_capacity = cbg->settings.initial_buffer_count;
-            cbg->free_buffers = (conn_buffer_t**) pool_malloc(sizeof(conn_buffer_t*) * cbg->free_buffer_list_capacity,
-                                                             CONN_BUFFER_POOL);
-        } else {
-            cbg->free_buffers = pool_realloc(cbg->free_buffers,
-                                            sizeof(conn_buffer_t*) * cbg->free_buffer_list_capacity * 2,
-                                            sizeof(conn_buffer_t*) * cbg->free_buffer_list_capacity,
-                                            CONN_BUFFER_POOL);
-            cbg->free_buffer_list_capacity *= 2;
-        }
-
-        memset(&cbg->free_buffers[cbg->num_free_buffers], 0,
-               sizeof(conn_buffer_t*) * (cbg->free_buffer_list_capacity - cbg->num_free_buffers));
-    }
+    assert(buffer->size_class < CONN_BUFFER_SIZE_CLASSES);
 
     buffer->in_freelist = true;
 
-    assert(cbg->free_buffers[cbg->num_free_buffers] == NULL);
-    cbg->free_buffers[cbg->num_free_buffers] = buffer;
-    index = cbg->num_free_buffers;
+    /* the most recently freed buffer is the most likely to still have its
+     * pages resident, so it goes to the front. */
+    buffer->next = cbg->free_lists[buffer->size_class];
+    cbg->free_lists[buffer->size_class] = buffer;
+    cbg->num_free[buffer->size_class] ++;
     cbg->num_free_buffers ++;
     cbg->total_rsize_in_freelist += buffer->max_rusage;
 
-    while (index != 0) {
-        size_t parent_index = HEAP_PARENT(index);
-
-        if (cbg->free_buffers[index]->max_rusage >
-            cbg->free_buffers[parent_index]->max_rusage) {
-            conn_buffer_t* temp;
-
-            /* swap */
-            temp = cbg->free_buffers[index];
-            cbg->free_buffers[index] = cbg->free_buffers[parent_index];
-            cbg->free_buffers[parent_index] = temp;
-        } else {
-            /* no swap occured, so we can stop the reheaping operation */
-            break;
-        }
-    }
     assert(cb_freelist_check(cbg) == 0);
 }
 
 
-static conn_buffer_t* remove_conn_buffer_from_freelist(conn_buffer_group_t* cbg, size_t max_rusage_hint) {
+static conn_buffer_t* remove_conn_buffer_from_freelist(conn_buffer_group_t* cbg, size_t size_class) {
     conn_buffer_t* ret;
-    conn_buffer_t* compare;
-    size_t index;
 
     assert(cb_freelist_check(cbg) == 0);
+    assert(size_class < CONN_BUFFER_SIZE_CLASSES);
 
-    if (cbg->num_free_buffers == 0) {
-        assert(cbg->free_buffers[0] == NULL);
+    if ((ret = cbg->free_lists[size_class]) == NULL) {
+        assert(cbg->num_free[size_class] == 0);
         return NULL;
     }
 
-    ret = cbg->free_buffers[0];
-    cbg->free_buffers[0] = NULL;
     assert(ret->signature == CONN_BUFFER_SIGNATURE);
     assert(ret->in_freelist == true);
     assert(ret->used == false);
+    assert(ret->size_class == size_class);
+
+    cbg->free_lists[size_class] = ret->next;
+    ret->next = NULL;
     ret->in_freelist = false;
 
+    cbg->num_free[size_class] --;
     cbg->num_free_buffers --;
     cbg->total_rsize_in_freelist -= ret->max_rusage;
 
-    if (cbg->num_free_buffers == 0) {
-        assert(cb_freelist_check(cbg) == 0);
-        return ret;
-    }
-
-    index = 0;
-    compare = cbg->free_buffers[cbg->num_free_buffers];
-    cbg->free_buffers[cbg->num_free_buffers] = NULL;
-
-    while (true) {
-        size_t left_child_index = HEAP_LEFT_CHILD(index);
-        size_t right_child_index = HEAP_RIGHT_CHILD(index);
-        bool valid_left, valid_right, swap_left, swap_right;
-
-        valid_left = (left_child_index < cbg->num_free_buffers) ? true : false;
-        valid_right = (right_child_index < cbg->num_free_buffers) ? true : false;
-
-        swap_left = (valid_left &&
-                     cbg->free_buffers[left_child_index]->max_rusage >
-                     compare->max_rusage) ? true : false;
-        swap_right = (valid_right &&
-                      cbg->free_buffers[right_child_index]->max_rusage >
-                      compare->max_rusage) ? true : false;
-
-        /* it's possible that we'd want to swap with both (i.e., bigger than
-         * both).  pick the larger one to swap with.
-         */
-        if (swap_left && swap_right) {
-            if (cbg->free_buffers[left_child_index]->max_rusage >
-                cbg->free_buffers[right_child_index]->max_rusage) {
-                /* left is greater, swap with left. */
-                swap_right = false;
-            } else {
-                swap_left = false;
-            }
-        }
-
-        if (swap_left) {
-            assert(cbg->free_buffers[index] == NULL);
-            cbg->free_buffers[index] = cbg->free_buffers[left_child_index];
-            cbg->free_buffers[left_child_index] = NULL;
-            index = left_child_index;
-        } else if (swap_right) {
-            assert(cbg->free_buffers[index] == NULL);
-            cbg->free_buffers[index] = cbg->free_buffers[right_child_index];
-            cbg->free_buffers[right_child_index] = NULL;
-            index = right_child_index;
-        } else {
-            assert(cbg->free_buffers[index] == NULL);
-            cbg->free_buffers[index] = compare;
-            break;
-        }
-    }
-
     assert(cb_freelist_check(cbg) == 0);
     return ret;
 }
 
 
-static conn_buffer_t* make_conn_buffer(conn_buffer_group_t* cbg) {
+static conn_buffer_t* make_conn_buffer(conn_buffer_group_t* cbg, size_t size_class) {
     conn_buffer_t* buffer;
 
     if (cbg->total_rsize + l.page_size >= cbg->settings.total_rsize_range_top) {
@@ -251,16 +157,18 @@ static conn_buffer_t* make_conn_buffer(conn_buffer_group_t* cbg) {
     }
 
     buffer = mmap(NULL,
-                  CONN_BUFFER_SIZE,
+                  CONN_BUFFER_CLASS_SIZE(size_class),
                   PROT_READ | PROT_WRITE,
                   MAP_PRIVATE | MAP_ANON,
                   -1, 0);
 
-    if (buffer == NULL) {
+    if (buffer == MAP_FAILED) {
         return NULL;
     }
 
+    buffer->next = NULL;
     buffer->signature = CONN_BUFFER_SIGNATURE;
+    buffer->size_class = size_class;
     buffer->max_rusage = round_up_to_page(CONN_BUFFER_HEADER_SZ);
     buffer->in_freelist = false;
     buffer->used = false;
@@ -322,7 +230,7 @@ static void destroy_conn_buffer(conn_buffer_group_t* cbg, conn_buffer_t* buffer)
 
     cbg->stats.destroys ++;
     cbg->total_rsize -= buffer->max_rusage;
-    munmap(buffer, CONN_BUFFER_SIZE);
+    munmap(buffer, CONN_BUFFER_CLASS_SIZE(buffer->size_class));
 
     /* if we're trying to detect corruption, we need to freeze out the address
      * space used by the connection buffer that we're destroying. */
@@ -363,9 +271,18 @@ static conn_buffer_t* get_buffer_from_data_ptr(void* _ptr) {
 static void conn_buffer_reclamation(conn_buffer_group_t* cbg) {
     if (cbg->reclamation_in_progress) {
         if (cbg->num_free_buffers != 0) {
-            /* grab the most space-consuming buffer and reclaim it. */
-            conn_buffer_t* tofree = remove_conn_buffer_from_freelist(cbg, CONN_BUFFER_SIZE);
+            /* reclaim a buffer from the largest class that has one, as it is
+             * likely to be the most space-consuming. */
+            size_t size_class = CONN_BUFFER_SIZE_CLASSES - 1;
+            conn_buffer_t* tofree;
+
+            while (cbg->free_lists[size_class] == NULL) {
+                assert(size_class > 0);
+                size_class --;
+            }
+            tofree = remove_conn_buffer_from_freelist(cbg, size_class);
 
+            TRACE_CONN_BUFFER_RECLAIM(tofree->max_rusage, cbg->total_rsize);
             destroy_conn_buffer(cbg, tofree);
         }
 
@@ -417,7 +334,7 @@ static void conn_buffer_group_init(conn_buffer_group_t* const cbg,
     for (i = 0; i < initial_buffer_count; i ++) {
         conn_buffer_t* buffer;
 
-        buffer = make_conn_buffer(cbg);
+        buffer = make_conn_buffer(cbg, 0);
         always_assert(buffer != NULL);
         add_conn_buffer_to_freelist(cbg, buffer);
     }
@@ -450,24 +367,28 @@ void conn_buffer_init(unsigned groups,
 
 /**
  * allocate a connection buffer.  max_rusage_hint is a hint for how much
- * of the buffer will be used in the worst case.  if it is 0, the hint is
- * discarded.  currently, the hint is ignored.
+ * of the buffer will be used in the worst case; the buffer comes from the
+ * smallest size class that holds that much.  if it is 0, the buffer is from
+ * the smallest class.  conn_buffer_capacity returns how much it can hold.
  *
  * this is a thread-guarded function, i.e., it should only be called for a
  * connection buffer group by the thread it is assigned to.
  */
 static void* do_alloc_conn_buffer(conn_buffer_group_t* cbg, size_t max_rusage_hint) {
     conn_buffer_t* buffer;
+    size_t size_class = size_class_for(max_rusage_hint);
 
     assert(cbg->settings.tid == pthread_self());
 
-    if ( (buffer = remove_conn_buffer_from_freelist(cbg, max_rusage_hint)) == NULL &&
-         (buffer = make_conn_buffer(cbg)) == NULL ) {
+    if ( size_class >= CONN_BUFFER_SIZE_CLASSES ||
+         ((buffer = remove_conn_buffer_from_freelist(cbg, size_class)) == NULL &&
+          (buffer = make_conn_buffer(cbg, size_class)) == NULL) ) {
         cbg->stats.allocs_failed ++;
         return NULL;
     }
 
     cbg->stats.allocs ++;
+    cbg->stats.class_allocs[size_class] ++;
 
     assert(buffer->signature == CONN_BUFFER_SIGNATURE);
     assert(buffer->in_freelist == false);
@@ -505,7 +426,7 @@ static void do_free_conn_buffer(conn_buffer_group_t* cbg, void* ptr, ssize_t max
     if (max_rusage == -1) {
         if (buffer->rusage_updated == false) {
             /* no one has reported any usage info on this block.  assume the worse. */
-            max_rusage = CONN_BUFFER_SIZE;
+            max_rusage = CONN_BUFFER_CLASS_SIZE(buffer->size_class);
         } else {
             max_rusage = buffer->max_rusage;
         }
@@ -576,6 +497,45 @@ static void do_report_max_rusage(conn_buffer_group_t* cbg, void* ptr, size_t max
 }
 
 
+/**
+ * moves the first used bytes of a connection buffer into a new buffer that
+ * can hold at least needed bytes, and releases the old one.  returns the new
+ * buffer, or NULL (leaving the old buffer alone) if there is none to be had.
+ *
+ * this is a thread-guarded function, i.e., it should only be called for a
+ * connection buffer group by the thread it is assigned to.
+ */
+static void* do_grow_conn_buffer(conn_buffer_group_t* cbg, void* ptr, size_t used, size_t needed) {
+    void* larger;
+
+    assert(used <= conn_buffer_capacity(ptr));
+    assert(needed > conn_buffer_capacity(ptr));
+
+    if ((larger = do_alloc_conn_buffer(cbg, needed)) == NULL) {
+        return NULL;
+    }
+
+    cbg->stats.grows ++;
+    if (used != 0) {
+        memcpy(larger, ptr, used);
+        do_report_max_rusage(cbg, larger, used);
+    }
+    do_free_conn_buffer(cbg, ptr, 0);
+
+    return larger;
+}
+
+
+/**
+ * returns how many bytes of data a connection buffer can hold.
+ */
+size_t conn_buffer_capacity(const void* ptr) {
+    const conn_buffer_t* buffer = get_buffer_from_data_ptr((void*) ptr);
+
+    return CONN_BUFFER_CLASS_SIZE(buffer->size_class) - CONN_BUFFER_HEADER_SZ;
+}
+
+
 void* alloc_conn_buffer(conn_buffer_group_t* cbg, size_t max_rusage_hint) {
     void* ret;
 
@@ -597,6 +557,15 @@ void report_max_rusage(conn_buffer_group_t* cbg, void* ptr, size_t max_rusage) {
     pthread_mutex_unlock(&cbg->lock);
 }
 
+void* grow_conn_buffer(conn_buffer_group_t* cbg, void* ptr, size_t used, size_t needed) {
+    void* ret;
+
+    pthread_mutex_lock(&cbg->lock);
+    ret = do_grow_conn_buffer(cbg, ptr, used, needed);
+    pthread_mutex_unlock(&cbg->lock);
+    return ret;
+}
+
 
 conn_buffer_group_t* get_conn_buffer_group(unsigned group) {
     assert(group < l.cbg_count);
@@ -621,12 +590,28 @@ bool assign_thread_id_to_conn_buffer_group(unsigned group, pthread_t tid) {
 }
 
 
+/**
+ * detach a connection buffer group from its thread when the thread exits, so
+ * that a thread started later can take it over.  the buffers on the freelist
+ * are kept for the next thread.
+ */
+void release_conn_buffer_group(unsigned group) {
+    assert(group < l.cbg_count);
+    if (group < l.cbg_count) {
+        pthread_mutex_lock(&l.cbg_list[group].lock);
+        l.cbg_list[group].settings.tid = 0;
+        pthread_mutex_unlock(&l.cbg_list[group].lock);
+    }
+}
+
+
 char* conn_buffer_stats(size_t* result_size) {
     size_t bufsize = 2048, offset = 0;
     char* buffer = malloc(bufsize);
     char terminator[] = "END\r\n";
-    unsigned ix;
+    unsigned ix, size_class;
 
+    size_t num_free[CONN_BUFFER_SIZE_CLASSES];
     size_t num_free_buffers = 0;
     size_t total_rsize = 0;
     size_t total_rsize_in_freelist = 0;
@@ -638,6 +623,7 @@ char* conn_buffer_stats(size_t* result_size) {
     }
 
     memset(&stats, 0, sizeof(conn_buffer_stats_t));
+    memset(num_free, 0, sizeof(num_free));
 
     for (ix = 0; ix < l.cbg_count; ix ++) {
         pthread_mutex_lock(&l.cbg_list[ix].lock);
@@ -649,6 +635,11 @@ char* conn_buffer_stats(size_t* result_size) {
         stats.destroys             += l.cbg_list[ix].stats.destroys;
         stats.reclamations_started += l.cbg_list[ix].stats.reclamations_started;
         stats.allocs_failed        += l.cbg_list[ix].stats.allocs_failed;
+        stats.grows                += l.cbg_list[ix].stats.grows;
+        for (size_class = 0; size_class < CONN_BUFFER_SIZE_CLASSES; size_class ++) {
+            num_free[size_class]                += l.cbg_list[ix].num_free[size_class];
+            stats.class_allocs[size_class]      += l.cbg_list[ix].stats.class_allocs[size_class];
+        }
         pthread_mutex_unlock(&l.cbg_list[ix].lock);
     }
 
@@ -660,7 +651,8 @@ char* conn_buffer_stats(size_t* result_size) {
                               "STAT frees %" PRINTF_INT64_MODIFIER "u\n"
                               "STAT failed_allocates %" PRINTF_INT64_MODIFIER "u\n"
                               "STAT destroys %" PRINTF_INT64_MODIFIER "u\n"
-                              "STAT reclamations_started %" PRINTF_INT64_MODIFIER "u\n",
+                              "STAT reclamations_started %" PRINTF_INT64_MODIFIER "u\n"
+                              "STAT grows %" PRINTF_INT64_MODIFIER "u\n",
                               num_free_buffers,
                               total_rsize,
                               total_rsize_in_freelist,
@@ -668,7 +660,18 @@ char* conn_buffer_stats(size_t* result_size) {
                               stats.frees,
                               stats.allocs_failed,
                               stats.destroys,
-                              stats.reclamations_started);
+                              stats.reclamations_started,
+                              stats.grows);
+
+    for (size_class = 0; size_class < CONN_BUFFER_SIZE_CLASSES; size_class ++) {
+        offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                                  "STAT class_%u_size %" PRINTF_INT64_MODIFIER "u\n"
+                                  "STAT class_%u_free_buffers %" PRINTF_INT64_MODIFIER "u\n"
+                                  "STAT class_%u_allocates %" PRINTF_INT64_MODIFIER "u\n",
+                                  size_class, (uint64_t) CONN_BUFFER_CLASS_SIZE(size_class),
+                                  size_class, (uint64_t) num_free[size_class],
+                                  size_class, stats.class_allocs[size_class]);
+    }
 
     offset = append_to_buffer(buffer, bufsize, offset, 0, terminator);
 
@@ -29,14 +29,28 @@
 #define CONN_BUFFER_TOTAL_RSIZE_RANGE_BOTTOM_DEFAULT (8 * 1024 * 1024)
 #define CONN_BUFFER_TOTAL_RSIZE_RANGE_TOP_DEFAULT    (16 * 1024 * 1024)
 
-#define CONN_BUFFER_SIZE (16 * 1024 * 1024)
+/* buffers come in CONN_BUFFER_SIZE_CLASSES sizes, each 2^CONN_BUFFER_CLASS_SHIFT
+ * times the one before it: 4 KB, 64 KB, 1 MB and 16 MB.  a buffer starts out
+ * in the smallest class that fits the caller's hint and is grown on demand
+ * with grow_conn_buffer. */
+#define CONN_BUFFER_SIZE_CLASSES (4)
+#define CONN_BUFFER_CLASS_SHIFT  (4)
+#define CONN_BUFFER_MIN_SIZE     (4 * 1024)
+#define CONN_BUFFER_CLASS_SIZE(size_class)                              \
+    ((size_t) CONN_BUFFER_MIN_SIZE << (CONN_BUFFER_CLASS_SHIFT * (size_class)))
+
+#define CONN_BUFFER_SIZE CONN_BUFFER_CLASS_SIZE(CONN_BUFFER_SIZE_CLASSES - 1)
 #define CONN_BUFFER_SIGNATURE  (0xbeadbeef)
 
+typedef struct conn_buffer_s conn_buffer_t;
+
 #define CONN_BUFFER_HEADER_CONTENTS             \
+    conn_buffer_t* next;                        \
     uint32_t signature;                         \
     uint32_t prev_rusage;                       \
     uint32_t max_rusage;                        \
-    uint8_t unused[3];                          \
+    uint8_t size_class;                         \
+    uint8_t unused[2];                          \
     unsigned char :5;                           \
     unsigned char rusage_updated:1;             \
     unsigned char in_freelist:1;                \
@@ -44,8 +58,9 @@
 
 #define CONN_BUFFER_HEADER_SZ sizeof(struct { CONN_BUFFER_HEADER_CONTENTS })
 
+/* the data size of the largest class.  smaller buffers only map the start of
+ * data. */
 #define CONN_BUFFER_DATA_SZ   (CONN_BUFFER_SIZE - CONN_BUFFER_HEADER_SZ)
-typedef struct conn_buffer_s conn_buffer_t;
 struct conn_buffer_s {
     CONN_BUFFER_HEADER_CONTENTS;
     unsigned char data[CONN_BUFFER_DATA_SZ];
@@ -59,13 +74,18 @@ struct conn_buffer_stats_s {
     uint64_t destroys;
     uint64_t reclamations_started;
     uint64_t allocs_failed;
+    uint64_t grows;
+    uint64_t class_allocs[CONN_BUFFER_SIZE_CLASSES];
 };
 
 
 typedef struct conn_buffer_group_s conn_buffer_group_t;
 struct conn_buffer_group_s {
-    conn_buffer_t** free_buffers;
-    size_t free_buffer_list_capacity;
+    conn_buffer_t* free_lists[CONN_BUFFER_SIZE_CLASSES]; /* one per size
+                                                          * class, most
+                                                          * recently freed
+                                                          * first. */
+    size_t num_free[CONN_BUFFER_SIZE_CLASSES];
     size_t num_free_buffers;
 
     size_t total_rsize;
@@ -101,6 +121,8 @@ struct conn_buffer_group_s {
 extern void* alloc_conn_buffer(conn_buffer_group_t* cbg, size_t max_rusage_hint);
 extern void free_conn_buffer(conn_buffer_group_t* cbg, void* ptr, ssize_t max_rusage);
 extern void report_max_rusage(conn_buffer_group_t* cbg, void* ptr, size_t max_rusage);
+extern void* grow_conn_buffer(conn_buffer_group_t* cbg, void* ptr, size_t used, size_t needed);
+extern size_t conn_buffer_capacity(const void* ptr);
 extern char* conn_buffer_stats(size_t* result_size);
 
 
@@ -112,6 +134,7 @@ extern void conn_buffer_init(unsigned threads,
 
 extern conn_buffer_group_t* get_conn_buffer_group(unsigned thread);
 extern bool assign_thread_id_to_conn_buffer_group(unsigned group, pthread_t tid);
+extern void release_conn_buffer_group(unsigned group);
 
 CB_STATIC_DECL(int cb_freelist_check(conn_buffer_group_t* cbg));
 
@@ -1,16 +1,22 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 
 /**
- * The flat allocator mmaps the entire region as limited by settings.maxbytes.
- * When first started, we do not initialize the entire region to prevent
- * unnecessary page allocation.  As we need additional memory, we will
- * initialize (and page in) additional memory.
+ * The flat allocator mmaps the entire region as limited by settings.maxbytes,
+ * plus room for the limit to be raised at runtime.  When first started, we do
+ * not initialize the entire region to prevent unnecessary page allocation.  As
+ * we need additional memory, we will initialize (and page in) additional
+ * memory.
  */
 
 #include <assert.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
+
 #include "generic.h"
 
 #if defined(USE_FLAT_ALLOCATOR)
@@ -21,6 +27,7 @@
 #include "flat_storage.h"
 #include "memcached.h"
 #include "stats.h"
+#include "trace.h"
 
 typedef enum {
     COALESCE_NO_PROGRESS,               /* no progress was made in coalescing a block */
@@ -44,20 +51,47 @@ static void item_free(item *it);
 /**
  * flat storage code
  */
-void flat_storage_init(size_t maxbytes) {
+void flat_storage_init(size_t maxbytes, size_t ceiling) {
     intptr_t addr;
+    uint64_t reserve;
 
     always_assert(fsi.initialized == false);
     always_assert(maxbytes % LARGE_CHUNK_SZ == 0);
     always_assert(maxbytes % FLAT_STORAGE_INCREMENT_DELTA == 0);
-    fsi.mmap_start = mmap(NULL,
-                          maxbytes + LARGE_CHUNK_SZ - 1, /* alloc extra to
-                                                          * ensure we can align
-                                                          * our buffers. */
-                          PROT_READ | PROT_WRITE,
-                          MAP_PRIVATE | MAP_ANON,
-                          -1,
-                          0);
+
+    /* memory is only touched as flat_storage_alloc initializes it, so we can
+     * reserve room for the memory limit to be raised later, up to ceiling
+     * (0 for FLAT_STORAGE_DEFAULT_CEILING).  if the OS won't give us that
+     * much address space, settle for maxbytes. */
+    reserve = (ceiling != 0) ? ceiling : FLAT_STORAGE_DEFAULT_CEILING;
+    reserve -= reserve % FLAT_STORAGE_INCREMENT_DELTA;
+    if (reserve > FLAT_STORAGE_MAX_BYTES) {
+        reserve = FLAT_STORAGE_MAX_BYTES - (FLAT_STORAGE_MAX_BYTES % FLAT_STORAGE_INCREMENT_DELTA);
+    }
+    if (reserve < maxbytes || reserve > SIZE_MAX / 2) {
+        reserve = maxbytes;
+    }
+
+    fsi.mmap_start = MAP_FAILED;
+    if (reserve > maxbytes) {
+        fsi.mmap_start = mmap(NULL,
+                              reserve + LARGE_CHUNK_SZ - 1,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANON | MAP_NORESERVE,
+                              -1,
+                              0);
+    }
+    if (fsi.mmap_start == MAP_FAILED) {
+        reserve = maxbytes;
+        fsi.mmap_start = mmap(NULL,
+                              maxbytes + LARGE_CHUNK_SZ - 1, /* alloc extra to
+                                                              * ensure we can align
+                                                              * our buffers. */
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANON,
+                              -1,
+                              0);
+    }
     if (fsi.mmap_start == MAP_FAILED) {
         fprintf(stderr, "failed to mmap memory\n");
         exit(EXIT_FAILURE);
@@ -69,13 +103,40 @@ void flat_storage_init(size_t maxbytes) {
     fsi.flat_storage_start = (void*) addr;
     fsi.uninitialized_start = fsi.flat_storage_start;
     fsi.unused_memory = maxbytes;
+    fsi.reserved_bytes = reserve;
 
     fsi.large_free_list = NULL_CHUNKPTR;
+    fsi.large_free_list_tail = NULL_CHUNKPTR;
     fsi.large_free_list_sz = 0;
     fsi.small_free_list = NULL_CHUNKPTR;
     fsi.small_free_list_sz = 0;
+#if defined(COMPACT_TITLES)
+    fsi.held = calloc(HELD_REFS_INITIAL, sizeof(held_ref_t));
+    if (fsi.held == NULL) {
+        fprintf(stderr, "failed to allocate reference table\n");
+        exit(EXIT_FAILURE);
+    }
+    fsi.held_size = HELD_REFS_INITIAL;
+    fsi.held_count = 0;
+    fsi.clock_hand = 0;
+#else
     fsi.lru_head = NULL_CHUNKPTR;
     fsi.lru_tail = NULL_CHUNKPTR;
+#endif /* #if defined(COMPACT_TITLES) */
+
+    /* we can only return whole pages of free large chunks to the OS. */
+    fsi.page_size = (size_t) sysconf(_SC_PAGESIZE);
+    if (fsi.page_size >= LARGE_CHUNK_SZ &&
+        fsi.page_size % LARGE_CHUNK_SZ == 0 &&
+        FLAT_STORAGE_INCREMENT_DELTA % fsi.page_size == 0 &&
+        ((intptr_t) fsi.flat_storage_start) % fsi.page_size == 0) {
+        fsi.released_pages = calloc((fsi.reserved_bytes / fsi.page_size + 7) / 8, 1);
+    }
+    if (fsi.released_pages == NULL) {
+        fsi.page_size = 0;
+    }
+    fsi.released_pages_count = 0;
+    fsi.released_pages_scan = 0;
 
     /* shouldn't fail here.... right? */
     flat_storage_alloc();
@@ -106,23 +167,33 @@ void item_init(void) {
     /* make sure that the fields line up in item */
     always_assert( &(((item*) 0)->empty_header.h_next) == &(((item*) 0)->large_title.h_next) );
     always_assert( &(((item*) 0)->empty_header.h_next) == &(((item*) 0)->small_title.h_next) );
+#if !defined(COMPACT_TITLES)
     always_assert( &(((item*) 0)->empty_header.next) == &(((item*) 0)->large_title.next) );
     always_assert( &(((item*) 0)->empty_header.next) == &(((item*) 0)->small_title.next) );
     always_assert( &(((item*) 0)->empty_header.prev) == &(((item*) 0)->large_title.prev) );
     always_assert( &(((item*) 0)->empty_header.prev) == &(((item*) 0)->small_title.prev) );
+#endif /* #if !defined(COMPACT_TITLES) */
     always_assert( &(((item*) 0)->empty_header.next_chunk) == &(((item*) 0)->large_title.next_chunk) );
     always_assert( &(((item*) 0)->empty_header.next_chunk) == &(((item*) 0)->small_title.next_chunk) );
     always_assert( &(((item*) 0)->empty_header.time) == &(((item*) 0)->large_title.time) );
     always_assert( &(((item*) 0)->empty_header.time) == &(((item*) 0)->small_title.time) );
+#if !defined(COMPACT_TITLES)
     always_assert( &(((item*) 0)->empty_header.exptime) == &(((item*) 0)->large_title.exptime) );
     always_assert( &(((item*) 0)->empty_header.exptime) == &(((item*) 0)->small_title.exptime) );
+#endif /* #if !defined(COMPACT_TITLES) */
     always_assert( &(((item*) 0)->empty_header.nbytes) == &(((item*) 0)->large_title.nbytes) );
     always_assert( &(((item*) 0)->empty_header.nbytes) == &(((item*) 0)->small_title.nbytes) );
+#if !defined(COMPACT_TITLES)
     always_assert( &(((item*) 0)->empty_header.refcount) == &(((item*) 0)->large_title.refcount) );
     always_assert( &(((item*) 0)->empty_header.refcount) == &(((item*) 0)->small_title.refcount) );
+#endif /* #if !defined(COMPACT_TITLES) */
     always_assert( &(((item*) 0)->empty_header.nkey) == &(((item*) 0)->large_title.nkey) );
     always_assert( &(((item*) 0)->empty_header.nkey) == &(((item*) 0)->small_title.nkey) );
 
+    /* ITEM_WALK finds the data of single-chunk items without checking their
+     * size. */
+    always_assert( &(((item*) 0)->large_title.data[0]) == &(((item*) 0)->small_title.data[0]) );
+
     /* make sure that the casting functions in flat_storage.h are sane. */
     always_assert( (void*) &(((item*) 0)->small_title) == ((void*) 0));
     always_assert( (void*) &(((item*) 0)->large_title) == ((void*) 0));
@@ -137,12 +208,97 @@ void item_init(void) {
 }
 
 
+/* returns the number of bytes of initialized memory that have not been
+ * returned to the OS. */
+static size_t flat_storage_resident_bytes(void) {
+    return ((fsi.uninitialized_start - fsi.flat_storage_start) * LARGE_CHUNK_SZ) -
+        (fsi.released_pages_count * fsi.page_size);
+}
+
+
+/* returns how much more item memory can be handed out without evicting: the
+ * free chunks, and the room left under settings.maxbytes to initialize or
+ * reclaim pages. */
+static size_t flat_storage_free_bytes(void) {
+    size_t resident = flat_storage_resident_bytes();
+
+    return (fsi.large_free_list_sz * LARGE_CHUNK_SZ) +
+        (fsi.small_free_list_sz * SMALL_CHUNK_SZ) +
+        (resident < settings.maxbytes ? settings.maxbytes - resident : 0);
+}
+
+
+/* returns the free item memory do_item_reclaim keeps ahead of demand. */
+static size_t flat_storage_reclaim_target(void) {
+    return (uint64_t) settings.maxbytes * settings.reclaim_percent / 100;
+}
+
+
+/* puts the chunks of up to FLAT_STORAGE_INCREMENT_DELTA bytes of pages that were
+ * returned to the OS back on the free list, as long as that stays within
+ * settings.maxbytes.  touching the chunks faults the pages back in.  returns
+ * the number of pages reclaimed. */
+static size_t flat_storage_reclaim(void) {
+    stats_t *stats = STATS_GET_TLS();
+    size_t pages = fsi.page_size ? (fsi.uninitialized_start - fsi.flat_storage_start) * LARGE_CHUNK_SZ / fsi.page_size : 0;
+    size_t chunks_per_page = fsi.page_size / LARGE_CHUNK_SZ;
+    size_t resident = flat_storage_resident_bytes();
+    size_t reclaimed = 0, scanned, limit;
+
+    if (resident >= settings.maxbytes) {
+        return 0;
+    }
+    limit = __fs_MIN(FLAT_STORAGE_INCREMENT_DELTA, settings.maxbytes - resident) / fsi.page_size;
+
+    for (scanned = 0;
+         scanned < pages &&
+             fsi.released_pages_count > 0 &&
+             reclaimed < limit;
+         scanned ++, fsi.released_pages_scan ++) {
+        size_t page, i;
+        large_chunk_t* first;
+
+        if (fsi.released_pages_scan >= pages) {
+            fsi.released_pages_scan = 0;
+        }
+        page = fsi.released_pages_scan;
+
+        if ((fsi.released_pages[page / 8] & (1 << (page % 8))) == 0) {
+            continue;
+        }
+
+        fsi.released_pages[page / 8] &= ~(1 << (page % 8));
+        fsi.released_pages_count --;
+        reclaimed ++;
+
+        first = fsi.flat_storage_start + (page * chunks_per_page);
+        for (i = 0; i < chunks_per_page; i ++) {
+            first[i].flags = LARGE_CHUNK_INITIALIZED;
+            free_list_push( (chunk_t*) &first[i], LARGE_CHUNK, false);
+        }
+    }
+
+    STATS_LOCK(stats);
+    stats->item_storage_released -= reclaimed * fsi.page_size;
+    STATS_UNLOCK(stats);
+    /* STATS: update */
+    fsi.stats.reclaim_events += reclaimed;
+
+    return reclaimed;
+}
+
+
 /* initialize at least nbytes more memory and add them as large chunks to the
- * free list. */
+ * free list.  pages that were returned to the OS are reused first. */
 FA_STATIC bool flat_storage_alloc(void) {
     stats_t *stats = STATS_GET_TLS();
     large_chunk_t* initialize_end;
 
+    if (fsi.released_pages_count > 0 &&
+        flat_storage_reclaim() != 0) {
+        return true;
+    }
+
     if (FLAT_STORAGE_INCREMENT_DELTA > fsi.unused_memory) {
         return false;
     }
@@ -222,10 +378,14 @@ static void free_list_push(chunk_t* chunk, chunk_type_t chunk_type,
             if (fsi.large_free_list != NULL_CHUNKPTR) {
                 chunk_t* old_head;
                 old_head = (chunk_t*) fsi.large_free_list;
+                old_head->lc.lc_free.prev = &(chunk->lc);
                 chunk->lc.lc_free.next = fsi.large_free_list;
             } else {
                 chunk->lc.lc_free.next = NULL_CHUNKPTR;
+                fsi.large_free_list_tail = &(chunk->lc);
             }
+            chunk->lc.lc_free.prev = NULL_CHUNKPTR;
+            chunk->lc.lc_free.freed = current_time;
             fsi.large_free_list = &(chunk->lc);
             fsi.large_free_list_sz ++;
 
@@ -285,6 +445,9 @@ static chunk_t* free_list_pop(chunk_type_t chunk_type) {
                 chunk_t* new_head;
 
                 new_head = (chunk_t*) fsi.large_free_list;
+                new_head->lc.lc_free.prev = NULL_CHUNKPTR;
+            } else {
+                fsi.large_free_list_tail = NULL_CHUNKPTR;
             }
             fsi.large_free_list_sz --;
 
@@ -392,6 +555,315 @@ static void unbreak_large_chunk(large_chunk_t* lc, bool mandatory) {
 }
 
 
+/* removes a large chunk from anywhere in the large chunk free list.  afterwards,
+ * the flags will be set to INITIALIZED. */
+static void large_free_list_remove(large_chunk_t* lc) {
+    assert( (LARGE_CHUNK_INITIALIZED | LARGE_CHUNK_FREE) == lc->flags );
+
+    if (lc->lc_free.prev != NULL_CHUNKPTR) {
+        lc->lc_free.prev->lc_free.next = lc->lc_free.next;
+    } else {
+        assert(fsi.large_free_list == lc);
+        fsi.large_free_list = lc->lc_free.next;
+    }
+    if (lc->lc_free.next != NULL_CHUNKPTR) {
+        lc->lc_free.next->lc_free.prev = lc->lc_free.prev;
+    } else {
+        assert(fsi.large_free_list_tail == lc);
+        fsi.large_free_list_tail = lc->lc_free.prev;
+    }
+    fsi.large_free_list_sz --;
+
+    lc->flags = LARGE_CHUNK_INITIALIZED;
+}
+
+
+/* if every large chunk on lc's page is free, take them off the free list and
+ * return the page to the OS.  returns true if the page was released. */
+static bool flat_storage_release_page(large_chunk_t* lc) {
+    stats_t *stats = STATS_GET_TLS();
+    size_t chunks_per_page = fsi.page_size / LARGE_CHUNK_SZ;
+    size_t page = (lc - fsi.flat_storage_start) / chunks_per_page;
+    large_chunk_t* first = fsi.flat_storage_start + (page * chunks_per_page);
+    size_t i;
+
+    for (i = 0; i < chunks_per_page; i ++) {
+        if (first[i].flags != (LARGE_CHUNK_INITIALIZED | LARGE_CHUNK_FREE)) {
+            return false;
+        }
+    }
+
+    for (i = 0; i < chunks_per_page; i ++) {
+        large_free_list_remove(&first[i]);
+    }
+
+    if (madvise(first, fsi.page_size, MADV_DONTNEED) != 0) {
+        for (i = 0; i < chunks_per_page; i ++) {
+            free_list_push( (chunk_t*) &first[i], LARGE_CHUNK, false);
+        }
+        return false;
+    }
+
+    fsi.released_pages[page / 8] |= (1 << (page % 8));
+    fsi.released_pages_count ++;
+
+    STATS_LOCK(stats);
+    stats->item_storage_released += fsi.page_size;
+    STATS_UNLOCK(stats);
+    /* STATS: update */
+    fsi.stats.release_events ++;
+
+    return true;
+}
+
+
+/*
+ * returns pages made up entirely of large chunks that have been on the free
+ * list for idle seconds to the OS.  the free list is ordered by the time chunks
+ * were freed, so we only look at its tail.  an idle chunk whose page is still
+ * partly in use is moved to the head of the free list, so that it is reused
+ * before a released page is faulted back in.
+ */
+static void flat_storage_release(const rel_time_t idle) {
+    rel_time_t now = current_time;
+    size_t examined;
+
+    if (fsi.page_size == 0) {
+        return;
+    }
+
+    for (examined = 0;
+         examined < FLAT_STORAGE_RELEASE_DEPTH && fsi.large_free_list_tail != NULL_CHUNKPTR;
+         examined ++) {
+        large_chunk_t* lc = fsi.large_free_list_tail;
+
+        if (now - lc->lc_free.freed < idle) {
+            /* everything closer to the head was freed more recently. */
+            break;
+        }
+
+        if (flat_storage_release_page(lc) == false) {
+            large_free_list_remove(lc);
+            free_list_push( (chunk_t*) lc, LARGE_CHUNK, false);
+        }
+    }
+}
+
+
+#if defined(COMPACT_TITLES)
+static size_t held_slot(const item_ptr_t iptr) {
+    return (iptr * 2654435761U) & (fsi.held_size - 1);
+}
+
+
+/* returns the slot that holds iptr, or the empty slot it would go in. */
+static held_ref_t* held_find(const item_ptr_t iptr) {
+    size_t i;
+
+    for (i = held_slot(iptr);
+         fsi.held[i].item != NULL_ITEM_PTR && fsi.held[i].item != iptr;
+         i = (i + 1) & (fsi.held_size - 1)) {
+    }
+    return &fsi.held[i];
+}
+
+
+unsigned short item_held_refcount(const item* it) {
+    held_ref_t* ref = held_find(ITEM_PTR((item*) it));
+
+    assert(ref->item != NULL_ITEM_PTR);
+    return ref->refcount;
+}
+
+
+static bool held_grow(void) {
+    held_ref_t* old = fsi.held;
+    size_t old_size = fsi.held_size, i;
+    held_ref_t* table = calloc(old_size * 2, sizeof(held_ref_t));
+
+    if (table == NULL) {
+        return false;
+    }
+    fsi.held = table;
+    fsi.held_size = old_size * 2;
+    for (i = 0; i < old_size; i ++) {
+        if (old[i].item != NULL_ITEM_PTR) {
+            *held_find(old[i].item) = old[i];
+        }
+    }
+    free(old);
+    return true;
+}
+
+
+static void item_ref_incr(item* it) {
+    held_ref_t* ref;
+
+    if (it->empty_header.it_flags & ITEM_HELD) {
+        held_find(ITEM_PTR(it))->refcount ++;
+        return;
+    }
+
+    if ((fsi.held_count + 1) * 2 > fsi.held_size && held_grow() == false) {
+        /* we can carry on fuller than we'd like, but not full. */
+        always_assert(fsi.held_count + 1 < fsi.held_size);
+    }
+    ref = held_find(ITEM_PTR(it));
+    ref->item = ITEM_PTR(it);
+    ref->refcount = 1;
+    fsi.held_count ++;
+    it->empty_header.it_flags |= ITEM_HELD;
+}
+
+
+static void item_ref_decr(item* it) {
+    const size_t mask = fsi.held_size - 1;
+    held_ref_t* ref;
+    size_t i, j;
+
+    if ((it->empty_header.it_flags & ITEM_HELD) == 0) {
+        return;
+    }
+    ref = held_find(ITEM_PTR(it));
+    if (-- ref->refcount != 0) {
+        return;
+    }
+    it->empty_header.it_flags &= ~(ITEM_HELD);
+    fsi.held_count --;
+
+    /* close the gap, so that lookups don't stop short of entries that probed
+     * past it.  an entry can move back into the gap if its home slot isn't
+     * between the gap and itself. */
+    i = ref - fsi.held;
+    for (j = (i + 1) & mask;
+         fsi.held[j].item != NULL_ITEM_PTR;
+         j = (j + 1) & mask) {
+        if (((j - held_slot(fsi.held[j].item)) & mask) >= ((j - i) & mask)) {
+            fsi.held[i] = fsi.held[j];
+            i = j;
+        }
+    }
+    fsi.held[i].item = NULL_ITEM_PTR;
+    fsi.held[i].refcount = 0;
+}
+
+
+/* returns true if the page holding the large chunk at lc_index was returned
+ * to the OS. */
+static bool flat_storage_chunk_released(const size_t lc_index) {
+    size_t page;
+
+    if (fsi.released_pages_count == 0) {
+        return false;
+    }
+    page = lc_index * LARGE_CHUNK_SZ / fsi.page_size;
+    return (fsi.released_pages[page / 8] & (1 << (page % 8))) != 0;
+}
+
+
+/*
+ * returns the first title chunk at or after *pos in storage order, and moves
+ * *pos past it.  positions count small chunk slots, SMALL_CHUNKS_PER_LARGE_CHUNK
+ * of them to a large chunk.  returns NULL if there are no more titles before
+ * the end of the initialized region.
+ */
+static item* storage_next_title(size_t* pos) {
+    const size_t large_chunks = fsi.uninitialized_start - fsi.flat_storage_start;
+    size_t lc_index = *pos / SMALL_CHUNKS_PER_LARGE_CHUNK;
+    size_t sc_index = *pos % SMALL_CHUNKS_PER_LARGE_CHUNK;
+
+    for (; lc_index < large_chunks; lc_index ++, sc_index = 0) {
+        large_chunk_t* lc = fsi.flat_storage_start + lc_index;
+
+        if (flat_storage_chunk_released(lc_index)) {
+            continue;
+        }
+
+        if (lc->flags == (LARGE_CHUNK_INITIALIZED | LARGE_CHUNK_USED | LARGE_CHUNK_TITLE)) {
+            if (sc_index == 0) {
+                *pos = (lc_index + 1) * SMALL_CHUNKS_PER_LARGE_CHUNK;
+                return get_item_from_large_title(&lc->lc_title);
+            }
+        } else if (lc->flags == (LARGE_CHUNK_INITIALIZED | LARGE_CHUNK_USED | LARGE_CHUNK_BROKEN)) {
+            for (; sc_index < SMALL_CHUNKS_PER_LARGE_CHUNK; sc_index ++) {
+                small_chunk_t* sc = &lc->lc_broken.lbc[sc_index];
+
+                if (sc->flags == (SMALL_CHUNK_INITIALIZED | SMALL_CHUNK_USED | SMALL_CHUNK_TITLE)) {
+                    *pos = (lc_index * SMALL_CHUNKS_PER_LARGE_CHUNK) + sc_index + 1;
+                    return get_item_from_small_title(&sc->sc_title);
+                }
+            }
+        }
+    }
+
+    *pos = large_chunks * SMALL_CHUNKS_PER_LARGE_CHUNK;
+    return NULL;
+}
+
+
+/* like storage_next_title, but carries on from the start of storage at the
+ * end.  returns NULL only if there are no titles at all. */
+static item* storage_next_title_wrap(size_t* pos) {
+    item* it = storage_next_title(pos);
+
+    if (it == NULL) {
+        *pos = 0;
+        it = storage_next_title(pos);
+    }
+    return it;
+}
+
+
+/*
+ * moves the clock hand on to the next item to evict: one with refcount == 0
+ * that hasn't been accessed since the hand last passed it.  the hand clears
+ * ITEM_RECENT as it goes, so if there is anything to evict, it is found by the
+ * second time around.
+ */
+static item* clock_next_victim(void) {
+    const size_t titles = fsi.stats.large_title_chunks + fsi.stats.small_title_chunks;
+    size_t examined;
+
+    for (examined = 0; examined <= titles * 2; examined ++) {
+        item* it = storage_next_title_wrap(&fsi.clock_hand);
+
+        if (it == NULL) {
+            return NULL;
+        }
+        if ((it->empty_header.it_flags & ITEM_LINKED) == 0 ||
+            ITEM_refcount(it) != 0) {
+            continue;
+        }
+        if (it->empty_header.it_flags & ITEM_RECENT) {
+            it->empty_header.it_flags &= ~(ITEM_RECENT);
+            continue;
+        }
+        return it;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * gets the item the clock hand evicts next.
+ */
+FA_STATIC item* get_lru_item(void) {
+    return clock_next_victim();
+}
+#else
+static void item_ref_incr(item* it) {
+    it->empty_header.refcount ++;
+}
+
+
+static void item_ref_decr(item* it) {
+    if (it->empty_header.refcount != 0) {
+        it->empty_header.refcount --;
+    }
+}
+
+
 /*
  * gets the oldest item on the LRU with refcount == 0.
  */
@@ -413,6 +885,68 @@ FA_STATIC item* get_lru_item(void) {
 
     return NULL;
 }
+#endif /* #if defined(COMPACT_TITLES) */
+
+
+/*
+ * gets the item to evict.  the lru policy takes the oldest item with
+ * refcount == 0.  the gdsf policy looks at the LRU_SEARCH_DEPTH items nearest
+ * the tail, and takes an expired item if there is one, and the item with the
+ * fewest recent hits per byte otherwise.  with compact titles, the candidates
+ * are the next items the clock hand would evict.
+ */
+static item* get_evict_item(void) {
+    rel_time_t now = current_time;
+    item* iter, * best = NULL;
+    int i;
+#if defined(COMPACT_TITLES)
+    size_t first_hand = 0;
+#else
+    item* prev;
+#endif /* #if defined(COMPACT_TITLES) */
+
+    if (settings.evict_policy == EVICT_LRU) {
+        return get_lru_item();
+    }
+
+#if defined(COMPACT_TITLES)
+    for (i = 0;
+         i < LRU_SEARCH_DEPTH && (iter = clock_next_victim()) != NULL;
+         i ++) {
+        if (i == 0) {
+            first_hand = fsi.clock_hand;
+        }
+#else
+    for (i = 0,
+             iter = fsi.lru_tail;
+         i < LRU_SEARCH_DEPTH && iter != NULL_CHUNKPTR;
+         i ++, iter = prev) {
+        prev = get_item_from_chunk(get_chunk_address(iter->empty_header.prev));
+#endif /* #if defined(COMPACT_TITLES) */
+
+        if (ITEM_refcount(iter) != 0) {
+            continue;
+        }
+        if (ITEM_exptime(iter) != 0 &&
+            ITEM_exptime(iter) <= now) {
+            best = iter;
+            break;
+        }
+        if (best == NULL || item_gdsf_cheaper(iter, best, now)) {
+            best = iter;
+        }
+    }
+
+#if defined(COMPACT_TITLES)
+    if (i > 0) {
+        /* only move the hand past the first candidate, so that the hand
+         * doesn't sweep faster than it does for lru. */
+        fsi.clock_hand = first_hand;
+    }
+#endif /* #if defined(COMPACT_TITLES) */
+
+    return best;
+}
 
 
 static bool small_chunk_referenced(const small_chunk_t* sc) {
@@ -429,7 +963,7 @@ static bool small_chunk_referenced(const small_chunk_t* sc) {
 
         assert((sc->flags & (SMALL_CHUNK_INITIALIZED | SMALL_CHUNK_USED | SMALL_CHUNK_TITLE)) ==
                (SMALL_CHUNK_INITIALIZED | SMALL_CHUNK_USED | SMALL_CHUNK_TITLE));
-        return (sc->sc_title.refcount == 0) ? false : true;
+        return (ITEM_refcount(get_item_from_small_title( (small_title_chunk_t*) &sc->sc_title)) == 0) ? false : true;
     }
 }
 
@@ -489,6 +1023,7 @@ static large_chunk_t* find_unreferenced_broken_chunk(size_t search_depth) {
 static coalesce_progress_t coalesce_free_small_chunks(void) {
     coalesce_progress_t retval = COALESCE_NO_PROGRESS;
 
+    TRACE_FLAT_COALESCE_START(fsi.small_free_list_sz, fsi.large_free_list_sz);
     while (fsi.small_free_list_sz >= SMALL_CHUNKS_PER_LARGE_CHUNK) {
         large_chunk_t* lc;
         unsigned i;
@@ -497,7 +1032,7 @@ static coalesce_progress_t coalesce_free_small_chunks(void) {
         if (lc == NULL) {
             /* we don't want to be stuck in an infinite loop if we can't find a
              * large unreferenced chunk, so just report no progress. */
-            return retval;
+            break;
         }
 
         /* STATS: update */
@@ -555,12 +1090,15 @@ static coalesce_progress_t coalesce_free_small_chunks(void) {
 
                     if (iter->flags & SMALL_CHUNK_TITLE) {
                         item* new_it, * old_it;
+#if !defined(COMPACT_TITLES)
                         chunk_t* next, * prev;
+#endif /* #if !defined(COMPACT_TITLES) */
                         small_chunk_t* next_chunk;
 
                         new_it = get_item_from_small_title(&(replacement->sc_title));
                         old_it = get_item_from_small_title(&(iter->sc_title));
 
+#if !defined(COMPACT_TITLES)
                         /* edit the forward and backward links. */
                         if (replacement->sc_title.next != NULL_CHUNKPTR) {
                             next = get_chunk_address(replacement->sc_title.next);
@@ -579,6 +1117,7 @@ static coalesce_progress_t coalesce_free_small_chunks(void) {
                             assert(fsi.lru_head == get_item_from_small_title(&old_chunk->sc.sc_title));
                             fsi.lru_head = get_item_from_small_title(&replacement->sc_title);
                         }
+#endif /* #if !defined(COMPACT_TITLES) */
 
                         /* edit the next_chunk's prev_chunk link */
                         next_chunk = &(get_chunk_address(replacement->sc_title.next_chunk))->sc;
@@ -632,22 +1171,33 @@ static coalesce_progress_t coalesce_free_small_chunks(void) {
 
         retval = COALESCE_LARGE_CHUNK_FORMED;
     }
+    TRACE_FLAT_COALESCE_DONE(fsi.small_free_list_sz, fsi.large_free_list_sz);
 
     return retval;
 }
 
 
-static bool flat_storage_lru_evict(chunk_type_t chunk_type, size_t nchunks) {
+/*
+ * evicts items until there are nchunks free chunks of chunk_type.  at most
+ * *budget items are evicted; the budget is reduced by the number evicted.
+ */
+static bool flat_storage_lru_evict(chunk_type_t chunk_type, size_t nchunks, size_t* budget) {
     while (1) {
         /* release one item from the LRU... */
         item* lru_item;
 
-        lru_item = get_lru_item();
+        if (*budget == 0) {
+            /* leave the rest to the reclaimer. */
+            return false;
+        }
+
+        lru_item = get_evict_item();
         if (lru_item == NULL) {
             /* nothing to release, so we just fail. */
             return false;
         }
         do_item_unlink(lru_item, UNLINK_MAYBE_EVICT, NULL);
+        (*budget) --;
 
         /* do we have enough free chunks to leave this loop? */
         switch (chunk_type) {
@@ -688,6 +1238,112 @@ static bool flat_storage_lru_evict(chunk_type_t chunk_type, size_t nchunks) {
 }
 
 
+/*
+ * frees some memory while more is resident than settings.maxbytes allows,
+ * which happens after the limit is lowered at runtime.  free pages are returned
+ * to the OS right away.  if that isn't enough, a bounded number of items are
+ * evicted from the LRU so that their pages can be released on a later pass.
+ * free chunks alone may not cover whole pages, so we keep evicting until the
+ * limit is met.
+ */
+static void flat_storage_shrink(void) {
+    size_t evicted;
+
+    if (fsi.page_size == 0 || flat_storage_resident_bytes() <= settings.maxbytes) {
+        return;
+    }
+
+    flat_storage_release(0);
+    if (flat_storage_resident_bytes() <= settings.maxbytes) {
+        return;
+    }
+
+    for (evicted = 0; evicted < FLAT_STORAGE_SHRINK_EVICTS; evicted ++) {
+        item* lru_item = get_evict_item();
+
+        if (lru_item == NULL) {
+            break;
+        }
+        do_item_unlink(lru_item, UNLINK_MAYBE_EVICT, NULL);
+    }
+
+    if (fsi.small_free_list_sz >= SMALL_CHUNKS_PER_LARGE_CHUNK) {
+        /* turn free small chunks back into large chunks we can release. */
+        coalesce_free_small_chunks();
+    }
+}
+
+
+/*
+ * evicts ahead of demand while less than settings.reclaim_percent of the
+ * memory limit is free.  when large chunks make up less than half of that,
+ * free small chunks are coalesced so that large items find large chunks
+ * ready.
+ */
+bool do_item_reclaim(void) {
+    stats_t *stats = STATS_GET_TLS();
+    const size_t target = flat_storage_reclaim_target();
+    size_t reclaimed = 0;
+    bool short_of_free;
+
+    if (target == 0) {
+        return false;
+    }
+
+    while ((short_of_free = (flat_storage_free_bytes() < target)) &&
+           reclaimed < ITEM_RECLAIM_BATCH) {
+        item* lru_item = get_evict_item();
+
+        if (lru_item == NULL) {
+            short_of_free = false;      /* nothing we can evict for now. */
+            break;
+        }
+        do_item_unlink(lru_item, UNLINK_MAYBE_EVICT, NULL);
+        reclaimed ++;
+    }
+
+    if (fsi.large_free_list_sz * LARGE_CHUNK_SZ < target / 2 &&
+        fsi.small_free_list_sz >= SMALL_CHUNKS_PER_LARGE_CHUNK) {
+        coalesce_free_small_chunks();
+    }
+
+    STATS_LOCK(stats);
+    stats->reclaimed_items += reclaimed;
+    STATS_UNLOCK(stats);
+
+    return short_of_free;
+}
+
+
+void do_item_release_memory(void) {
+    flat_storage_shrink();
+    if (settings.mem_release_idle != 0) {
+        flat_storage_release(settings.mem_release_idle);
+    }
+}
+
+
+/*
+ * raising the limit lets flat_storage_alloc initialize more of the reserved
+ * region.  lowering it stops flat_storage_alloc from initializing or
+ * reclaiming memory, and leaves flat_storage_shrink to give back the excess.
+ * the limit must be a multiple of FLAT_STORAGE_INCREMENT_DELTA, and can't be
+ * raised past the address space reserved by flat_storage_init.
+ */
+bool do_item_set_maxbytes(const size_t maxbytes) {
+    size_t initialized = (fsi.uninitialized_start - fsi.flat_storage_start) * LARGE_CHUNK_SZ;
+
+    if (maxbytes > fsi.reserved_bytes ||
+        maxbytes % FLAT_STORAGE_INCREMENT_DELTA != 0) {
+        return false;
+    }
+
+    settings.maxbytes = maxbytes;
+    fsi.unused_memory = (maxbytes > initialized) ? maxbytes - initialized : 0;
+    return true;
+}
+
+
 static int do_stamp_on_block(char* block_start, size_t block_offset, size_t block_sz,
                              const rel_time_t now, const struct in_addr addr) {
     int retflags = 0;
@@ -736,8 +1392,27 @@ void item_memcpy_from(void* dst, const item* it, size_t offset, size_t nbytes,
 
 
 int item_key_compare(const item* it, const char* key, const size_t nkey) {
-    if (nkey != it->empty_header.nkey) {
-        return it->empty_header.nkey - nkey;
+    size_t offset = 0, stored = it->empty_header.nkey;
+
+    if (nkey != ITEM_nkey(it)) {
+        return ITEM_nkey(it) - nkey;
+    }
+
+    if (it->empty_header.it_flags & ITEM_KEY_PREFIXED) {
+        const key_prefix_t* prefix = &key_prefixes[key_prefix_id_get(it->small_title.data)];
+        int retval;
+
+        if ((retval = memcmp(prefix->prefix, key, prefix->nprefix)) != 0) {
+            return retval;
+        }
+        key += prefix->nprefix;
+        offset = KEY_PREFIX_ID_SZ;
+    }
+
+    /* a key that fits in a small title is always in one piece, even if the
+     * value goes on into other chunks. */
+    if (stored <= SMALL_TITLE_CHUNK_DATA_SZ) {
+        return memcmp(&it->small_title.data[offset], key, stored - offset);
     }
 
 #define ITEM_KEY_COMPARE_APPLIER(it, ptr, bytes)        \
@@ -751,7 +1426,7 @@ int item_key_compare(const item* it, const char* key, const size_t nkey) {
         key += bytes;                                   \
     } while (0);
 
-    ITEM_WALK(it, 0, nkey, 0, ITEM_KEY_COMPARE_APPLIER, const);
+    ITEM_WALK(it, offset, stored - offset, 0, ITEM_KEY_COMPARE_APPLIER, const);
 #undef ITEM_KEY_COMPARE_APPLIER
 
     return 0;
@@ -789,15 +1464,24 @@ void do_try_item_stamp(item* it, rel_time_t now, const struct in_addr addr) {
 }
 
 
-/* allocates one item capable of storing a key of size nkey and a value field of
- * size nbytes.  stores the key, flags, and exptime.  the value field is not
- * initialized.  if there is insufficient memory, NULL is returned. */
-item* do_item_alloc(const char *key, const size_t nkey, const int flags, const rel_time_t exptime,
-                    const size_t nbytes, const struct in_addr addr) {
+static item* do_item_alloc_impl(const char *key, const size_t nkey, const int flags,
+                                const rel_time_t exptime, const size_t nbytes,
+                                const struct in_addr addr) {
+    size_t evict_budget = SIZE_MAX;
+
     if (item_size_ok(nkey, flags, nbytes) == false) {
         return NULL;
     }
 
+    if (settings.reclaim_percent != 0) {
+        /* the reclaimer keeps memory free ahead of us, so we only evict a
+         * bounded number of items ourselves. */
+        evict_budget = chunks_needed(nkey, nbytes) + FLAT_STORAGE_FOREGROUND_EVICTS;
+        if (flat_storage_free_bytes() < flat_storage_reclaim_target()) {
+            thread_wake_reclaimer();
+        }
+    }
+
     if (is_large_chunk(nkey, nbytes)) {
         /* allocate a large chunk */
 
@@ -834,7 +1518,7 @@ item* do_item_alloc(const char *key, const size_t nkey, const int flags, const r
                 continue;
             }
 
-            if (flat_storage_lru_evict(LARGE_CHUNK, needed)) {
+            if (flat_storage_lru_evict(LARGE_CHUNK, needed, &evict_budget)) {
                 continue;
             }
 
@@ -849,13 +1533,21 @@ item* do_item_alloc(const char *key, const size_t nkey, const int flags, const r
         assert(temp != NULL);
         title = &(temp->lc.lc_title);
         title->h_next = NULL_ITEM_PTR;
+#if defined(COMPACT_TITLES)
+        title->next_chunk = NULL_CHUNKPTR;
+#else
         title->next = title->prev = title->next_chunk = NULL_CHUNKPTR;
-        title->refcount = 1;            /* the caller will have a reference */
+        title->refcount = 0;
+#endif /* #if defined(COMPACT_TITLES) */
         title->it_flags = ITEM_VALID;
         title->nkey = nkey;
+        title->hits = 0;
+        title->atime_rel = 0;
         title->nbytes = nbytes;
-        title->exptime = exptime;
+        title->time = current_time;
+        ITEM_set_exptime(get_item_from_large_title(title), exptime);
         title->flags = flags;
+        item_ref_incr(get_item_from_large_title(title)); /* the caller will have a reference */
         prev_next = &title->next_chunk;
 
         key_write = __fs_MIN(LARGE_TITLE_CHUNK_DATA_SZ, key_left);
@@ -937,7 +1629,7 @@ item* do_item_alloc(const char *key, const size_t nkey, const int flags, const r
                 continue;
             }
 
-            if (flat_storage_lru_evict(SMALL_CHUNK, needed)) {
+            if (flat_storage_lru_evict(SMALL_CHUNK, needed, &evict_budget)) {
                 continue;
             }
 
@@ -952,13 +1644,21 @@ item* do_item_alloc(const char *key, const size_t nkey, const int flags, const r
         assert(temp != NULL);
         title = &(temp->sc.sc_title);
         title->h_next = NULL_ITEM_PTR;
+#if defined(COMPACT_TITLES)
+        title->next_chunk = NULL_CHUNKPTR;
+#else
         title->next = title->prev = title->next_chunk = NULL_CHUNKPTR;
-        title->refcount = 1;            /* the caller will have a reference */
+        title->refcount = 0;
+#endif /* #if defined(COMPACT_TITLES) */
         title->it_flags = ITEM_VALID;
         title->nkey = nkey;
+        title->hits = 0;
+        title->atime_rel = 0;
         title->nbytes = nbytes;
-        title->exptime = exptime;
+        title->time = current_time;
+        ITEM_set_exptime(get_item_from_small_title(title), exptime);
         title->flags = flags;
+        item_ref_incr(get_item_from_small_title(title)); /* the caller will have a reference */
         prev = get_chunkptr(temp);
         prev_next = &title->next_chunk;
 
@@ -1012,6 +1712,40 @@ item* do_item_alloc(const char *key, const size_t nkey, const int flags, const r
 }
 
 
+/* allocates one item capable of storing a key of size nkey and a value field of
+ * size nbytes.  stores the key, flags, and exptime.  the value field is not
+ * initialized.  if there is insufficient memory, NULL is returned. */
+item* do_item_alloc(const char *key, const size_t nkey, const int flags, const rel_time_t exptime,
+                    const size_t nbytes, const struct in_addr addr) {
+#if TRACE_ENABLED
+    stats_t *stats = STATS_GET_TLS();
+    const uint64_t evictions = stats->evictions;
+#endif /* #if TRACE_ENABLED */
+    char stored[KEY_MAX_LENGTH + KEY_PREFIX_ID_SZ];
+    size_t nprefix;
+    int prefix_id;
+    item* it;
+
+    /* a key with an interned prefix is stored as the prefix's id followed by
+     * the rest of the key. */
+    if ((prefix_id = do_key_prefix_intern(key, nkey, &nprefix)) >= 0) {
+        key_prefix_id_set(stored, prefix_id);
+        memcpy(stored + KEY_PREFIX_ID_SZ, key + nprefix, nkey - nprefix);
+        it = do_item_alloc_impl(stored, KEY_PREFIX_ID_SZ + nkey - nprefix, flags, exptime, nbytes, addr);
+        if (it != NULL) {
+            it->empty_header.it_flags |= ITEM_KEY_PREFIXED;
+        }
+    } else {
+        it = do_item_alloc_impl(key, nkey, flags, exptime, nbytes, addr);
+    }
+
+#if TRACE_ENABLED
+    TRACE_ITEM_ALLOC(key, nkey, nbytes, it != NULL, stats->evictions - evictions);
+#endif /* #if TRACE_ENABLED */
+    return it;
+}
+
+
 /* marks the item as free.  if to_freelist is true, it can be sent to the
  * freelist.  as it is now, to_freelist is *always* true. */
 static void item_free(item *it) {
@@ -1022,10 +1756,12 @@ static void item_free(item *it) {
 #endif /* #if !defined(NDEBUG) */
     bool is_large_chunks = is_item_large_chunk(it);
 
-    assert((it->empty_header.it_flags & ~(ITEM_HAS_TIMESTAMP | ITEM_HAS_IP_ADDRESS))== ITEM_VALID);
-    assert(it->empty_header.refcount == 0);
+    assert((it->empty_header.it_flags & ~(ITEM_HAS_TIMESTAMP | ITEM_HAS_IP_ADDRESS | ITEM_KEY_PREFIXED))== ITEM_VALID);
+    assert(ITEM_refcount(it) == 0);
+#if !defined(COMPACT_TITLES)
     assert(it->empty_header.next == NULL_CHUNKPTR);
     assert(it->empty_header.prev == NULL_CHUNKPTR);
+#endif /* #if !defined(COMPACT_TITLES) */
     assert(it->empty_header.h_next == NULL_ITEM_PTR);
 
     /* find all the chunks and liberate them. */
@@ -1116,11 +1852,26 @@ bool item_size_ok(const size_t nkey, const int flags, const int nbytes) {
 
 bool item_need_realloc(const item* it,
                        const size_t new_nkey, const int new_flags, const size_t new_nbytes) {
-    return (is_item_large_chunk(it) != is_large_chunk(new_nkey, new_nbytes) ||
-            chunks_in_item(it) != chunks_needed(new_nkey, new_nbytes));
+    /* the item is reused with the key it already holds, so a prefixed key
+     * takes the room it is stored in. */
+    const size_t stored_nkey = (new_nkey == ITEM_nkey(it)) ? it->empty_header.nkey : new_nkey;
+
+    return (is_item_large_chunk(it) != is_large_chunk(stored_nkey, new_nbytes) ||
+            chunks_in_item(it) != chunks_needed(stored_nkey, new_nbytes));
 }
 
 
+#if defined(COMPACT_TITLES)
+/* new items get one pass of the clock hand before they can be evicted. */
+static void item_link_q(item *it) {
+    it->empty_header.it_flags |= ITEM_RECENT;
+}
+
+
+static void item_unlink_q(item* it) {
+    it->empty_header.it_flags &= ~(ITEM_RECENT);
+}
+#else
 static void item_link_q(item *it) {
     assert(it->empty_header.next == NULL_CHUNKPTR);
     assert(it->empty_header.prev == NULL_CHUNKPTR);
@@ -1163,19 +1914,84 @@ static void item_unlink_q(item* it) {
     it->empty_header.prev = NULL_CHUNKPTR;
     it->empty_header.next = NULL_CHUNKPTR;
 }
+#endif /* #if defined(COMPACT_TITLES) */
+
+
+/*
+ * evicts the oldest unreferenced items that share the prefix of the item `it'
+ * until the prefix is back under its quota.  the search is limited to
+ * PREFIX_QUOTA_SEARCH_DEPTH items from the tail of the LRU, or from the clock
+ * hand with compact titles.
+ */
+static void item_evict_over_quota(const item* it, const char* key) {
+    const size_t nkey = ITEM_nkey(it);
+    const size_t nprefix = stats_prefix_length(key, nkey);
+    item* iter;
+    int i;
+    char key_temp[KEY_MAX_LENGTH];
+#if defined(COMPACT_TITLES)
+    const size_t titles = fsi.stats.large_title_chunks + fsi.stats.small_title_chunks;
+    size_t pos = fsi.clock_hand;
+
+    for (i = 0;
+         i < PREFIX_QUOTA_SEARCH_DEPTH && i < titles &&
+             (iter = storage_next_title_wrap(&pos)) != NULL;
+         i ++) {
+        if ((iter->empty_header.it_flags & ITEM_LINKED) == 0) {
+            continue;
+        }
+#else
+    item* prev;
+
+    for (i = 0,
+             iter = fsi.lru_tail;
+         i < PREFIX_QUOTA_SEARCH_DEPTH && iter != NULL_CHUNKPTR;
+         i ++, iter = prev) {
+        prev = get_item_from_chunk(get_chunk_address(iter->empty_header.prev));
+#endif /* #if defined(COMPACT_TITLES) */
+
+        if (ITEM_refcount(iter) != 0 ||
+            ITEM_nkey(iter) <= nprefix ||
+            memcmp(item_key_copy(iter, key_temp), key, nprefix + 1) != 0) {
+            continue;
+        }
+
+        /* counted in evictions or expirations by do_item_unlink, the same as
+         * the evictions that make room for new items. */
+        do_item_unlink(iter, UNLINK_MAYBE_EVICT, NULL);
+
+        if (! stats_prefix_quota_evicted(key, nkey)) {
+            return;
+        }
+    }
+}
 
 
 /**
  * adds the item to the LRU.
  */
-int do_item_link(item* it, const char* key) {
+int do_item_link(item* it, const char* key, const uint32_t hv) {
+    return do_item_link_slot(it, key, hv, assoc_find_slot(key, ITEM_nkey(it), hv));
+}
+
+
+int do_item_link_slot(item* it, const char* key, const uint32_t hv, item_ptr_t* slot) {
     stats_t *stats = STATS_GET_TLS();
+    item* old_it;
     assert(it->empty_header.it_flags & ITEM_VALID);
     assert((it->empty_header.it_flags & ITEM_LINKED) == 0);
+    assert(key != NULL);
 
     it->empty_header.it_flags |= ITEM_LINKED;
-    it->empty_header.time = current_time;
-    assoc_insert(it, key);
+    ITEM_set_time(it, current_time);
+    ITEM_set_atime_rel(it, 0);
+    old_it = assoc_link_slot(slot, it);
+    if (old_it != NULL) {
+        do_item_unlink(old_it, UNLINK_NORMAL | UNLINK_REPLACED, key);
+    } else {
+        /* stores don't promote victims, so an older value may be there. */
+        do_victim_delete(key, ITEM_nkey(it), hv);
+    }
 
     STATS_LOCK(stats);
     stats->item_total_size += ITEM_nkey(it) + ITEM_nbytes(it);
@@ -1185,6 +2001,10 @@ int do_item_link(item* it, const char* key) {
 
     item_link_q(it);
 
+    if (stats_prefix_quota_charge(key, ITEM_nkey(it), ITEM_nkey(it) + ITEM_nbytes(it))) {
+        item_evict_over_quota(it, key);
+    }
+
     return 1;
 }
 
@@ -1213,8 +2033,8 @@ void do_item_unlink(item* it, long flags, const char* key) {
         if (flags & UNLINK_MAYBE_EVICT) {
             /* if the item is expired, then it is an expire.  otherwise it is an
              * evict. */
-            if (it->empty_header.exptime == 0 ||
-                it->empty_header.exptime > current_time) {
+            if (ITEM_exptime(it) == 0 ||
+                ITEM_exptime(it) > current_time) {
                 /* it's an evict. */
                 flags = UNLINK_IS_EVICT;
             } else {
@@ -1231,17 +2051,28 @@ void do_item_unlink(item* it, long flags, const char* key) {
             stats_evict(ITEM_nkey(it) + ITEM_nbytes(it));
             STATS_LOCK(stats);
             stats->evictions ++;
+            stats->evicted_bytes += ITEM_nkey(it) + ITEM_nbytes(it);
+            if (ITEM_hits(it) == 0) {
+                stats->evicted_unfetched ++;
+            }
+            stats->evicted_hits += ITEM_hits(it);
             STATS_UNLOCK(stats);
+            if ((it->empty_header.it_flags & ITEM_DELETED) == 0) {
+                do_victim_insert(it, key);
+            }
         } else if (flags & UNLINK_IS_EXPIRED) {
             stats_expire(ITEM_nkey(it) + ITEM_nbytes(it));
         }
         if (settings.detail_enabled) {
             stats_prefix_record_removal(key, ITEM_nkey(it), ITEM_nkey(it) + ITEM_nbytes(it), it->empty_header.time, flags);
         }
-        assoc_delete(key, ITEM_nkey(it));
+        stats_prefix_quota_uncharge(key, ITEM_nkey(it), ITEM_nkey(it) + ITEM_nbytes(it));
+        if ((flags & UNLINK_REPLACED) == 0) {
+            assoc_delete(key, ITEM_nkey(it));
+        }
         it->empty_header.h_next = NULL_ITEM_PTR;
         item_unlink_q(it);
-        if (it->empty_header.refcount == 0) {
+        if (ITEM_refcount(it) == 0) {
             item_free(it);
         }
     }
@@ -1253,12 +2084,10 @@ void do_item_deref(item* it) {
     assert(it->empty_header.it_flags & ITEM_VALID);
 
     /* may not be ITEM_LINKED because the unlink may have preceeded the remove. */
-    if (it->empty_header.refcount != 0) {
-        it->empty_header.refcount --;
-    }
+    item_ref_decr(it);
     assert((it->empty_header.it_flags & ITEM_DELETED) == 0 ||
-           it->empty_header.refcount != 0);
-    if (it->empty_header.refcount == 0 &&
+           ITEM_refcount(it) != 0);
+    if (ITEM_refcount(it) == 0 &&
         (it->empty_header.it_flags & ITEM_LINKED) == 0) {
         item_free(it);
     }
@@ -1267,30 +2096,27 @@ void do_item_deref(item* it) {
 
 /** update LRU time to current and reposition */
 void do_item_update(item* it) {
+#if defined(COMPACT_TITLES)
+    /* setting the clock bit is cheap, so unlike moving the item to the head
+     * of the LRU, it is done on every access. */
+    if (it->empty_header.it_flags & ITEM_LINKED) {
+        it->empty_header.it_flags |= ITEM_RECENT;
+    }
+#endif /* #if defined(COMPACT_TITLES) */
     if (it->empty_header.time < current_time - ITEM_UPDATE_INTERVAL) {
         assert(it->empty_header.it_flags & ITEM_VALID);
 
         if (it->empty_header.it_flags & ITEM_LINKED) {
             item_unlink_q(it);
-            it->empty_header.time = current_time;
+            ITEM_set_time(it, current_time);
             item_link_q(it);
         }
     }
+    /* after the move, so that the access time is relative to the new LRU
+     * time. */
+    item_count_hit(it, current_time);
 }
 
-int do_item_replace(item* it, item* new_it, const char* key) {
-    int retval;
-
-    assert((it->empty_header.it_flags & (ITEM_VALID | ITEM_LINKED)) ==
-           (ITEM_VALID | ITEM_LINKED));
-    do_item_unlink(it, UNLINK_NORMAL, key);
-
-    assert(new_it->empty_header.it_flags & ITEM_VALID);
-    retval = do_item_link(new_it, key);
-    return retval;
-}
-
-
 char* do_item_cachedump(const chunk_type_t type, const unsigned int limit, unsigned int* bytes) {
     unsigned int memlimit = ITEM_CACHEDUMP_LIMIT;   /* 2MB max response size */
     char *buffer;
@@ -1302,23 +2128,43 @@ char* do_item_cachedump(const chunk_type_t type, const unsigned int limit, unsig
     char key_temp[KEY_MAX_LENGTH];
     const char* key;
 
+#if defined(COMPACT_TITLES)
+    size_t pos = 0;
+#endif /* #if defined(COMPACT_TITLES) */
+
     buffer = malloc((size_t)memlimit);
     if (buffer == 0) return NULL;
     bufcurr = 0;
 
+#if defined(COMPACT_TITLES)
+    /* there's no LRU, so the items are listed in storage order. */
+    it = storage_next_title(&pos);
+#else
     it = fsi.lru_head;
+#endif /* #if defined(COMPACT_TITLES) */
 
     while (it != NULL && (limit == 0 || shown < limit)) {
+#if defined(COMPACT_TITLES)
+        if ((it->empty_header.it_flags & ITEM_LINKED) == 0) {
+            it = storage_next_title(&pos);
+            continue;
+        }
+#endif /* #if defined(COMPACT_TITLES) */
         key = item_key_copy(it, key_temp);
-        len = snprintf(temp, sizeof(temp), "ITEM %*s [%d b; %lu s]\r\n",
+        len = snprintf(temp, sizeof(temp), "ITEM %.*s [%d b; %lu s; %u hits; last access %lu s]\r\n",
                        ITEM_nkey(it), key,
-                       ITEM_nbytes(it), it->empty_header.time + started);
+                       ITEM_nbytes(it), it->empty_header.time + started, ITEM_hits(it),
+                       item_last_access(it) + started);
         if (bufcurr + len + 6 > memlimit)  /* 6 is END\r\n\0 */
             break;
         strcpy(buffer + bufcurr, temp);
         bufcurr += len;
         shown++;
+#if defined(COMPACT_TITLES)
+        it = storage_next_title(&pos);
+#else
         it = get_item_from_chunk(get_chunk_address(it->empty_header.next));
+#endif /* #if defined(COMPACT_TITLES) */
     }
 
     memcpy(buffer + bufcurr, "END\r\n", 6);
@@ -1329,58 +2175,25 @@ char* do_item_cachedump(const chunk_type_t type, const unsigned int limit, unsig
 }
 
 
-char* do_item_stats_sizes(int* bytes) {
-    const size_t max_item_size = sizeof(large_chunk_t) + KEY_MAX_LENGTH + MAX_ITEM_SIZE;
-    const int num_buckets = (max_item_size + 32 - 1) / 32;   /* max object, divided into 32 bytes size buckets */
-    unsigned int *histogram = (unsigned int *)malloc((size_t)num_buckets * sizeof(int));
-    char *buf = (char *)malloc(ITEM_STATS_SIZES); /* 2MB max response size */
-    int i;
-
-    if (histogram == 0 || buf == 0) {
-        if (histogram) free(histogram);
-        if (buf) free(buf);
-        return NULL;
-    }
-
-    /* build the histogram */
-    memset(histogram, 0, (size_t)num_buckets * sizeof(int));
-
-    item* iter = fsi.lru_head;
-    while (iter) {
-        int ntotal = ITEM_ntotal(iter);
-        int bucket = ntotal / 32;
-        if ((ntotal % 32) != 0) bucket++;
-        if (bucket < num_buckets) histogram[bucket]++;
-        iter = get_item_from_chunk(get_chunk_address(iter->small_title.next));
-    }
-
-    iter = fsi.lru_head;
-    while (iter) {
-        int ntotal = ITEM_ntotal(iter);
-        int bucket = ntotal / 32;
-        if ((ntotal % 32) != 0) bucket++;
-        if (bucket < num_buckets) histogram[bucket]++;
-        iter = get_item_from_chunk(get_chunk_address(iter->large_title.next));
-    }
-
-    /* write the buffer */
-    *bytes = 0;
-    for (i = 0; i < num_buckets; i++) {
-        if (histogram[i] != 0) {
-            *bytes += sprintf(&buf[*bytes], "%d %u\r\n", i * 32, histogram[i]);
-        }
-    }
-    *bytes += sprintf(&buf[*bytes], "END\r\n");
-    free(histogram);
-    return buf;
-}
-
-
 void do_item_flush_expired(void) {
+#if defined(COMPACT_TITLES)
+    item *iter;
+    size_t pos = 0;
+#else
     item *iter, *next;
+#endif /* #if defined(COMPACT_TITLES) */
     if (settings.oldest_live == 0)
         return;
 
+#if defined(COMPACT_TITLES)
+    /* items aren't kept in access order, so we have to look at all of them. */
+    while ((iter = storage_next_title(&pos)) != NULL) {
+        if ((iter->empty_header.it_flags & ITEM_LINKED) != 0 &&
+            iter->empty_header.time >= settings.oldest_live) {
+            do_item_unlink(iter, UNLINK_IS_EXPIRED, NULL);
+        }
+    }
+#else
     for (iter = fsi.lru_head;
          iter != NULL;
          iter = next) {
@@ -1408,6 +2221,9 @@ void do_item_flush_expired(void) {
             break;
         }
     }
+#endif /* #if defined(COMPACT_TITLES) */
+
+    do_victim_flush_expired();
 }
 
 
@@ -1416,9 +2232,16 @@ item* item_get(const char* key, const size_t nkey) {
 }
 
 
-item* do_item_get_notedeleted(const char* key, const size_t nkey, bool* delete_locked) {
-    item *it = assoc_find(key, nkey);
+static item* do_item_get_impl(const char* key, const size_t nkey, const uint32_t hv,
+                              bool* delete_locked, const bool promote, item_ptr_t** slot) {
+    item_ptr_t* pos = assoc_find_slot(key, nkey, hv);
+    item *it = *pos ? ITEM(*pos) : NULL;
+    if (slot) *slot = pos;
     if (delete_locked) *delete_locked = false;
+    if (it == NULL && promote) {
+        /* it may have been evicted recently. */
+        return do_victim_promote(key, nkey, hv);
+    }
     if (it != NULL && (it->empty_header.it_flags & ITEM_DELETED)) {
         /* it's flagged as delete-locked.  let's see if that condition
            is past due, and the 5-second delete_timer just hasn't
@@ -1432,23 +2255,50 @@ item* do_item_get_notedeleted(const char* key, const size_t nkey, bool* delete_l
         it->empty_header.time <= settings.oldest_live) {
         do_item_unlink(it, UNLINK_IS_EXPIRED, key); /* MTSAFE - cache_lock held */
         it = NULL;
+        if (slot) *slot = assoc_find_slot(key, nkey, hv);   /* the chain changed */
     }
-    if (it != NULL && it->empty_header.exptime != 0 && it->empty_header.exptime <= current_time) {
+    if (it != NULL && ITEM_exptime(it) != 0 && ITEM_exptime(it) <= current_time) {
         do_item_unlink(it, UNLINK_IS_EXPIRED, key); /* MTSAFE - cache_lock held */
         it = NULL;
+        if (slot) *slot = assoc_find_slot(key, nkey, hv);   /* the chain changed */
     }
 
     if (it != NULL) {
-        it->empty_header.refcount ++;
+        item_ref_incr(it);
     }
     return it;
 }
 
 
-item* do_item_get_nocheck(const char* key, const size_t nkey) {
-    item *it = assoc_find(key, nkey);
+item* do_item_get_notedeleted(const char* key, const size_t nkey, const uint32_t hv,
+                              bool* delete_locked) {
+    return do_item_get_impl(key, nkey, hv, delete_locked, false, NULL);
+}
+
+
+item* do_item_get_slot(const char* key, const size_t nkey, const uint32_t hv,
+                       bool* delete_locked, item_ptr_t** slot) {
+    return do_item_get_impl(key, nkey, hv, delete_locked, false, slot);
+}
+
+
+item* do_item_get_promote(const char* key, const size_t nkey, const uint32_t hv) {
+    /* only the gets are traced; the stores' lookups aren't. */
+    item* it = do_item_get_impl(key, nkey, hv, NULL, true, NULL);
+
+    if (it != NULL) {
+        TRACE_ITEM_GET_HIT(key, nkey, ITEM_nbytes(it));
+    } else {
+        TRACE_ITEM_GET_MISS(key, nkey);
+    }
+    return it;
+}
+
+
+item* do_item_get_nocheck(const char* key, const size_t nkey, const uint32_t hv) {
+    item *it = assoc_find(key, nkey, hv);
     if (it) {
-        it->empty_header.refcount ++;
+        item_ref_incr(it);
     }
     return it;
 }
@@ -1457,20 +2307,30 @@ item* do_item_get_nocheck(const char* key, const size_t nkey) {
    should be removed from the namespace */
 bool item_delete_lock_over(item* it) {
     assert(it->empty_header.it_flags & ITEM_DELETED);
-    return (current_time >= it->empty_header.exptime);
+    return (current_time >= ITEM_exptime(it));
 }
 
 
 /**
  * returns a pointer to the key, flattened into a single array.  if the key
- * spans multiple chunks, it is copied into space pointed to by keyptr.
- * otherwise, the key is returned directly.
+ * spans multiple chunks or starts with an interned prefix, it is copied into
+ * space pointed to by keyptr.  otherwise, the key is returned directly.
  */
 const char* item_key_copy(const item* it, char* keyptr) {
     const char* retval = keyptr;
-    size_t title_data_size;
+    size_t title_data_size, offset = 0;
+
+#define ITEM_key_copy_applier(it, ptr, bytes)   \
+    memcpy(keyptr, ptr, bytes);                 \
+    keyptr += bytes;
+
+    if (it->empty_header.it_flags & ITEM_KEY_PREFIXED) {
+        const key_prefix_t* prefix = &key_prefixes[key_prefix_id_get(it->small_title.data)];
 
-    if (is_item_large_chunk(it)) {
+        memcpy(keyptr, prefix->prefix, prefix->nprefix);
+        keyptr += prefix->nprefix;
+        offset = KEY_PREFIX_ID_SZ;
+    } else if (is_item_large_chunk(it)) {
         title_data_size = LARGE_TITLE_CHUNK_DATA_SZ;
         if (it->large_title.nkey <= title_data_size) {
             return &it->large_title.data[0];
@@ -1481,11 +2341,9 @@ const char* item_key_copy(const item* it, char* keyptr) {
             return &it->small_title.data[0];
         }
     }
-#define ITEM_key_copy_applier(it, ptr, bytes)   \
-    memcpy(keyptr, ptr, bytes);                 \
-    keyptr += bytes;
 
-    ITEM_WALK(it, 0, it->empty_header.nkey, false, ITEM_key_copy_applier, const);
+    ITEM_WALK(it, offset, it->empty_header.nkey - offset, false, ITEM_key_copy_applier, const);
+#undef ITEM_key_copy_applier
 
     return retval;
 }
@@ -1504,7 +2362,16 @@ char* do_flat_allocator_stats(size_t* result_size) {
     }
 
     /* get the LRU items */
+#if defined(COMPACT_TITLES)
+    /* the clock keeps no order by age, and looking for the next victim would
+     * move the hand.  report the item the hand is at. */
+    {
+        size_t pos = fsi.clock_hand;
+        lru_item = storage_next_title_wrap(&pos);
+    }
+#else
     lru_item = get_lru_item();
+#endif /* #if defined(COMPACT_TITLES) */
     if (lru_item == NULL) {
         oldest_item_lifetime = 0;
     } else {
@@ -1514,6 +2381,7 @@ char* do_flat_allocator_stats(size_t* result_size) {
     offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
                               "STAT large_chunk_sz %d\n"
                               "STAT small_chunk_sz %d\n"
+                              "STAT title_header_sz %lu\n"
                               "STAT large_title_chunks %" PRINTF_INT64_MODIFIER "u\n"
                               "STAT large_body_chunks %" PRINTF_INT64_MODIFIER "u\n"
                               "STAT large_broken_chunks %" PRINTF_INT64_MODIFIER "u\n"
@@ -1521,6 +2389,7 @@ char* do_flat_allocator_stats(size_t* result_size) {
                               "STAT small_body_chunks %" PRINTF_INT64_MODIFIER "u\n",
                               LARGE_CHUNK_SZ,
                               SMALL_CHUNK_SZ,
+                              (unsigned long) TITLE_CHUNK_HEADER_SZ,
                               fsi.stats.large_title_chunks,
                               fsi.stats.large_body_chunks,
                               fsi.stats.large_broken_chunks,
@@ -1539,6 +2408,9 @@ char* do_flat_allocator_stats(size_t* result_size) {
                               "STAT unused_memory %lu\n"
                               "STAT large_free_list_sz %lu\n"
                               "STAT small_free_list_sz %lu\n"
+                              "STAT released_pages %lu\n"
+                              "STAT release_events %" PRINTF_INT64_MODIFIER "u\n"
+                              "STAT reclaim_events %" PRINTF_INT64_MODIFIER "u\n"
                               "STAT oldest_item_lifetime %us\n",
                               fsi.stats.break_events,
                               fsi.stats.unbreak_events,
@@ -1546,8 +2418,19 @@ char* do_flat_allocator_stats(size_t* result_size) {
                               fsi.unused_memory,
                               fsi.large_free_list_sz,
                               fsi.small_free_list_sz,
+                              fsi.released_pages_count,
+                              fsi.stats.release_events,
+                              fsi.stats.reclaim_events,
                               oldest_item_lifetime);
 
+#if defined(COMPACT_TITLES)
+    offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                              "STAT clock_hand %lu\n"
+                              "STAT held_items %lu\n",
+                              (unsigned long) fsi.clock_hand,
+                              (unsigned long) fsi.held_count);
+#endif /* #if defined(COMPACT_TITLES) */
+
     offset = append_to_buffer(buffer, bufsize, offset, 0, terminator);
 
     *result_size = offset;
@@ -73,11 +73,31 @@
  *     unsigned short refcount
  *     uint8_t it_flags
  *     uint8_t nkey            # key length.
+ *     uint8_t hits            # accesses, saturating.
+ *     uint8_t atime_rel       # last access, in seconds after time.
  *     data
  *
  * body chunks contain:
  *     pointer to title
  *     data
+ *
+ *
+ * compact titles
+ * --------------
+ *
+ * when built with --enable-compact-titles, title chunks drop the LRU links and
+ * the refcount, and keep the expire time relative to the access time in 3
+ * bytes.  that shrinks the header by 11 bytes, so that more small items fit in
+ * a single small chunk.
+ *    - the LRU is replaced by CLOCK.  items accessed since the clock hand last
+ *      passed them have ITEM_RECENT set.  the hand sweeps the title chunks in
+ *      storage order, clearing the bit, and evicts the first item without it.
+ *    - at any time only a handful of items have references held on them.
+ *      those have ITEM_HELD set, and their reference counts are kept in a hash
+ *      table on the side (fsi.held).
+ *    - expire times are kept relative to the most recent access, in 24 bits.
+ *      one more than TITLE_EXPTIME_REL_MAX seconds (about 194 days) past it
+ *      can't be kept, so such items never expire rather than expire early.
  */
 
 #if !defined(_flat_storage_h_)
@@ -89,6 +109,8 @@
 #include <string.h>
 #include <stdint.h>
 
+#include "key_prefix.h"
+
 #if defined(__GNUC__)
 #define PACKED __attribute__((packed))
 #endif
@@ -144,8 +166,16 @@ typedef enum it_flags_e {
     ITEM_VALID   = 0x1,
     ITEM_LINKED  = 0x2,                 /* linked into the LRU. */
     ITEM_DELETED = 0x4,                 /* deferred delete. */
+    ITEM_KEY_PREFIXED = 0x8,            /* the key starts with the id of an
+                                         * interned prefix; see key_prefix.h.
+                                         * nkey in the header is the length
+                                         * as stored. */
     ITEM_HAS_IP_ADDRESS = 0x10,
     ITEM_HAS_TIMESTAMP = 0x20,
+    ITEM_RECENT  = 0x40,                /* accessed since the clock hand last
+                                         * passed.  compact titles only. */
+    ITEM_HELD    = 0x80,                /* references are held, and counted in
+                                         * fsi.held.  compact titles only. */
 } it_flags_t;
 
 
@@ -184,6 +214,26 @@ typedef enum chunk_type_e {
 #define LRU_SEARCH_DEPTH   50           /* number of items we'll check in the
                                          * LRU to find items to evict. */
 
+#define FLAT_STORAGE_RELEASE_DEPTH 4096 /* number of idle free large chunks we'll
+                                         * check each time we look for memory
+                                         * to return to the OS. */
+
+#define FLAT_STORAGE_SHRINK_EVICTS 256  /* number of items we'll evict each
+                                         * time we shrink towards a lowered
+                                         * memory limit. */
+
+#define FLAT_STORAGE_FOREGROUND_EVICTS 64 /* when the reclaimer keeps a reserve
+                                           * of free memory, the most items an
+                                           * allocation will evict beyond the
+                                           * number of chunks it needs. */
+
+/* unless -g says otherwise, how far the memory limit can be raised at runtime;
+ * flat_storage_init reserves address space up to it. */
+#define FLAT_STORAGE_DEFAULT_CEILING (1024 * 1024 * 1024)
+
+/* the largest storage region chunkptrs can address. */
+#define FLAT_STORAGE_MAX_BYTES (((uint64_t) UINT32_MAX / (LARGE_CHUNK_SZ / CHUNK_ADDRESSING_SZ)) * LARGE_CHUNK_SZ)
+
 /**
  * data types and structures
  */
@@ -201,6 +251,25 @@ typedef union item_u item;
 typedef struct large_chunk_s large_chunk_t;
 typedef struct small_chunk_s small_chunk_t;
 
+#if defined(COMPACT_TITLES)
+#define TITLE_EXPTIME_REL_MAX 0xffffff      /* the largest exptime_rel */
+
+#define TITLE_CHUNK_HEADER_CONTENTS                                     \
+    item_ptr_t h_next;                      /* hash next */             \
+    chunkptr_t next_chunk;                  /* next chunk */            \
+    rel_time_t time;                        /* most recent access */    \
+    int nbytes;                             /* size of data */          \
+    unsigned int flags;                     /* flags */                 \
+    unsigned int exptime_rel : 24;          /* expire time, 1 + seconds \
+                                             * after time.  0 if the    \
+                                             * item doesn't expire. */  \
+    uint8_t it_flags;                       /* it flags */              \
+    uint8_t nkey;                           /* key length */            \
+    uint8_t hits;                           /* accesses, saturating */  \
+    uint8_t atime_rel;                      /* last access, seconds     \
+                                             * after time */            \
+
+#else
 #define TITLE_CHUNK_HEADER_CONTENTS                                     \
     item_ptr_t h_next;                      /* hash next */             \
     chunkptr_t next;                        /* LRU next */              \
@@ -213,7 +282,11 @@ typedef struct small_chunk_s small_chunk_t;
     unsigned short refcount;                                            \
     uint8_t it_flags;                       /* it flags */              \
     uint8_t nkey;                           /* key length */            \
+    uint8_t hits;                           /* accesses, saturating */  \
+    uint8_t atime_rel;                      /* last access, seconds     \
+                                             * after time */            \
 
+#endif /* #if defined(COMPACT_TITLES) */
 
 #define LARGE_BODY_CHUNK_HEADER                 \
     chunkptr_t next_chunk;
@@ -255,10 +328,13 @@ struct large_body_chunk_s {
 
 typedef struct large_free_chunk_s large_free_chunk_t;
 struct large_free_chunk_s {
-    /* large chunks do not need prev_next and next_prev pointers because we never remove an element
-     * from the middle of the free list. */
+    /* the large chunk free list is doubly linked so that chunks can be removed
+     * from the middle of the list when their page is returned to the OS. */
     large_chunk_t* next;
     large_chunk_t* prev;
+    rel_time_t freed;                   /* when the chunk was put on the free
+                                         * list.  this is nondecreasing from
+                                         * the tail to the head. */
 };
 
 #define SMALL_TITLE_CHUNK_DATA_SZ (SMALL_CHUNK_SZ - SMALL_CHUNK_TAIL_SZ - TITLE_CHUNK_HEADER_SZ)
@@ -341,24 +417,57 @@ union chunk_u {
 };
 
 
+#if defined(COMPACT_TITLES)
+typedef struct held_ref_s held_ref_t;
+struct held_ref_s {
+    item_ptr_t item;                    /* NULL_ITEM_PTR if the slot is empty. */
+    unsigned short refcount;
+};
+
+#define HELD_REFS_INITIAL 256           /* initial number of fsi.held slots. */
+#endif /* #if defined(COMPACT_TITLES) */
+
+
 typedef struct flat_storage_info_s flat_storage_info_t;
 struct flat_storage_info_s {
     void* mmap_start;                   // start of the mmap'ed region.
     large_chunk_t* flat_storage_start;  // start of the storage region.
     large_chunk_t* uninitialized_start; // start of the uninitialized region.
     size_t unused_memory;               // unused memory region.
+    size_t reserved_bytes;              // size of the storage region,
+                                        // including room to grow into.
 
     // large chunk free list
     large_chunk_t* large_free_list;     // free list head.
+    large_chunk_t* large_free_list_tail; // free list tail (least recently freed).
     size_t large_free_list_sz;          // number of large free list chunks.
 
+    // pages returned to the OS.  chunks in released pages are not on any free
+    // list; flat_storage_alloc puts them back before initializing new memory.
+    uint8_t* released_pages;            // bitmap, one bit per page.
+    size_t released_pages_count;        // number of bits set in released_pages.
+    size_t released_pages_scan;         // where the next reclaim scan starts.
+    size_t page_size;                   // OS page size, 0 if we can't release.
+
     // small chunk free list
     small_chunk_t* small_free_list;     // free list head.
     size_t small_free_list_sz;          // number of small free list chunks.
 
+#if defined(COMPACT_TITLES)
+    // reference counts of the items with ITEM_HELD set.  open addressing with
+    // linear probing, kept at most half full.
+    held_ref_t* held;
+    size_t held_size;                   // number of slots, a power of 2.
+    size_t held_count;                  // number of slots in use.
+
+    // CLOCK hand.  counts small chunk slots in storage order,
+    // SMALL_CHUNKS_PER_LARGE_CHUNK of them to a large chunk.
+    size_t clock_hand;
+#else
     // LRU.
     item* lru_head;
     item* lru_tail;
+#endif /* #if defined(COMPACT_TITLES) */
 
     bool initialized;
 
@@ -374,6 +483,9 @@ struct flat_storage_info_s {
         uint64_t unbreak_events;
 
         uint64_t migrates;
+
+        uint64_t release_events;
+        uint64_t reclaim_events;
     } stats;
 };
 
@@ -617,9 +729,16 @@ static inline item*          ITEM(item_ptr_t iptr)   { return get_item_from_chun
 static inline item_ptr_t     ITEM_PTR(item* it)      { return (item_ptr_t) get_chunkptr(get_chunk_from_item(it)); }
 static inline bool           ITEM_PTR_IS_NULL(item_ptr_t iptr)    { return iptr != NULL_ITEM_PTR; }
 
-static inline uint8_t        ITEM_nkey(const item* it) { return it->empty_header.nkey; }
-static inline int            ITEM_nbytes(item* it)   { return it->empty_header.nbytes; }
-static inline size_t         ITEM_ntotal(item* it)   {
+static inline uint8_t        ITEM_nkey(const item* it) {
+    if (it->empty_header.it_flags & ITEM_KEY_PREFIXED) {
+        /* the id always fits in the title. */
+        return key_prefixes[key_prefix_id_get(it->small_title.data)].nprefix +
+            it->empty_header.nkey - KEY_PREFIX_ID_SZ;
+    }
+    return it->empty_header.nkey;
+}
+static inline int            ITEM_nbytes(const item* it)   { return it->empty_header.nbytes; }
+static inline size_t         ITEM_ntotal(const item* it)   {
     if (is_item_large_chunk(it)) {
         size_t item_sz = it->empty_header.nkey + it->empty_header.nbytes;
 
@@ -647,13 +766,56 @@ static inline size_t         ITEM_ntotal(item* it)   {
     }
 }
 
-static inline unsigned int   ITEM_flags(item* it)    { return it->empty_header.flags; }
-static inline rel_time_t     ITEM_time(item* it)     { return it->empty_header.time; }
-static inline rel_time_t     ITEM_exptime(item* it)  { return it->empty_header.exptime; }
-static inline unsigned short ITEM_refcount(item* it) { return it->empty_header.refcount; }
+static inline unsigned int   ITEM_flags(const item* it)    { return it->empty_header.flags; }
+static inline rel_time_t     ITEM_time(const item* it)     { return it->empty_header.time; }
+static inline uint8_t        ITEM_hits(const item* it)     { return it->empty_header.hits; }
+static inline uint8_t        ITEM_atime_rel(const item* it){ return it->empty_header.atime_rel; }
 
 static inline void ITEM_set_nbytes(item* it, int nbytes)    { it->empty_header.nbytes = nbytes; }
+static inline void ITEM_set_hits(item* it, uint8_t hits)    { it->empty_header.hits = hits; }
+static inline void ITEM_set_atime_rel(item* it, uint8_t rel){ it->empty_header.atime_rel = rel; }
+
+#if defined(COMPACT_TITLES)
+extern unsigned short item_held_refcount(const item* it);
+
+static inline rel_time_t     ITEM_exptime(const item* it)  {
+    if (it->empty_header.exptime_rel == 0) {
+        return 0;
+    }
+    return it->empty_header.time + it->empty_header.exptime_rel - 1;
+}
+static inline unsigned short ITEM_refcount(const item* it) {
+    return (it->empty_header.it_flags & ITEM_HELD) ? item_held_refcount(it) : 0;
+}
+
+static inline void ITEM_set_exptime(item* it, rel_time_t t) {
+    if (t == 0) {
+        it->empty_header.exptime_rel = 0;
+    } else if (t <= it->empty_header.time) {
+        it->empty_header.exptime_rel = 1;
+    } else if (t - it->empty_header.time >= TITLE_EXPTIME_REL_MAX) {
+        /* too far out to keep; the item stays until it's evicted, as it
+         * would if it expired later than that. */
+        it->empty_header.exptime_rel = 0;
+    } else {
+        it->empty_header.exptime_rel = t - it->empty_header.time + 1;
+    }
+}
+/* the expire time is kept relative to the access time, so it has to be
+ * carried over when the access time changes. */
+static inline void ITEM_set_time(item* it, rel_time_t t) {
+    rel_time_t exptime = ITEM_exptime(it);
+
+    it->empty_header.time = t;
+    ITEM_set_exptime(it, exptime);
+}
+#else
+static inline rel_time_t     ITEM_exptime(const item* it)  { return it->empty_header.exptime; }
+static inline unsigned short ITEM_refcount(const item* it) { return it->empty_header.refcount; }
+
 static inline void ITEM_set_exptime(item* it, rel_time_t t) { it->empty_header.exptime = t; }
+static inline void ITEM_set_time(item* it, rel_time_t t)    { it->empty_header.time = t; }
+#endif /* #if defined(COMPACT_TITLES) */
 
 static inline item_ptr_t ITEM_PTR_h_next(item_ptr_t iptr)  { return ITEM(iptr)->empty_header.h_next; }
 static inline item_ptr_t* ITEM_h_next_p(item* it)               { return &it->empty_header.h_next; }
@@ -664,6 +826,7 @@ static inline bool ITEM_is_valid(item* it)        { return it->empty_header.it_f
 static inline bool ITEM_has_timestamp(item* it)   { return it->empty_header.it_flags & ITEM_HAS_TIMESTAMP; }
 static inline bool ITEM_has_ip_address(item* it)  { return it->empty_header.it_flags & ITEM_HAS_IP_ADDRESS; }
 
+static inline bool ITEM_is_deleted(const item* it) { return it->empty_header.it_flags & ITEM_DELETED; }
 static inline void ITEM_mark_deleted(item* it)    { it->empty_header.it_flags |= ITEM_DELETED; }
 static inline void ITEM_unmark_deleted(item* it)  { it->empty_header.it_flags &= ~ITEM_DELETED; }
 static inline void ITEM_set_has_timestamp(item* it)      { it->empty_header.it_flags |= ITEM_HAS_TIMESTAMP; }
@@ -671,7 +834,7 @@ static inline void ITEM_clear_has_timestamp(item* it)    { it->empty_header.it_f
 static inline void ITEM_set_has_ip_address(item* it)     { it->empty_header.it_flags |= ITEM_HAS_IP_ADDRESS; }
 static inline void ITEM_clear_has_ip_address(item* it)   { it->empty_header.it_flags &= ~(ITEM_HAS_IP_ADDRESS); }
 
-extern void flat_storage_init(size_t maxbytes);
+extern void flat_storage_init(size_t maxbytes, size_t ceiling);
 extern char* do_item_cachedump(const chunk_type_t type, const unsigned int limit, unsigned int *bytes);
 extern const char* item_key_copy(const item* it, char* keyptr);
 
@@ -722,6 +885,17 @@ static inline size_t __fs_MAX(size_t a, size_t b) {
             break;                                                      \
         }                                                               \
                                                                         \
+        /* most items fit entirely in their title chunk.  the data of   \
+         * large and small titles starts at the same place, so there's  \
+         * nothing to work out. */                                      \
+        if ((_it)->empty_header.next_chunk == NULL_CHUNKPTR) {          \
+            assert((_offset) + (_nbytes) <=                             \
+                   (is_item_large_chunk((_it)) ? LARGE_TITLE_CHUNK_DATA_SZ : \
+                    SMALL_TITLE_CHUNK_DATA_SZ));                        \
+            applier((_it), &(_it)->small_title.data[0] + (_offset), left); \
+            break;                                                      \
+        }                                                               \
+                                                                        \
         if (is_item_large_chunk((_it))) {                               \
             /* large chunk handling code. */                            \
                                                                         \
@@ -43,13 +43,23 @@ static inline int add_item_value_to_iov(conn *c, const item* it, bool send_cr_lf
 
 static inline int add_item_key_to_iov(conn *c, const item* it) {
     int retval;
+    size_t offset = 0;
 
 #define ADD_ITEM_TO_IOV_APPLIER(it, ptr, bytes)                 \
     if ((retval = add_iov(c, (ptr), (bytes), false)) != 0) {    \
         return retval;                                          \
     }
 
-    ITEM_WALK(it, 0, it->empty_header.nkey, false, ADD_ITEM_TO_IOV_APPLIER, const);
+    if (it->empty_header.it_flags & ITEM_KEY_PREFIXED) {
+        /* interned prefixes are never freed, so they can be sent from where
+         * they are. */
+        const key_prefix_t* prefix = &key_prefixes[key_prefix_id_get(it->small_title.data)];
+
+        ADD_ITEM_TO_IOV_APPLIER(it, prefix->prefix, prefix->nprefix);
+        offset = KEY_PREFIX_ID_SZ;
+    }
+
+    ITEM_WALK(it, offset, it->empty_header.nkey - offset, false, ADD_ITEM_TO_IOV_APPLIER, const);
 
 #undef ADD_ITEM_TO_IOV_APPLIER
 
@@ -72,6 +82,15 @@ static inline size_t item_setup_receive(item* it, conn* c) {
         if (c->riov == NULL) {
             return false;
         }
+    } else if (sizeof(struct iovec) * iov_len_required > conn_buffer_capacity(c->riov)) {
+        /* the key has already been received, so nothing in it needs to be
+         * kept. */
+        struct iovec* new_riov = (struct iovec*) grow_conn_buffer(c->cbg, c->riov, 0,
+                                                                  sizeof(struct iovec) * iov_len_required);
+        if (new_riov == NULL) {
+            return false;
+        }
+        c->riov = new_riov;
     }
     /* in binary protocol, receiving the key already requires the riov to be set
      * up. */
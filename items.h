@@ -13,6 +13,8 @@
 #define UNLINK_MAYBE_EVICT     0x000000004 /* could be either due to eviction or
                                             * expiration.  need to check the
                                             * expiration time. */
+#define UNLINK_REPLACED        0x000000008 /* assoc_link_slot already took the
+                                            * item out of the hash table. */
 
 #if defined(USE_SLAB_ALLOCATOR)
 #include "slabs.h"
@@ -23,6 +25,54 @@
 #include "flat_storage.h"
 #endif /* #if defined(USE_FLAT_ALLOCATOR) */
 
+#define ITEM_HITS_MAX          UINT8_MAX
+#define ITEM_ATIME_REL_MAX     UINT8_MAX
+
+/*
+ * counts an access to an item, saturating at ITEM_HITS_MAX, and records when
+ * it happened.  the access time is kept as an offset from the item's LRU time,
+ * which do_item_update moves up at least every ITEM_UPDATE_INTERVAL seconds
+ * of an item being accessed, so it fits in a byte without moving the item.
+ */
+static inline void item_count_hit(item* it, const rel_time_t now) {
+    const rel_time_t rel = (now > ITEM_time(it)) ? now - ITEM_time(it) : 0;
+
+    if (ITEM_hits(it) < ITEM_HITS_MAX) {
+        ITEM_set_hits(it, ITEM_hits(it) + 1);
+    }
+    ITEM_set_atime_rel(it, (rel > ITEM_ATIME_REL_MAX) ? ITEM_ATIME_REL_MAX : rel);
+}
+
+/* returns the time of an item's last access, or of its store if it hasn't
+ * been accessed since. */
+static inline rel_time_t item_last_access(item* it) {
+    return ITEM_time(it) + ITEM_atime_rel(it);
+}
+
+#define ITEM_HITS_HALF_LIFE    600  /* seconds without an access for an item's
+                                     * hits to count half as much when
+                                     * picking items to evict. */
+
+/* returns an item's hits, halved for every ITEM_HITS_HALF_LIFE seconds since
+ * it was last accessed. */
+static inline unsigned int item_aged_hits(item* it, const rel_time_t now) {
+    const rel_time_t atime = item_last_access(it);
+    const rel_time_t halvings = (now > atime ? now - atime : 0) / ITEM_HITS_HALF_LIFE;
+
+    return (halvings >= 8) ? 0 : (ITEM_hits(it) >> halvings);
+}
+
+/*
+ * returns true if the item `a' is a better candidate for eviction than `b'
+ * under the gdsf policy, i.e., it has fewer recent hits per byte.  an item
+ * that hasn't been hit counts as one hit so that size still tells apart items
+ * that were never read.
+ */
+static inline bool item_gdsf_cheaper(item* a, item* b, const rel_time_t now) {
+    return (uint64_t) (item_aged_hits(a, now) + 1) * (ITEM_nkey(b) + ITEM_nbytes(b)) <
+        (uint64_t) (item_aged_hits(b, now) + 1) * (ITEM_nkey(a) + ITEM_nbytes(a));
+}
+
 /* See items.c */
 extern void item_init(void);
 /*@null@*/
@@ -32,20 +82,59 @@ extern item* do_item_alloc(const char *key, const size_t nkey,
                            const struct in_addr addr);
 extern bool  item_size_ok(const size_t nkey, const int flags, const int nbytes);
 
-extern int   do_item_link(item *it, const char* key);     /** may fail if transgresses limits */
+/* links an item under key, whose hash value is hv.  an item already linked
+ * under the same key is unlinked; it is replaced in the same pass over the
+ * hash chain that links the new one. */
+extern int   do_item_link(item *it, const char* key, const uint32_t hv);     /** may fail if transgresses limits */
+/* like do_item_link, at the key's link in its hash chain that a lookup
+ * returned, so that the chain isn't walked again. */
+extern int   do_item_link_slot(item *it, const char* key, const uint32_t hv, item_ptr_t* slot);
 extern void  do_item_unlink(item *it, long flags, const char* key);
 extern void  do_item_unlink_impl(item *it, long flags, bool to_freelist);
 extern void  do_item_deref(item *it);
 extern void  do_item_update(item *it);   /** update LRU time to current and reposition */
-extern int   do_item_replace(item *it, item *new_it, const char* key);
 
 /*@null@*/
-extern char* do_item_stats_sizes(int *bytes);
 extern void  do_item_flush_expired(void);
+
+/* called on an item by a walk of the cache (see assoc_walk), with its key
+ * (not NUL-terminated).  may not change the cache. */
+typedef void (*item_visitor_t)(item* it, const char* key, void* arg);
+
+/* returns free item memory that has been idle for settings.mem_release_idle
+ * seconds to the OS, and frees some memory if more is in use than
+ * settings.maxbytes allows. */
+DECL_MT_FUNC(void, item_release_memory, (void));
+
+#define ITEM_RECLAIM_BATCH     64   /* most items do_item_reclaim evicts per
+                                     * call. */
+
+/* evicts up to ITEM_RECLAIM_BATCH items while less than
+ * settings.reclaim_percent of the item memory is free, so that allocations
+ * rarely have to evict.  returns true if there is still too little free.
+ * must be called with the cache lock held. */
+extern bool  do_item_reclaim(void);
+
+/* changes settings.maxbytes.  growing takes effect immediately; shrinking
+ * evicts items and releases their memory a little at a time in
+ * item_release_memory.  returns false if the limit can't be raised that
+ * high. */
+DECL_MT_FUNC(bool, item_set_maxbytes, (const size_t maxbytes));
 extern item* item_get(const char *key, const size_t nkey);
 
-extern item* do_item_get_notedeleted(const char *key, const size_t nkey, bool *delete_locked);
-extern item* do_item_get_nocheck(const char *key, const size_t nkey);
+/* the lookups take the hash value of the key, so that a request hashes its
+ * key once, outside the cache lock. */
+extern item* do_item_get_notedeleted(const char *key, const size_t nkey, const uint32_t hv,
+                                     bool *delete_locked);
+/* like do_item_get_notedeleted, and sets *slot to the key's link in its hash
+ * chain for do_item_link_slot.  for stores, which link right after. */
+extern item* do_item_get_slot(const char *key, const size_t nkey, const uint32_t hv,
+                              bool *delete_locked, item_ptr_t** slot);
+/* like do_item_get_notedeleted, but a miss moves the key's item back from the
+ * victim tier if it is there.  only for gets: a store or a delete has no use
+ * for the old value. */
+extern item* do_item_get_promote(const char *key, const size_t nkey, const uint32_t hv);
+extern item* do_item_get_nocheck(const char *key, const size_t nkey, const uint32_t hv);
 
 /* returns true if a deleted item's delete-locked-time is over, and it
    should be removed from the namespace */
@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Key prefix dictionary.  Maps the prefixes that many keys share to small ids
+ * that the flat allocator stores instead; see key_prefix.h.
+ *
+ * Prefixes earn an id by being stored often: a fixed table of candidate slots,
+ * indexed by the prefix's hash, counts stores of prefixes that don't have one
+ * yet.  A slot is taken over by whichever prefix hashes to it next, so keys
+ * whose "prefix" is really unique (say "user:1234:") keep evicting each other
+ * and never get in, while the handful of namespaces in use get in soon enough.
+ */
+#include "generic.h"
+
+#if defined(USE_FLAT_ALLOCATOR)
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memcached.h"
+#include "assoc.h"
+#include "key_prefix.h"
+
+typedef struct {
+    uint32_t hv;                /* hash of the prefix counted here */
+    uint32_t stores;
+} candidate_t;
+
+key_prefix_t* key_prefixes = NULL;
+
+static struct {
+    unsigned max_entries;
+    unsigned entries;
+    uint32_t* index;            /* open-addressed; id + 1, or 0 if empty */
+    uint32_t index_mask;
+    candidate_t candidates[KEY_PREFIX_CANDIDATES];
+
+    uint64_t bytes;             /* held by the prefixes themselves */
+    uint64_t stores;            /* items stored with an id */
+    uint64_t bytes_saved;       /* by those items, when they were stored */
+} kp;
+
+
+void key_prefix_init(const unsigned max_entries) {
+    uint32_t index_size = 1;
+
+    if (max_entries == 0) {
+        return;
+    }
+    always_assert(max_entries <= KEY_PREFIX_MAX_ENTRIES);
+
+    /* keep the index at most half full. */
+    while (index_size < max_entries * 2) {
+        index_size <<= 1;
+    }
+
+    key_prefixes = calloc(max_entries, sizeof(key_prefix_t));
+    kp.index = calloc(index_size, sizeof(uint32_t));
+    if (key_prefixes == NULL || kp.index == NULL) {
+        fprintf(stderr, "failed to allocate the key prefix dictionary\n");
+        exit(EXIT_FAILURE);
+    }
+    kp.index_mask = index_size - 1;
+    kp.max_entries = max_entries;
+}
+
+
+/* returns the slot of the index that holds the prefix, or the empty slot where
+ * it would go. */
+static uint32_t* index_find(const char* prefix, const size_t nprefix, const uint32_t hv) {
+    uint32_t pos;
+
+    for (pos = hv & kp.index_mask;
+         kp.index[pos] != 0;
+         pos = (pos + 1) & kp.index_mask) {
+        const key_prefix_t* entry = &key_prefixes[kp.index[pos] - 1];
+
+        if (entry->nprefix == nprefix &&
+            memcmp(entry->prefix, prefix, nprefix) == 0) {
+            break;
+        }
+    }
+
+    return &kp.index[pos];
+}
+
+
+int do_key_prefix_intern(const char* key, const size_t nkey, size_t* nprefix) {
+    size_t length;
+    uint32_t hv;
+    uint32_t* slot;
+    candidate_t* candidate;
+    char* copy;
+
+    if (kp.max_entries == 0) {
+        return -1;
+    }
+
+    /* everything up to the last delimiter. */
+    for (length = nkey; length > 0; length --) {
+        if (key[length - 1] == settings.prefix_delimiter) {
+            break;
+        }
+    }
+    if (length < KEY_PREFIX_MIN_LENGTH) {
+        return -1;
+    }
+    *nprefix = length;
+
+    hv = hash(key, length, 0);
+    slot = index_find(key, length, hv);
+    if (*slot != 0) {
+        kp.stores ++;
+        kp.bytes_saved += length - KEY_PREFIX_ID_SZ;
+        return *slot - 1;
+    }
+
+    candidate = &kp.candidates[hv % KEY_PREFIX_CANDIDATES];
+    if (candidate->hv != hv) {
+        candidate->hv = hv;
+        candidate->stores = 0;
+    }
+    if (++ candidate->stores < KEY_PREFIX_ADMIT_STORES ||
+        kp.entries >= kp.max_entries ||
+        (copy = malloc(length)) == NULL) {
+        return -1;
+    }
+
+    memcpy(copy, key, length);
+    key_prefixes[kp.entries].prefix = copy;
+    key_prefixes[kp.entries].nprefix = length;
+    *slot = ++ kp.entries;
+    kp.bytes += length;
+    candidate->hv = 0;
+    candidate->stores = 0;
+
+    kp.stores ++;
+    kp.bytes_saved += length - KEY_PREFIX_ID_SZ;
+    return *slot - 1;
+}
+
+
+char* do_key_prefix_stats(size_t* result_size) {
+    size_t bufsize = 1024, offset = 0;
+    char* buffer = malloc(bufsize);
+    char terminator[] = "END\r\n";
+
+    if (buffer == NULL) {
+        *result_size = 0;
+        return NULL;
+    }
+
+    offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                              "STAT key_prefix_max_entries %u\r\n"
+                              "STAT key_prefix_entries %u\r\n"
+                              "STAT key_prefix_bytes %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT key_prefix_stores %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT key_prefix_bytes_saved %" PRINTF_INT64_MODIFIER "u\r\n",
+                              kp.max_entries,
+                              kp.entries,
+                              kp.bytes,
+                              kp.stores,
+                              kp.bytes_saved);
+
+    offset = append_to_buffer(buffer, bufsize, offset, 0, terminator);
+
+    *result_size = offset;
+    return buffer;
+}
+
+#endif /* #if defined(USE_FLAT_ALLOCATOR) */
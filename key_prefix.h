@@ -0,0 +1,59 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#if !defined(_key_prefix_h_)
+#define _key_prefix_h_
+
+#include "generic.h"
+
+#include <stdint.h>
+
+/*
+ * key prefix interning (-K).  the prefix of a key is everything up to and
+ * including the last prefix delimiter (-D, ':' by default), e.g.
+ * "svc:feed:v3:user:" for "svc:feed:v3:user:1234".  once a prefix has been
+ * seen in KEY_PREFIX_ADMIT_STORES stores it is given an id, and items whose
+ * keys start with it store the id in KEY_PREFIX_ID_SZ bytes in its place.
+ *
+ * the dictionary only grows: an id stays valid for as long as the process
+ * runs, so items and responses can refer to its prefix without a lock.  it is
+ * added to with the cache lock held.
+ */
+
+#define KEY_PREFIX_ID_SZ          2     /* bytes an id takes in the item */
+#define KEY_PREFIX_MAX_ENTRIES    65536 /* ids that fit in KEY_PREFIX_ID_SZ */
+#define KEY_PREFIX_MIN_LENGTH     8     /* shorter prefixes aren't worth it */
+#define KEY_PREFIX_ADMIT_STORES   16    /* stores of a prefix before it is
+                                         * given an id */
+#define KEY_PREFIX_CANDIDATES     4096  /* slots counting the stores of
+                                         * prefixes without an id */
+
+typedef struct key_prefix_s key_prefix_t;
+struct key_prefix_s {
+    const char* prefix;
+    uint8_t nprefix;
+};
+
+extern key_prefix_t* key_prefixes;
+
+/* max_entries is the most prefixes the dictionary will hold.  0 leaves
+ * interning off. */
+extern void key_prefix_init(const unsigned max_entries);
+
+/* counts a store of key, and returns the id of its prefix, or -1 if it
+ * doesn't have one (yet).  *nprefix is set to the prefix's length.  the cache
+ * lock must be held. */
+extern int do_key_prefix_intern(const char* key, const size_t nkey, size_t* nprefix);
+
+DECL_MT_FUNC(char*, key_prefix_stats, (size_t* result_size));
+
+
+static inline unsigned key_prefix_id_get(const char* stored) {
+    return ((unsigned) (unsigned char) stored[0] << 8) | (unsigned char) stored[1];
+}
+
+static inline void key_prefix_id_set(char* stored, const unsigned id) {
+    stored[0] = (char) (id >> 8);
+    stored[1] = (char) (id & 0xff);
+}
+
+#endif /* #if !defined(_key_prefix_h_) */
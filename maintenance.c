@@ -0,0 +1,455 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Maintenance thread.  Worker threads queue up admin commands here instead of
+ * carrying them out with the cache lock held, which would hold up every
+ * client of the worker, and of the others, until the whole cache was walked.
+ *
+ * "stats sizes", "flush_regex" and "dump_keys" walk the hash table a slice at
+ * a time (see
+ * do_assoc_walk), letting go of the cache lock in between.  "stats cachedump"
+ * and "slabs reassign" are bounded by their output and by a slab page
+ * respectively, so they still take the lock once, but it is this thread that
+ * waits for it.
+ */
+#include "generic.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif /* #if defined(__linux__) */
+#ifdef HAVE_REGEX_H
+#include <regex.h>
+#endif
+
+#include "memcached.h"
+#include "assoc.h"
+#include "items.h"
+#include "stats.h"
+#include "maintenance.h"
+
+typedef enum {
+    MAINTENANCE_STATS_SIZES,
+    MAINTENANCE_CACHEDUMP,
+    MAINTENANCE_PREFIX_DUMP,
+    MAINTENANCE_FLUSH_REGEX,
+    MAINTENANCE_SLABS_REASSIGN,
+    MAINTENANCE_DUMP_KEYS,
+} maintenance_op_t;
+
+typedef struct maintenance_job_s maintenance_job_t;
+struct maintenance_job_s {
+    maintenance_op_t   op;
+    conn*              c;
+    unsigned int       id;          /* cachedump */
+    unsigned int       limit;
+    int                srcid;       /* slabs reassign */
+    int                dstid;
+    size_t             budget;      /* dump_keys */
+#ifdef HAVE_REGEX_H
+    regex_t            regex;       /* flush_regex */
+#endif
+    maintenance_job_t* next;
+};
+
+/* the 32-byte size buckets of "stats sizes". */
+typedef struct {
+    unsigned int* counts;
+    size_t        size;
+    bool          oom;
+} maintenance_histogram_t;
+
+static struct {
+    pthread_mutex_t    lock;        /* guards the fields below */
+    pthread_cond_t     cond;
+    maintenance_job_t* head;
+    maintenance_job_t* tail;
+    uint64_t           queued;      /* jobs waiting or under way */
+    uint64_t           jobs;        /* jobs done */
+    uint64_t           slices;      /* times the cache lock was taken */
+    uint64_t           max_hold;    /* longest a job held the lock, in usec */
+} mt;
+
+
+static uint64_t maintenance_usec_since(const struct timeval* start) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_usec - start->tv_usec);
+}
+
+
+/* notes that the cache lock was held for one slice of a job. */
+static void maintenance_account_slice(const uint64_t usec) {
+    pthread_mutex_lock(&mt.lock);
+    mt.slices++;
+    if (usec > mt.max_hold) {
+        mt.max_hold = usec;
+    }
+    pthread_mutex_unlock(&mt.lock);
+}
+
+
+void maintenance_walk(item_visitor_t visit, void* arg) {
+    assoc_cursor_t cursor;
+    struct timeval start;
+    bool done;
+
+    memset(&cursor, 0, sizeof(cursor));
+    do {
+        gettimeofday(&start, NULL);
+        done = assoc_walk(&cursor, MAINTENANCE_SLICE_BUCKETS, visit, arg);
+        maintenance_account_slice(maintenance_usec_since(&start));
+        sched_yield();
+    } while (! done);
+}
+
+
+static char* maintenance_string(const char* str, size_t* result_size) {
+    char* buf = strdup(str);
+
+    *result_size = buf == NULL ? 0 : strlen(buf);
+    return buf;
+}
+
+
+/******************************* STATS SIZES *********************************/
+
+static void maintenance_count_size(item* it, const char* key, void* arg) {
+    maintenance_histogram_t* histogram = arg;
+    size_t bucket = (ITEM_ntotal(it) + 32 - 1) / 32;
+
+    if (bucket >= histogram->size) {
+        size_t size = histogram->size;
+        unsigned int* counts;
+
+        while (size <= bucket) {
+            size *= 2;
+        }
+        if ((counts = realloc(histogram->counts, size * sizeof(unsigned int))) == NULL) {
+            histogram->oom = true;
+            return;
+        }
+        memset(counts + histogram->size, 0, (size - histogram->size) * sizeof(unsigned int));
+        histogram->counts = counts;
+        histogram->size = size;
+    }
+    histogram->counts[bucket]++;
+}
+
+
+/* a list of the number of items of each size, with a granularity of 32
+ * bytes. */
+static char* maintenance_run_stats_sizes(size_t* result_size) {
+    maintenance_histogram_t histogram;
+    size_t bufsize = ITEM_STATS_SIZES, offset = 0;
+    char terminator[] = "END\r\n";
+    char* buf;
+    size_t i;
+
+    histogram.size = 1024;
+    histogram.oom = false;
+    if ((histogram.counts = calloc(histogram.size, sizeof(unsigned int))) == NULL) {
+        *result_size = 0;
+        return NULL;
+    }
+
+    maintenance_walk(maintenance_count_size, &histogram);
+
+    if (histogram.oom || (buf = malloc(bufsize)) == NULL) {
+        free(histogram.counts);
+        *result_size = 0;
+        return NULL;
+    }
+    for (i = 0; i < histogram.size; i++) {
+        if (histogram.counts[i] != 0) {
+            offset = append_to_buffer(buf, bufsize, offset, sizeof(terminator),
+                                      "%lu %u\r\n", (unsigned long) i * 32,
+                                      histogram.counts[i]);
+        }
+    }
+    offset = append_to_buffer(buf, bufsize, offset, 0, terminator);
+    free(histogram.counts);
+
+    *result_size = offset;
+    return buf;
+}
+
+
+/******************************* FLUSH_REGEX *********************************/
+
+#ifdef HAVE_REGEX_H
+static void maintenance_expire_match(item* it, const char* key, void* arg) {
+    regex_t* regex = arg;
+
+    if (regexec(regex, key, 0, NULL, 0) == 0) {
+        /* the item matches; mark it expired. */
+        ITEM_set_exptime(it, 1);
+    }
+}
+#endif /* #ifdef HAVE_REGEX_H */
+
+
+/********************************** JOBS *************************************/
+
+static char* maintenance_run(maintenance_job_t* job, size_t* result_size) {
+    struct timeval start;
+    char* buf = NULL;
+
+    *result_size = 0;
+    switch (job->op) {
+    case MAINTENANCE_STATS_SIZES:
+        buf = maintenance_run_stats_sizes(result_size);
+        break;
+
+    case MAINTENANCE_CACHEDUMP:
+    {
+        unsigned int bytes = 0;
+
+        gettimeofday(&start, NULL);
+#if defined(USE_SLAB_ALLOCATOR)
+        buf = item_cachedump(job->id, job->limit, &bytes);
+#endif /* #if defined(USE_SLAB_ALLOCATOR) */
+#if defined(USE_FLAT_ALLOCATOR)
+        buf = item_cachedump((chunk_type_t) job->id, job->limit, &bytes);
+#endif /* #if defined(USE_FLAT_ALLOCATOR) */
+        maintenance_account_slice(maintenance_usec_since(&start));
+        *result_size = bytes;
+        break;
+    }
+
+    case MAINTENANCE_PREFIX_DUMP:
+    {
+        int bytes = 0;
+
+        buf = stats_prefix_dump(&bytes);
+        *result_size = bytes;
+        break;
+    }
+
+    case MAINTENANCE_FLUSH_REGEX:
+#ifdef HAVE_REGEX_H
+        maintenance_walk(maintenance_expire_match, &job->regex);
+        regfree(&job->regex);
+#endif /* #ifdef HAVE_REGEX_H */
+        buf = maintenance_string("DELETED\r\n", result_size);
+        break;
+
+    case MAINTENANCE_SLABS_REASSIGN:
+#if defined(USE_SLAB_ALLOCATOR)
+    {
+        int rv;
+
+        gettimeofday(&start, NULL);
+        rv = slabs_reassign(job->srcid, job->dstid);
+        maintenance_account_slice(maintenance_usec_since(&start));
+        buf = maintenance_string(rv == 1 ? "DONE\r\n" : rv == -1 ? "BUSY\r\n" : "CANT\r\n",
+                                 result_size);
+    }
+#endif /* #if defined(USE_SLAB_ALLOCATOR) */
+        break;
+
+    case MAINTENANCE_DUMP_KEYS:
+        buf = warmup_dump_keys(job->budget, result_size);
+        break;
+    }
+    return buf;
+}
+
+
+static void* maintenance_loop(void* arg) {
+    maintenance_job_t* job;
+    char* buf;
+    size_t len;
+
+    STATS_SET_TLS(0);   /* shares the main thread's stats */
+#if defined(__linux__)
+    /* on linux, nice values are per thread. */
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), MAINTENANCE_NICE);
+#endif /* #if defined(__linux__) */
+
+    for (;;) {
+        pthread_mutex_lock(&mt.lock);
+        while (mt.head == NULL) {
+            pthread_cond_wait(&mt.cond, &mt.lock);
+        }
+        job = mt.head;
+        mt.head = job->next;
+        if (mt.head == NULL) {
+            mt.tail = NULL;
+        }
+        pthread_mutex_unlock(&mt.lock);
+
+        buf = maintenance_run(job, &len);
+
+        pthread_mutex_lock(&mt.lock);
+        mt.queued--;
+        mt.jobs++;
+        pthread_mutex_unlock(&mt.lock);
+
+        thread_maintenance_done(job->c, buf, len);
+        free(job);
+    }
+    return NULL;
+}
+
+
+/* parks the job's connection and hands the job to the maintenance thread.
+ * takes ownership of job. */
+static void maintenance_queue(maintenance_job_t* job) {
+    assert(job->c->thread != NULL);
+
+    conn_start_maintenance(job->c);
+    job->next = NULL;
+
+    pthread_mutex_lock(&mt.lock);
+    if (mt.tail == NULL) {
+        mt.head = job;
+    } else {
+        mt.tail->next = job;
+    }
+    mt.tail = job;
+    mt.queued++;
+    pthread_cond_signal(&mt.cond);
+    pthread_mutex_unlock(&mt.lock);
+}
+
+
+static maintenance_job_t* maintenance_job_new(conn* c, const maintenance_op_t op) {
+    maintenance_job_t* job = calloc(1, sizeof(maintenance_job_t));
+
+    if (job != NULL) {
+        job->op = op;
+        job->c = c;
+    }
+    return job;
+}
+
+
+bool maintenance_stats_sizes(conn* c) {
+    maintenance_job_t* job = maintenance_job_new(c, MAINTENANCE_STATS_SIZES);
+
+    if (job == NULL) {
+        return false;
+    }
+    maintenance_queue(job);
+    return true;
+}
+
+
+bool maintenance_prefix_dump(conn* c) {
+    maintenance_job_t* job = maintenance_job_new(c, MAINTENANCE_PREFIX_DUMP);
+
+    if (job == NULL) {
+        return false;
+    }
+    maintenance_queue(job);
+    return true;
+}
+
+
+bool maintenance_cachedump(conn* c, const unsigned int id, const unsigned int limit) {
+    maintenance_job_t* job = maintenance_job_new(c, MAINTENANCE_CACHEDUMP);
+
+    if (job == NULL) {
+        return false;
+    }
+    job->id = id;
+    job->limit = limit;
+    maintenance_queue(job);
+    return true;
+}
+
+
+#if defined(USE_SLAB_ALLOCATOR)
+bool maintenance_slabs_reassign(conn* c, const int srcid, const int dstid) {
+    maintenance_job_t* job = maintenance_job_new(c, MAINTENANCE_SLABS_REASSIGN);
+
+    if (job == NULL) {
+        return false;
+    }
+    job->srcid = srcid;
+    job->dstid = dstid;
+    maintenance_queue(job);
+    return true;
+}
+#endif /* #if defined(USE_SLAB_ALLOCATOR) */
+
+
+bool maintenance_dump_keys(conn* c, const size_t budget) {
+    maintenance_job_t* job = maintenance_job_new(c, MAINTENANCE_DUMP_KEYS);
+
+    if (job == NULL) {
+        return false;
+    }
+    job->budget = budget;
+    maintenance_queue(job);
+    return true;
+}
+
+
+int maintenance_flush_regex(conn* c, const char* pattern) {
+#ifdef HAVE_REGEX_H
+    maintenance_job_t* job = maintenance_job_new(c, MAINTENANCE_FLUSH_REGEX);
+
+    if (job == NULL) {
+        return -1;
+    }
+    if (regcomp(&job->regex, pattern, REG_EXTENDED | REG_NOSUB)) {
+        free(job);
+        return 0;
+    }
+    maintenance_queue(job);
+    return 1;
+#else
+    return 0;
+#endif /* #ifdef HAVE_REGEX_H */
+}
+
+
+void maintenance_init(void) {
+    pthread_t thread;
+    int ret;
+
+    pthread_mutex_init(&mt.lock, NULL);
+    pthread_cond_init(&mt.cond, NULL);
+    if ((ret = pthread_create(&thread, NULL, maintenance_loop, NULL)) != 0) {
+        fprintf(stderr, "Can't create maintenance thread: %s\n", strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+char* maintenance_stats(size_t* result_size) {
+    size_t bufsize = 1024, offset = 0;
+    char* buffer = malloc(bufsize);
+    char terminator[] = "END\r\n";
+
+    if (buffer == NULL) {
+        *result_size = 0;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mt.lock);
+    offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                              "STAT maintenance_queued %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT maintenance_jobs %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT maintenance_lock_slices %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT maintenance_max_lock_usec %" PRINTF_INT64_MODIFIER "u\r\n",
+                              mt.queued,
+                              mt.jobs,
+                              mt.slices,
+                              mt.max_hold);
+    pthread_mutex_unlock(&mt.lock);
+    offset = append_to_buffer(buffer, bufsize, offset, 0, terminator);
+
+    *result_size = offset;
+    return buffer;
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#if !defined(_maintenance_h_)
+#define _maintenance_h_
+
+#include "generic.h"
+
+/*
+ * the maintenance thread carries out the admin commands that walk the cache
+ * ("stats sizes", "stats cachedump", "stats detail dump", "flush_regex",
+ * "slabs reassign" and "dump_keys"), so that the worker thread of the
+ * connection that sent one goes on serving its other connections meanwhile.
+ * the connection is parked in conn_maintenance until its response is handed
+ * back.
+ *
+ * walks over the whole cache take the cache lock for a slice of the hash
+ * table at a time, so that clients never wait on the lock for long.  the
+ * thread runs at a low priority.
+ */
+
+#define MAINTENANCE_SLICE_BUCKETS 1024  /* hash buckets walked per
+                                         * acquisition of the cache lock */
+#define MAINTENANCE_NICE          10    /* how much lower the thread's
+                                         * priority is, where supported */
+
+extern void maintenance_init(void);
+
+/* each of these parks c and queues its command; the response is written out
+ * once the command is done.  they return false if they are out of memory,
+ * and then leave c alone. */
+extern bool maintenance_stats_sizes(conn* c);
+extern bool maintenance_cachedump(conn* c, const unsigned int id, const unsigned int limit);
+extern bool maintenance_prefix_dump(conn* c);
+extern bool maintenance_dump_keys(conn* c, const size_t budget);
+#if defined(USE_SLAB_ALLOCATOR)
+extern bool maintenance_slabs_reassign(conn* c, const int srcid, const int dstid);
+#endif /* #if defined(USE_SLAB_ALLOCATOR) */
+
+/* returns 1 if the command was queued, 0 if the pattern isn't a valid regular
+ * expression (or regular expressions aren't supported) and -1 if out of
+ * memory. */
+extern int maintenance_flush_regex(conn* c, const char* pattern);
+
+extern char* maintenance_stats(size_t* result_size);
+
+/* calls visit (an item_visitor_t, which items.h may not have defined yet) on
+ * every item in the hash table, taking the cache lock for
+ * MAINTENANCE_SLICE_BUCKETS buckets at a time.  for the jobs of the
+ * maintenance thread only. */
+extern void maintenance_walk(void (*visit)(item* it, const char* key, void* arg),
+                             void* arg);
+
+#endif /* #if !defined(_maintenance_h_) */
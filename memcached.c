@@ -48,6 +48,7 @@
 #endif
 
 #include "assoc.h"
+#include "trace.h"
 #include "binary_sm.h"
 #include "items.h"
 #include "memcached.h"
@@ -69,6 +70,7 @@
  */
 static void drive_machine(conn* c);
 static int new_socket(const bool is_udp);
+static void set_busy_poll(const int sfd);
 static int server_socket(const int port, const bool is_udp);
 static int try_read_command(conn *c);
 
@@ -83,6 +85,7 @@ static void conn_init(void);
 static void complete_nread(conn* c);
 static void process_command(conn* c, char *command);
 static int ensure_iov_space(conn* c);
+static void listen_udp(const int thread);
 
 void pre_gdb(void);
 static void conn_free(conn* c);
@@ -101,6 +104,18 @@ struct event_base *main_base;
 
 static int *buckets = 0; /* bucket->generation array for a managed instance */
 
+/* listening socket */
+static int l_socket = 0;
+
+/* udp socket */
+static int u_socket = -1;
+
+/* binary listening socket */
+static int b_socket = 0;
+
+/* binary udp socket */
+static int bu_socket = -1;
+
 #define REALTIME_MAXDELTA 60*60*24*30
 /*
  * given time value that's either unix time or delta from current unix time, return
@@ -169,6 +184,19 @@ static void settings_init(void) {
     settings.prefix_delimiter = ':';
     settings.detail_enabled = 0;
     settings.reqs_per_event = 1;
+    settings.mem_release_idle = 0;    /* keep free item memory */
+    settings.victim_percent = 0;      /* no victim tier */
+    settings.lookup_batching = false;
+    settings.evict_policy = EVICT_LRU;
+    settings.reclaim_percent = 0;     /* evict only when memory runs out */
+    settings.client_stats = false;
+    settings.mirror = NULL;           /* no write mirroring */
+    settings.router = NULL;           /* serve keys locally */
+    settings.warmup = NULL;           /* start empty */
+    settings.busy_poll_usec = 0;      /* block in the event loop */
+    settings.busy_poll_sock_usec = 0;
+    settings.key_prefixes = 0;        /* store keys whole */
+    settings.maxbytes_ceiling = 0;    /* the allocator's default */
 
 #ifdef HAVE__SC_NPROCESSORS_ONLN
     /*
@@ -285,80 +313,6 @@ bool do_conn_add_to_freelist(conn* c) {
     return true;
 }
 
-#if defined(HAVE_UDP_REPLY_PORTS)
-/* Allocate a port for udp reply transmission.
-
-   Starting from the port of the reciever socket, increment by one
-   until bind succeeds or we fail settings.num_threads times.
-   No locking is needed since each thread is racing to get a port
-   and the OS will only allow one thread to bind to any particular
-   port. */
-static int allocate_udp_reply_port(int sfd, int tries) {
-    struct addrinfo hints, *res = NULL;
-    struct sockaddr addr;
-    socklen_t addr_len;
-    char port[6];
-    char host[100];
-    int error;
-    int xfd = -1;
-
-    /* Need the address to lookup the host:port pair */
-    addr_len = sizeof(addr);
-    if (getsockname(sfd, &addr, &addr_len) < 0) {
-        perror("getsockname");
-        return -1;
-    }
-
-    /* Lookup the host:port pair for the recieve socket. */
-    if (getnameinfo(&addr, addr_len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST|NI_NUMERICSERV)) {
-        perror("getnameinfo");
-        return -1;
-    }
-
-    /* Already bound to the recieve port, so start the search
-       at the next one. */
-    sprintf(port, "%d", atoi(port) + 1);
-
-    for (; tries; tries--) {
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = PF_INET;
-        hints.ai_socktype = SOCK_DGRAM;
-        hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICHOST;
-
-        if (res)
-            freeaddrinfo(res);
-
-        res = NULL;
-        error = getaddrinfo(host, port, &hints, &res);
-        if (error) {
-            fprintf(stderr, "%s\n", gai_strerror(error));
-            break;
-        }
-
-        xfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (xfd < 0) {
-            perror("socket");
-            break;
-        }
-
-        if (bind(xfd, res->ai_addr, res->ai_addrlen) < 0) {
-            close(xfd);
-            xfd = -1;
-            if (errno == EADDRINUSE) {
-                sprintf(port, "%d", atoi(port) + 1); /* next port */
-                continue;
-            }
-            perror("bind");
-        }
-        maximize_socket_buffer(xfd, SO_SNDBUF);
-        break; /* success or error, break out */
-    }
-    if (res)
-        freeaddrinfo(res);
-    return xfd;
-}
-#endif
-
 conn *conn_new(const int sfd, const int init_state, const int event_flags,
                conn_buffer_group_t* cbg, const bool is_udp, const bool is_binary,
                const struct sockaddr* const addr, const socklen_t addrlen,
@@ -436,25 +390,12 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
             fprintf(stderr, "<%d new client connection\n", sfd);
     }
 
-    c->sfd = c->xfd = sfd;
-#if defined(HAVE_UDP_REPLY_PORTS)
-    /* The linux UDP transmit path is heavily contended when more than one
-       thread is writing to the same socket.  If configured to support
-       per-thread reply ports, allocate a per-thread udp socket and set the
-       udp fd accordingly, otherwise use the recieve socket. The transmit
-       fd is set in try_read_udp to validate that the client request
-       can handle the number of reply ports the server is configured for. */
-    if (is_udp) {
-        c->ufd = allocate_udp_reply_port(sfd, settings.num_threads - 1);
-        if (c->ufd == -1) {
-            fprintf(stderr, "unable to allocate all udp reply ports.\n");
-            exit(1);
-        }
-    }
-#endif
+    c->sfd = sfd;
     c->udp = is_udp;
     c->binary = is_binary;
     c->state = init_state;
+    c->thread = NULL;
+    c->thread_next = c->thread_prev = NULL;
     c->rbytes = c->wbytes = 0;
     c->rcurr = c->rbuf;
     c->wcurr = c->wbuf;
@@ -471,6 +412,12 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
     c->item = 0;
     c->bucket = -1;
     c->gen = 0;
+    memset(&c->traffic, 0, sizeof(c->traffic));
+    c->connected = current_time;
+    c->proxy_parts = 0;
+    c->proxy_buf = NULL;
+    c->proxy_used = c->proxy_size = 0;
+    c->proxy_oom = false;
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
@@ -491,6 +438,21 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
     return c;
 }
 
+/*
+ * Drops a connection's read buffer.  A connection buffer goes back to its
+ * group; the buffer inside the conn needs nothing.
+ */
+static void conn_release_rbuf(conn* c, ssize_t max_rusage) {
+    assert(c->rbuf != NULL);
+
+    if (c->rbuf != c->rbuf_inline) {
+        free_conn_buffer(c->cbg, c->rbuf, max_rusage);
+    }
+    c->rbuf = NULL;
+    c->rcurr = NULL;
+    c->rsize = 0;
+}
+
 void conn_cleanup(conn* c) {
     assert(c != NULL);
 
@@ -511,9 +473,7 @@ void conn_cleanup(conn* c) {
     }
 
     if (c->rbuf) {
-        free_conn_buffer(c->cbg, c->rbuf, 0);   /* no idea how much was used... */
-        c->rbuf = NULL;
-        c->rsize = 0;
+        conn_release_rbuf(c, 0);    /* no idea how much was used... */
     }
     if (c->iov) {
         free_conn_buffer(c->cbg, c->iov, 0);    /* no idea how much was used... */
@@ -538,7 +498,7 @@ void conn_free(conn* c) {
         if (c->msglist)
             pool_free(c->msglist, sizeof(struct msghdr) * c->msgsize, CONN_BUFFER_MSGLIST_POOL);
         if (c->rbuf)
-            free_conn_buffer(c->cbg, c->rbuf, 0);
+            conn_release_rbuf(c, 0);
         if (c->wbuf)
             pool_free(c->wbuf, c->wsize, CONN_BUFFER_WBUF_POOL);
         if (c->ilist)
@@ -567,6 +527,7 @@ void conn_close(conn* c) {
 
     close(c->sfd);
     accept_new_conns(true, c->binary);
+    thread_conn_closed(c);
     conn_cleanup(c);
 
     /* if the connection has big buffers, just free it */
@@ -584,6 +545,59 @@ void conn_close(conn* c) {
 }
 
 
+/*
+ * Returns true if a connection is between requests, so that it can be handed
+ * to another thread without losing any state.
+ */
+bool conn_is_idle(const conn* c) {
+    return c->rbytes == 0 &&
+        (c->state == conn_read || c->state == conn_bp_header_size_unknown);
+}
+
+/*
+ * Hands an idle connection's socket to another worker thread and frees the
+ * conn.  UDP connections are dropped, and the thread's own udp socket closed;
+ * the kernel sends its port's datagrams to the remaining threads.
+ */
+void conn_migrate(conn* c) {
+    stats_t *stats = STATS_GET_TLS();
+    assert(c != NULL);
+    assert(conn_is_idle(c));
+
+    event_del(&c->event);
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "<%d connection migrated.\n", c->sfd);
+
+    if (c->udp) {
+        if (c->sfd != u_socket && c->sfd != bu_socket) {
+            close(c->sfd);
+        }
+    } else {
+        dispatch_conn_new(c->sfd, c->state, EV_READ | EV_PERSIST, NULL,
+                          false, c->binary,
+                          (struct sockaddr*) &c->request_addr,
+                          c->request_addr_size);
+    }
+    conn_cleanup(c);
+
+    /* the receiving thread counts the connection again.  this has to be done
+     * while c is still ours: once it is on the freelist, another thread may
+     * take it. */
+    STATS_LOCK(stats);
+    stats->curr_conns--;
+    if (! c->udp) {
+        stats->total_conns--;
+    }
+    STATS_UNLOCK(stats);
+
+    if (c->rsize > READ_BUFFER_HIGHWAT ||
+        c->wsize > WRITE_BUFFER_HIGHWAT ||
+        conn_add_to_freelist(c)) {
+        conn_free(c);
+    }
+}
+
 /*
  * Shrinks a connection's buffers if they're too big.  This prevents
  * periodic large "get" requests from permanently chewing lots of server
@@ -600,10 +614,7 @@ void conn_shrink(conn* c) {
 
     if (c->rbytes == 0 && c->rbuf != NULL) {
         /* drop the buffer since we have no bytes to preserve. */
-        free_conn_buffer(c->cbg, c->rbuf, 0);
-        c->rbuf = NULL;
-        c->rcurr = NULL;
-        c->rsize = 0;
+        conn_release_rbuf(c, 0);
     } else {
         memmove(c->rbuf, c->rcurr, (size_t)c->rbytes);
         c->rcurr = c->rbuf;
@@ -677,6 +688,7 @@ static void conn_set_state(conn* c, int state) {
             c->msgused = 0;
             c->iovused = 0;
         }
+        TRACE_CONN_STATE(c->sfd, c->state, state);
         c->state = state;
     }
 }
@@ -694,7 +706,27 @@ static int ensure_iov_space(conn* c) {
     if (c->iovsize == 0) {
         c->iov = (struct iovec *)alloc_conn_buffer(c->cbg, 0);
         if (c->iov != NULL) {
-            c->iovsize = CONN_BUFFER_DATA_SZ / sizeof(struct iovec);
+            c->iovsize = conn_buffer_capacity(c->iov) / sizeof(struct iovec);
+        }
+    }
+
+    if (c->iovsize != 0 && c->iovused >= c->iovsize) {
+        struct iovec* new_iov;
+        int i, iovnum;
+
+        new_iov = (struct iovec*) grow_conn_buffer(c->cbg, c->iov,
+                                                   c->iovused * sizeof(struct iovec),
+                                                   (c->iovsize + 1) * sizeof(struct iovec));
+        if (new_iov == NULL) {
+            return -1;
+        }
+        c->iov = new_iov;
+        c->iovsize = conn_buffer_capacity(c->iov) / sizeof(struct iovec);
+
+        /* point all the msghdr structures at the new list */
+        for (i = 0, iovnum = 0; i < c->msgused; i++) {
+            c->msglist[i].msg_iov = &c->iov[iovnum];
+            iovnum += c->msglist[i].msg_iovlen;
         }
     }
 
@@ -872,14 +904,18 @@ static void complete_nread(conn* c) {
     item *it = c->item;
     int comm = c->item_comm;
 
+    c->traffic.set_cmds++;
     STATS_LOCK(stats);
     stats->set_cmds++;
     STATS_UNLOCK(stats);
 
     if (memcmp("\r\n", c->crlf, 2) != 0) {
         out_string(c, "CLIENT_ERROR bad data chunk");
+    } else if (settings.router != NULL) {
+        router_store(c, it, comm, c->update_key);
     } else {
         if (store_item(it, comm, c->update_key)) {
+            mirror_store(c->update_key, ITEM_nkey(it));
             out_string(c, "STORED");
         } else {
             out_string(c, "NOT_STORED");
@@ -896,13 +932,16 @@ static void complete_nread(conn* c) {
  *
  * Returns true if the item was stored.
  */
-int do_store_item(item *it, int comm, const char* key) {
+int do_store_item(item *it, int comm, const char* key, const uint32_t hv) {
     bool delete_locked = false;
-    item *old_it;
+    item_ptr_t* slot;
+    item *old_it, *replaced;
     int stored = 0;
     size_t nkey = ITEM_nkey(it);
 
-    old_it = do_item_get_notedeleted(key, nkey, &delete_locked);
+    /* the lookup leaves slot at the key's link in its hash chain, so that
+     * the item is linked without walking the chain again. */
+    old_it = do_item_get_slot(key, nkey, hv, &delete_locked, &slot);
 
     if (old_it != NULL && comm == NREAD_ADD) {
         /* add only adds a nonexistent item, but promote to head of LRU */
@@ -913,17 +952,19 @@ int do_store_item(item *it, int comm, const char* key) {
         /* replace and add can't override delete locks; don't store */
     } else {
         /* "set" commands can override the delete lock
-           window... in which case we have to find the old hidden item
+           window... in which case we replace the old hidden item
            that's in the namespace/LRU but wasn't returned by
-           item_get.... because we need to replace it */
+           the lookup.  it's still linked at the slot. */
+        replaced = old_it;
         if (delete_locked) {
-            old_it = do_item_get_nocheck(key, nkey);
+            assert(*slot);
+            replaced = ITEM(*slot);
         }
 
         if (settings.detail_enabled) {
             int prefix_stats_flags = PREFIX_INCR_ITEM_COUNT;
 
-            if (old_it != NULL) {
+            if (replaced != NULL) {
                 prefix_stats_flags |= PREFIX_IS_OVERWRITE;
             }
             stats_prefix_record_byte_total_change(key, nkey, ITEM_nkey(it) + ITEM_nbytes(it),
@@ -931,13 +972,10 @@ int do_store_item(item *it, int comm, const char* key) {
         }
 
         stats_set(ITEM_nkey(it) + ITEM_nbytes(it),
-                  (old_it == NULL) ? 0 : ITEM_nkey(old_it) + ITEM_nbytes(old_it));
+                  (replaced == NULL) ? 0 : ITEM_nkey(replaced) + ITEM_nbytes(replaced));
 
-        if (old_it != NULL) {
-            do_item_replace(old_it, it, key);
-        } else {
-            do_item_link(it, key);
-        }
+        /* links the new item in place of the old one, if there is one. */
+        do_item_link_slot(it, key, hv, slot);
 
         stored = 1;
     }
@@ -947,17 +985,6 @@ int do_store_item(item *it, int comm, const char* key) {
     return stored;
 }
 
-typedef struct token_s {
-    char *value;
-    size_t length;
-} token_t;
-
-#define COMMAND_TOKEN 0
-#define SUBCOMMAND_TOKEN 1
-#define KEY_TOKEN 1
-
-#define MAX_TOKENS 6
-
 /*
  * Tokenize the command string by replacing whitespace with '\0' and update
  * the token array tokens with pointer to start of each token and length.
@@ -975,7 +1002,7 @@ typedef struct token_s {
  *      command  = tokens[ix].value;
  *   }
  */
-static size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
+size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
     char *s, *e;
     size_t ntokens = 0;
 
@@ -1042,16 +1069,63 @@ inline static void process_stats_detail(conn* c, const char *command) {
         out_string(c, "OK");
     }
     else if (strcmp(command, "dump") == 0) {
-        int len;
-        char *stats;
-        stats = stats_prefix_dump(&len);
-        write_and_free(c, stats, len);
+        if (! maintenance_prefix_dump(c)) {
+            out_string(c, "SERVER_ERROR out of memory");
+        }
     }
     else {
-        out_string(c, "CLIENT_ERROR usage: stats detail on|off|dump");
+        out_string(c, "CLIENT_ERROR usage: stats detail on|off|dump|quota <prefix> <bytes>");
+    }
+}
+
+inline static void process_stats_detail_quota(conn* c, token_t* prefix, token_t* bytes) {
+    uint64_t quota;
+    char* end;
+
+    assert(c != NULL);
+
+    if (stats_prefix_length(prefix->value, prefix->length) != prefix->length) {
+        out_string(c, "CLIENT_ERROR prefix may not contain the prefix delimiter");
+        return;
+    }
+
+    /* the opengroup spec says that if we care about errno after strtol/strtoul, we have to zero
+     * it out beforehard.  see
+     * http://www.opengroup.org/onlinepubs/000095399/functions/strtoul.html */
+    errno = 0;
+    quota = strtoull(bytes->value, &end, 10);
+
+    if (errno == ERANGE || *end != '\0' || end == bytes->value) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    if (stats_prefix_set_quota(prefix->value, prefix->length, quota)) {
+        out_string(c, "OK");
+    } else {
+        out_string(c, "SERVER_ERROR out of memory");
     }
 }
 
+/*
+ * Returns the resident set size of the process in bytes, or 0 if the platform
+ * doesn't tell us.  Compare with item_allocated - item_released to see how
+ * much of the item memory is actually backed by physical pages.
+ */
+static unsigned long get_rss_bytes(void) {
+    unsigned long size, resident = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+        return 0;
+
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+
+    return resident * (unsigned long) sysconf(_SC_PAGESIZE);
+}
+
 static void process_stat(conn* c, token_t *tokens, const size_t ntokens) {
     rel_time_t now = current_time;
     char *command;
@@ -1069,7 +1143,7 @@ static void process_stat(conn* c, token_t *tokens, const size_t ntokens) {
 
     STATS_AGGREGATE(&stats);
     if (ntokens == 2 && strcmp(command, "stats") == 0) {
-        size_t bufsize = 2048, offset = 0;
+        size_t bufsize = 4096, offset = 0;
         char temp[bufsize];
         char terminator[] = "END";
         pid_t pid = getpid();
@@ -1097,6 +1171,8 @@ static void process_stat(conn* c, token_t *tokens, const size_t ntokens) {
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT curr_items %u\r\n", stats.curr_items);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT total_items %u\r\n", stats.total_items);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT item_allocated %" PRINTF_INT64_MODIFIER "u\r\n", stats.item_storage_allocated);
+        offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT item_released %" PRINTF_INT64_MODIFIER "u\r\n", stats.item_storage_released);
+        offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT rss %lu\r\n", get_rss_bytes());
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT item_total_size %" PRINTF_INT64_MODIFIER "u\r\n", stats.item_total_size);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT curr_connections %u\r\n", stats.curr_conns - 1); /* ignore listening conn */
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT total_connections %u\r\n", stats.total_conns);
@@ -1109,12 +1185,18 @@ static void process_stat(conn* c, token_t *tokens, const size_t ntokens) {
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT arith_hits %" PRINTF_INT64_MODIFIER "u\r\n", stats.arith_hits);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT hit_rate %g%%\r\n", (stats.get_hits + stats.get_misses) == 0 ? 0.0 : (double)stats.get_hits * 100 / (stats.get_hits + stats.get_misses));
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT evictions %" PRINTF_INT64_MODIFIER "u\r\n", stats.evictions);
+        offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT evicted_bytes %" PRINTF_INT64_MODIFIER "u\r\n", stats.evicted_bytes);
+        offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT evicted_unfetched %" PRINTF_INT64_MODIFIER "u\r\n", stats.evicted_unfetched);
+        offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT evicted_hits %" PRINTF_INT64_MODIFIER "u\r\n", stats.evicted_hits);
+        offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT evict_policy %s\r\n", settings.evict_policy == EVICT_GDSF ? "gdsf" : "lru");
+        offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT reclaimed_items %" PRINTF_INT64_MODIFIER "u\r\n", stats.reclaimed_items);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT bytes_read %" PRINTF_INT64_MODIFIER "u\r\n", stats.bytes_read);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT bytes_written %" PRINTF_INT64_MODIFIER "u\r\n", stats.bytes_written);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT limit_maxbytes %lu\r\n", settings.maxbytes);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT get_bytes %" PRINTF_INT64_MODIFIER "u\r\n", stats.get_bytes);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT byte_seconds %" PRINTF_INT64_MODIFIER "u\r\n", stats.byte_seconds);
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT threads %u\r\n", settings.num_threads);
+        offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT threads_retiring %d\r\n", thread_retiring_count());
         offset = append_thread_stats(temp, bufsize, offset, sizeof(terminator));
 #if defined(USE_SLAB_ALLOCATOR)
         offset = append_to_buffer(temp, bufsize, offset, sizeof(terminator), "STAT slabs_rebalance %d\r\n", slabs_get_rebalance_interval());
@@ -1198,8 +1280,7 @@ static void process_stat(conn* c, token_t *tokens, const size_t ntokens) {
 
     if (strcmp(subcommand, "cachedump") == 0) {
 #if defined(USE_SLAB_ALLOCATOR)
-        char *buf;
-        unsigned int bytes, id, limit = 0;
+        unsigned int id, limit = 0;
 
         if(ntokens < 5) {
             out_string(c, "CLIENT_ERROR bad command line");
@@ -1218,13 +1299,13 @@ static void process_stat(conn* c, token_t *tokens, const size_t ntokens) {
             return;
         }
 
-        buf = item_cachedump(id, limit, &bytes);
-        write_and_free(c, buf, bytes);
+        if (! maintenance_cachedump(c, id, limit)) {
+            out_string(c, "SERVER_ERROR out of memory");
+        }
         return;
 #endif /* #if defined(USE_SLAB_ALLOCATOR) */
 #if defined(USE_FLAT_ALLOCATOR)
-        char *buf;
-        unsigned int bytes, limit = 0;
+        unsigned int limit = 0;
         chunk_type_t chunk_type;
 
         if(ntokens < 5) {
@@ -1247,8 +1328,9 @@ static void process_stat(conn* c, token_t *tokens, const size_t ntokens) {
             return;
         }
 
-        buf = item_cachedump(chunk_type, limit, &bytes);
-        write_and_free(c, buf, bytes);
+        if (! maintenance_cachedump(c, chunk_type, limit)) {
+            out_string(c, "SERVER_ERROR out of memory");
+        }
         return;
 #endif /* #if defined(USE_FLAT_ALLOCATOR) */
     }
@@ -1279,23 +1361,106 @@ static void process_stat(conn* c, token_t *tokens, const size_t ntokens) {
         write_and_free(c, buf, bytes);
         return;
     }
+
+    if (strcmp(subcommand, "key_prefixes") == 0) {
+        size_t bytes = 0;
+        char* buf = key_prefix_stats(&bytes);
+
+        write_and_free(c, buf, bytes);
+        return;
+    }
 #endif /* #if defined(USE_FLAT_ALLOCATOR) */
 
+    if (strcmp(subcommand, "victim") == 0) {
+        size_t bytes = 0;
+        char* buf = victim_stats(&bytes);
+
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
+    if (strcmp(subcommand, "mirror") == 0) {
+        size_t bytes = 0;
+        char* buf = mirror_stats(&bytes);
+
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
+    if (strcmp(subcommand, "warmup") == 0) {
+        size_t bytes = 0;
+        char* buf = warmup_stats(&bytes);
+
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
+    if (strcmp(subcommand, "maintenance") == 0) {
+        size_t bytes = 0;
+        char* buf = maintenance_stats(&bytes);
+
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
+    if (strcmp(subcommand, "busy_poll") == 0) {
+        size_t bytes = 0;
+        char* buf = thread_busy_poll_stats(&bytes);
+
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
+    if (strcmp(subcommand, "router") == 0) {
+        size_t bytes = 0;
+        char* buf = router_stats(&bytes);
+
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
     if (strcmp(subcommand, "detail") == 0) {
         if (ntokens < 4)
             process_stats_detail(c, "");  /* outputs the error message */
+        else if (ntokens == 6 && strcmp(tokens[2].value, "quota") == 0)
+            process_stats_detail_quota(c, &tokens[3], &tokens[4]);
         else
             process_stats_detail(c, tokens[2].value);
         return;
     }
 
-    if (strcmp(subcommand, "sizes") == 0) {
+    if (strcmp(subcommand, "clients") == 0 || strcmp(subcommand, "conns") == 0) {
+        size_t limit = CLIENT_STATS_DEFAULT_LIMIT;
         int bytes = 0;
-        char *buf = item_stats_sizes(&bytes);
+        char *buf;
+
+        if (ntokens == 4) {
+            char *end;
+
+            errno = 0;
+            limit = strtoul(tokens[2].value, &end, 10);
+            if (errno == ERANGE || *end != '\0' || limit == 0) {
+                out_string(c, "CLIENT_ERROR bad command line format");
+                return;
+            }
+        }
+
+        if (strcmp(subcommand, "clients") == 0) {
+            buf = stats_clients(limit, &bytes);
+        } else {
+            buf = stats_conns(limit, &bytes);
+        }
         write_and_free(c, buf, bytes);
         return;
     }
 
+    if (strcmp(subcommand, "sizes") == 0) {
+        if (! maintenance_stats_sizes(c)) {
+            out_string(c, "SERVER_ERROR out of memory");
+        }
+        return;
+    }
+
     if (strcmp(subcommand, "buckets") == 0) {
         int bytes = 0;
         char *buf = item_stats_buckets(&bytes);
@@ -1422,9 +1587,114 @@ static int ensure_wbuf(conn* const c, const size_t req_bytes)
 #define FLAGS_LENGTH_STRING_LEN (sizeof(" 4xxxyyyzzz 1xxxyyy\r\n") - 1)
 
 
+/*
+ * Counts a get of one key.
+ */
+static void record_get(conn* c, const char* key, const size_t nkey, item* it) {
+    stats_t *stats = STATS_GET_TLS();
+
+    c->traffic.get_cmds++;
+    if (NULL == it) {
+        c->traffic.get_misses++;
+    }
+
+    STATS_LOCK(stats);
+    stats->get_cmds++;
+    stats->get_bytes += (NULL != it) ? ITEM_nbytes(it) : 0;
+    if (NULL == it) {
+        stats->get_misses++;
+    }
+    STATS_UNLOCK(stats);
+
+    if (settings.detail_enabled) {
+        stats_prefix_record_get(key, nkey, (NULL != it) ? ITEM_nbytes(it) : 0, NULL != it);
+    }
+}
+
+/*
+ * Adds a hit to the response to a get, as the i'th item sent.  The item's
+ * reference is dropped once the response has been sent.  Returns false if
+ * the response can't hold the item.
+ */
+static bool process_get_hit(conn* c, const char* key, const size_t nkey, item* it,
+                            const int i) {
+    stats_t *stats = STATS_GET_TLS();
+    char* flags_len_string_start;
+    ssize_t flags_len_string_len;
+
+    if (i >= c->isize) {
+        item **new_list = pool_realloc(c->ilist, sizeof(item *) * c->isize * 2,
+                                       sizeof(item*) * c->isize, CONN_BUFFER_ILIST_POOL);
+        if (new_list) {
+            c->isize *= 2;
+            c->ilist = new_list;
+        } else return false;
+    }
+
+    /* write flags + length to the buffer. */
+    assert(c->wsize - c->wbytes >= FLAGS_LENGTH_STRING_LEN + 1);
+
+    flags_len_string_start = c->wcurr;
+    flags_len_string_len = snprintf(c->wcurr, FLAGS_LENGTH_STRING_LEN + 1,
+                                    " %u %u\r\n", ITEM_flags(it),
+                                    (unsigned int) (ITEM_nbytes(it)));
+    c->wcurr += flags_len_string_len;
+    c->wbytes += flags_len_string_len;
+
+    /*
+     * Construct the response. Each hit adds three elements to the
+     * outgoing data list:
+     *   "VALUE "
+     *   key
+     *   " " + flags + " " + data length + "\r\n" + data (with \r\n)
+     */
+    if (add_iov(c, "VALUE ", 6, true) != 0 ||
+        add_item_key_to_iov(c, it) != 0 ||
+        add_iov(c, flags_len_string_start, flags_len_string_len, false) != 0 ||
+        add_item_value_to_iov(c, it, true /* send cr-lf */) != 0)
+        {
+            return false;
+        }
+    if (settings.verbose > 1) {
+        fprintf(stderr, ">%d sending key %*s\n", c->sfd, (int) nkey, key);
+    }
+
+    c->traffic.get_hits++;
+    STATS_LOCK(stats);
+    stats->get_hits++;
+    STATS_UNLOCK(stats);
+
+    stats_get(ITEM_nkey(it) + ITEM_nbytes(it));
+#if defined(USE_SLAB_ALLOCATOR)
+    item_mark_visited(it);
+#endif /* #if defined(USE_SLAB_ALLOCATOR) */
+    *(c->ilist + i) = it;
+
+    return true;
+}
+
+/*
+ * Ends the response to a get that found nitems items, and starts sending it.
+ */
+static void complete_get_command(conn* c, const int nitems) {
+    c->icurr = c->ilist;
+    c->ileft = nitems;
+
+    if (settings.verbose > 1)
+        fprintf(stderr, ">%d END\n", c->sfd);
+    add_iov(c, "END\r\n", 5, true);
+
+    if (c->udp && build_udp_headers(c) != 0) {
+        out_string(c, "SERVER_ERROR out of memory");
+    }
+    else {
+        conn_set_state(c, conn_mwrite);
+        c->msgcurr = 0;
+    }
+}
+
 /* ntokens is overwritten here... shrug.. */
 static inline void process_get_command(conn* c, token_t *tokens, size_t ntokens) {
-    stats_t *stats = STATS_GET_TLS();
     char *key;
     size_t nkey;
     int i = 0;
@@ -1462,6 +1732,27 @@ static inline void process_get_command(conn* c, token_t *tokens, size_t ntokens)
         out_string(c, "SERVER_ERROR cannot allocate sufficient memory");
     }
 
+    if (settings.lookup_batching && c->thread != NULL &&
+        tokens[ntokens - 1].value == NULL) {
+        /* all the keys were tokenized in one pass.  they stay in the read
+         * buffer until the lookups are done, since the connection doesn't
+         * read anything in the meantime. */
+        for (c->lookup_count = 0; key_token->length != 0; key_token++) {
+            if (key_token->length > KEY_MAX_LENGTH) {
+                out_string(c, "CLIENT_ERROR bad command line format");
+                return;
+            }
+            assert(c->lookup_count < LOOKUP_BATCH_KEYS);
+            c->lookup_keys[c->lookup_count] = key_token->value;
+            c->lookup_nkeys[c->lookup_count] = key_token->length;
+            c->lookup_hvs[c->lookup_count] = hash(key_token->value, key_token->length, 0);
+            c->lookup_count++;
+        }
+        conn_set_state(c, conn_lookup);
+        thread_queue_lookup(c);
+        return;
+    }
+
     do {
         while(key_token->length != 0) {
 
@@ -1473,105 +1764,109 @@ static inline void process_get_command(conn* c, token_t *tokens, size_t ntokens)
                 return;
             }
 
-            it = item_get(key, nkey);
-
-            STATS_LOCK(stats);
-            stats->get_cmds++;
-            stats->get_bytes += (NULL != it) ? ITEM_nbytes(it) : 0;
-            STATS_UNLOCK(stats);
-
-            if (settings.detail_enabled) {
-                stats_prefix_record_get(key, nkey, (NULL != it) ? ITEM_nbytes(it) : 0, NULL != it);
-            }
+            it = item_get_promote(key, nkey);
+            record_get(c, key, nkey, it);
 
             if (it) {
-                char* flags_len_string_start;
-                ssize_t flags_len_string_len;
-
-                if (i >= c->isize) {
-                    item **new_list = pool_realloc(c->ilist, sizeof(item *) * c->isize * 2,
-                                                   sizeof(item*) * c->isize, CONN_BUFFER_ILIST_POOL);
-                    if (new_list) {
-                        c->isize *= 2;
-                        c->ilist = new_list;
-                    } else break;
+                /* item_get() has incremented it->refcount for us */
+                if (! process_get_hit(c, key, nkey, it, i)) {
+                    break;
                 }
+                item_update(it);
+                i++;
+            }
 
-                /* write flags + length to the buffer. */
-                assert(c->wsize - c->wbytes >= FLAGS_LENGTH_STRING_LEN + 1);
-
-                flags_len_string_start = c->wcurr;
-                flags_len_string_len = snprintf(c->wcurr, FLAGS_LENGTH_STRING_LEN + 1,
-                                                " %u %u\r\n", ITEM_flags(it),
-                                                (unsigned int) (ITEM_nbytes(it)));
-                c->wcurr += flags_len_string_len;
-                c->wbytes += flags_len_string_len;
-
-                /*
-                 * Construct the response. Each hit adds three elements to the
-                 * outgoing data list:
-                 *   "VALUE "
-                 *   key
-                 *   " " + flags + " " + data length + "\r\n" + data (with \r\n)
-                 */
-                if (add_iov(c, "VALUE ", 6, true) != 0 ||
-                    add_item_key_to_iov(c, it) != 0 ||
-                    add_iov(c, flags_len_string_start, flags_len_string_len, false) != 0 ||
-                    add_item_value_to_iov(c, it, true /* send cr-lf */) != 0)
-                    {
-                        break;
-                    }
-                if (settings.verbose > 1) {
-                    fprintf(stderr, ">%d sending key %*s\n", c->sfd, (int) nkey, key);
-                }
+            key_token++;
+        }
+        /*
+         * If the command string hasn't been fully processed, get the next set
+         * of tokens.
+         */
+        if(key_token->value != NULL) {
+            ntokens = tokenize_command(key_token->value, tokens, MAX_TOKENS);
+            key_token = tokens;
+        }
 
-                /* item_get() has incremented it->refcount for us */
-                STATS_LOCK(stats);
-                stats->get_hits++;
-                STATS_UNLOCK(stats);
+    } while(key_token->value != NULL);
 
-                stats_get(ITEM_nkey(it) + ITEM_nbytes(it));
-                item_update(it);
-#if defined(USE_SLAB_ALLOCATOR)
-                item_mark_visited(it);
-#endif /* #if defined(USE_SLAB_ALLOCATOR) */
-                *(c->ilist + i) = it;
-                i++;
+    complete_get_command(c, i);
+    return;
+}
+
+/*
+ * Sends the response to a get whose keys were looked up by
+ * thread_queue_lookup, and carries on with the connection.
+ */
+void conn_complete_lookup(conn* c) {
+    bool full = false;
+    int k, i = 0;
+
+    assert(c->state == conn_lookup);
+
+    for (k = 0; k < c->lookup_count; k++) {
+        item* it = c->lookup_items[k];
+
+        record_get(c, c->lookup_keys[k], c->lookup_nkeys[k], it);
+        if (it == NULL) {
+            continue;
+        }
+        if (full || ! process_get_hit(c, c->lookup_keys[k], c->lookup_nkeys[k], it, i)) {
+            full = true;
+            item_deref(it);
+            continue;
+        }
+        i++;
+    }
+    c->lookup_count = 0;
+
+    complete_get_command(c, i);
+    drive_machine(c);
+}
+
+
+/*
+ * Parks a connection while the router waits for the upstreams to answer its
+ * command.  It doesn't read anything meanwhile.
+ */
+void conn_start_proxy(conn* c) {
+    conn_set_state(c, conn_proxy);
+    update_event(c, 0);
+}
 
-            } else {
-                STATS_LOCK(stats);
-                stats->get_misses++;
-                STATS_UNLOCK(stats);
-            }
 
-            key_token++;
-        }
-        /*
-         * If the command string hasn't been fully processed, get the next set
-         * of tokens.
-         */
-        if(key_token->value != NULL) {
-            ntokens = tokenize_command(key_token->value, tokens, MAX_TOKENS);
-            key_token = tokens;
-        }
+/*
+ * Called by the router once the upstreams have answered a connection that is
+ * in conn_proxy.  buf is the response, which is freed once it is written; NULL
+ * if it couldn't be put together.
+ */
+void conn_complete_proxy(conn* c, char* buf, const size_t len) {
+    assert(c->state == conn_proxy);
 
-    } while(key_token->value != NULL);
+    write_and_free(c, buf, len);
+    drive_machine(c);
+}
 
-    c->icurr = c->ilist;
-    c->ileft = i;
 
-    if (settings.verbose > 1)
-        fprintf(stderr, ">%d END\n", c->sfd);
-    add_iov(c, "END\r\n", 5, true);
+/*
+ * Parks a connection while the maintenance thread carries out its admin
+ * command.  It doesn't read anything meanwhile.
+ */
+void conn_start_maintenance(conn* c) {
+    conn_set_state(c, conn_maintenance);
+    update_event(c, 0);
+}
 
-    if (c->udp && build_udp_headers(c) != 0) {
-        out_string(c, "SERVER_ERROR out of memory");
-    }
-    else {
-        conn_set_state(c, conn_mwrite);
-        c->msgcurr = 0;
-    }
-    return;
+
+/*
+ * Called on the connection's worker thread once the maintenance thread is
+ * done with its command.  buf is the response, which is freed once it is
+ * written; NULL if it couldn't be put together.
+ */
+void conn_complete_maintenance(conn* c, char* buf, const size_t len) {
+    assert(c->state == conn_maintenance);
+
+    write_and_free(c, buf, len);
+    drive_machine(c);
 }
 
 /* ntokens is overwritten here... shrug.. */
@@ -1591,7 +1886,7 @@ static inline void process_metaget_command(conn *c, token_t *tokens, size_t ntok
         return;
     }
 
-    it = item_get(key, nkey);
+    it = item_get_promote(key, nkey);
     if (it) {
         ssize_t written, avail = c->wsize - c->wbytes;
         char* txstart;
@@ -1626,7 +1921,9 @@ static inline void process_metaget_command(conn *c, token_t *tokens, size_t ntok
         }
 
         written = snprintf(c->wcurr, avail,
-                           " age: %s; exptime: %d; from: %s\r\n", age_str, ITEM_exptime(it), ip_addr_str);
+                           " age: %s; exptime: %d; from: %s; hits: %u; idle: %d\r\n",
+                           age_str, ITEM_exptime(it), ip_addr_str, ITEM_hits(it),
+                           (int) (now - item_last_access(it)));
 
         if (written > avail) {
             txcount = avail;
@@ -1734,7 +2031,7 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
 static void process_arithmetic_command(conn* c, token_t *tokens, const size_t ntokens, const int incr) {
     char temp[32];
     unsigned int delta;
-    char *key;
+    char *key, *out;
     size_t nkey;
 
     assert(c != NULL);
@@ -1770,7 +2067,12 @@ static void process_arithmetic_command(conn* c, token_t *tokens, const size_t nt
         return;
     }
 
-    out_string(c, add_delta(key, nkey, incr, delta, temp, NULL, get_request_addr(c)));
+    c->traffic.arith_cmds++;
+    out = add_delta(key, nkey, incr, delta, temp, NULL, get_request_addr(c));
+    if (out == temp) {
+        mirror_store(key, nkey);
+    }
+    out_string(c, out);
 }
 
 /*
@@ -1783,15 +2085,16 @@ static void process_arithmetic_command(conn* c, token_t *tokens, const size_t nt
  *
  * returns a response string to send back to the client.
  */
-char *do_add_delta(const char* key, const size_t nkey, const int incr, const unsigned int delta,
-                   char *buf, uint32_t* res_val, const struct in_addr addr) {
+char *do_add_delta(const char* key, const size_t nkey, const uint32_t hv, const int incr,
+                   const unsigned int delta, char *buf, uint32_t* res_val,
+                   const struct in_addr addr) {
     stats_t *stats = STATS_GET_TLS();
     uint32_t value;
     int res;
     rel_time_t now;
     item* it;
 
-    it = do_item_get_notedeleted(key, nkey, NULL);
+    it = do_item_get_notedeleted(key, nkey, hv, NULL);
     if (!it) {
         STATS_LOCK(stats);
         stats->arith_cmds ++;
@@ -1857,7 +2160,7 @@ char *do_add_delta(const char* key, const size_t nkey, const int incr, const uns
             return "SERVER_ERROR out of memory";
         }
         item_memcpy_to(new_it, 0, buf, res, false);
-        do_item_replace(it, new_it, key);
+        do_item_link(new_it, key, hv);
         do_item_deref(new_it);       /* release our reference */
     } else { /* replace in-place */
         ITEM_set_nbytes(it, res);               /* update the length field. */
@@ -1913,10 +2216,10 @@ static void process_delete_command(conn* c, token_t *tokens, const size_t ntoken
         }
     }
 
+    c->traffic.delete_cmds++;
     if (settings.detail_enabled) {
         stats_prefix_record_delete(key, nkey);
     }
-
     it = item_get(key, nkey);
     if (it) {
         if (exptime == 0) {
@@ -1941,8 +2244,13 @@ static void process_delete_command(conn* c, token_t *tokens, const size_t ntoken
             }
         }
     } else {
+        /* it may have been evicted; make sure a get doesn't bring it back.
+         * an evicted item is gone as far as clients can tell, so this is
+         * still a miss, and there is nothing to hold a delete lock on. */
+        victim_delete(key, nkey);
         out_string(c, "NOT_FOUND");
     }
+    mirror_delete(key, nkey, exptime);
 }
 
 /*
@@ -1987,6 +2295,82 @@ static void process_verbosity_command(conn* c, token_t *tokens, const size_t nto
     return;
 }
 
+/*
+ * Changes the number of worker threads, given like the -t option.
+ */
+static void process_threads_command(conn* c, token_t *tokens, const size_t ntokens) {
+    int nworkers, old, ix;
+    char *end;
+
+    assert(c != NULL);
+
+    nworkers = strtol(tokens[1].value, &end, 10);
+    if (*end != '\0' || end == tokens[1].value) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    old = thread_set_workers(nworkers);
+    if (old == -1) {
+        out_string(c, "CLIENT_ERROR bad number of threads");
+        return;
+    } else if (old == -2) {
+        out_string(c, "SERVER_ERROR threads still retiring");
+        return;
+    }
+
+    for (ix = old; ix < nworkers + 1; ix++) {
+        listen_udp(ix);
+    }
+    out_string(c, "OK");
+}
+
+/*
+ * Lists the keys of the most recently used items, for a peer warming up
+ * from us.
+ */
+static void process_dump_keys_command(conn* c, token_t *tokens, const size_t ntokens) {
+    unsigned long budget;
+    char *end;
+
+    assert(c != NULL);
+
+    errno = 0;
+    budget = strtoul(tokens[1].value, &end, 10);
+    if (*end != '\0' || end == tokens[1].value || errno == ERANGE) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    if (! maintenance_dump_keys(c, budget)) {
+        out_string(c, "SERVER_ERROR out of memory");
+    }
+}
+
+/*
+ * Changes the memory limit, given in megabytes like the -m option.
+ */
+static void process_maxbytes_command(conn* c, token_t *tokens, const size_t ntokens) {
+    unsigned long megabytes;
+    char *end;
+
+    assert(c != NULL);
+
+    errno = 0;
+    megabytes = strtoul(tokens[1].value, &end, 10);
+    if (errno == ERANGE || *end != '\0' || end == tokens[1].value ||
+        megabytes == 0 || megabytes > SIZE_MAX / (1024 * 1024)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    if (item_set_maxbytes((size_t) megabytes * 1024 * 1024)) {
+        out_string(c, "OK");
+    } else {
+        out_string(c, "SERVER_ERROR cannot raise the memory limit that high");
+    }
+}
+
 static void process_command(conn* c, char *command) {
 
     token_t tokens[MAX_TOKENS];
@@ -1998,6 +2382,8 @@ static void process_command(conn* c, char *command) {
     if (settings.verbose > 1)
         fprintf(stderr, "<%d %s\n", c->sfd, command);
 
+    c->traffic.cmds++;
+
     /* ensure that conn_set_state going into the conn_read state cleared the
      * c->msg* and c->iov* counters.
      */
@@ -2014,6 +2400,18 @@ static void process_command(conn* c, char *command) {
 
     ntokens = tokenize_command(command, tokens, MAX_TOKENS);
 
+    if (settings.router != NULL) {
+        if (c->udp) {
+            /* the response would have to wait for the upstreams while the
+             * thread's udp socket carries on with other requests. */
+            out_string(c, "SERVER_ERROR udp requests are not routed");
+            return;
+        }
+        if (router_process_command(c, tokens, ntokens)) {
+            return;
+        }
+    }
+
     if (ntokens >= 3 &&
         ((strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ||
          (strcmp(tokens[COMMAND_TOKEN].value, "bget") == 0))) {
@@ -2116,6 +2514,7 @@ static void process_command(conn* c, char *command) {
         if(ntokens == 2) {
             settings.oldest_live = current_time - 1;
             item_flush_expired();
+            mirror_flush_all(0);
             out_string(c, "OK");
             return;
         }
@@ -2132,6 +2531,7 @@ static void process_command(conn* c, char *command) {
 
         settings.oldest_live = realtime(exptime) - 1;
         item_flush_expired();
+        mirror_flush_all(exptime);
         out_string(c, "OK");
         return;
 
@@ -2147,7 +2547,7 @@ static void process_command(conn* c, char *command) {
     } else if (ntokens == 5 && (strcmp(tokens[COMMAND_TOKEN].value, "slabs") == 0 &&
                                 strcmp(tokens[COMMAND_TOKEN + 1].value, "reassign") == 0)) {
 
-        int src, dst, rv;
+        int src, dst;
 
         /* the opengroup spec says that if we care about errno after strtol/strtoul, we have to zero
          * it out beforehard.  see
@@ -2161,19 +2561,10 @@ static void process_command(conn* c, char *command) {
             return;
         }
 
-        rv = slabs_reassign(src, dst);
-        if (rv == 1) {
-            out_string(c, "DONE");
-            return;
-        }
-        if (rv == 0) {
-            out_string(c, "CANT");
-            return;
-        }
-        if (rv == -1) {
-            out_string(c, "BUSY");
-            return;
+        if (! maintenance_slabs_reassign(c, src, dst)) {
+            out_string(c, "SERVER_ERROR out of memory");
         }
+        return;
 
     } else if (ntokens == 4 && (strcmp(tokens[COMMAND_TOKEN].value, "slabs") == 0 &&
                                 strcmp(tokens[COMMAND_TOKEN + 1].value, "rebalance") == 0)) {
@@ -2195,14 +2586,25 @@ static void process_command(conn* c, char *command) {
 
 #endif /* #if defined(USE_SLAB_ALLOCATOR) */
     } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "flush_regex") == 0)) {
-        if (assoc_expire_regex(tokens[COMMAND_TOKEN + 1].value)) {
-            out_string(c, "DELETED");
-        }
-        else {
+        switch (maintenance_flush_regex(c, tokens[COMMAND_TOKEN + 1].value)) {
+        case 1:
+            mirror_flush_regex(tokens[COMMAND_TOKEN + 1].value);
+            break;
+        case 0:
             out_string(c, "CLIENT_ERROR Bad regular expression (or regex not supported)");
+            break;
+        default:
+            out_string(c, "SERVER_ERROR out of memory");
+            break;
         }
     } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "verbosity") == 0)) {
         process_verbosity_command(c, tokens, ntokens);
+    } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "maxbytes") == 0)) {
+        process_maxbytes_command(c, tokens, ntokens);
+    } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "threads") == 0)) {
+        process_threads_command(c, tokens, ntokens);
+    } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "dump_keys") == 0)) {
+        process_dump_keys_command(c, tokens, ntokens);
     } else {
         out_string(c, "ERROR");
     }
@@ -2223,7 +2625,7 @@ static int try_read_command(conn* c) {
         return 0;
     }
 
-    assert(c->rcurr < (c->rbuf + c->rsize));
+    assert(c->rcurr <= (c->rbuf + c->rsize));
 
     if (c->rbytes == 0)
         return 0;
@@ -2244,7 +2646,7 @@ static int try_read_command(conn* c) {
     c->rbytes -= (cont - c->rcurr);
     c->rcurr = cont;
 
-    assert(c->rcurr < (c->rbuf + c->rsize));
+    assert(c->rcurr <= (c->rbuf + c->rsize));
 
     return 1;
 }
@@ -2261,12 +2663,12 @@ int try_read_udp(conn* c) {
     assert(c->rbytes == 0);
 
     if (c->rbuf == NULL) {
-        /* no idea how big the buffer will need to be. */
-        c->rbuf = (char*) alloc_conn_buffer(c->cbg, 0);
+        /* make room for the largest datagram there can be. */
+        c->rbuf = (char*) alloc_conn_buffer(c->cbg, UDP_MAX_DATAGRAM_SIZE);
 
         if (c->rbuf != NULL) {
             c->rcurr = c->rbuf;
-            c->rsize = CONN_BUFFER_DATA_SZ;
+            c->rsize = conn_buffer_capacity(c->rbuf);
         } else {
             if (c->binary) {
                 bp_write_err_msg(c, "out of memory");
@@ -2282,9 +2684,7 @@ int try_read_udp(conn* c) {
                    0, &c->request_addr, &c->request_addr_size);
     if (res > 8) {
         unsigned char *buf = (unsigned char *)c->rbuf;
-#if defined(HAVE_UDP_REPLY_PORTS)
-        uint16_t reply_ports;
-#endif
+        c->traffic.bytes_read += res;
         STATS_LOCK(stats);
         stats->bytes_read += res;
         STATS_UNLOCK(stats);
@@ -2305,18 +2705,6 @@ int try_read_udp(conn* c) {
         /* report peak usage here */
         report_max_rusage(c->cbg, c->rbuf, res);
 
-#if defined(HAVE_UDP_REPLY_PORTS)
-        reply_ports = ntohs(*((uint16_t*)(buf + 6)));
-        c->xfd = c->ufd;
-        /* If the client cannot support the number of reply sockets
-           use the receive socket instead.  We check against num_threads
-           to account for the entire range of ports in use, including the
-           receive port. */
-        if (reply_ports < settings.num_threads) {
-            c->xfd = c->sfd;
-        }
-#endif /* defined(HAVE_UDP_REPLY_PORTS) */
-
         /* Don't care about any of the rest of the header. */
         res -= 8;
         memmove(c->rbuf, c->rbuf + 8, res);
@@ -2326,10 +2714,7 @@ int try_read_udp(conn* c) {
         return 1;
     } else {
         /* return the conn buffer. */
-        free_conn_buffer(c->cbg, c->rbuf, 8 - 1 /* worst case for memory usage */);
-        c->rbuf = NULL;
-        c->rcurr = NULL;
-        c->rsize = 0;
+        conn_release_rbuf(c, 8 - 1 /* worst case for memory usage */);
     }
 
     return 0;
@@ -2357,25 +2742,48 @@ int try_read_network(conn* c) {
             c->rcurr = c->rbuf;
         }
     } else {
-        c->rbuf = (char*) alloc_conn_buffer(c->cbg, 0);
-        if (c->rbuf != NULL) {
-            c->rcurr = c->rbuf;
-            c->rsize = CONN_BUFFER_DATA_SZ;
-        } else {
-            if (c->binary) {
-                bp_write_err_msg(c, "out of memory");
+        /* start out in the buffer inside the conn. */
+        c->rbuf = c->rcurr = c->rbuf_inline;
+        c->rsize = sizeof(c->rbuf_inline);
+    }
+
+    while (1) {
+        if (c->rbytes >= c->rsize) {
+            char* new_rbuf;
+
+            /* let the commands already read be processed before making the
+             * buffer bigger. */
+            if (gotdata) {
+                break;
+            }
+
+            /* the buffer is full of a command that doesn't fit. */
+            if (c->rbuf == c->rbuf_inline) {
+                new_rbuf = (char*) alloc_conn_buffer(c->cbg, c->rsize + 1);
+                if (new_rbuf != NULL) {
+                    memcpy(new_rbuf, c->rbuf, c->rbytes);
+                }
             } else {
-                out_string(c, "SERVER_ERROR out of memory");
+                new_rbuf = (char*) grow_conn_buffer(c->cbg, c->rbuf, c->rbytes, c->rsize + 1);
             }
-            return 0;
+            if (new_rbuf == NULL) {
+                if (c->binary) {
+                    bp_write_err_msg(c, "out of memory reading request");
+                } else {
+                    out_string(c, "SERVER_ERROR out of memory reading request");
+                    c->write_and_go = conn_closing;
+                }
+                return 1;
+            }
+            c->rbuf = c->rcurr = new_rbuf;
+            c->rsize = conn_buffer_capacity(c->rbuf);
         }
-    }
 
-    while (1) {
         avail = c->rsize - c->rbytes;
 
         res = read(c->sfd, c->rbuf + c->rbytes, avail);
         if (res > 0) {
+            c->traffic.bytes_read += res;
             STATS_LOCK(stats);
             stats->bytes_read += res;
             STATS_UNLOCK(stats);
@@ -2383,7 +2791,9 @@ int try_read_network(conn* c) {
             c->rbytes += res;
 
             /* report peak usage here */
-            report_max_rusage(c->cbg, c->rbuf, c->rbytes);
+            if (c->rbuf != c->rbuf_inline) {
+                report_max_rusage(c->cbg, c->rbuf, c->rbytes);
+            }
 
             if (res < avail) {
                 break;
@@ -2402,10 +2812,7 @@ int try_read_network(conn* c) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 /* if we have no data, release the connection buffer */
                 if (c->rbytes == 0) {
-                    free_conn_buffer(c->cbg, c->rbuf, 0);
-                    c->rbuf = NULL;
-                    c->rcurr = NULL;
-                    c->rsize = 0;
+                    conn_release_rbuf(c, 0);
                 }
                 break;
             }
@@ -2480,8 +2887,9 @@ int transmit(conn* c) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
 
-        res = sendmsg(c->xfd, m, 0);
+        res = sendmsg(c->sfd, m, 0);
         if (res > 0) {
+            c->traffic.bytes_written += res;
             STATS_LOCK(stats);
             stats->bytes_written += res;
             STATS_UNLOCK(stats);
@@ -2576,6 +2984,7 @@ static void drive_machine(conn* c) {
                 close(sfd);
                 break;
             }
+            set_busy_poll(sfd);
             dispatch_conn_new(sfd, conn_read, EV_READ | EV_PERSIST,
                               NULL, false, c->binary,
                               &addr, addrlen);
@@ -2636,6 +3045,7 @@ static void drive_machine(conn* c) {
             res = readv(c->sfd, &c->riov[c->riov_curr],
                         c->riov_left <= IOV_MAX ? c->riov_left : IOV_MAX);
             if (res > 0) {
+                c->traffic.bytes_read += res;
                 STATS_LOCK(stats);
                 stats->bytes_read += res;
                 STATS_UNLOCK(stats);
@@ -2697,13 +3107,16 @@ static void drive_machine(conn* c) {
             /*  now try reading from the socket */
             res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
             if (res > 0) {
+                c->traffic.bytes_read += res;
                 STATS_LOCK(stats);
                 stats->bytes_read += res;
                 STATS_UNLOCK(stats);
                 c->sbytes -= res;
 
                 /* report peak usage here */
-                report_max_rusage(c->cbg, c->rbuf, res);
+                if (c->rbuf != c->rbuf_inline) {
+                    report_max_rusage(c->cbg, c->rbuf, res);
+                }
 
                 break;
             }
@@ -2788,6 +3201,21 @@ static void drive_machine(conn* c) {
             }
             break;
 
+        case conn_lookup:
+            /* the connection is resumed once its lookups are done. */
+            stop = true;
+            break;
+
+        case conn_proxy:
+            /* the connection is resumed once the upstreams have answered. */
+            stop = true;
+            break;
+
+        case conn_maintenance:
+            /* the connection is resumed once its command is done. */
+            stop = true;
+            break;
+
         case conn_closing:
             if (c->udp)
                 conn_cleanup(c);
@@ -2806,6 +3234,7 @@ static void drive_machine(conn* c) {
 
 void event_handler(const int fd, const short which, void *arg) {
     conn* c;
+    void* thread;
 
     c = (conn*) arg;
     assert(c != NULL);
@@ -2820,16 +3249,43 @@ void event_handler(const int fd, const short which, void *arg) {
         return;
     }
 
+    /* the connection may be closed or handed to another thread below. */
+    thread = c->thread;
+    if (settings.busy_poll_usec > 0 && thread != NULL) {
+        thread_poll_event(thread);
+    }
+    if (settings.client_stats && thread != NULL) {
+        thread_conn_busy(c);
+    }
+
     if (c->binary) {
         process_binary_protocol(c);
     } else {
         drive_machine(c);
     }
 
+    if (settings.client_stats && thread != NULL) {
+        thread_conn_idle(thread);
+    }
+
     /* wait for next event */
     return;
 }
 
+/*
+ * Has the kernel poll the network device for a while when a read on the
+ * socket finds nothing, with -y.  Not every kernel can; then reads just
+ * don't poll.
+ */
+static void set_busy_poll(const int sfd) {
+#if defined(SO_BUSY_POLL)
+    if (settings.busy_poll_sock_usec > 0) {
+        setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL,
+                   (void *)&settings.busy_poll_sock_usec, sizeof(int));
+    }
+#endif /* #if defined(SO_BUSY_POLL) */
+}
+
 static int new_socket(const bool is_udp) {
     int sfd;
     int flags;
@@ -2936,8 +3392,15 @@ static int server_socket(const int port, const bool is_udp) {
 
     setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
     if (is_udp) {
+#if defined(SO_REUSEPORT)
+        /* lets each worker thread bind a udp socket of its own to the port;
+           see listen_udp.  another process could share the port this way
+           too, so main checks it isn't in use first. */
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+#endif
         maximize_socket_buffer(sfd, SO_SNDBUF);
         maximize_socket_buffer(sfd, SO_RCVBUF);
+        set_busy_poll(sfd);
     } else {
         setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
         setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
@@ -2966,6 +3429,30 @@ static int server_socket(const int port, const bool is_udp) {
     return sfd;
 }
 
+/*
+ * Returns true if a udp socket is bound to the port already.  The udp sockets
+ * set SO_REUSEADDR and SO_REUSEPORT, which would let one share the port with
+ * another memcached's without an error, so this checks with a socket that
+ * sets neither.
+ */
+static bool udp_port_in_use(const int port) {
+    struct sockaddr_in addr;
+    bool in_use;
+    int sfd;
+
+    if ((sfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        return false;   /* server_socket will report it */
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = settings.interf;
+    in_use = bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == EADDRINUSE;
+    close(sfd);
+    return in_use;
+}
+
 static int new_socket_unix(void) {
     int sfd;
     int flags;
@@ -3032,19 +3519,6 @@ static int server_socket_unix(const char *path) {
     return sfd;
 }
 
-/* listening socket */
-static int l_socket = 0;
-
-/* udp socket */
-static int u_socket = -1;
-
-/* binary listening socket */
-static int b_socket = 0;
-
-/* binary udp socket */
-static int bu_socket = -1;
-
-
 /* invoke right before gdb is called, on assert */
 void pre_gdb(void) {
     int i;
@@ -3054,6 +3528,42 @@ void pre_gdb(void) {
     kill(getpid(), SIGABRT);
 }
 
+/*
+ * Returns a udp socket of the thread's own, bound to the same port as the
+ * shared one, so that the kernel spreads datagrams across the threads rather
+ * than waking all of them for each one.  Replies go out on the same socket.
+ * Thread 1 uses the socket bound at startup.  Falls back to sharing that one
+ * if another socket can't be bound, e.g. without SO_REUSEPORT or after
+ * dropping the privileges a low port needs.
+ */
+static int thread_udp_socket(const int thread, const int shared, const int port) {
+#if defined(SO_REUSEPORT)
+    int sfd;
+
+    if (thread > 1 && (sfd = server_socket(port, true)) != -1) {
+        return sfd;
+    }
+#endif
+    return shared;
+}
+
+/*
+ * Has a worker thread listen on the udp sockets.
+ */
+static void listen_udp(const int thread) {
+    if (u_socket > -1) {
+        dispatch_conn_new_to_thread(thread,
+                                    thread_udp_socket(thread, u_socket, settings.udpport),
+                                    conn_read, EV_READ | EV_PERSIST, true, false);
+    }
+    if (bu_socket > -1) {
+        dispatch_conn_new_to_thread(thread,
+                                    thread_udp_socket(thread, bu_socket, settings.binary_udpport),
+                                    conn_bp_header_size_unknown,
+                                    EV_READ | EV_PERSIST, true, true);
+    }
+}
+
 /*
  * We keep the current time of day in a global variable that's updated by a
  * timer event. This saves us a bunch of time() system calls (we really only
@@ -3078,6 +3588,24 @@ void update_stats(void) {
     STATS_UNLOCK(stats);
 }
 
+static struct event releaseevent;
+
+static void release_handler(const int fd, const short which, void *arg) {
+    struct timeval t = {.tv_sec = 1, .tv_usec = 0};
+    static bool initialized = false;
+
+    if (initialized) {
+        evtimer_del(&releaseevent);
+    } else {
+        initialized = true;
+    }
+
+    evtimer_set(&releaseevent, release_handler, 0);
+    event_base_set(main_base, &releaseevent);
+    evtimer_add(&releaseevent, &t);
+    item_release_memory();
+}
+
 static struct event deleteevent;
 
 static void delete_handler(const int fd, const short which, void *arg) {
@@ -3146,6 +3674,38 @@ static void usage(void) {
            "              to prevent starvation.  default 1\n");
     printf("-C            Maximum bytes used for connection buffers\n"
            "              default 16MB\n");
+    printf("-Z <num>      return free item memory to the OS after it has been\n"
+           "              idle for <num> seconds.  default 0 (never)\n");
+    printf("-V <num>      keep evicted items compressed in a victim tier of up\n"
+           "              to <num> percent of the memory limit.  default 0 (off)\n");
+    printf("-B            look up the keys of gets from all ready connections\n"
+           "              together, once per event loop pass\n");
+    printf("-E <policy>   how to pick items to evict: lru, or gdsf for the fewest\n"
+           "              hits per byte near the LRU tail.  default lru\n");
+    printf("-W <num>      keep <num> percent of the memory limit free by evicting\n"
+           "              from a background thread.  default 0 (off)\n");
+    printf("-O <host:port> send sets, deletes, incrs, decrs and flushes on to the\n"
+           "              memcached listening for binary connections there\n");
+    printf("-T            time each connection's requests and keep the traffic of\n"
+           "              closed connections for \"stats clients\"\n");
+    printf("-X <host:port>[,<host:port>...]\n"
+           "              route ascii commands to these memcached instances on\n"
+           "              a consistent hash ring instead of serving them\n");
+    printf("-A <host:port>[,<num>]\n"
+           "              fill the cache in the background from the most\n"
+           "              recently used items of the memcached there, up to\n"
+           "              <num> megabytes.  default 90%% of the memory limit\n");
+    printf("-y <num>[,<num>]\n"
+           "              keep worker threads polling for events for <num>\n"
+           "              microseconds after the last one, rather than sleeping,\n"
+           "              and set SO_BUSY_POLL on client sockets to the second\n"
+           "              <num>.  costs CPU; see \"stats busy_poll\".  default 0 (off)\n");
+    printf("-K <num>      store up to <num> common key prefixes (up to the last\n"
+           "              -D delimiter) once, and a 2-byte id in each item in\n"
+           "              their place.  flat allocator only.  default 0 (off)\n");
+    printf("-g <num>      set aside address space for the \"maxbytes\" command to\n"
+           "              raise the memory limit up to <num> megabytes.  flat\n"
+           "              allocator only.  default 1024, or -m if larger\n");
     return;
 }
 
@@ -3275,7 +3835,7 @@ int main (int argc, char **argv) {
     setbuf(stderr, NULL);
 
     /* process arguments */
-    while ((c = getopt(argc, argv, "bp:s:U:m:Mc:khirvdl:u:P:f:s:n:t:D:n:N:R:C:")) != -1) {
+    while ((c = getopt(argc, argv, "bp:s:U:m:Mc:khirvdl:u:P:f:s:n:t:D:n:N:R:C:Z:V:BE:W:TO:X:A:y:K:g:")) != -1) {
         switch (c) {
         case 'U':
             settings.udpport = atoi(optarg);
@@ -3370,6 +3930,81 @@ int main (int argc, char **argv) {
         case 'C':
             settings.max_conn_buffer_bytes = atoi(optarg);
             break;
+        case 'Z':
+            settings.mem_release_idle = atoi(optarg);
+            break;
+        case 'B':
+            settings.lookup_batching = true;
+            break;
+        case 'V':
+            settings.victim_percent = atoi(optarg);
+            if (settings.victim_percent < 0 || settings.victim_percent > 100) {
+                fprintf(stderr, "Victim tier size must be between 0 and 100 percent\n");
+                return 1;
+            }
+            break;
+        case 'W':
+            settings.reclaim_percent = atoi(optarg);
+            if (settings.reclaim_percent < 0 || settings.reclaim_percent > 50) {
+                fprintf(stderr, "Reclaim watermark must be between 0 and 50 percent\n");
+                return 1;
+            }
+            break;
+        case 'T':
+            settings.client_stats = true;
+            break;
+        case 'O':
+            settings.mirror = strdup(optarg);
+            break;
+        case 'X':
+            settings.router = strdup(optarg);
+            break;
+        case 'A':
+            settings.warmup = strdup(optarg);
+            break;
+        case 'y':
+            if (sscanf(optarg, "%d,%d", &settings.busy_poll_usec,
+                       &settings.busy_poll_sock_usec) < 1 ||
+                settings.busy_poll_usec < 0 || settings.busy_poll_sock_usec < 0) {
+                fprintf(stderr, "Busy-poll times can't be negative\n");
+                return 1;
+            }
+            break;
+        case 'K':
+#if defined(USE_FLAT_ALLOCATOR)
+            settings.key_prefixes = atoi(optarg);
+            if (settings.key_prefixes < 1 || settings.key_prefixes > KEY_PREFIX_MAX_ENTRIES) {
+                fprintf(stderr, "Number of key prefixes must be between 1 and %d\n",
+                        KEY_PREFIX_MAX_ENTRIES);
+                return 1;
+            }
+#else
+            fprintf(stderr, "Key prefix interning needs the flat allocator\n");
+            return 1;
+#endif /* #if defined(USE_FLAT_ALLOCATOR) */
+            break;
+        case 'g':
+#if defined(USE_FLAT_ALLOCATOR)
+            settings.maxbytes_ceiling = ((size_t)atoi(optarg)) * 1024 * 1024;
+            if (settings.maxbytes_ceiling == 0) {
+                fprintf(stderr, "Memory limit ceiling must be greater than 0\n");
+                return 1;
+            }
+#else
+            fprintf(stderr, "A memory limit ceiling needs the flat allocator\n");
+            return 1;
+#endif /* #if defined(USE_FLAT_ALLOCATOR) */
+            break;
+        case 'E':
+            if (strcmp(optarg, "lru") == 0) {
+                settings.evict_policy = EVICT_LRU;
+            } else if (strcmp(optarg, "gdsf") == 0) {
+                settings.evict_policy = EVICT_GDSF;
+            } else {
+                fprintf(stderr, "Eviction policy must be lru or gdsf\n");
+                return 1;
+            }
+            break;
 
         default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
@@ -3430,6 +4065,13 @@ int main (int argc, char **argv) {
      * descriptors created by libevent wouldn't survive forking).
      */
 
+    if (settings.router != NULL &&
+        (settings.binary_port != 0 || settings.binary_udpport != 0)) {
+        fprintf(stderr, "Only the ascii protocol can be routed; -X can't be "
+                "used with -n or -N.\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* create the listening socket and bind it */
     if (settings.socketpath == NULL) {
         if (settings.port == 0 && settings.binary_port == 0) {
@@ -3454,6 +4096,10 @@ int main (int argc, char **argv) {
 
     if (settings.udpport > 0 && settings.socketpath == NULL) {
         /* create the UDP listening socket and bind it */
+        if (udp_port_in_use(settings.udpport)) {
+            fprintf(stderr, "UDP port %d is already in use\n", settings.udpport);
+            exit(EXIT_FAILURE);
+        }
         u_socket = server_socket(settings.udpport, 1);
         if (u_socket == -1) {
             fprintf(stderr, "failed to listen on UDP port %d\n", settings.udpport);
@@ -3462,6 +4108,10 @@ int main (int argc, char **argv) {
     }
     if (settings.binary_udpport > 0 && ! settings.socketpath) {
         /* create the UDP listening socket and bind it */
+        if (udp_port_in_use(settings.binary_udpport)) {
+            fprintf(stderr, "UDP port %d is already in use\n", settings.binary_udpport);
+            exit(1);
+        }
         if ((bu_socket = server_socket(settings.binary_udpport, 1)) == -1) {
             fprintf(stderr, "failed to listen on UDP port %d\n", settings.binary_udpport);
             exit(1);
@@ -3538,17 +4188,24 @@ int main (int argc, char **argv) {
 
     /* initialize other stuff */
     item_init();
-    stats_init(settings.num_threads);
+    /* leave room for the "threads" command to add worker threads later. */
+    settings.max_threads = settings.num_threads > MAX_WORKER_THREADS + 1 ?
+        settings.num_threads : MAX_WORKER_THREADS + 1;
+    stats_init(settings.max_threads);
     STATS_SET_TLS(0);
     assoc_init();
+    victim_init();
+    mirror_init();
+    router_init();
     conn_init();
 #if defined(USE_SLAB_ALLOCATOR)
     slabs_init(settings.maxbytes, settings.factor);
 #endif /* #if defined(USE_SLAB_ALLOCATOR) */
 #if defined(USE_FLAT_ALLOCATOR)
-    flat_storage_init(settings.maxbytes);
+    flat_storage_init(settings.maxbytes, settings.maxbytes_ceiling);
+    key_prefix_init(settings.key_prefixes);
 #endif /* #if defined(USE_FLAT_ALLOCATOR) */
-    conn_buffer_init(settings.num_threads - 1, 0, 0, settings.max_conn_buffer_bytes / 2, settings.max_conn_buffer_bytes);
+    conn_buffer_init(settings.max_threads - 1, 0, 0, settings.max_conn_buffer_bytes / 2, settings.max_conn_buffer_bytes);
 
     /* managed instance? alloc and zero a bucket array */
     if (settings.managed) {
@@ -3600,6 +4257,8 @@ int main (int argc, char **argv) {
     }
     /* start up worker threads if MT mode */
     thread_init(settings.num_threads, main_base);
+    warmup_init();
+    maintenance_init();
     /* save the PID in if we're a daemon, do this after thread_init due to
        a file descriptor handling bug somewhere in libevent */
     if (daemonize)
@@ -3614,25 +4273,11 @@ int main (int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
     delete_handler(0, 0, 0); /* sets up the event */
-    /* create the initial listening udp connection, monitored on all threads */
-    if (u_socket > -1) {
-        /* Skip thread 0, the tcp accept socket dispatcher
-           if running with > 1 thread. */
-        for (c = 1; c < settings.num_threads; c++) {
-            /* this is guaranteed to hit all threads because we round-robin */
-            dispatch_conn_new(u_socket, conn_read, EV_READ | EV_PERSIST,
-                              get_conn_buffer_group(c - 1), 1, 0, NULL, 0);
-        }
-    }
-    /* create the initial listening udp connection, monitored on all threads */
-    if (bu_socket > -1) {
-        /* Skip thread 0, the tcp accept socket dispatcher
-           if running with > 1 thread. */
-        for (c = 1; c < settings.num_threads; c++) {
-            /* this is guaranteed to hit all threads because we round-robin */
-            dispatch_conn_new(bu_socket, conn_bp_header_size_unknown, EV_READ | EV_PERSIST,
-                              get_conn_buffer_group(c - 1), true, true, NULL, 0);
-        }
+    release_handler(0, 0, 0); /* sets up the event */
+    /* create the initial listening udp connections.  Skip thread 0, the tcp
+       accept socket dispatcher. */
+    for (c = 1; c < settings.num_threads; c++) {
+        listen_udp(c);
     }
     /* enter the event loop */
     event_base_loop(main_base, 0);
@@ -36,11 +36,15 @@
 #define IOV_LIST_HIGHWAT 600
 #define MSG_LIST_HIGHWAT 100
 
+/** Size of the read buffer inside each conn. */
+#define CONN_INLINE_RBUF_SIZE 2048
+
 /** other useful constants. */
 #define BUFFER_ALIGNMENT (sizeof(uint32_t))
 #define KEY_MAX_LENGTH 255
 #define MAX_ITEM_SIZE  (1024 * 1024)
 #define UDP_HEADER_SIZE 8
+#define UDP_MAX_DATAGRAM_SIZE 65507     /* the largest UDP payload over IPv4 */
 
 /* number of virtual buckets for a managed instance */
 #define MAX_BUCKETS 32768
@@ -73,6 +77,18 @@ typedef struct conn_s        conn;
  * define types that don't rely on other modules.
  */
 
+/* a word of an ascii command, split up by tokenize_command. */
+typedef struct token_s {
+    char *value;
+    size_t length;
+} token_t;
+
+#define COMMAND_TOKEN 0
+#define SUBCOMMAND_TOKEN 1
+#define KEY_TOKEN 1
+
+#define MAX_TOKENS 6
+
 typedef enum conn_states_e {
     conn_listening,  /** the socket which listens for connections */
     conn_read,       /** reading in a command line */
@@ -81,6 +97,11 @@ typedef enum conn_states_e {
     conn_swallow,    /** swallowing unnecessary bytes w/o storing */
     conn_closing,    /** closing this connection */
     conn_mwrite,     /** writing out many items sequentially */
+    conn_lookup,     /** waiting for a get's keys to be looked up along with
+                         other connections' */
+    conn_proxy,      /** waiting for upstreams to answer a routed command */
+    conn_maintenance, /** waiting for the maintenance thread to carry out an
+                          admin command */
 
     conn_bp_header_size_unknown,        /** waiting for enough data to determine
                                             the size of the header. */
@@ -106,6 +127,13 @@ enum nread_e {
 };
 
 
+typedef enum evict_policy_e {
+    EVICT_LRU  = 0,             /* evict the least recently used item. */
+    EVICT_GDSF = 1,             /* evict the item with the fewest hits per
+                                 * byte among those near the LRU tail. */
+} evict_policy_t;
+
+
 enum transmit_sts_e {
     TRANSMIT_COMPLETE   = 0,
     TRANSMIT_INCOMPLETE = 1,
@@ -123,6 +151,8 @@ struct stats_s {
     unsigned int  curr_items;
     unsigned int  total_items;
     uint64_t      item_storage_allocated;
+    uint64_t      item_storage_released;   /* part of item_storage_allocated
+                                            * returned to the OS. */
     uint64_t      item_total_size;
     unsigned int  curr_conns;
     unsigned int  total_conns;
@@ -134,6 +164,11 @@ struct stats_s {
     uint64_t      arith_cmds;
     uint64_t      arith_hits;
     uint64_t      evictions;
+    uint64_t      evicted_bytes;
+    uint64_t      evicted_unfetched;/* evicted items that were never hit. */
+    uint64_t      evicted_hits;     /* hits the evicted items had had. */
+    uint64_t      reclaimed_items;  /* items unlinked by the reclaimer thread,
+                                     * included in evictions. */
     uint64_t      bytes_read;
     uint64_t      bytes_written;
 
@@ -160,6 +195,11 @@ struct stats_s {
 };
 
 #define MAX_VERBOSITY_LEVEL 2
+#define LOOKUP_BATCH_KEYS 4     /* most keys a get can have and still have its
+                                 * lookups batched: the keys the tokenizer
+                                 * handles in one pass. */
+#define MAX_WORKER_THREADS 64   /* the most worker threads the "threads"
+                                 * command can run, unless -t starts more. */
 struct settings_s {
     size_t maxbytes;
     int maxconns;
@@ -172,16 +212,49 @@ struct settings_s {
     rel_time_t oldest_live; /* ignore existing items older than this */
     bool managed;          /* if 1, a tracker manages virtual buckets */
     int evict_to_free;
+    evict_policy_t evict_policy;    /* how victims are picked when memory runs
+                                     * out. */
     char *socketpath;   /* path to unix socket if using local socket */
     double factor;          /* chunk size growth factor */
     int chunk_size;
     int num_threads;        /* number of libevent threads to run */
+    int max_threads;        /* number of libevent threads there is room for */
     char prefix_delimiter;  /* character that marks a key prefix (for stats) */
     int detail_enabled;     /* nonzero if we're collecting detailed stats */
     int reqs_per_event;     /* Maximum number of requests to process on each
                                io-event. */
     size_t max_conn_buffer_bytes;       /* high-water mark for memory taken by
                                          * connection buffers. */
+    rel_time_t mem_release_idle;        /* seconds free item memory must be
+                                         * unused before it is returned to
+                                         * the OS.  0 disables. */
+    int victim_percent;     /* size of the victim tier, as a percentage of
+                             * maxbytes.  0 disables. */
+    bool lookup_batching;   /* look up the keys of gets from all the
+                             * connections a worker serves in one event loop
+                             * pass together. */
+    int reclaim_percent;    /* item memory a background thread keeps free
+                             * ahead of demand, as a percentage of maxbytes.
+                             * 0 disables. */
+    char *warmup;           /* <host>:<port>[,<megabytes>] of a peer to fill
+                             * the cache from at startup, or NULL */
+    int busy_poll_usec;     /* microseconds a worker keeps polling for events
+                             * after the last one before it blocks.  0
+                             * disables busy-polling. */
+    int busy_poll_sock_usec;  /* SO_BUSY_POLL setting for client sockets, or
+                               * 0 to leave it alone */
+    unsigned key_prefixes;  /* most key prefixes to intern, or 0 to store
+                             * keys whole */
+    size_t maxbytes_ceiling;    /* how far the "maxbytes" command can raise
+                                 * the flat allocator's limit, or 0 for the
+                                 * default */
+    char *router;           /* comma-separated <host>:<port>s of the
+                             * upstreams to route commands to, or NULL */
+    char *mirror;           /* <host>:<port> of a secondary to send writes
+                             * to, or NULL */
+    bool client_stats;      /* time how long each connection keeps its
+                             * worker busy, and keep the traffic of closed
+                             * connections by client address. */
 };
 
 
@@ -192,16 +265,34 @@ struct settings_s {
 #include "binary_sm.h"
 #include "conn_buffer.h"
 #include "items.h"
+#include "victim.h"
+#include "mirror.h"
+#include "router.h"
+#include "warmup.h"
+#include "maintenance.h"
 
 
 /**
  * define types that rely on other modules.
  */
 
+/* what a connection has asked of us, for "stats conns" and "stats clients". */
+typedef struct conn_traffic_s conn_traffic_t;
+struct conn_traffic_s {
+    uint64_t cmds;
+    uint64_t get_cmds;      /* keys asked for */
+    uint64_t get_hits;
+    uint64_t get_misses;
+    uint64_t set_cmds;
+    uint64_t delete_cmds;
+    uint64_t arith_cmds;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t busy_usec;     /* time the worker spent on it; only kept with -T */
+};
+
 struct conn_s {
     int    sfd;
-    int    ufd;     /** udp fd */
-    int    xfd;     /** transmit fd */
     conn_states_t state;
     struct event event;
     short  ev_flags;
@@ -288,6 +379,41 @@ struct conn_s {
 
     char*  bp_key;
     char*  bp_string;
+
+    /* worker thread bookkeeping, maintained by thread.c */
+    void*  thread;      /* thread the connection was handed to, or NULL */
+    conn*  thread_next;
+    conn*  thread_prev;
+
+    /* a get whose keys are looked up together with other connections' (-B) */
+    conn*  lookup_next;
+    char*  lookup_keys[LOOKUP_BATCH_KEYS];
+    size_t lookup_nkeys[LOOKUP_BATCH_KEYS];
+    uint32_t lookup_hvs[LOOKUP_BATCH_KEYS];  /* hashed before taking the lock */
+    item*  lookup_items[LOOKUP_BATCH_KEYS];
+    int    lookup_count;
+
+    conn_traffic_t traffic;
+    rel_time_t connected;   /* when the connection was made */
+
+    /* a command routed to upstreams (-X); see router.c */
+    int    proxy_kind;
+    int    proxy_parts;     /* upstreams that haven't answered yet */
+    char*  proxy_buf;       /* the response, as the answers come in */
+    size_t proxy_used;
+    size_t proxy_size;
+    bool   proxy_oom;       /* the response couldn't be held */
+
+    /* an admin command carried out by the maintenance thread; see
+     * maintenance.c */
+    conn*  maint_next;
+    char*  maint_buf;       /* the response */
+    size_t maint_len;
+
+    /* rbuf points here until a command doesn't fit, so that most reads
+     * never need a connection buffer.  kept last, out of the way of the
+     * fields above. */
+    char   rbuf_inline[CONN_INLINE_RBUF_SIZE];
 };
 
 extern settings_t settings;
@@ -307,15 +433,24 @@ conn *do_conn_from_freelist();
 bool do_conn_add_to_freelist(conn* c);
 int  do_defer_delete(item *item, time_t exptime);
 void do_run_deferred_deletes(void);
-char *do_add_delta(const char* key, const size_t nkey, const int incr, const unsigned int delta,
-                   char *buf, uint32_t* res_val, const struct in_addr addr);
-int do_store_item(item *item, int comm, const char* key);
+char *do_add_delta(const char* key, const size_t nkey, const uint32_t hv, const int incr,
+                   const unsigned int delta, char *buf, uint32_t* res_val,
+                   const struct in_addr addr);
+int do_store_item(item *item, int comm, const char* key, const uint32_t hv);
 conn* conn_new(const int sfd, const int init_state, const int event_flags, conn_buffer_group_t* cbg,
                  const bool is_udp, const bool is_binary,
                  const struct sockaddr* const addr, const socklen_t addrlen,
                  struct event_base *base);
 void conn_cleanup(conn* c);
 void conn_close(conn* c);
+bool conn_is_idle(const conn* c);
+void conn_complete_lookup(conn* c);
+void conn_start_proxy(conn* c);
+void conn_complete_proxy(conn* c, char* buf, const size_t len);
+void conn_start_maintenance(conn* c);
+void conn_complete_maintenance(conn* c, char* buf, const size_t len);
+size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens);
+void conn_migrate(conn* c);
 void conn_shrink(conn* c);
 void accept_new_conns(const bool do_accept, const bool is_binary);
 bool update_event(conn* c, const int new_flags);
@@ -339,11 +474,25 @@ extern int try_read_udp(conn *c);
 extern int transmit(conn *c);
 
 void thread_init(int nthreads, struct event_base *main_base);
+int  thread_set_workers(const int nworkers);
+int  thread_retiring_count(void);
+void thread_conn_closed(conn* c);
+int  thread_index(const conn* c);
+void thread_conn_busy(conn* c);
+void thread_conn_idle(void* thread);
+void thread_poll_event(void* thread);
+void thread_maintenance_done(conn* c, char* buf, const size_t len);
+char* thread_busy_poll_stats(size_t* result_size);
+void thread_conns_visit(void (*visit)(const conn* c, void* arg), void* arg);
+void thread_queue_lookup(conn* c);
+void thread_wake_reclaimer(void);
 int  dispatch_event_add(int thread, conn* c);
 void dispatch_conn_new(int sfd, int init_state, int event_flags,
                        conn_buffer_group_t* cbg,
                        const bool is_udp, const bool is_binary,
                        const struct sockaddr* addr, socklen_t addrlen);
+void dispatch_conn_new_to_thread(const int thread, int sfd, int init_state, int event_flags,
+                                 const bool is_udp, const bool is_binary);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 char *mt_add_delta(const char* key, const size_t nkey, const int incr, const unsigned int delta,
@@ -359,9 +508,9 @@ item *mt_item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int n
 char *mt_item_cachedump(const unsigned int slabs_clsid, const unsigned int limit, unsigned int *bytes);
 void  mt_item_flush_expired(void);
 item *mt_item_get_notedeleted(const char *key, const size_t nkey, bool *delete_locked);
+item *mt_item_get_promote(const char *key, const size_t nkey);
 void  mt_item_deref(item *it);
 char *mt_item_stats(int *bytes);
-char *mt_item_stats_sizes(int *bytes);
 void  mt_item_unlink(item *it, long flags, const char* key);
 void  mt_item_update(item *it);
 void  mt_run_deferred_deletes(void);
@@ -369,6 +518,11 @@ void *mt_slabs_alloc(size_t size);
 void  mt_slabs_free(void *ptr, size_t size);
 int   mt_slabs_reassign(unsigned char srcid, unsigned char dstid);
 void  mt_slabs_rebalance();
+void  mt_slabs_release_memory(const rel_time_t idle);
+bool  mt_slabs_set_limit(const size_t limit);
+void  mt_slabs_shrink(void);
+void  mt_slabs_free_shortfall(const unsigned int percent, unsigned int *shortfall,
+                              const unsigned int nclasses);
 char *mt_slabs_stats(int *buflen);
 void  mt_stats_lock(stats_t *stats);
 void  mt_global_stats_lock(void);
@@ -396,9 +550,9 @@ void mt_clock_handler(const int fd, const short which, void *arg);
 # define item_cachedump              mt_item_cachedump
 # define item_flush_expired          mt_item_flush_expired
 # define item_get_notedeleted        mt_item_get_notedeleted
+# define item_get_promote            mt_item_get_promote
 # define item_deref                  mt_item_deref
 # define item_stats                  mt_item_stats
-# define item_stats_sizes            mt_item_stats_sizes
 # define item_update                 mt_item_update
 # define item_unlink                 mt_item_unlink
 # define run_deferred_deletes        mt_run_deferred_deletes
@@ -406,6 +560,10 @@ void mt_clock_handler(const int fd, const short which, void *arg);
 # define slabs_free                  mt_slabs_free
 # define slabs_reassign              mt_slabs_reassign
 # define slabs_rebalance             mt_slabs_rebalance
+# define slabs_release_memory        mt_slabs_release_memory
+# define slabs_set_limit             mt_slabs_set_limit
+# define slabs_shrink                mt_slabs_shrink
+# define slabs_free_shortfall        mt_slabs_free_shortfall
 # define slabs_stats                 mt_slabs_stats
 # define store_item                  mt_store_item
 # define stats_init                  mt_stats_init
@@ -0,0 +1,522 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Write mirroring.  The writes this server carries out are sent on to a
+ * secondary memcached, so that it has a warm cache to take over with.
+ *
+ * Writes are encoded as binary protocol requests into one of several queues,
+ * picked by the hash of the key, so that the writes to a key are sent in the
+ * order they were queued in.  A sender thread swaps the queues out every few
+ * milliseconds, or sooner once one of them is half full, and writes them to
+ * the secondary in one batch.  Sets and deletes go as quiet requests, so the
+ * secondary only answers the others and failures; the sender reads and
+ * discards the replies.  Nothing waits on the secondary: when it is down or
+ * too slow, requests are dropped and counted, and the secondary falls behind.
+ *
+ * A write isn't sent as the command that made it: what is queued is the key's
+ * state just after, looked up with the key's queue locked.  A key with an item
+ * is sent as a set of the whole item, and one without as a delete.  So an add,
+ * a replace or an incr leaves the secondary with the same value even if it
+ * had missed earlier writes, and two connections writing one key at once
+ * can't leave the secondary with the older value.  Flushes are queued in
+ * every queue.
+ */
+#include "generic.h"
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "memcached.h"
+#include "assoc.h"
+#include "binary_protocol.h"
+
+typedef struct mirror_queue_s mirror_queue_t;
+struct mirror_queue_s {
+    pthread_mutex_t lock;
+    char*           buf;        /* requests not yet sent; allocated the first
+                                 * time the thread mirrors a write */
+    size_t          used;
+    size_t          count;      /* number of requests in buf */
+    uint64_t        queued;
+    uint64_t        dropped;    /* didn't fit in buf */
+};
+
+static struct {
+    struct sockaddr_in addr;
+    mirror_queue_t* queues;     /* picked by the hash of the key */
+    int             nqueues;
+    char**          spares;     /* the sender's half of each queue's buffers */
+
+    pthread_mutex_t lock;       /* guards the fields below */
+    pthread_cond_t  cond;       /* wakes the sender early */
+    bool            connected;
+    uint64_t        sent;
+    uint64_t        bytes_sent;
+    uint64_t        dropped;    /* the secondary was down or went away */
+    uint64_t        connects;
+} mi;
+
+
+static bool mirror_parse_addr(const char* spec) {
+    char host[256];
+    const char* colon = strrchr(spec, ':');
+    struct addrinfo hints, *ai;
+    int port;
+
+    if (colon == NULL || colon == spec || colon - spec >= sizeof(host) ||
+        (port = atoi(colon + 1)) <= 0 || port > 65535) {
+        return false;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &ai) != 0) {
+        return false;
+    }
+    memcpy(&mi.addr, ai->ai_addr, sizeof(mi.addr));
+    mi.addr.sin_port = htons(port);
+    freeaddrinfo(ai);
+    return true;
+}
+
+
+static int mirror_connect(void) {
+    int fd, flags = 1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &mi.addr, sizeof(mi.addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*) &flags, sizeof(flags));
+    return fd;
+}
+
+
+/* throws away whatever the secondary has answered.  returns false if it
+ * closed the connection. */
+static bool mirror_discard_replies(const int fd) {
+    char buf[4096];
+    ssize_t res;
+
+    while ((res = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        ;
+    return res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+
+/*
+ * writes a whole batch, or returns false if the connection failed.  the
+ * secondary answers incrs and decrs, and stops reading once it can't write
+ * those answers, so they are read while we wait to send.  a secondary that
+ * takes nothing for MIRROR_SEND_TIMEOUT_MS is given up on.
+ */
+static bool mirror_write(const int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        struct pollfd pfd;
+        ssize_t res = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (res > 0) {
+            buf += res;
+            len -= res;
+            continue;
+        }
+        if (res == 0 ||
+            (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return false;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN | POLLOUT;
+        pfd.revents = 0;
+        res = poll(&pfd, 1, MIRROR_SEND_TIMEOUT_MS);
+        if (res == 0 || (res < 0 && errno != EINTR)) {
+            return false;
+        }
+        if ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) != 0 &&
+            ! mirror_discard_replies(fd)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void* mirror_loop(void* arg) {
+    int fd = -1, ix;
+    time_t next_connect = 0;
+
+    while (1) {
+        struct timeval now;
+        struct timespec until;
+
+        pthread_mutex_lock(&mi.lock);
+        gettimeofday(&now, NULL);
+        until.tv_sec = now.tv_sec;
+        until.tv_nsec = (now.tv_usec + MIRROR_INTERVAL_MS * 1000) * 1000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec ++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&mi.cond, &mi.lock, &until);
+        pthread_mutex_unlock(&mi.lock);
+
+        if (fd == -1 && now.tv_sec >= next_connect) {
+            next_connect = now.tv_sec + MIRROR_RETRY_SECS;
+            if ((fd = mirror_connect()) != -1) {
+                pthread_mutex_lock(&mi.lock);
+                mi.connected = true;
+                mi.connects ++;
+                pthread_mutex_unlock(&mi.lock);
+            }
+        }
+
+        for (ix = 0; ix < mi.nqueues; ix++) {
+            mirror_queue_t* q = &mi.queues[ix];
+            char* batch;
+            size_t len, count;
+
+            if (mi.spares[ix] == NULL &&
+                (mi.spares[ix] = malloc(MIRROR_QUEUE_BYTES)) == NULL) {
+                continue;
+            }
+
+            pthread_mutex_lock(&q->lock);
+            batch = q->buf;
+            len = q->used;
+            count = q->count;
+            if (len != 0) {
+                q->buf = mi.spares[ix];
+                q->used = q->count = 0;
+                mi.spares[ix] = batch;
+            }
+            pthread_mutex_unlock(&q->lock);
+
+            if (len == 0) {
+                continue;
+            }
+
+            if (fd != -1 && ! mirror_write(fd, batch, len)) {
+                close(fd);
+                fd = -1;
+                pthread_mutex_lock(&mi.lock);
+                mi.connected = false;
+                pthread_mutex_unlock(&mi.lock);
+            }
+
+            pthread_mutex_lock(&mi.lock);
+            if (fd != -1) {
+                mi.sent += count;
+                mi.bytes_sent += len;
+            } else {
+                mi.dropped += count;
+            }
+            pthread_mutex_unlock(&mi.lock);
+        }
+
+        if (fd != -1 && ! mirror_discard_replies(fd)) {
+            close(fd);
+            fd = -1;
+            pthread_mutex_lock(&mi.lock);
+            mi.connected = false;
+            pthread_mutex_unlock(&mi.lock);
+        }
+    }
+    return NULL;
+}
+
+
+void mirror_init(void) {
+    pthread_t thread;
+    int ix, ret;
+
+    if (settings.mirror == NULL) {
+        return;
+    }
+
+    if (! mirror_parse_addr(settings.mirror)) {
+        fprintf(stderr, "Can't resolve mirror address %s; use <host>:<port>\n",
+                settings.mirror);
+        exit(EXIT_FAILURE);
+    }
+
+    mi.nqueues = settings.max_threads;
+    mi.queues = calloc(mi.nqueues, sizeof(mirror_queue_t));
+    mi.spares = calloc(mi.nqueues, sizeof(char*));
+    if (mi.queues == NULL || mi.spares == NULL) {
+        fprintf(stderr, "Failed to init write mirroring.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (ix = 0; ix < mi.nqueues; ix++) {
+        pthread_mutex_init(&mi.queues[ix].lock, NULL);
+    }
+    pthread_mutex_init(&mi.lock, NULL);
+    pthread_cond_init(&mi.cond, NULL);
+
+    if ((ret = pthread_create(&thread, NULL, mirror_loop, NULL)) != 0) {
+        fprintf(stderr, "Can't create mirror thread: %s\n", strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Makes room for a request of len bytes at the end of a locked queue, and
+ * returns where to put it, or NULL if it doesn't fit.  mirror_commit finishes
+ * the request.
+ */
+static char* mirror_reserve(mirror_queue_t* q, const size_t len) {
+    if (q->buf == NULL) {
+        q->buf = malloc(MIRROR_QUEUE_BYTES);
+    }
+    if (q->buf == NULL || q->used + len > MIRROR_QUEUE_BYTES) {
+        q->dropped ++;
+        return NULL;
+    }
+    return q->buf + q->used;
+}
+
+
+/* returns true if the queue just got half full, and the sender should be
+ * woken.  a request counted as false is a copy of one queued elsewhere. */
+static bool mirror_commit(mirror_queue_t* q, const size_t len, const bool counted) {
+    q->used += len;
+    if (counted) {
+        q->count ++;
+        q->queued ++;
+    }
+    return (q->used - len < MIRROR_QUEUE_BYTES / 2 &&
+            q->used >= MIRROR_QUEUE_BYTES / 2);
+}
+
+
+static void mirror_wake(void) {
+    pthread_mutex_lock(&mi.lock);
+    pthread_cond_signal(&mi.cond);
+    pthread_mutex_unlock(&mi.lock);
+}
+
+
+/* fills in a request header.  body_length counts what follows the header. */
+static void mirror_header(void* req, const bp_cmd_t cmd, const size_t nkey,
+                          const size_t body_length) {
+    empty_req_t* hdr = req;
+
+    hdr->magic = BP_REQ_MAGIC_BYTE;
+    hdr->cmd = cmd;
+    hdr->keylen = nkey;
+    hdr->reserved = 0;
+    hdr->opaque = 0;
+    hdr->body_length = htonl(body_length);
+}
+
+
+static bool mirror_put_item(mirror_queue_t* q, const char* key, const item* it) {
+    const size_t nkey = ITEM_nkey(it), nbytes = ITEM_nbytes(it);
+    const size_t len = sizeof(key_value_req_t) + nkey + nbytes;
+    key_value_req_t req;
+    char* pos;
+
+    if ((pos = mirror_reserve(q, len)) == NULL) {
+        return false;
+    }
+
+    mirror_header(&req, BP_SETQ_CMD, nkey, len - BINARY_PROTOCOL_REQUEST_HEADER_SZ);
+    /* the secondary started at a different time, so send the absolute
+     * expiration time. */
+    req.exptime = htonl(ITEM_exptime(it) == 0 ? 0 : started + ITEM_exptime(it));
+    req.flags = htonl(ITEM_flags(it));
+    memcpy(pos, &req, sizeof(req));
+    memcpy(pos + sizeof(req), key, nkey);
+    item_memcpy_from(pos + sizeof(req) + nkey, it, 0, nbytes, false);
+
+    return mirror_commit(q, len, true);
+}
+
+
+static bool mirror_put_delete(mirror_queue_t* q, const char* key, const size_t nkey,
+                              const time_t exptime) {
+    const size_t len = sizeof(key_number_req_t) + nkey;
+    key_number_req_t req;
+    char* pos;
+
+    if ((pos = mirror_reserve(q, len)) == NULL) {
+        return false;
+    }
+
+    mirror_header(&req, BP_DELETEQ_CMD, nkey, len - BINARY_PROTOCOL_REQUEST_HEADER_SZ);
+    req.number = htonl(exptime);
+    memcpy(pos, &req, sizeof(req));
+    memcpy(pos + sizeof(req), key, nkey);
+
+    return mirror_commit(q, len, true);
+}
+
+
+/*
+ * Queues the key's state as it is now: its item as a set, or a delete if it
+ * has none.  The key's queue stays locked while the cache is looked at, so
+ * that of two writes to a key from different connections, the request queued
+ * last carries the later one, whichever connection gets here first.
+ */
+static void mirror_key(const char* key, const size_t nkey, const time_t exptime) {
+    mirror_queue_t* q;
+    bool wake;
+    item* it;
+
+    if (settings.mirror == NULL) {
+        return;
+    }
+
+    q = &mi.queues[hash(key, nkey, 0) % mi.nqueues];
+    pthread_mutex_lock(&q->lock);
+    if ((it = item_get(key, nkey)) != NULL) {
+        wake = mirror_put_item(q, key, it);
+        item_deref(it);
+    } else {
+        wake = mirror_put_delete(q, key, nkey, exptime);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (wake) {
+        mirror_wake();
+    }
+}
+
+
+void mirror_store(const char* key, const size_t nkey) {
+    mirror_key(key, nkey, 0);
+}
+
+
+void mirror_delete(const char* key, const size_t nkey, const time_t exptime) {
+    mirror_key(key, nkey, exptime);
+}
+
+
+/*
+ * Queues a request that covers every key in every queue, so that it is sent
+ * after the writes queued before it and before the ones queued after it.  Only
+ * the first copy is counted.
+ */
+static void mirror_put_all(const void* req, const size_t len) {
+    bool wake = false;
+    int ix;
+
+    for (ix = 0; ix < mi.nqueues; ix++) {
+        mirror_queue_t* q = &mi.queues[ix];
+        char* pos;
+
+        pthread_mutex_lock(&q->lock);
+        if ((pos = mirror_reserve(q, len)) != NULL) {
+            memcpy(pos, req, len);
+            wake |= mirror_commit(q, len, ix == 0);
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    if (wake) {
+        mirror_wake();
+    }
+}
+
+
+void mirror_flush_all(const time_t exptime) {
+    number_req_t req;
+
+    if (settings.mirror == NULL) {
+        return;
+    }
+
+    mirror_header(&req, BP_FLUSH_ALL_CMD, 0,
+                  sizeof(req) - BINARY_PROTOCOL_REQUEST_HEADER_SZ);
+    req.number = htonl(exptime);
+    mirror_put_all(&req, sizeof(req));
+}
+
+
+void mirror_flush_regex(const char* regex) {
+    const size_t nregex = strlen(regex);
+    const size_t len = sizeof(string_req_t) + nregex;
+    string_req_t* req;
+
+    if (settings.mirror == NULL) {
+        return;
+    }
+    if ((req = malloc(len)) == NULL) {
+        pthread_mutex_lock(&mi.queues[0].lock);
+        mi.queues[0].dropped ++;
+        pthread_mutex_unlock(&mi.queues[0].lock);
+        return;
+    }
+
+    mirror_header(req, BP_FLUSH_REGEX_CMD, 0, nregex);
+    memcpy((char*) req + sizeof(*req), regex, nregex);
+    mirror_put_all(req, len);
+    free(req);
+}
+
+
+char* mirror_stats(size_t* result_size) {
+    size_t bufsize = 1024, offset = 0;
+    char* buffer = malloc(bufsize);
+    char terminator[] = "END\r\n";
+    uint64_t queued = 0, dropped = 0, queued_bytes = 0;
+    int ix;
+
+    if (buffer == NULL) {
+        *result_size = 0;
+        return NULL;
+    }
+
+    for (ix = 0; ix < mi.nqueues; ix++) {
+        mirror_queue_t* q = &mi.queues[ix];
+
+        pthread_mutex_lock(&q->lock);
+        queued += q->queued;
+        dropped += q->dropped;
+        queued_bytes += q->used;
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    if (settings.mirror != NULL) {
+        pthread_mutex_lock(&mi.lock);
+        offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                                  "STAT mirror %s\r\n"
+                                  "STAT mirror_connected %d\r\n"
+                                  "STAT mirror_connects %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT mirror_queued %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT mirror_queued_bytes %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT mirror_sent %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT mirror_bytes_sent %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT mirror_dropped_full %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT mirror_dropped_down %" PRINTF_INT64_MODIFIER "u\r\n",
+                                  settings.mirror,
+                                  mi.connected ? 1 : 0,
+                                  mi.connects,
+                                  queued,
+                                  queued_bytes,
+                                  mi.sent,
+                                  mi.bytes_sent,
+                                  dropped,
+                                  mi.dropped);
+        pthread_mutex_unlock(&mi.lock);
+    }
+    offset = append_to_buffer(buffer, bufsize, offset, 0, terminator);
+
+    *result_size = offset;
+    return buffer;
+}
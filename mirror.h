@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#if !defined(_mirror_h_)
+#define _mirror_h_
+
+#include "generic.h"
+
+/*
+ * write mirroring sends the sets, deletes, incrs, decrs and flushes this
+ * server carries out to a secondary memcached (-O), as binary protocol
+ * requests.  requests are queued by the hash of their key; a sender thread
+ * writes them out in batches.  requests that don't fit in their queue, or that
+ * can't be sent because the secondary is down, are dropped and counted.
+ *
+ * all of these must be called without the cache lock held, after the write
+ * is done, and return at once.
+ */
+
+#define MIRROR_QUEUE_BYTES   (1024 * 1024)  /* room each queue has for
+                                             * requests not yet sent. */
+#define MIRROR_INTERVAL_MS   10             /* how long requests may wait in a
+                                             * queue before they are sent. */
+#define MIRROR_RETRY_SECS    1              /* how often we try to reconnect
+                                             * to the secondary. */
+#define MIRROR_SEND_TIMEOUT_MS 1000         /* how long the secondary may take
+                                             * nothing before we give up on
+                                             * the connection. */
+
+/* starts the sender thread if a secondary is configured. */
+extern void mirror_init(void);
+
+/* a set, add, replace, incr or decr of key; the resulting item is sent. */
+extern void mirror_store(const char* key, const size_t nkey);
+extern void mirror_delete(const char* key, const size_t nkey, const time_t exptime);
+extern void mirror_flush_all(const time_t exptime);
+extern void mirror_flush_regex(const char* regex);
+
+extern char* mirror_stats(size_t* result_size);
+
+#endif /* #if !defined(_mirror_h_) */
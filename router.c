@@ -0,0 +1,854 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Router mode.  With -X, the server doesn't serve keys from its own cache but
+ * passes the ascii commands it gets on to a pool of upstream memcached
+ * instances, so that clients don't need a proxy tier in front of them.
+ *
+ * Keys are mapped to upstreams with a consistent hash ring, in the style of
+ * ketama: every upstream gets a number of points on a ring of 32-bit hash
+ * values, and a key goes to the upstream whose point follows the key's hash.
+ * Adding or removing an upstream moves only the keys next to its points.
+ *
+ * Every worker thread keeps one non-blocking connection to each upstream,
+ * served by its own event loop.  The requests of all the clients a worker
+ * serves are pipelined over it, and the answers come back in the same order.
+ * A get's keys are split up by upstream and the parts sent to all of them
+ * at once; the client is answered once every part is back.  The client's
+ * connection doesn't read anything while it waits.
+ *
+ * When an upstream can't be reached, the keys it holds are misses for gets,
+ * and other commands fail with a SERVER_ERROR.  The next command tries to
+ * connect again.
+ */
+#include "generic.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "assoc.h"
+#include "memcached.h"
+
+#define UPSTREAM_BUFFER_SIZE 16384  /* initial size of the buffers */
+#define UPSTREAM_ERROR       "SERVER_ERROR upstream unavailable\r\n"
+
+/* how the answers of a command's parts make up the response. */
+typedef enum router_kind_e {
+    ROUTER_GET,             /* the values of all the parts, then END */
+    ROUTER_LINE,            /* the line the one upstream sent */
+    ROUTER_BROADCAST,       /* OK if every upstream said so, otherwise the
+                             * first thing that isn't OK */
+} router_kind_t;
+
+/* a request sent to an upstream, waiting for its answer. */
+typedef struct router_part_s router_part_t;
+struct router_part_s {
+    conn*          c;
+    bool           get;     /* answered with values and END, rather than a
+                             * single line */
+    router_part_t* next;
+};
+
+typedef struct upstream_conn_s upstream_conn_t;
+struct upstream_conn_s {
+    int            fd;      /* -1 when not connected */
+    struct event   event;
+    short          ev_flags;
+    bool           connecting;
+    bool           broken;  /* failed while a command was being sent; cleaned
+                             * up from the event loop */
+    int            upstream;
+
+    char*          wbuf;    /* requests not yet sent */
+    size_t         wsent;
+    size_t         wused;
+    size_t         wsize;
+
+    char*          rbuf;    /* answers not yet handled */
+    size_t         rused;
+    size_t         rsize;
+
+    router_part_t* head;    /* requests sent, in order */
+    router_part_t* tail;
+
+    /* read by router_stats without a lock; only ever go up. */
+    uint64_t       requests;
+    uint64_t       failures;
+    uint64_t       connects;
+};
+
+typedef struct upstream_s upstream_t;
+struct upstream_s {
+    char*              name;    /* <host>:<port>, as given */
+    struct sockaddr_in addr;
+};
+
+typedef struct ring_point_s ring_point_t;
+struct ring_point_s {
+    uint32_t hv;
+    int      upstream;
+};
+
+static upstream_t       upstreams[ROUTER_MAX_UPSTREAMS];
+static int              nupstreams;
+static ring_point_t*    ring;
+static int              nring;
+static upstream_conn_t* pools;  /* [thread][upstream] */
+
+
+static void upstream_handler(const int fd, const short which, void* arg);
+
+
+static bool router_parse_upstream(upstream_t* u, const char* spec, const size_t len) {
+    char host[256];
+    struct addrinfo hints, *ai;
+    const char* colon = memchr(spec, ':', len);
+    int port;
+
+    if (colon == NULL || colon == spec || colon - spec >= sizeof(host) ||
+        (port = atoi(colon + 1)) <= 0 || port > 65535) {
+        return false;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &ai) != 0) {
+        return false;
+    }
+    memcpy(&u->addr, ai->ai_addr, sizeof(u->addr));
+    u->addr.sin_port = htons(port);
+    freeaddrinfo(ai);
+
+    if ((u->name = malloc(len + 1)) == NULL) {
+        return false;
+    }
+    memcpy(u->name, spec, len);
+    u->name[len] = '\0';
+    return true;
+}
+
+
+static int ring_point_compare(const void* a, const void* b) {
+    const ring_point_t *pa = a, *pb = b;
+
+    return pa->hv < pb->hv ? -1 : pa->hv > pb->hv ? 1 : 0;
+}
+
+
+void router_init(void) {
+    const char* spec = settings.router;
+    int ix, point;
+
+    if (spec == NULL) {
+        return;
+    }
+
+    while (*spec != '\0') {
+        size_t len = strcspn(spec, ",");
+
+        if (nupstreams == ROUTER_MAX_UPSTREAMS ||
+            ! router_parse_upstream(&upstreams[nupstreams], spec, len)) {
+            fprintf(stderr, "Bad upstream %.*s; use <host>:<port>[,<host>:<port>...]"
+                    " with at most %d upstreams\n", (int) len, spec,
+                    ROUTER_MAX_UPSTREAMS);
+            exit(EXIT_FAILURE);
+        }
+        nupstreams ++;
+        spec += len;
+        if (*spec == ',') {
+            spec ++;
+        }
+    }
+    if (nupstreams == 0) {
+        fprintf(stderr, "No upstreams to route to\n");
+        exit(EXIT_FAILURE);
+    }
+
+    nring = nupstreams * ROUTER_POINTS_PER_UPSTREAM;
+    ring = malloc(nring * sizeof(ring_point_t));
+    pools = calloc(settings.max_threads * nupstreams, sizeof(upstream_conn_t));
+    if (ring == NULL || pools == NULL) {
+        fprintf(stderr, "Failed to init router.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (ix = 0; ix < nupstreams; ix++) {
+        for (point = 0; point < ROUTER_POINTS_PER_UPSTREAM; point++) {
+            char name[300];
+            int len = snprintf(name, sizeof(name), "%s-%d", upstreams[ix].name, point);
+
+            ring[ix * ROUTER_POINTS_PER_UPSTREAM + point].hv = hash(name, len, 0);
+            ring[ix * ROUTER_POINTS_PER_UPSTREAM + point].upstream = ix;
+        }
+    }
+    qsort(ring, nring, sizeof(ring_point_t), ring_point_compare);
+
+    for (ix = 0; ix < settings.max_threads * nupstreams; ix++) {
+        pools[ix].fd = -1;
+        pools[ix].upstream = ix % nupstreams;
+    }
+}
+
+
+/* the upstream that holds a key: the first point at or after its hash. */
+static int router_find(const char* key, const size_t nkey) {
+    const uint32_t hv = hash(key, nkey, 0);
+    int low = 0, high = nring;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+
+        if (ring[mid].hv < hv) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return ring[low == nring ? 0 : low].upstream;
+}
+
+
+static bool buffer_reserve(char** buf, size_t* size, const size_t needed) {
+    size_t newsize = *size == 0 ? UPSTREAM_BUFFER_SIZE : *size;
+    char* newbuf;
+
+    if (*size >= needed) {
+        return true;
+    }
+    while (newsize < needed) {
+        newsize *= 2;
+    }
+    if ((newbuf = realloc(*buf, newsize)) == NULL) {
+        return false;
+    }
+    *buf = newbuf;
+    *size = newsize;
+    return true;
+}
+
+
+/***************************** CLIENT RESPONSES ******************************/
+
+static void proxy_append(conn* c, const char* data, const size_t len) {
+    if (c->proxy_oom ||
+        ! buffer_reserve(&c->proxy_buf, &c->proxy_size, c->proxy_used + len)) {
+        c->proxy_oom = true;
+        return;
+    }
+    memcpy(c->proxy_buf + c->proxy_used, data, len);
+    c->proxy_used += len;
+}
+
+
+static void proxy_line(conn* c, const char* line, const size_t len) {
+    if (c->proxy_kind != ROUTER_BROADCAST) {
+        proxy_append(c, line, len);
+    } else if (c->proxy_used == 0 &&
+               ! (len == sizeof("OK\r\n") - 1 && memcmp(line, "OK\r\n", len) == 0)) {
+        proxy_append(c, line, len);
+    }
+}
+
+
+/* one of a client's parts is done.  once they all are, sends the response. */
+static void proxy_part_done(conn* c) {
+    char* buf;
+    size_t len;
+
+    assert(c->state == conn_proxy && c->proxy_parts > 0);
+    if (-- c->proxy_parts > 0) {
+        return;
+    }
+
+    if (c->proxy_kind == ROUTER_GET) {
+        proxy_append(c, "END\r\n", sizeof("END\r\n") - 1);
+    } else if (c->proxy_kind == ROUTER_BROADCAST && c->proxy_used == 0) {
+        proxy_append(c, "OK\r\n", sizeof("OK\r\n") - 1);
+    }
+
+    buf = c->proxy_oom ? NULL : c->proxy_buf;
+    len = c->proxy_used;
+    if (c->proxy_oom) {
+        free(c->proxy_buf);
+    }
+    c->proxy_buf = NULL;
+    c->proxy_used = c->proxy_size = 0;
+    c->proxy_oom = false;
+
+    conn_complete_proxy(c, buf, len);
+}
+
+
+/**************************** UPSTREAM CONNECTIONS ***************************/
+
+static bool upstream_update_event(upstream_conn_t* u, struct event_base* base,
+                                  const short flags) {
+    if (u->ev_flags == flags && flags != 0) {
+        return true;
+    }
+    if (u->ev_flags != 0) {
+        event_del(&u->event);
+    }
+    event_set(&u->event, u->fd, flags, upstream_handler, u);
+    event_base_set(base, &u->event);
+    u->ev_flags = flags;
+    return flags == 0 || event_add(&u->event, 0) != -1;
+}
+
+
+/* drops the connection, and answers every request still waiting on it. */
+static void upstream_fail(upstream_conn_t* u) {
+    router_part_t *part, *next = u->head;
+
+    if (u->ev_flags != 0) {
+        event_del(&u->event);
+        u->ev_flags = 0;
+    }
+    if (u->fd != -1) {
+        close(u->fd);
+        u->fd = -1;
+    }
+    u->connecting = u->broken = false;
+    u->wsent = u->wused = u->rused = 0;
+    u->head = u->tail = NULL;
+
+    /* the clients may send more requests as they are answered; those go on a
+     * new connection. */
+    while ((part = next) != NULL) {
+        next = part->next;
+        u->failures ++;
+        if (! part->get) {
+            proxy_line(part->c, UPSTREAM_ERROR, sizeof(UPSTREAM_ERROR) - 1);
+        }
+        proxy_part_done(part->c);
+        free(part);
+    }
+}
+
+
+/* a failure found while a client's command is being sent is handled from the
+ * event loop, so that the client isn't answered before it has finished. */
+static void upstream_break(upstream_conn_t* u, struct event_base* base) {
+    u->broken = true;
+    upstream_update_event(u, base, 0);
+    event_set(&u->event, u->fd, 0, upstream_handler, u);
+    event_base_set(base, &u->event);
+    event_active(&u->event, EV_WRITE, 1);
+}
+
+
+static void upstream_connect(upstream_conn_t* u, struct event_base* base) {
+    int flags = 1;
+
+    u->connects ++;
+    if ((u->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        fcntl(u->fd, F_SETFL, fcntl(u->fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        upstream_break(u, base);
+        return;
+    }
+    setsockopt(u->fd, IPPROTO_TCP, TCP_NODELAY, (void*) &flags, sizeof(flags));
+
+    if (connect(u->fd, (struct sockaddr*) &upstreams[u->upstream].addr,
+                sizeof(struct sockaddr_in)) == 0) {
+        u->connecting = false;
+    } else if (errno == EINPROGRESS) {
+        u->connecting = true;
+    } else {
+        upstream_break(u, base);
+        return;
+    }
+    if (! upstream_update_event(u, base, EV_READ | EV_WRITE | EV_PERSIST)) {
+        upstream_break(u, base);
+    }
+}
+
+
+/* sends what it can without blocking.  returns false on a hard error. */
+static bool upstream_flush(upstream_conn_t* u, struct event_base* base) {
+    while (u->wsent < u->wused) {
+        ssize_t res = send(u->fd, u->wbuf + u->wsent, u->wused - u->wsent,
+                           MSG_NOSIGNAL);
+
+        if (res > 0) {
+            u->wsent += res;
+        } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return upstream_update_event(u, base, EV_READ | EV_WRITE | EV_PERSIST);
+        } else if (res == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    u->wsent = u->wused = 0;
+    return upstream_update_event(u, base, EV_READ | EV_PERSIST);
+}
+
+
+/*
+ * Hands the complete answers at the front of the read buffer to the clients
+ * waiting for them.
+ */
+static void upstream_parse(upstream_conn_t* u) {
+    size_t done = 0;
+
+    while (u->head != NULL) {
+        router_part_t* part = u->head;
+        char* start = u->rbuf + done;
+        size_t left = u->rused - done;
+        char* el = left < 2 ? NULL : memchr(start, '\n', left);
+        size_t line;
+
+        if (el == NULL) {
+            break;
+        }
+        line = el - start + 1;
+
+        if (part->get && line > 6 && memcmp(start, "VALUE ", 6) == 0) {
+            /* VALUE <key> <flags> <bytes>, then the value and a CR-LF. */
+            char* pos = start + 6;
+            unsigned long bytes;
+            int field;
+
+            for (field = 0; field < 2 && pos < el; field++) {
+                pos = memchr(pos, ' ', el - pos);
+                if (pos == NULL) {
+                    break;
+                }
+                pos ++;
+            }
+            if (pos == NULL || pos >= el) {
+                upstream_fail(u);
+                return;
+            }
+            bytes = strtoul(pos, NULL, 10);
+            if (left < line + bytes + 2) {
+                break;
+            }
+            proxy_append(part->c, start, line + bytes + 2);
+            done += line + bytes + 2;
+            continue;
+        }
+
+        /* a single-line answer, or the END (or an error) after the values. */
+        u->head = part->next;
+        if (u->head == NULL) {
+            u->tail = NULL;
+        }
+        if (! part->get) {
+            proxy_line(part->c, start, line);
+        }
+        done += line;
+        proxy_part_done(part->c);
+        free(part);
+    }
+
+    if (u->fd == -1) {
+        /* a client's new request failed and reset the connection. */
+        return;
+    }
+    if (done > 0) {
+        memmove(u->rbuf, u->rbuf + done, u->rused - done);
+        u->rused -= done;
+    }
+}
+
+
+static void upstream_handler(const int fd, const short which, void* arg) {
+    upstream_conn_t* u = arg;
+    struct event_base* base = u->event.ev_base;
+
+    if (u->broken) {
+        upstream_fail(u);
+        return;
+    }
+
+    if (u->connecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        if (getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+            upstream_fail(u);
+            return;
+        }
+        u->connecting = false;
+    }
+
+    if ((which & EV_WRITE) && ! upstream_flush(u, base)) {
+        upstream_fail(u);
+        return;
+    }
+
+    if (which & EV_READ) {
+        while (1) {
+            ssize_t res;
+
+            if (! buffer_reserve(&u->rbuf, &u->rsize, u->rused + UPSTREAM_BUFFER_SIZE / 2)) {
+                upstream_fail(u);
+                return;
+            }
+            res = read(u->fd, u->rbuf + u->rused, u->rsize - u->rused);
+            if (res > 0) {
+                u->rused += res;
+                continue;
+            }
+            if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (res == -1 && errno == EINTR) {
+                continue;
+            }
+            /* closed, or a real error; answer what did come first. */
+            upstream_parse(u);
+            if (u->fd != -1) {
+                upstream_fail(u);
+            }
+            return;
+        }
+        upstream_parse(u);
+    }
+}
+
+
+/* the calling worker's connection to an upstream, connected if it isn't. */
+static upstream_conn_t* upstream_get(conn* c, const int upstream) {
+    upstream_conn_t* u = &pools[thread_index(c) * nupstreams + upstream];
+
+    if (u->fd == -1 && ! u->broken) {
+        upstream_connect(u, c->event.ev_base);
+    }
+    return u;
+}
+
+
+static bool upstream_append(upstream_conn_t* u, const char* data, const size_t len) {
+    if (! buffer_reserve(&u->wbuf, &u->wsize, u->wused + len)) {
+        return false;
+    }
+    memcpy(u->wbuf + u->wused, data, len);
+    u->wused += len;
+    return true;
+}
+
+
+/* starts a part of a client's command on an upstream. */
+static bool upstream_add_part(upstream_conn_t* u, conn* c, const bool get) {
+    router_part_t* part = malloc(sizeof(router_part_t));
+
+    if (part == NULL) {
+        return false;
+    }
+    part->c = c;
+    part->get = get;
+    part->next = NULL;
+    if (u->tail != NULL) {
+        u->tail->next = part;
+    } else {
+        u->head = part;
+    }
+    u->tail = part;
+    u->requests ++;
+    c->proxy_parts ++;
+    return true;
+}
+
+
+/* sends off the requests a client's command added. */
+static void upstream_send(upstream_conn_t* u, struct event_base* base) {
+    if (u->broken || u->fd == -1) {
+        return;
+    }
+    if (! u->connecting && ! upstream_flush(u, base)) {
+        upstream_break(u, base);
+    }
+}
+
+
+/******************************** COMMANDS ***********************************/
+
+/* the client waits for its parts; it doesn't read anything meanwhile. */
+static void proxy_start(conn* c, const router_kind_t kind) {
+    c->proxy_kind = kind;
+    c->proxy_parts = 0;
+    c->proxy_used = 0;
+    c->proxy_oom = false;
+    conn_start_proxy(c);
+}
+
+
+/* a command whose parts couldn't all be queued: the parts that were wait for
+ * their answers, and the rest count as failed. */
+static void proxy_queue_failed(conn* c) {
+    if (c->proxy_kind != ROUTER_GET) {
+        proxy_line(c, "SERVER_ERROR out of memory\r\n",
+                   sizeof("SERVER_ERROR out of memory\r\n") - 1);
+    }
+}
+
+
+/* sends a command line as it is to one upstream, or to all of them. */
+static void router_forward_line(conn* c, token_t* tokens, const size_t ntokens,
+                                const int upstream, const router_kind_t kind) {
+    struct event_base* base = c->event.ev_base;
+    int ix;
+
+    proxy_start(c, kind);
+    c->proxy_parts = 1;     /* until all the parts are queued */
+
+    for (ix = 0; ix < nupstreams; ix++) {
+        upstream_conn_t* u;
+        size_t t;
+        bool ok = true;
+
+        if (upstream != -1 && ix != upstream) {
+            continue;
+        }
+        u = upstream_get(c, ix);
+        for (t = 0; t < ntokens && tokens[t].length != 0 && ok; t++) {
+            ok = upstream_append(u, tokens[t].value, tokens[t].length) &&
+                upstream_append(u, t + 1 < ntokens && tokens[t + 1].length != 0 ?
+                                " " : "\r\n", t + 1 < ntokens && tokens[t + 1].length != 0 ? 1 : 2);
+        }
+        if (! ok || ! upstream_add_part(u, c, false)) {
+            proxy_queue_failed(c);
+            continue;
+        }
+        upstream_send(u, base);
+    }
+
+    proxy_part_done(c);
+}
+
+
+/* whether every key of a get fits.  the keys past the tokens the command was
+ * split into are still one string; they're only looked at here. */
+static bool router_get_keys_ok(const token_t* tokens, const size_t ntokens) {
+    const token_t* key_token;
+    const char* p;
+    size_t len = 0;
+
+    for (key_token = &tokens[KEY_TOKEN]; key_token->length != 0; key_token++) {
+        if (key_token->length > KEY_MAX_LENGTH) {
+            return false;
+        }
+    }
+    for (p = tokens[ntokens - 1].value; p != NULL && *p != '\0'; p++) {
+        len = *p == ' ' ? 0 : len + 1;
+        if (len > KEY_MAX_LENGTH) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void router_get(conn* c, token_t* tokens) {
+    struct event_base* base = c->event.ev_base;
+    token_t* key_token = &tokens[KEY_TOKEN];
+    bool started[ROUTER_MAX_UPSTREAMS];
+    int ix;
+
+    memset(started, 0, sizeof(started));
+    proxy_start(c, ROUTER_GET);
+    c->proxy_parts = 1;     /* until all the parts are queued */
+
+    do {
+        for (; key_token->length != 0; key_token++) {
+            upstream_conn_t* u;
+
+            ix = router_find(key_token->value, key_token->length);
+            u = upstream_get(c, ix);
+            if (! started[ix]) {
+                if (! upstream_append(u, "get", 3)) {
+                    continue;
+                }
+                started[ix] = true;
+            }
+            if (! upstream_append(u, " ", 1) ||
+                ! upstream_append(u, key_token->value, key_token->length)) {
+                c->proxy_oom = true;
+            }
+        }
+
+        if (key_token->value != NULL) {
+            tokenize_command(key_token->value, tokens, MAX_TOKENS);
+            key_token = tokens;
+        }
+    } while (key_token->value != NULL);
+
+    for (ix = 0; ix < nupstreams; ix++) {
+        upstream_conn_t* u;
+
+        if (! started[ix]) {
+            continue;
+        }
+        u = upstream_get(c, ix);
+        if (! upstream_append(u, "\r\n", 2) || ! upstream_add_part(u, c, true)) {
+            /* the half-written request would confuse the upstream. */
+            upstream_break(u, base);
+            continue;
+        }
+        upstream_send(u, base);
+    }
+
+    proxy_part_done(c);
+}
+
+
+bool router_process_command(conn* c, token_t* tokens, const size_t ntokens) {
+    const char* command = tokens[COMMAND_TOKEN].value;
+
+    if (ntokens >= 3 && (strcmp(command, "get") == 0 || strcmp(command, "bget") == 0)) {
+        if (! router_get_keys_ok(tokens, ntokens)) {
+            return false;   /* refused locally */
+        }
+        router_get(c, tokens);
+        return true;
+    }
+
+    if ((ntokens == 3 || ntokens == 4) && strcmp(command, "delete") == 0) {
+        if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
+            return false;   /* refused locally */
+        }
+        router_forward_line(c, tokens, ntokens,
+                            router_find(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length),
+                            ROUTER_LINE);
+        return true;
+    }
+
+    if (ntokens == 4 && (strcmp(command, "incr") == 0 || strcmp(command, "decr") == 0)) {
+        if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
+            return false;   /* refused locally */
+        }
+        router_forward_line(c, tokens, ntokens,
+                            router_find(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length),
+                            ROUTER_LINE);
+        return true;
+    }
+
+    if (((ntokens == 2 || ntokens == 3) && strcmp(command, "flush_all") == 0) ||
+        (ntokens == 3 && strcmp(command, "flush_regex") == 0)) {
+        router_forward_line(c, tokens, ntokens, -1, ROUTER_BROADCAST);
+        return true;
+    }
+
+    return false;
+}
+
+
+void router_store(conn* c, const item* it, const int comm, const char* key) {
+    static const char* const commands[] = { NULL, "add", "set", "replace" };
+    const size_t nkey = ITEM_nkey(it), nbytes = ITEM_nbytes(it);
+    const int upstream = router_find(key, nkey);
+    struct event_base* base = c->event.ev_base;
+    upstream_conn_t* u;
+    char line[KEY_MAX_LENGTH + 80];
+    int len;
+
+    proxy_start(c, ROUTER_LINE);
+    c->proxy_parts = 1;     /* until the part is queued */
+
+    /* the upstream may have been started at another time than us, so send
+     * the absolute expiration time. */
+    len = snprintf(line, sizeof(line), "%s %.*s %u %lu %lu\r\n", commands[comm],
+                   (int) nkey, key, ITEM_flags(it),
+                   ITEM_exptime(it) == 0 ? 0 : (unsigned long) (started + ITEM_exptime(it)),
+                   (unsigned long) nbytes);
+
+    u = upstream_get(c, upstream);
+    if (! upstream_append(u, line, len) ||
+        ! buffer_reserve(&u->wbuf, &u->wsize, u->wused + nbytes + 2)) {
+        upstream_break(u, base);
+        proxy_line(c, UPSTREAM_ERROR, sizeof(UPSTREAM_ERROR) - 1);
+        proxy_part_done(c);
+        return;
+    }
+    item_memcpy_from(u->wbuf + u->wused, it, 0, nbytes, false);
+    u->wused += nbytes;
+    upstream_append(u, "\r\n", 2);
+
+    if (upstream_add_part(u, c, false)) {
+        upstream_send(u, base);
+    } else {
+        upstream_break(u, base);
+        proxy_queue_failed(c);
+    }
+    proxy_part_done(c);
+}
+
+
+void router_thread_exit(const int thread) {
+    int ix;
+
+    if (pools == NULL) {
+        return;
+    }
+    for (ix = 0; ix < nupstreams; ix++) {
+        upstream_conn_t* u = &pools[thread * nupstreams + ix];
+
+        /* the thread only exits once its clients have all been answered. */
+        assert(u->head == NULL);
+        if (u->ev_flags != 0 || u->broken) {
+            event_del(&u->event);
+            u->ev_flags = 0;
+        }
+        if (u->fd != -1) {
+            close(u->fd);
+            u->fd = -1;
+        }
+        u->connecting = u->broken = false;
+        u->wsent = u->wused = u->rused = 0;
+    }
+}
+
+
+char* router_stats(size_t* result_size) {
+    size_t bufsize = 128 + nupstreams * 512, offset = 0;
+    char* buffer = malloc(bufsize);
+    char terminator[] = "END\r\n";
+    int ix, t;
+
+    if (buffer == NULL) {
+        *result_size = 0;
+        return NULL;
+    }
+
+    for (ix = 0; ix < nupstreams; ix++) {
+        uint64_t requests = 0, failures = 0, connects = 0;
+        int connected = 0;
+
+        for (t = 0; t < settings.max_threads; t++) {
+            const upstream_conn_t* u = &pools[t * nupstreams + ix];
+
+            requests += u->requests;
+            failures += u->failures;
+            connects += u->connects;
+            if (u->fd != -1 && ! u->connecting) {
+                connected ++;
+            }
+        }
+        offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                                  "STAT upstream_%d %s\r\n"
+                                  "STAT upstream_%d_connections %d\r\n"
+                                  "STAT upstream_%d_connects %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT upstream_%d_requests %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT upstream_%d_failures %" PRINTF_INT64_MODIFIER "u\r\n",
+                                  ix, upstreams[ix].name,
+                                  ix, connected,
+                                  ix, connects,
+                                  ix, requests,
+                                  ix, failures);
+    }
+    offset = append_to_buffer(buffer, bufsize, offset, 0, terminator);
+
+    *result_size = offset;
+    return buffer;
+}
@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#if !defined(_router_h_)
+#define _router_h_
+
+#include "generic.h"
+
+/*
+ * router mode (-X) turns the server into a proxy for a pool of upstream
+ * memcached instances.  keys are mapped to upstreams on a consistent hash
+ * ring; a get's keys are split up by upstream and the parts sent at the same
+ * time, and the replies merged.  each worker thread keeps its own non-blocking
+ * connection to every upstream, served by the worker's own event loop.
+ *
+ * only the ascii protocol is routed.
+ */
+
+#define ROUTER_POINTS_PER_UPSTREAM 160  /* points each upstream has on the
+                                         * ring */
+#define ROUTER_MAX_UPSTREAMS       64
+
+/* parses settings.router and builds the ring. */
+extern void router_init(void);
+
+/* routes a command.  returns false if the command isn't routed and should be
+ * handled locally. */
+extern bool router_process_command(conn* c, token_t* tokens, const size_t ntokens);
+
+/* routes a set, add or replace whose value has been read into it. */
+extern void router_store(conn* c, const item* it, const int comm, const char* key);
+
+/* closes a retiring worker thread's upstream connections. */
+extern void router_thread_exit(const int thread);
+
+extern char* router_stats(size_t* result_size);
+
+#endif /* #if !defined(_router_h_) */
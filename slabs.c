@@ -23,16 +23,31 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "memcached.h"
 #include "items.h"
+#include "trace.h"
 
 #define POWER_SMALLEST 1
 #define POWER_LARGEST  200
 #define POWER_BLOCK 1048576
 #define CHUNK_ALIGN_BYTES (sizeof(void *))
+#define SLABS_RELEASE_PAGES_PER_PASS 16 /* number of slab pages examined each
+                                         * time we look for idle pages to
+                                         * return to the OS. */
+#define SLABS_SHRINK_PAGES_PER_PASS 4   /* number of slab pages freed each
+                                         * time we shrink towards a lowered
+                                         * memory limit. */
 //#define DONT_PREALLOC_SLABS
 
+typedef enum {
+    SLAB_PAGE_IN_USE,           /* page holds items, or has not been examined. */
+    SLAB_PAGE_FREE,             /* page has held no items since page_free_since. */
+    SLAB_PAGE_RELEASED,         /* page has been returned to the OS. */
+} slab_page_state_t;
+
 /* powers-of-N allocation structures */
 
 typedef struct {
@@ -51,6 +66,9 @@ typedef struct {
     void **slab_list;       /* array of slab pointers */
     unsigned int list_size; /* size of prev array */
 
+    unsigned char *page_state;      /* slab_page_state_t of each slab */
+    rel_time_t *page_free_since;    /* when each slab was first seen free */
+
     unsigned int total_hits;  /* total number of get hits for items in this slab class */
     unsigned int unique_hits; /* total number of get hits for unique items in this slab class */
     unsigned int evictions;   /* total number of evictions from this class */
@@ -61,6 +79,23 @@ typedef struct {
 
 static slabclass_t slabclass[POWER_LARGEST + 1];
 static size_t mem_limit = 0;
+
+#if defined(SLAB_PAGE_REFS)
+#if POWER_BLOCK != (1 << SLAB_PAGE_SHIFT)
+#error "slab page references need POWER_BLOCK to be 1 << SLAB_PAGE_SHIFT"
+#endif
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+slab_page_t *slab_pages = NULL;
+unsigned int slab_chunk_bits;
+uint32_t *slab_page_map[SLAB_PAGE_MAP_SIZE];
+static uint32_t slab_page_ids;          /* ids a reference can hold */
+static uint32_t slab_page_next_id = 1;  /* lowest id never handed out */
+static uint32_t slab_page_free_id = 0;  /* ids of freed pages, chained
+                                         * through their size fields */
+#endif /* #if defined(SLAB_PAGE_REFS) */
 static int power_largest;
 static int slab_rebalanced_count = 0;
 static int slab_rebalanced_reversed = 0;
@@ -69,6 +104,9 @@ static int slab_rebalanced_reversed = 0;
  * Forward Declarations
  */
 static int do_slabs_newslab(const unsigned int id);
+static size_t slab_release_size(void *slab);
+static bool slab_evict(slabclass_t *p, void *slab);
+static void slab_list_remove(slabclass_t *p, const unsigned int page);
 
 #ifndef DONT_PREALLOC_SLABS
 /* Preallocate as many slab pages as possible (called from slabs_init)
@@ -109,6 +147,113 @@ unsigned int slabs_chunksize(const unsigned int clsid) {
     return 0;
 }
 
+#if defined(SLAB_PAGE_REFS)
+/* the most memory slab page references can reach. */
+static size_t slab_refs_max_bytes(void) {
+    return (size_t) (slab_page_ids - 1) * POWER_BLOCK;
+}
+
+/*
+ * Sizes item references to the chunk sizes: the chunk index takes as few bits
+ * as the smallest class needs, and the page id gets the rest.
+ */
+static void slab_refs_init(const size_t limit) {
+    const unsigned int perslab = POWER_BLOCK / slabclass[POWER_SMALLEST].size;
+
+    for (slab_chunk_bits = 0; (1u << slab_chunk_bits) < perslab; slab_chunk_bits++)
+        ;
+    slab_page_ids = (uint32_t) ((uint64_t) 1 << (32 - slab_chunk_bits));
+
+    if (limit > slab_refs_max_bytes()) {
+        fprintf(stderr, "Items can use at most %lu MB of memory with the slab allocator\n",
+                (unsigned long) (slab_refs_max_bytes() / POWER_BLOCK));
+        exit(EXIT_FAILURE);
+    }
+
+    slab_pages = calloc(slab_page_ids, sizeof(slab_page_t));
+    if (slab_pages == NULL) {
+        perror("Can't allocate the slab page table");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* returns the id of a slab page. */
+static uint32_t slab_page_id(const void *slab) {
+    const uintptr_t frame = (uintptr_t) slab >> SLAB_PAGE_SHIFT;
+
+    return slab_page_map[frame >> SLAB_PAGE_LEAF_SHIFT][frame & ((1 << SLAB_PAGE_LEAF_SHIFT) - 1)];
+}
+#endif /* #if defined(SLAB_PAGE_REFS) */
+
+/* returns a new slab page for chunks of size bytes, or NULL. */
+static void *slab_page_alloc(const unsigned int size) {
+#if defined(SLAB_PAGE_REFS)
+    char *map, *page;
+    uintptr_t frame;
+    uint32_t id, **leaf;
+
+    if (slab_page_free_id != 0) {
+        id = slab_page_free_id;
+    } else if (slab_page_next_id < slab_page_ids) {
+        id = slab_page_next_id;
+    } else {
+        return NULL;
+    }
+
+    /* map twice the page size and keep the highest aligned page in it, which
+     * leaves the next page mapped the same way right below this one. */
+    map = mmap(NULL, 2 * POWER_BLOCK, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    page = (char *) (((uintptr_t) map + POWER_BLOCK) & ~(uintptr_t) (POWER_BLOCK - 1));
+    if (page > map) {
+        munmap(map, page - map);
+    }
+    if (page + POWER_BLOCK < map + 2 * POWER_BLOCK) {
+        munmap(page + POWER_BLOCK, map + POWER_BLOCK - page);
+    }
+
+    frame = (uintptr_t) page >> SLAB_PAGE_SHIFT;
+    leaf = &slab_page_map[frame >> SLAB_PAGE_LEAF_SHIFT];
+    if ((frame >> SLAB_PAGE_LEAF_SHIFT) >= SLAB_PAGE_MAP_SIZE ||
+        (*leaf == NULL &&
+         (*leaf = calloc(1 << SLAB_PAGE_LEAF_SHIFT, sizeof(uint32_t))) == NULL)) {
+        munmap(page, POWER_BLOCK);
+        return NULL;
+    }
+
+    if (id == slab_page_free_id) {
+        slab_page_free_id = slab_pages[id].size;
+    } else {
+        slab_page_next_id++;
+    }
+    slab_pages[id].base = page;
+    slab_pages[id].size = size;
+    (*leaf)[frame & ((1 << SLAB_PAGE_LEAF_SHIFT) - 1)] = id;
+    return page;
+#else
+    (void) size;
+    return malloc(POWER_BLOCK);
+#endif /* #if defined(SLAB_PAGE_REFS) */
+}
+
+static void slab_page_free(void *slab) {
+#if defined(SLAB_PAGE_REFS)
+    const uintptr_t frame = (uintptr_t) slab >> SLAB_PAGE_SHIFT;
+    const uint32_t id = slab_page_id(slab);
+
+    slab_page_map[frame >> SLAB_PAGE_LEAF_SHIFT][frame & ((1 << SLAB_PAGE_LEAF_SHIFT) - 1)] = 0;
+    slab_pages[id].base = NULL;
+    slab_pages[id].size = slab_page_free_id;
+    slab_page_free_id = id;
+    munmap(slab, POWER_BLOCK);
+#else
+    free(slab);
+#endif /* #if defined(SLAB_PAGE_REFS) */
+}
+
 /**
  * Determines the chunk sizes and initializes the slab class descriptors
  * accordingly.
@@ -142,6 +287,9 @@ void slabs_init(const size_t limit, const double factor) {
     power_largest = i;
     slabclass[power_largest].size = POWER_BLOCK;
     slabclass[power_largest].perslab = 1;
+#if defined(SLAB_PAGE_REFS)
+    slab_refs_init(limit);
+#endif /* #if defined(SLAB_PAGE_REFS) */
 
     /* for the test suite:  faking of how much we've already malloc'd */
     {
@@ -189,10 +337,21 @@ static int grow_slab_list (const unsigned int id) {
     slabclass_t *p = &slabclass[id];
     if (p->slabs == p->list_size) {
         size_t new_size =  (p->list_size != 0) ? p->list_size * 2 : 16;
-        void *new_list = realloc(p->slab_list, new_size * sizeof(void *));
+        void *new_list, *new_state, *new_free_since;
+
+        new_list = realloc(p->slab_list, new_size * sizeof(void *));
         if (new_list == 0) return 0;
-        p->list_size = new_size;
         p->slab_list = new_list;
+
+        new_state = realloc(p->page_state, new_size * sizeof(unsigned char));
+        if (new_state == 0) return 0;
+        p->page_state = new_state;
+
+        new_free_since = realloc(p->page_free_since, new_size * sizeof(rel_time_t));
+        if (new_free_since == 0) return 0;
+        p->page_free_since = new_free_since;
+
+        p->list_size = new_size;
     }
     return 1;
 }
@@ -210,13 +369,14 @@ static int do_slabs_newslab(const unsigned int id) {
 
     if (grow_slab_list(id) == 0) return 0;
 
-    ptr = malloc((size_t)len);
+    ptr = slab_page_alloc(p->size);
     if (ptr == 0) return 0;
 
     memset(ptr, 0, (size_t)len);
     p->end_page_ptr = ptr;
     p->end_page_free = p->perslab;
 
+    p->page_state[p->slabs] = SLAB_PAGE_IN_USE;
     p->slab_list[p->slabs++] = ptr;
     STATS_LOCK(stats);
     stats->item_storage_allocated += len;
@@ -366,10 +526,8 @@ char* do_slabs_stats(int *buflen) {
    0 = fail
    -1 = tried. busy. send again shortly. */
 int do_slabs_reassign(unsigned char srcid, unsigned char dstid) {
-    void *slab, *slab_end;
+    void *slab;
     slabclass_t *p, *dp;
-    void *iter;
-    int fi;
 
     if (srcid < POWER_SMALLEST || srcid > power_largest ||
         dstid < POWER_SMALLEST || dstid > power_largest ||
@@ -388,15 +546,47 @@ int do_slabs_reassign(unsigned char srcid, unsigned char dstid) {
         return 0;
 
     slab = p->slab_list[0];
-    slab_end = (char*)slab + POWER_BLOCK - p->size; // inclusive!
+
+    if (! slab_evict(p, slab)) {
+        /* we have picked a busy slab, maybe our decision wasn't right */
+        p->rebalance_wait = 20;
+        return -1;
+    }
+
+    /* if good, now move it to the dst slab class.  the memset below faults a
+     * released slab back in. */
+    slab_list_remove(p, 0);
+    p->rebalanced_from++;
+    dp->page_state[dp->slabs] = SLAB_PAGE_IN_USE;
+    dp->slab_list[dp->slabs++] = slab;
+    dp->end_page_ptr = slab;
+    dp->end_page_free = dp->perslab;
+    dp->rebalanced_to++;
+#if defined(SLAB_PAGE_REFS)
+    slab_pages[slab_page_id(slab)].size = dp->size;
+#endif /* #if defined(SLAB_PAGE_REFS) */
+
+    /* clearing out entire slab */
+    memset(slab, 0, POWER_BLOCK);
+    TRACE_SLABS_REASSIGN(srcid, dstid);
+    return 1;
+}
+
+/*
+ * Unlinks every item stored in a slab and takes its chunks off the free list,
+ * so that the slab can be handed to another class or freed.  Returns false,
+ * and leaves the slab alone, if any of its items is in use.
+ */
+static bool slab_evict(slabclass_t *p, void *slab) {
+    void *slab_end = (char*)slab + POWER_BLOCK - p->size; // inclusive!
+    void *iter;
+    int fi;
 
     /* if there are any items that are in the middle of something, abort */
     for (iter = slab; iter <= slab_end; iter += p->size) {
         item *it = (item *)iter;
         if (it->slabs_clsid && it->refcount) {
-            /* we have picked a busy slab, maybe our decision wasn't right */
-            p->rebalance_wait = 20;
-            return -1;
+            return false;
         }
     }
 
@@ -416,20 +606,230 @@ int do_slabs_reassign(unsigned char srcid, unsigned char dstid) {
         }
     }
 
-    /* if good, now move it to the dst slab class */
-    for (fi = 0; fi < p->slabs - 1; fi++) {
+    /* stop carving new items out of the slab. */
+    if (p->end_page_ptr >= slab && p->end_page_ptr <= slab_end) {
+        p->end_page_ptr = 0;
+        p->end_page_free = 0;
+    }
+
+    return true;
+}
+
+/* removes an evicted slab from its class's slab list. */
+static void slab_list_remove(slabclass_t *p, const unsigned int page) {
+    stats_t *stats = STATS_GET_TLS();
+    unsigned int fi;
+
+    if (p->page_state[page] == SLAB_PAGE_RELEASED) {
+        STATS_LOCK(stats);
+        stats->item_storage_released -= slab_release_size(p->slab_list[page]);
+        STATS_UNLOCK(stats);
+    }
+
+    for (fi = page; fi < p->slabs - 1; fi++) {
         p->slab_list[fi] = p->slab_list[fi + 1];
+        p->page_state[fi] = p->page_state[fi + 1];
+        p->page_free_since[fi] = p->page_free_since[fi + 1];
     }
     p->slabs--;
-    p->rebalanced_from++;
-    dp->slab_list[dp->slabs++] = slab;
-    dp->end_page_ptr = slab;
-    dp->end_page_free = dp->perslab;
-    dp->rebalanced_to++;
+}
 
-    /* clearing out entire slab */
-    memset(slab, 0, POWER_BLOCK);
-    return 1;
+bool do_slabs_set_limit(const size_t limit) {
+#if defined(SLAB_PAGE_REFS)
+    if (limit > slab_refs_max_bytes()) {
+        return false;
+    }
+#endif /* #if defined(SLAB_PAGE_REFS) */
+    mem_limit = limit;
+    return true;
+}
+
+void do_slabs_free_shortfall(const unsigned int percent, unsigned int *shortfall,
+                             const unsigned int nclasses) {
+    unsigned int id;
+    stats_t accum;
+
+    memset(shortfall, 0, nclasses * sizeof(*shortfall));
+
+#ifdef USE_SYSTEM_MALLOC
+    (void)accum;
+    return;
+#else
+    /* no class is short while do_slabs_newslab would give it another page. */
+    STATS_AGGREGATE(&accum);
+    if (mem_limit == 0 || accum.item_storage_allocated + POWER_BLOCK <= mem_limit)
+        return;
+
+    for (id = POWER_SMALLEST; id <= power_largest && id < nclasses; id++) {
+        slabclass_t *p = &slabclass[id];
+        uint64_t free_chunks = p->sl_curr + (p->end_page_ptr != 0 ? p->end_page_free : 0);
+        uint64_t wanted = ((uint64_t) p->slabs * p->perslab * percent + 99) / 100;
+
+        if (free_chunks < wanted)
+            shortfall[id] = (unsigned int) (wanted - free_chunks);
+    }
+#endif
+}
+
+/*
+ * Frees a few slab pages while more memory is allocated than the limit allows,
+ * which happens after the limit is lowered at runtime.  Pages are taken from
+ * the class holding the most of them, newest page first, and the items in
+ * them are evicted.  Every class keeps at least one page.
+ *
+ * The cache lock must be held, since the items are unlinked.
+ */
+void do_slabs_shrink(void) {
+    stats_t *stats = STATS_GET_TLS();
+    int freed, examined;
+
+    for (freed = 0, examined = 0;
+         freed < SLABS_SHRINK_PAGES_PER_PASS && examined < SLABS_SHRINK_PAGES_PER_PASS * 2;
+         examined++) {
+        slabclass_t *p = NULL;
+        unsigned int i, page;
+        stats_t accum;
+        void *slab;
+
+        STATS_AGGREGATE(&accum);
+        if (mem_limit == 0 || accum.item_storage_allocated <= mem_limit) {
+            return;
+        }
+
+        for (i = POWER_SMALLEST; i <= power_largest; i++) {
+            if (slabclass[i].slabs > 1 &&
+                (p == NULL || slabclass[i].slabs > p->slabs)) {
+                p = &slabclass[i];
+            }
+        }
+        if (p == NULL) {
+            return;
+        }
+
+        /* try the newest page first; fall back to older ones if it's busy. */
+        page = p->slabs - 1 - (examined % p->slabs);
+        slab = p->slab_list[page];
+        if (! slab_evict(p, slab)) {
+            continue;
+        }
+
+        slab_list_remove(p, page);
+        slab_page_free(slab);
+        freed++;
+
+        STATS_LOCK(stats);
+        stats->item_storage_allocated -= POWER_BLOCK;
+        STATS_UNLOCK(stats);
+    }
+}
+
+/*
+ * Returns the page-aligned part of a slab, which is what madvise can give back
+ * to the OS.
+ */
+static char *slab_release_start(void *slab, size_t *len) {
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    intptr_t start = (intptr_t) slab, end = start + POWER_BLOCK;
+
+    start = ((start + page_size - 1) / page_size) * page_size;
+    end = (end / page_size) * page_size;
+    *len = (end > start) ? end - start : 0;
+
+    return (char *) start;
+}
+
+static size_t slab_release_size(void *slab) {
+    size_t len;
+
+    slab_release_start(slab, &len);
+    return len;
+}
+
+/* returns true if no chunk in the slab holds an item. */
+static bool slab_is_free(const slabclass_t *p, void *slab) {
+    char *iter = slab;
+    unsigned int i;
+
+    for (i = 0; i < p->perslab; i++, iter += p->size) {
+        if (((item *)iter)->slabs_clsid != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Looks at a few slab pages, and returns the ones that have held no items for
+ * at least idle seconds to the OS with madvise(MADV_DONTNEED).  A released
+ * page stays on its class's slab list and free list; it is faulted back in,
+ * zero-filled, when an item is next stored in it.  Free chunks carry
+ * slabs_clsid == 0, so the zero-filled page still reads as free.
+ *
+ * The cache lock must be held, since items are marked in use by do_item_alloc
+ * under that lock.
+ */
+void do_slabs_release_memory(const rel_time_t idle) {
+    static unsigned int clsid = POWER_SMALLEST;
+    static unsigned int page = 0;
+    stats_t *stats = STATS_GET_TLS();
+    rel_time_t now = current_time;
+    int examined;
+
+    for (examined = 0; examined < SLABS_RELEASE_PAGES_PER_PASS; examined++, page++) {
+        slabclass_t *p;
+        void *slab;
+        int tries = 0;
+
+        /* advance to the next slab that exists. */
+        while (clsid > power_largest || page >= slabclass[clsid].slabs) {
+            page = 0;
+            if (++clsid > power_largest) {
+                clsid = POWER_SMALLEST;
+            }
+            if (++tries > power_largest) {
+                return;
+            }
+        }
+
+        p = &slabclass[clsid];
+        slab = p->slab_list[page];
+
+        if (! slab_is_free(p, slab)) {
+            if (p->page_state[page] == SLAB_PAGE_RELEASED) {
+                /* storing the item faulted the page back in. */
+                STATS_LOCK(stats);
+                stats->item_storage_released -= slab_release_size(slab);
+                STATS_UNLOCK(stats);
+            }
+            p->page_state[page] = SLAB_PAGE_IN_USE;
+            continue;
+        }
+
+        switch (p->page_state[page]) {
+            case SLAB_PAGE_IN_USE:
+                p->page_state[page] = SLAB_PAGE_FREE;
+                p->page_free_since[page] = now;
+                break;
+
+            case SLAB_PAGE_FREE:
+                if (now - p->page_free_since[page] >= idle) {
+                    size_t len;
+                    char *start = slab_release_start(slab, &len);
+
+                    if (len != 0 && madvise(start, len, MADV_DONTNEED) == 0) {
+                        p->page_state[page] = SLAB_PAGE_RELEASED;
+                        STATS_LOCK(stats);
+                        stats->item_storage_released += len;
+                        STATS_UNLOCK(stats);
+                    }
+                }
+                break;
+
+            case SLAB_PAGE_RELEASED:
+                break;
+        }
+    }
 }
 
 void slabs_add_hit(void *it, int unique) {
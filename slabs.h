@@ -25,6 +25,22 @@ void *do_slabs_alloc(const size_t size);
 /** Free previously allocated object */
 void do_slabs_free(void *ptr, size_t size);
 
+/** Return slab pages that have been free for idle seconds to the OS */
+void do_slabs_release_memory(const rel_time_t idle);
+
+/** Change the limit on the no. of bytes to allocate, 0 if no limit.  Returns
+    false if item references can't reach that much memory */
+bool do_slabs_set_limit(const size_t limit);
+
+/** Free some slab pages if more bytes are allocated than the limit */
+void do_slabs_shrink(void);
+
+/** Set shortfall[id] to how many chunks class id must free to have percent%
+    of its chunks free, for each of the first nclasses classes; 0 for a class
+    that has enough, and for all of them while memory isn't at the limit */
+void do_slabs_free_shortfall(const unsigned int percent, unsigned int *shortfall,
+                             const unsigned int nclasses);
+
 /** Fill buffer with stats */ /*@null@*/
 char* do_slabs_stats(int *buflen);
 
@@ -24,6 +24,7 @@
 #include "stats.h"
 #include "conn_buffer.h"
 #include "slabs_items_support.h"
+#include "trace.h"
 
 /* Forward Declarations */
 static void item_link_q(item *it);
@@ -124,10 +125,110 @@ void do_try_item_stamp(item* it, const rel_time_t now, const struct in_addr addr
 }
 
 
-/*@null@*/
-item *do_item_alloc(const char *key, const size_t nkey, const int flags, const rel_time_t exptime,
-                    const size_t nbytes, const struct in_addr addr) {
+/*
+ * picks the item to evict from slab class `id' among the LRU_SEARCH_DEPTH
+ * items nearest the tail of its LRU, skipping referenced items.  the lru
+ * policy takes the oldest.  the gdsf policy takes an expired item if there is
+ * one, and the item with the fewest recent hits per byte otherwise.  returns
+ * NULL if every item checked is referenced.
+ */
+static item *item_evict_candidate(const unsigned int id) {
+    rel_time_t now = current_time;
+    item *search, *best = NULL;
+    int tries;
+
+    for (search = tails[id], tries = LRU_SEARCH_DEPTH;
+         tries > 0 && search != NULL;
+         tries--, search = ITEM_prev(search)) {
+        if (search->refcount != 0) {
+            continue;
+        }
+        if (settings.evict_policy == EVICT_LRU ||
+            (search->exptime != 0 && search->exptime <= now)) {
+            return search;
+        }
+        if (best == NULL || item_gdsf_cheaper(search, best, now)) {
+            best = search;
+        }
+    }
+
+    return best;
+}
+
+
+/*
+ * unlinks the item item_evict_candidate picks from slab class `id', counting
+ * it as an eviction unless it has expired.  returns false if every item it
+ * checked is referenced.
+ */
+static bool item_evict_one(const unsigned int id) {
+    stats_t *stats = STATS_GET_TLS();
+    item *search = item_evict_candidate(id);
+
+    if (search == NULL) {
+        return false;
+    }
+
+    if (search->exptime == 0 || search->exptime > current_time) {
+        STATS_LOCK(stats);
+        stats->evictions++;
+        stats->evicted_bytes += search->nkey + search->nbytes;
+        STATS_UNLOCK(stats);
+
+        slabs_add_eviction(id);
+        do_item_unlink(search, UNLINK_IS_EVICT, NULL);
+    } else {
+        do_item_unlink(search, UNLINK_IS_EXPIRED, NULL);
+    }
+    return true;
+}
+
+
+/*
+ * evicts ahead of demand from the slab classes that have run low on free
+ * chunks and can't get another slab.
+ */
+bool do_item_reclaim(void) {
     stats_t *stats = STATS_GET_TLS();
+    unsigned int shortfall[LARGEST_ID];
+    unsigned int id, reclaimed = 0;
+    bool short_of_free = false;
+
+    if (settings.reclaim_percent == 0 || settings.evict_to_free == 0) {
+        return false;
+    }
+
+    /* each eviction frees one chunk of its class, so the shortfall is
+     * worked out once for the batch. */
+    slabs_free_shortfall(settings.reclaim_percent, shortfall, LARGEST_ID);
+    for (id = 0; id < LARGEST_ID; id++) {
+        if (tails[id] == NULL) {
+            continue;
+        }
+        for (; shortfall[id] > 0; shortfall[id]--) {
+            if (reclaimed == ITEM_RECLAIM_BATCH) {
+                short_of_free = true;
+                break;
+            }
+            if (! item_evict_one(id)) {
+                break;
+            }
+            reclaimed++;
+        }
+    }
+
+    STATS_LOCK(stats);
+    stats->reclaimed_items += reclaimed;
+    STATS_UNLOCK(stats);
+
+    return short_of_free;
+}
+
+
+/*@null@*/
+static item *do_item_alloc_impl(const char *key, const size_t nkey, const int flags,
+                                const rel_time_t exptime, const size_t nbytes,
+                                const struct in_addr addr) {
     item *it;
     size_t ntotal = stritem_length + nkey + nbytes;
     rel_time_t now = current_time;
@@ -148,9 +249,6 @@ item *do_item_alloc(const char *key, const size_t nkey, const int flags, const r
     }
 
     if (it == 0) {
-        int tries = 50;
-        item *search;
-
         /* If requested to not push old items out of cache when memory runs out,
          * we're out of luck at this point...
          */
@@ -167,21 +265,10 @@ item *do_item_alloc(const char *key, const size_t nkey, const int flags, const r
         if (id > LARGEST_ID) return NULL;
         if (tails[id] == 0) return NULL;
 
-        for (search = tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-            if (search->refcount == 0) {
-                if (search->exptime == 0 || search->exptime > now) {
-                    STATS_LOCK(stats);
-                    stats->evictions++;
-                    STATS_UNLOCK(stats);
-
-                    slabs_add_eviction(id);
-                    do_item_unlink(search, UNLINK_IS_EVICT, key);
-                } else {
-                    do_item_unlink(search, UNLINK_IS_EXPIRED, key);
-                }
-                break;
-            }
-        }
+        /* the reserve ran out; have the reclaimer top it up. */
+        thread_wake_reclaimer();
+
+        item_evict_one(id);
         it = slabs_alloc(ntotal);
         if (it == 0) return NULL;
     }
@@ -192,11 +279,13 @@ item *do_item_alloc(const char *key, const size_t nkey, const int flags, const r
 
     assert(it != heads[it->slabs_clsid]);
 
-    it->next = it->prev = it->h_next = 0;
+    it->next = it->prev = it->h_next = NULL_ITEM_PTR;
     it->refcount = 1;     /* the caller will have a reference */
     DEBUG_REFCNT(it, '*');
     it->it_flags = 0;
     it->nkey = nkey;
+    it->hits = 0;
+    it->atime_rel = 0;
     it->nbytes = nbytes;
     memcpy(ITEM_key(it), key, nkey);
     it->exptime = exptime;
@@ -207,6 +296,21 @@ item *do_item_alloc(const char *key, const size_t nkey, const int flags, const r
     return it;
 }
 
+/*@null@*/
+item *do_item_alloc(const char *key, const size_t nkey, const int flags, const rel_time_t exptime,
+                    const size_t nbytes, const struct in_addr addr) {
+#if TRACE_ENABLED
+    stats_t *stats = STATS_GET_TLS();
+    const uint64_t evictions = stats->evictions;
+    item *it = do_item_alloc_impl(key, nkey, flags, exptime, nbytes, addr);
+
+    TRACE_ITEM_ALLOC(key, nkey, nbytes, it != NULL, stats->evictions - evictions);
+    return it;
+#else
+    return do_item_alloc_impl(key, nkey, flags, exptime, nbytes, addr);
+#endif /* #if TRACE_ENABLED */
+}
+
 static void item_free(item *it, bool to_freelist) {
     size_t ntotal = ITEM_ntotal(it);
     assert((it->it_flags & ITEM_LINKED) == 0);
@@ -255,9 +359,9 @@ static void item_link_q(item *it) { /* item is the new head */
     tail = &tails[it->slabs_clsid];
     assert(it != *head);
     assert((*head && *tail) || (*head == 0 && *tail == 0));
-    it->prev = 0;
-    it->next = *head;
-    if (it->next) it->next->prev = it;
+    ITEM_set_prev(it, NULL);
+    ITEM_set_next(it, *head);
+    if (*head) ITEM_set_prev(*head, it);
     *head = it;
     if (*tail == 0) *tail = it;
     sizes[it->slabs_clsid]++;
@@ -271,31 +375,86 @@ static void item_unlink_q(item *it) {
     tail = &tails[it->slabs_clsid];
 
     if (*head == it) {
-        assert(it->prev == 0);
-        *head = it->next;
+        assert(ITEM_prev(it) == NULL);
+        *head = ITEM_next(it);
     }
     if (*tail == it) {
-        assert(it->next == 0);
-        *tail = it->prev;
+        assert(ITEM_next(it) == NULL);
+        *tail = ITEM_prev(it);
     }
-    assert(it->next != it);
-    assert(it->prev != it);
+    assert(ITEM_next(it) != it);
+    assert(ITEM_prev(it) != it);
 
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
+    if (ITEM_next(it)) ITEM_next(it)->prev = it->prev;
+    if (ITEM_prev(it)) ITEM_prev(it)->next = it->next;
     sizes[it->slabs_clsid]--;
     return;
 }
 
-int do_item_link(item *it, const char* key) {
+/*
+ * evicts the oldest unreferenced items that share the prefix of the item `it'
+ * until the prefix is back under its quota.  the search is limited to
+ * PREFIX_QUOTA_SEARCH_DEPTH items from the tail of each LRU.
+ */
+static void item_evict_over_quota(item *it) {
     stats_t *stats = STATS_GET_TLS();
+    const char *key = ITEM_key(it);
+    const size_t nprefix = stats_prefix_length(key, it->nkey);
+    rel_time_t now = current_time;
+    int i;
+
+    for (i = 0; i < LARGEST_ID; i++) {
+        int tries = PREFIX_QUOTA_SEARCH_DEPTH;
+        item *search, *prev;
+
+        for (search = tails[i]; tries > 0 && search != NULL; tries--, search = prev) {
+            prev = ITEM_prev(search);
+            if (search->refcount != 0 ||
+                search->nkey <= nprefix ||
+                memcmp(ITEM_key(search), key, nprefix + 1) != 0) {
+                continue;
+            }
+
+            if (search->exptime == 0 || search->exptime > now) {
+                STATS_LOCK(stats);
+                stats->evictions++;
+                stats->evicted_bytes += search->nkey + search->nbytes;
+                STATS_UNLOCK(stats);
+
+                slabs_add_eviction(i);
+                do_item_unlink(search, UNLINK_IS_EVICT, NULL);
+            } else {
+                do_item_unlink(search, UNLINK_IS_EXPIRED, NULL);
+            }
+
+            if (! stats_prefix_quota_evicted(key, it->nkey)) {
+                return;
+            }
+        }
+    }
+}
+
+int do_item_link(item *it, const char* key, const uint32_t hv) {
+    return do_item_link_slot(it, key, hv, assoc_find_slot(key, it->nkey, hv));
+}
+
+int do_item_link_slot(item *it, const char* key, const uint32_t hv, item_ptr_t* slot) {
+    stats_t *stats = STATS_GET_TLS();
+    item *old_it;
 
     assert((it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) == 0);
     assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
     it->it_flags |= ITEM_LINKED;
     it->it_flags &= ~ITEM_VISITED;
     it->time = current_time;
-    assoc_insert(it, key);
+    it->atime_rel = 0;
+    old_it = assoc_link_slot(slot, it);
+    if (old_it != NULL) {
+        do_item_unlink(old_it, UNLINK_NORMAL | UNLINK_REPLACED, key);
+    } else {
+        /* stores don't promote victims, so an older value may be there. */
+        do_victim_delete(key, it->nkey, hv);
+    }
 
     STATS_LOCK(stats);
     stats->item_total_size += it->nkey + it->nbytes; /* cr-lf shouldn't count */
@@ -305,6 +464,10 @@ int do_item_link(item *it, const char* key) {
 
     item_link_q(it);
 
+    if (stats_prefix_quota_charge(ITEM_key(it), it->nkey, it->nkey + it->nbytes)) {
+        item_evict_over_quota(it);
+    }
+
     return 1;
 }
 
@@ -324,12 +487,24 @@ void do_item_unlink_impl(item *it, long flags, bool to_freelist) {
         if (settings.detail_enabled) {
             stats_prefix_record_removal(ITEM_key(it), ITEM_nkey(it), it->nkey + it->nbytes, it->time, flags);
         }
+        stats_prefix_quota_uncharge(ITEM_key(it), it->nkey, it->nkey + it->nbytes);
         if (flags & UNLINK_IS_EVICT) {
             stats_evict(it->nkey + it->nbytes);
+            STATS_LOCK(stats);
+            if (it->hits == 0) {
+                stats->evicted_unfetched++;
+            }
+            stats->evicted_hits += it->hits;
+            STATS_UNLOCK(stats);
+            if ((it->it_flags & ITEM_DELETED) == 0) {
+                do_victim_insert(it, ITEM_key(it));
+            }
         } else if (flags & UNLINK_IS_EXPIRED) {
             stats_expire(it->nkey + it->nbytes);
         }
-        assoc_delete(ITEM_key(it), it->nkey);
+        if ((flags & UNLINK_REPLACED) == 0) {
+            assoc_delete(ITEM_key(it), it->nkey);
+        }
         item_unlink_q(it);
         if (it->refcount == 0) {
             item_free(it, to_freelist);
@@ -359,13 +534,9 @@ void do_item_update(item *it) {
             item_link_q(it);
         }
     }
-}
-
-int do_item_replace(item *it, item *new_it, const char* key) {
-    assert((it->it_flags & ITEM_SLABBED) == 0);
-
-    do_item_unlink(it, UNLINK_NORMAL, key);
-    return do_item_link(new_it, key);
+    /* after the move, so that the access time is relative to the new LRU
+     * time. */
+    item_count_hit(it, current_time);
 }
 
 /*@null@*/
@@ -389,13 +560,15 @@ char *do_item_cachedump(const unsigned int slabs_clsid, const unsigned int limit
     while (it != NULL && (limit == 0 || shown < limit)) {
         memcpy(key_tmp, ITEM_key(it), it->nkey);
         key_tmp[it->nkey] = 0;          /* null terminate */
-        len = snprintf(temp, sizeof(temp), "ITEM %s [%d b; %lu s]\r\n", key_tmp, it->nbytes, it->time + started);
+        len = snprintf(temp, sizeof(temp), "ITEM %s [%d b; %lu s; %u hits; last access %lu s]\r\n",
+                       key_tmp, it->nbytes, it->time + started, it->hits,
+                       item_last_access(it) + started);
         if (bufcurr + len + 6 > memlimit)  /* 6 is END\r\n\0 */
             break;
         strcpy(buffer + bufcurr, temp);
         bufcurr += len;
         shown++;
-        it = it->next;
+        it = ITEM_next(it);
     }
 
     memcpy(buffer + bufcurr, "END\r\n", 6);
@@ -438,48 +611,6 @@ char *do_item_stats(int *bytes) {
     return buffer;
 }
 
-/** dumps out a list of objects of each size, with granularity of 32 bytes */
-/*@null@*/
-char* do_item_stats_sizes(int *bytes) {
-    const int num_buckets = 32768;   /* max 1MB object, divided into 32 bytes size buckets */
-    unsigned int *histogram = (unsigned int *)malloc((size_t)num_buckets * sizeof(int));
-    size_t bufsize = (2 * 1024 * 1024), offset = 0;
-    char *buf = (char *)malloc(bufsize); /* 2MB max response size */
-    char terminator[] = "END\r\n";
-    int i;
-
-    if (histogram == 0 || buf == 0) {
-        if (histogram) free(histogram);
-        if (buf) free(buf);
-        return NULL;
-    }
-
-    /* build the histogram */
-    memset(histogram, 0, (size_t)num_buckets * sizeof(int));
-    for (i = 0; i < LARGEST_ID; i++) {
-        item *iter = heads[i];
-        while (iter) {
-            int ntotal = ITEM_ntotal(iter);
-            int bucket = ntotal / 32;
-            if ((ntotal % 32) != 0) bucket++;
-            if (bucket < num_buckets) histogram[bucket]++;
-            iter = iter->next;
-        }
-    }
-
-    /* write the buffer */
-    *bytes = 0;
-    for (i = 0; i < num_buckets; i++) {
-        if (histogram[i] != 0) {
-            offset = append_to_buffer(buf, bufsize, offset, sizeof(terminator), "%d %u\r\n", i * 32, histogram[i]);
-        }
-    }
-    offset = append_to_buffer(buf, bufsize, offset, 0, terminator);
-    *bytes = (int) offset;
-    free(histogram);
-    return buf;
-}
-
 /** returns true if a deleted item's delete-locked-time is over, and it
     should be removed from the namespace */
 bool item_delete_lock_over (item *it) {
@@ -488,9 +619,16 @@ bool item_delete_lock_over (item *it) {
 }
 
 /** wrapper around assoc_find which does the lazy expiration/deletion logic */
-item *do_item_get_notedeleted(const char *key, const size_t nkey, bool *delete_locked) {
-    item *it = assoc_find(key, nkey);
+static item *do_item_get_impl(const char *key, const size_t nkey, const uint32_t hv,
+                              bool *delete_locked, const bool promote, item_ptr_t** slot) {
+    item_ptr_t* pos = assoc_find_slot(key, nkey, hv);
+    item *it = *pos ? ITEM(*pos) : NULL;
+    if (slot) *slot = pos;
     if (delete_locked) *delete_locked = false;
+    if (it == NULL && promote) {
+        /* it may have been evicted recently. */
+        return do_victim_promote(key, nkey, hv);
+    }
     if (it != NULL && (it->it_flags & ITEM_DELETED)) {
         /* it's flagged as delete-locked.  let's see if that condition
            is past due, and the 5-second delete_timer just hasn't
@@ -504,10 +642,12 @@ item *do_item_get_notedeleted(const char *key, const size_t nkey, bool *delete_l
         it->time <= settings.oldest_live) {
         do_item_unlink(it, UNLINK_IS_EXPIRED, key); /* MTSAFE - cache_lock held */
         it = NULL;
+        if (slot) *slot = assoc_find_slot(key, nkey, hv);   /* the chain changed */
     }
     if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
         do_item_unlink(it, UNLINK_IS_EXPIRED, key); /* MTSAFE - cache_lock held */
         it = NULL;
+        if (slot) *slot = assoc_find_slot(key, nkey, hv);   /* the chain changed */
     }
 
     if (it != NULL) {
@@ -517,6 +657,29 @@ item *do_item_get_notedeleted(const char *key, const size_t nkey, bool *delete_l
             it = NULL;
         }
     }
+
+    return it;
+}
+
+item *do_item_get_notedeleted(const char *key, const size_t nkey, const uint32_t hv,
+                              bool *delete_locked) {
+    return do_item_get_impl(key, nkey, hv, delete_locked, false, NULL);
+}
+
+item *do_item_get_slot(const char *key, const size_t nkey, const uint32_t hv,
+                       bool *delete_locked, item_ptr_t** slot) {
+    return do_item_get_impl(key, nkey, hv, delete_locked, false, slot);
+}
+
+item *do_item_get_promote(const char *key, const size_t nkey, const uint32_t hv) {
+    /* only the gets are traced; the stores' lookups aren't. */
+    item *it = do_item_get_impl(key, nkey, hv, NULL, true, NULL);
+
+    if (it != NULL) {
+        TRACE_ITEM_GET_HIT(key, nkey, it->nbytes);
+    } else {
+        TRACE_ITEM_GET_MISS(key, nkey);
+    }
     return it;
 }
 
@@ -525,8 +688,8 @@ item *item_get(const char *key, const size_t nkey) {
 }
 
 /** returns an item whether or not it's delete-locked or expired. */
-item *do_item_get_nocheck(const char *key, const size_t nkey) {
-    item *it = assoc_find(key, nkey);
+item *do_item_get_nocheck(const char *key, const size_t nkey, const uint32_t hv) {
+    item *it = assoc_find(key, nkey, hv);
     if (it) {
         if (BUMP(it->refcount)) {
             DEBUG_REFCNT(it, '+');
@@ -552,7 +715,7 @@ void do_item_flush_expired(void) {
          */
         for (iter = heads[i]; iter != NULL; iter = next) {
             if (iter->time >= settings.oldest_live) {
-                next = iter->next;
+                next = ITEM_next(iter);
                 if ((iter->it_flags & ITEM_SLABBED) == 0) {
                     do_item_unlink(iter, UNLINK_IS_EXPIRED, NULL);
                 }
@@ -562,6 +725,24 @@ void do_item_flush_expired(void) {
             }
         }
     }
+    do_victim_flush_expired();
+}
+
+
+void do_item_release_memory(void) {
+    slabs_shrink();
+    if (settings.mem_release_idle != 0) {
+        slabs_release_memory(settings.mem_release_idle);
+    }
+}
+
+
+bool do_item_set_maxbytes(const size_t maxbytes) {
+    if (! slabs_set_limit(maxbytes)) {
+        return false;
+    }
+    settings.maxbytes = maxbytes;
+    return true;
 }
 
 
@@ -8,7 +8,40 @@
 /* forward declare some data types. */
 
 typedef struct _stritem item;
-typedef item* item_ptr_t;
+
+/*
+ * items refer to each other, in the hash table and the LRU lists, with 32-bit
+ * references rather than pointers.  on 64-bit builds a reference is the id of
+ * the item's slab page, in the high bits, and the index of its chunk in the
+ * page, in the low slab_chunk_bits bits; those are as few as the smallest
+ * chunk size allows, so that the default sizes leave 18 bits of page id, or
+ * 256GB of pages.  slab_pages maps a page id to the page, and slab_page_map
+ * maps a page, which is aligned to its size, back to its id.  on 32-bit
+ * builds a reference is just the pointer.  0 is the NULL reference; page id 0
+ * is never used.
+ */
+typedef uint32_t item_ptr_t;
+
+#if UINTPTR_MAX > 0xffffffffu
+#define SLAB_PAGE_REFS
+#define SLAB_PAGE_SHIFT      20     /* log2 of the slab page size */
+#define SLAB_PAGE_MAP_BITS   48     /* of the addresses slab pages may have */
+#define SLAB_PAGE_LEAF_SHIFT 14     /* log2 of the ids in a slab_page_map leaf */
+#define SLAB_PAGE_MAP_SIZE   (1 << (SLAB_PAGE_MAP_BITS - SLAB_PAGE_SHIFT - SLAB_PAGE_LEAF_SHIFT))
+
+#if defined(USE_SYSTEM_MALLOC)
+#error "items allocated with malloc can't be referred to by slab page"
+#endif /* #if defined(USE_SYSTEM_MALLOC) */
+
+typedef struct {
+    char*        base;      /* NULL if the id isn't in use */
+    unsigned int size;      /* of the page's chunks */
+} slab_page_t;
+
+extern slab_page_t*  slab_pages;
+extern unsigned int  slab_chunk_bits;
+extern uint32_t*     slab_page_map[SLAB_PAGE_MAP_SIZE];
+#endif /* #if UINTPTR_MAX > 0xffffffffu */
 
 #include "memcached.h"
 
@@ -21,10 +54,13 @@ typedef item* item_ptr_t;
 #define ITEM_HAS_IP_ADDRESS 0x10
 #define ITEM_HAS_TIMESTAMP  0x20
 
+#define LRU_SEARCH_DEPTH 50     /* number of items we'll check in the LRU to
+                                 * find an item to evict. */
+
 struct _stritem {
-    struct _stritem *next;
-    struct _stritem *prev;
-    struct _stritem *h_next;    /* hash chain next */
+    item_ptr_t      next;       /* LRU list */
+    item_ptr_t      prev;
+    item_ptr_t      h_next;     /* hash chain next */
     rel_time_t      time;       /* least recent access */
     rel_time_t      exptime;    /* expire time */
     int             nbytes;     /* size of data */
@@ -33,6 +69,8 @@ struct _stritem {
     uint8_t         it_flags;   /* ITEM_* above */
     uint8_t         slabs_clsid;/* which slab class we're in */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
+    uint8_t         hits;       /* accesses, saturating */
+    uint8_t         atime_rel;  /* last access, in seconds after time */
     char            end;
     /* then key */
     /* then data */
@@ -40,11 +78,26 @@ struct _stritem {
 
 #define stritem_length    ((intptr_t) &(((item*) 0)->end))
 
-#define NULL_ITEM_PTR     ((item_ptr_t) NULL)
-
-static inline item*          ITEM(item_ptr_t iptr)   { return (item*) iptr; }
-static inline item_ptr_t     ITEM_PTR(item* it)      { return (item_ptr_t) it; }
-static inline bool           ITEM_PTR_IS_NULL(item_ptr_t iptr)  { return (iptr != NULL); }
+#define NULL_ITEM_PTR     ((item_ptr_t) 0)
+
+#if defined(SLAB_PAGE_REFS)
+static inline item*          ITEM(item_ptr_t iptr)   {
+    const slab_page_t* page = &slab_pages[iptr >> slab_chunk_bits];
+
+    return (item*) (page->base + (size_t) (iptr & ((1u << slab_chunk_bits) - 1)) * page->size);
+}
+static inline item_ptr_t     ITEM_PTR(item* it)      {
+    const uintptr_t frame = (uintptr_t) it >> SLAB_PAGE_SHIFT;
+    const uint32_t id = slab_page_map[frame >> SLAB_PAGE_LEAF_SHIFT][frame & ((1 << SLAB_PAGE_LEAF_SHIFT) - 1)];
+
+    return (id << slab_chunk_bits) |
+        (item_ptr_t) (((uintptr_t) it & ((1 << SLAB_PAGE_SHIFT) - 1)) / slab_pages[id].size);
+}
+#else
+static inline item*          ITEM(item_ptr_t iptr)   { return (item*) (uintptr_t) iptr; }
+static inline item_ptr_t     ITEM_PTR(item* it)      { return (item_ptr_t) (uintptr_t) it; }
+#endif /* #if defined(SLAB_PAGE_REFS) */
+static inline bool           ITEM_PTR_IS_NULL(item_ptr_t iptr)  { return (iptr != NULL_ITEM_PTR); }
 static inline char*          ITEM_key(item* it)      { return &(it->end); }
 static inline const char*    ITEM_key_const(const item* it){ return &(it->end); }
 static inline uint8_t        ITEM_nkey(const item* it)     { return it->nkey; }
@@ -54,20 +107,31 @@ static inline unsigned int   ITEM_flags(const item* it)    { return it->flags; }
 static inline rel_time_t     ITEM_time(const item* it)     { return it->time; }
 static inline rel_time_t     ITEM_exptime(const item* it)  { return it->exptime; }
 static inline unsigned short ITEM_refcount(const item* it) { return it->refcount; }
+static inline uint8_t        ITEM_hits(const item* it)     { return it->hits; }
+static inline uint8_t        ITEM_atime_rel(const item* it){ return it->atime_rel; }
 
 
 static inline void ITEM_set_nbytes(item* it, int new_nbytes)     { it->nbytes = new_nbytes; }
 static inline void ITEM_set_exptime(item* it, rel_time_t t)      { it->exptime = t; }
+static inline void ITEM_set_hits(item* it, uint8_t hits)         { it->hits = hits; }
+static inline void ITEM_set_atime_rel(item* it, uint8_t rel)     { it->atime_rel = rel; }
 
 static inline item_ptr_t  ITEM_PTR_h_next(item_ptr_t iptr)       { return ITEM(iptr)->h_next; }
 static inline item_ptr_t* ITEM_h_next_p(item* it)                { return &it->h_next; }
 
 static inline void   ITEM_set_h_next(item* it, item_ptr_t next) { it->h_next = next; }
 
+/* LRU neighbours, as pointers; NULL at the ends of the list. */
+static inline item*  ITEM_next(const item* it) { return it->next == NULL_ITEM_PTR ? NULL : ITEM(it->next); }
+static inline item*  ITEM_prev(const item* it) { return it->prev == NULL_ITEM_PTR ? NULL : ITEM(it->prev); }
+static inline void   ITEM_set_next(item* it, item* next) { it->next = next == NULL ? NULL_ITEM_PTR : ITEM_PTR(next); }
+static inline void   ITEM_set_prev(item* it, item* prev) { it->prev = prev == NULL ? NULL_ITEM_PTR : ITEM_PTR(prev); }
+
 static inline bool ITEM_is_valid(const item* it)        { return !(it->it_flags & ITEM_SLABBED); }
 static inline bool ITEM_has_timestamp(const item* it)   { return (it->it_flags & ITEM_HAS_TIMESTAMP); }
 static inline bool ITEM_has_ip_address(const item* it)  { return (it->it_flags & ITEM_HAS_IP_ADDRESS); }
 
+static inline bool ITEM_is_deleted(const item* it) { return (it->it_flags & ITEM_DELETED); }
 static inline void ITEM_mark_deleted(item* it)    { it->it_flags |= ITEM_DELETED; }
 static inline void ITEM_unmark_deleted(item* it)  { it->it_flags &= ~ITEM_DELETED; }
 static inline void ITEM_set_has_timestamp(item* it)     { it->it_flags |= ITEM_HAS_TIMESTAMP; }
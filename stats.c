@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <arpa/inet.h>
 
 #include "assoc.h"
 #include "memcached.h"
@@ -41,6 +42,9 @@ struct _prefix_stats {
     uint64_t      num_bytes;
     uint64_t      bytes_txed;
     uint64_t      total_byte_seconds;
+    uint64_t      quota_bytes;          /* 0 means no quota. */
+    uint64_t      charged_bytes;        /* bytes charged against the quota. */
+    uint64_t      num_quota_evicts;
     PREFIX_STATS *next;
 };
 
@@ -51,6 +55,13 @@ static int num_prefixes = 0;
 static int total_prefix_size = 0;
 static PREFIX_STATS wildcard;
 
+/*
+ * Number of prefixes with a quota set.  It is changed under the global stats
+ * lock but read with a relaxed atomic load on the link/unlink paths, so that
+ * quota accounting costs nothing when no quotas are configured.
+ */
+static int num_prefix_quotas = 0;
+
 #if defined(STATS_BUCKETS)
 SIZE_BUCKETS set;
 SIZE_BUCKETS hit;
@@ -96,51 +107,64 @@ void stats_prefix_clear() {
     int i;
 
     GLOBAL_STATS_LOCK();
+    num_prefixes = 0;
+    total_prefix_size = 0;
     for (i = 0; i < PREFIX_HASH_SIZE; i++) {
-        PREFIX_STATS *cur, *next;
+        PREFIX_STATS *cur, *next, *kept = NULL;
         for (cur = prefix_stats[i]; cur != NULL; cur = next) {
             next = cur->next;
-            pool_free(cur->prefix, strlen(cur->prefix) + 1, STATS_PREFIX_POOL);
-            pool_free(cur, sizeof(PREFIX_STATS) * 1, STATS_PREFIX_POOL);
+            if (cur->quota_bytes != 0) {
+                /* prefixes with a quota keep the quota and the bytes charged
+                 * against it, since those describe items still in the
+                 * cache. */
+                PREFIX_STATS saved = *cur;
+
+                memset(cur, 0, sizeof(PREFIX_STATS));
+                cur->prefix = saved.prefix;
+                cur->prefix_len = saved.prefix_len;
+                cur->quota_bytes = saved.quota_bytes;
+                cur->charged_bytes = saved.charged_bytes;
+                cur->last_update = current_time;
+                cur->next = kept;
+                kept = cur;
+
+                num_prefixes++;
+                total_prefix_size += cur->prefix_len;
+            } else {
+                pool_free(cur->prefix, strlen(cur->prefix) + 1, STATS_PREFIX_POOL);
+                pool_free(cur, sizeof(PREFIX_STATS) * 1, STATS_PREFIX_POOL);
+            }
         }
-        prefix_stats[i] = NULL;
+        prefix_stats[i] = kept;
     }
-    num_prefixes = 0;
-    total_prefix_size = 0;
     memset(&wildcard, 0, sizeof(PREFIX_STATS));
     GLOBAL_STATS_UNLOCK();
 }
 
 
 /*
- * Returns the stats structure for a prefix, creating it if it's not already
- * in the list.
+ * Returns the stats structure for a prefix of the given length.  If create is
+ * true, the structure is created if it's not already in the list; otherwise
+ * NULL is returned for unknown prefixes.
  */
 /*@null@*/
-static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
+static PREFIX_STATS *stats_prefix_lookup(const char *prefix, const size_t length, const bool create) {
     PREFIX_STATS *pfs;
     uint32_t hashval;
-    size_t length;
-
-    assert(key != NULL);
-
-    for (length = 0; length < nkey; length++)
-        if (key[length] == settings.prefix_delimiter)
-            break;
-
-    if (length == nkey) {
-        return &wildcard;
-    }
 
-    hashval = hash(key, length, 0) % PREFIX_HASH_SIZE;
+    hashval = hash(prefix, length, 0) % PREFIX_HASH_SIZE;
 
     for (pfs = prefix_stats[hashval]; NULL != pfs; pfs = pfs->next) {
         if (length == pfs->prefix_len &&
-            (memcmp(pfs->prefix, key, length) == 0)) {
+            (memcmp(pfs->prefix, prefix, length) == 0)) {
             return pfs;
         }
     }
 
+    if (! create) {
+        return NULL;
+    }
+
     pfs = pool_calloc(sizeof(PREFIX_STATS), 1, STATS_PREFIX_POOL);
     if (NULL == pfs) {
         perror("Can't allocate space for stats structure: calloc");
@@ -154,7 +178,7 @@ static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
         return NULL;
     }
 
-    memcpy(pfs->prefix, key, length);
+    memcpy(pfs->prefix, prefix, length);
     pfs->prefix_len = length;
 
     pfs->next = prefix_stats[hashval];
@@ -166,6 +190,24 @@ static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
     return pfs;
 }
 
+/*
+ * Returns the stats structure for a key's prefix, creating it if it's not
+ * already in the list.
+ */
+/*@null@*/
+static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
+    size_t length;
+
+    assert(key != NULL);
+
+    length = stats_prefix_length(key, nkey);
+    if (length == nkey) {
+        return &wildcard;
+    }
+
+    return stats_prefix_lookup(key, length, true);
+}
+
 /*
  * Records a "get" of a key.
  */
@@ -287,6 +329,114 @@ void stats_prefix_record_removal(const char *key, const size_t nkey, size_t byte
     GLOBAL_STATS_UNLOCK();
 }
 
+/*
+ * Sets the byte quota for a prefix.  A quota of 0 removes the quota.  The
+ * items the prefix already has are charged with the byte total its prefix
+ * stats have recorded, which only counts items stored while "stats detail" was
+ * on.
+ *
+ * Returns false if the prefix stats structure could not be allocated.
+ */
+bool stats_prefix_set_quota(const char *prefix, const size_t nprefix, const uint64_t bytes) {
+    PREFIX_STATS *pfs;
+
+    GLOBAL_STATS_LOCK();
+    pfs = stats_prefix_lookup(prefix, nprefix, bytes != 0);
+    if (NULL == pfs) {
+        GLOBAL_STATS_UNLOCK();
+        return (bytes == 0);
+    }
+
+    if (pfs->quota_bytes == 0 && bytes != 0) {
+        __atomic_store_n(&num_prefix_quotas, num_prefix_quotas + 1, __ATOMIC_RELAXED);
+        pfs->charged_bytes = pfs->num_bytes;
+    } else if (pfs->quota_bytes != 0 && bytes == 0) {
+        __atomic_store_n(&num_prefix_quotas, num_prefix_quotas - 1, __ATOMIC_RELAXED);
+        pfs->charged_bytes = 0;
+    }
+    pfs->quota_bytes = bytes;
+    GLOBAL_STATS_UNLOCK();
+
+    return true;
+}
+
+/*
+ * Charges the bytes of a newly linked item against its prefix's quota.
+ * Returns true if the prefix is over its quota afterwards.
+ */
+bool stats_prefix_quota_charge(const char *key, const size_t nkey, const size_t bytes) {
+    PREFIX_STATS *pfs;
+    size_t length;
+    bool over_quota = false;
+
+    if (__atomic_load_n(&num_prefix_quotas, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+
+    length = stats_prefix_length(key, nkey);
+    if (length == nkey) {
+        return false;
+    }
+
+    GLOBAL_STATS_LOCK();
+    pfs = stats_prefix_lookup(key, length, false);
+    if (NULL != pfs && pfs->quota_bytes != 0) {
+        pfs->charged_bytes += bytes;
+        over_quota = (pfs->charged_bytes > pfs->quota_bytes);
+    }
+    GLOBAL_STATS_UNLOCK();
+
+    return over_quota;
+}
+
+/*
+ * Returns the bytes of an unlinked item to its prefix's quota.
+ */
+void stats_prefix_quota_uncharge(const char *key, const size_t nkey, const size_t bytes) {
+    PREFIX_STATS *pfs;
+    size_t length;
+
+    if (__atomic_load_n(&num_prefix_quotas, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    length = stats_prefix_length(key, nkey);
+    if (length == nkey) {
+        return;
+    }
+
+    GLOBAL_STATS_LOCK();
+    pfs = stats_prefix_lookup(key, length, false);
+    if (NULL != pfs && pfs->quota_bytes != 0) {
+        /* items stored while "stats detail" was off were never charged. */
+        if (pfs->charged_bytes > bytes) {
+            pfs->charged_bytes -= bytes;
+        } else {
+            pfs->charged_bytes = 0;
+        }
+    }
+    GLOBAL_STATS_UNLOCK();
+}
+
+/*
+ * Records an eviction made to bring a key's prefix back under its quota.
+ * Returns true if the prefix is still over its quota.
+ */
+bool stats_prefix_quota_evicted(const char *key, const size_t nkey) {
+    PREFIX_STATS *pfs;
+    bool over_quota = false;
+
+    GLOBAL_STATS_LOCK();
+    pfs = stats_prefix_lookup(key, stats_prefix_length(key, nkey), false);
+    if (NULL != pfs && pfs->quota_bytes != 0) {
+        pfs->num_quota_evicts++;
+        over_quota = (pfs->charged_bytes > pfs->quota_bytes);
+    }
+    GLOBAL_STATS_UNLOCK();
+
+    return over_quota;
+}
+
 /*
  * Returns stats in textual form suitable for writing to a client.
  */
@@ -299,6 +449,10 @@ char *stats_prefix_dump(int *length) {
         "u ov %" PRINTF_INT64_MODIFIER "u exp %" PRINTF_INT64_MODIFIER  \
         "u bytes %" PRINTF_INT64_MODIFIER "u txed %" PRINTF_INT64_MODIFIER \
         "u byte-seconds %" PRINTF_INT64_MODIFIER "u\r\n"
+#define STATS_PREFIX_QUOTA_DUMP_FORMAT \
+    "QUOTA %.*s limit %" PRINTF_INT64_MODIFIER                          \
+        "u charged %" PRINTF_INT64_MODIFIER "u evict %" PRINTF_INT64_MODIFIER \
+        "u\r\n"
     PREFIX_STATS *pfs;
     char *buf;
     int i;
@@ -312,12 +466,16 @@ char *stats_prefix_dump(int *length) {
      * Figure out how big the buffer needs to be. This is the sum of the
      * lengths of the prefixes themselves, plus the size of one copy of
      * the per-prefix output with 20-digit values for all the counts,
-     * plus space for the "END" at the end.
+     * plus a quota line for each prefix with a quota, plus space for the
+     * "END" at the end.
      */
     GLOBAL_STATS_LOCK();
     size = total_prefix_size +
         (num_prefixes + 1) * (strlen(STATS_PREFIX_DUMP_FORMAT)
                               + 11 * (20 - format_len)) /* %llu replaced by 20-digit num */
+        + num_prefix_quotas * (strlen(STATS_PREFIX_QUOTA_DUMP_FORMAT)
+                               + 3 * (20 - format_len))
+        + total_prefix_size
         + sizeof(wildcard_name)
         + sizeof("END\r\n");
     buf = malloc(size);
@@ -343,6 +501,12 @@ char *stats_prefix_dump(int *length) {
                                       pfs->num_overwrites, pfs->num_expires,
                                       pfs->num_bytes, pfs->bytes_txed,
                                       pfs->total_byte_seconds);
+            if (pfs->quota_bytes != 0) {
+                offset = append_to_buffer(buf, size, offset, sizeof(terminator),
+                                          STATS_PREFIX_QUOTA_DUMP_FORMAT, (unsigned) pfs->prefix_len,
+                                          pfs->prefix, pfs->quota_bytes, pfs->charged_bytes,
+                                          pfs->num_quota_evicts);
+            }
         }
     }
 
@@ -480,6 +644,271 @@ char* cost_benefit_stats(int *bytes) {
 }
 
 
+/*
+ * Traffic by client address.  Connections add their counters here when they
+ * are closed (with -T); "stats clients" adds those of the live connections
+ * on top.  The table has a fixed size so that a flood of clients can't make
+ * it grow; addresses that don't fit are lumped together as "other".
+ */
+typedef struct client_stats_s client_stats_t;
+struct client_stats_s {
+    bool           used;
+    in_addr_t      addr;
+    uint32_t       conns;       /* live connections, when reporting */
+    conn_traffic_t traffic;
+};
+
+#define CLIENT_HASH_SIZE    1024    /* must be a power of 2 */
+#define CLIENT_SEARCH_DEPTH 16      /* slots we probe before giving up */
+
+/* the last entry is "other". */
+static client_stats_t clients[CLIENT_HASH_SIZE + 1];
+
+/* what "stats conns" shows of a connection, copied while it can't go away. */
+typedef struct conn_snapshot_s conn_snapshot_t;
+struct conn_snapshot_s {
+    int            fd;
+    bool           udp;
+    in_addr_t      addr;
+    rel_time_t     connected;
+    conn_traffic_t traffic;
+};
+
+typedef struct conn_snapshots_s conn_snapshots_t;
+struct conn_snapshots_s {
+    conn_snapshot_t* snaps;
+    size_t           count;
+    size_t           size;
+};
+
+#define CLIENT_STATS_FORMAT \
+    " cmd %" PRINTF_INT64_MODIFIER "u get %" PRINTF_INT64_MODIFIER      \
+        "u hit %" PRINTF_INT64_MODIFIER "u miss %" PRINTF_INT64_MODIFIER \
+        "u set %" PRINTF_INT64_MODIFIER "u del %" PRINTF_INT64_MODIFIER \
+        "u arith %" PRINTF_INT64_MODIFIER "u read %" PRINTF_INT64_MODIFIER \
+        "u written %" PRINTF_INT64_MODIFIER "u busy_us %" PRINTF_INT64_MODIFIER \
+        "u\r\n"
+#define CLIENT_STATS_LINE_MAX   (sizeof("CONN -2147483648 255.255.255.255 age 4294967295") + \
+                                 sizeof(CLIENT_STATS_FORMAT) + 10 * 20)
+
+static in_addr_t conn_peer_addr(const conn* c) {
+    if (c->request_addr_size != 0 && c->request_addr.sa_family == AF_INET) {
+        return ((const struct sockaddr_in*) &c->request_addr)->sin_addr.s_addr;
+    }
+    return INADDR_NONE;
+}
+
+static client_stats_t* client_find(client_stats_t* table, const in_addr_t addr) {
+    uint32_t slot = ntohl(addr) * 2654435761U;
+    int depth;
+
+    for (depth = 0; depth < CLIENT_SEARCH_DEPTH; depth++, slot++) {
+        client_stats_t* cs = &table[slot & (CLIENT_HASH_SIZE - 1)];
+
+        if (! cs->used) {
+            cs->used = true;
+            cs->addr = addr;
+            return cs;
+        }
+        if (cs->addr == addr) {
+            return cs;
+        }
+    }
+
+    table[CLIENT_HASH_SIZE].used = true;
+    table[CLIENT_HASH_SIZE].addr = INADDR_ANY;
+    return &table[CLIENT_HASH_SIZE];
+}
+
+static void traffic_add(conn_traffic_t* sum, const conn_traffic_t* t) {
+    sum->cmds += t->cmds;
+    sum->get_cmds += t->get_cmds;
+    sum->get_hits += t->get_hits;
+    sum->get_misses += t->get_misses;
+    sum->set_cmds += t->set_cmds;
+    sum->delete_cmds += t->delete_cmds;
+    sum->arith_cmds += t->arith_cmds;
+    sum->bytes_read += t->bytes_read;
+    sum->bytes_written += t->bytes_written;
+    sum->busy_usec += t->busy_usec;
+}
+
+static size_t append_traffic(char* buf, const size_t bufsize, size_t offset,
+                             const size_t reserved, const conn_traffic_t* t) {
+    return append_to_buffer(buf, bufsize, offset, reserved, CLIENT_STATS_FORMAT,
+                            t->cmds, t->get_cmds, t->get_hits, t->get_misses,
+                            t->set_cmds, t->delete_cmds, t->arith_cmds,
+                            t->bytes_read, t->bytes_written, t->busy_usec);
+}
+
+/*
+ * Adds a closing connection's traffic to its client's.
+ */
+void stats_client_fold(const conn* c) {
+    GLOBAL_STATS_LOCK();
+    traffic_add(&client_find(clients, conn_peer_addr(c))->traffic, &c->traffic);
+    GLOBAL_STATS_UNLOCK();
+}
+
+static void conn_snapshot(const conn* c, void* arg) {
+    conn_snapshots_t* cs = arg;
+    conn_snapshot_t* snap;
+
+    if (cs->count == cs->size) {
+        size_t size = cs->size == 0 ? 64 : cs->size * 2;
+        conn_snapshot_t* snaps = realloc(cs->snaps, size * sizeof(conn_snapshot_t));
+
+        if (snaps == NULL) {
+            return;
+        }
+        cs->snaps = snaps;
+        cs->size = size;
+    }
+
+    snap = &cs->snaps[cs->count++];
+    snap->fd = c->sfd;
+    snap->udp = c->udp;
+    snap->addr = conn_peer_addr(c);
+    snap->connected = c->connected;
+    snap->traffic = c->traffic;
+}
+
+/* busiest first, by bytes moved. */
+static int traffic_compare(const conn_traffic_t* a, const conn_traffic_t* b) {
+    uint64_t abytes = a->bytes_read + a->bytes_written;
+    uint64_t bbytes = b->bytes_read + b->bytes_written;
+
+    return abytes > bbytes ? -1 : abytes < bbytes ? 1 : 0;
+}
+
+static int client_compare(const void* a, const void* b) {
+    return traffic_compare(&((const client_stats_t*) a)->traffic,
+                           &((const client_stats_t*) b)->traffic);
+}
+
+static int conn_snapshot_compare(const void* a, const void* b) {
+    return traffic_compare(&((const conn_snapshot_t*) a)->traffic,
+                           &((const conn_snapshot_t*) b)->traffic);
+}
+
+static const char* addr_string(const in_addr_t addr, char* buf, const size_t size) {
+    struct in_addr in;
+
+    if (addr == INADDR_NONE) {
+        return "local";
+    }
+    in.s_addr = addr;
+    return inet_ntop(AF_INET, &in, buf, size);
+}
+
+/*
+ * Returns the clients that moved the most bytes, busiest first, with the
+ * traffic of their closed and live connections.
+ */
+char* stats_clients(const size_t limit, int* bytes) {
+    conn_snapshots_t cs = { NULL, 0, 0 };
+    client_stats_t* table;
+    char terminator[] = "END\r\n";
+    char addr[INET_ADDRSTRLEN];
+    size_t i, n, bufsize, offset = 0;
+    char* buf;
+
+    *bytes = 0;
+    if ((table = malloc(sizeof(clients))) == NULL) {
+        return NULL;
+    }
+
+    thread_conns_visit(conn_snapshot, &cs);
+
+    GLOBAL_STATS_LOCK();
+    memcpy(table, clients, sizeof(clients));
+    GLOBAL_STATS_UNLOCK();
+
+    for (i = 0; i < cs.count; i++) {
+        if (! cs.snaps[i].udp) {
+            client_stats_t* client = client_find(table, cs.snaps[i].addr);
+
+            client->conns++;
+            traffic_add(&client->traffic, &cs.snaps[i].traffic);
+        }
+    }
+    free(cs.snaps);
+
+    /* pack the clients we know of at the front. */
+    for (i = 0, n = 0; i < CLIENT_HASH_SIZE; i++) {
+        if (table[i].used) {
+            table[n++] = table[i];
+        }
+    }
+    if (table[CLIENT_HASH_SIZE].used) {
+        table[n++] = table[CLIENT_HASH_SIZE];
+    }
+    qsort(table, n, sizeof(client_stats_t), client_compare);
+    if (n > limit) {
+        n = limit;
+    }
+
+    bufsize = n * CLIENT_STATS_LINE_MAX + sizeof(terminator);
+    if ((buf = malloc(bufsize)) == NULL) {
+        free(table);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        offset = append_to_buffer(buf, bufsize, offset, sizeof(terminator),
+                                  "CLIENT %s conns %u",
+                                  table[i].addr == INADDR_ANY ? "other" :
+                                  addr_string(table[i].addr, addr, sizeof(addr)),
+                                  table[i].conns);
+        offset = append_traffic(buf, bufsize, offset, sizeof(terminator),
+                                &table[i].traffic);
+    }
+    offset = append_to_buffer(buf, bufsize, offset, 0, terminator);
+    free(table);
+
+    *bytes = offset;
+    return buf;
+}
+
+/*
+ * Returns the live connections that moved the most bytes, busiest first.
+ */
+char* stats_conns(const size_t limit, int* bytes) {
+    conn_snapshots_t cs = { NULL, 0, 0 };
+    char terminator[] = "END\r\n";
+    char addr[INET_ADDRSTRLEN];
+    size_t i, n, bufsize, offset = 0;
+    rel_time_t now = current_time;
+    char* buf;
+
+    *bytes = 0;
+    thread_conns_visit(conn_snapshot, &cs);
+    qsort(cs.snaps, cs.count, sizeof(conn_snapshot_t), conn_snapshot_compare);
+    n = cs.count > limit ? limit : cs.count;
+
+    bufsize = n * CLIENT_STATS_LINE_MAX + sizeof(terminator);
+    if ((buf = malloc(bufsize)) == NULL) {
+        free(cs.snaps);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        const conn_snapshot_t* snap = &cs.snaps[i];
+
+        offset = append_to_buffer(buf, bufsize, offset, sizeof(terminator),
+                                  "CONN %d %s age %u", snap->fd,
+                                  snap->udp ? "udp" :
+                                  addr_string(snap->addr, addr, sizeof(addr)),
+                                  now - snap->connected);
+        offset = append_traffic(buf, bufsize, offset, sizeof(terminator),
+                                &snap->traffic);
+    }
+    offset = append_to_buffer(buf, bufsize, offset, 0, terminator);
+    free(cs.snaps);
+
+    *bytes = offset;
+    return buf;
+}
+
+
 #ifdef UNIT_TEST
 
 /****************************************************************************
@@ -11,6 +11,24 @@ enum prefix_stats_flags_e {
     PREFIX_IS_OVERWRITE    = 0x2,
 };
 
+#define PREFIX_QUOTA_SEARCH_DEPTH  100    /* number of items we'll check on each
+                                          * LRU when evicting to bring a prefix
+                                          * back under its quota. */
+
+/*
+ * returns the length of the prefix of a key, or nkey if the key has no
+ * prefix.
+ */
+static inline size_t stats_prefix_length(const char *key, const size_t nkey) {
+    size_t length;
+
+    for (length = 0; length < nkey; length++)
+        if (key[length] == settings.prefix_delimiter)
+            break;
+
+    return length;
+}
+
 /* stats */
 extern void stats_prefix_init(void);
 extern void stats_prefix_clear(void);
@@ -20,6 +38,12 @@ extern void stats_prefix_record_set(const char *key, const size_t nkey);
 extern void stats_prefix_record_byte_total_change(const char *key, const size_t nkey, const long bytes, const int prefix_stats_flags);
 extern void stats_prefix_record_removal(const char *key, const size_t nkey, const size_t bytes, const rel_time_t time, const long flags);
 
+/* per-prefix quotas */
+extern bool stats_prefix_set_quota(const char *prefix, const size_t nprefix, const uint64_t bytes);
+extern bool stats_prefix_quota_charge(const char *key, const size_t nkey, const size_t bytes);
+extern void stats_prefix_quota_uncharge(const char *key, const size_t nkey, const size_t bytes);
+extern bool stats_prefix_quota_evicted(const char *key, const size_t nkey);
+
 /*@null@*/
 extern char *stats_prefix_dump(int *length);
 
@@ -286,4 +310,11 @@ static inline void stats_expire(size_t sz) {
 extern char* item_stats_buckets(int *bytes);
 extern char* cost_benefit_stats(int *bytes);
 
+/* traffic by client address and by connection */
+#define CLIENT_STATS_DEFAULT_LIMIT  20  /* lines "stats clients" and "stats
+                                         * conns" return by default */
+extern void stats_client_fold(const conn* c);
+extern char* stats_clients(const size_t limit, int* bytes);
+extern char* stats_conns(const size_t limit, int* bytes);
+
 #endif /* #if !defined(_stats_h_) */
@@ -0,0 +1,90 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+plan skip_all => "UDP not supported" unless MemcachedTest::supports_udp();
+plan tests => 12;
+
+my $bport = MemcachedTest::free_port("udp");
+my $server = new_memcached("-N $bport");
+my $sock = $server->sock;
+
+my $usock = IO::Socket::INET->new(PeerAddr  => '127.0.0.1',
+                                  PeerPort  => $bport,
+                                  Proto     => 'udp',
+                                  LocalAddr => '127.0.0.1',
+                                  LocalPort => MemcachedTest::free_port('udp'))
+    or die "Can't bind : $@\n";
+
+for my $i (1..40) {
+    print $sock "set key$i 0 0 6\r\nvalue$i\r\n" if $i < 10;
+    print $sock "set key$i 0 0 7\r\nvalue$i\r\n" if $i >= 10;
+    <$sock>;
+}
+my $big = "x" x 3000;
+print $sock "set big 0 0 3000\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored big");
+
+use constant GET  => 0x20;
+use constant GETQ => 0x28;
+
+sub bp_get {
+    my ($cmd, $key, $opaque) = @_;
+    return pack("CCCCNN", 0x50, $cmd, length($key), 0, $opaque, length($key)) . $key;
+}
+
+# sends one datagram and returns the datagrams of the reply, and the
+# binary replies parsed out of them.
+sub udp_request {
+    my ($reqid, $body) = @_;
+    send($usock, pack("nnnn", $reqid, 0, 1, 0) . $body, 0) or die "send: $!";
+
+    my (%pkts, $total);
+    while (!defined($total) || keys(%pkts) < $total) {
+        my $rin = '';
+        vec($rin, fileno($usock), 1) = 1;
+        last unless select(my $rout = $rin, undef, undef, 1.5);
+        my $res;
+        $usock->recv($res, 1500, 0);
+        my ($resid, $seq, $npkts) = unpack("nnn", $res);
+        next unless $resid == $reqid;
+        $total = $npkts;
+        $pkts{$seq} = substr($res, 8);
+    }
+    my $payload = join("", map { $pkts{$_} } sort { $a <=> $b } keys %pkts);
+    my @replies;
+    while (length($payload) >= 12) {
+        my ($magic, $cmd, $status, $res, $opaque, $blen) = unpack("CCCCNN", $payload);
+        my $value = substr($payload, 16, $blen - 4);
+        push @replies, { cmd => $cmd, opaque => $opaque, value => $value };
+        substr($payload, 0, 12 + $blen) = "";
+    }
+    return ($total, \@replies);
+}
+
+my ($npkts, $replies) = udp_request(1, join("", map { bp_get(GETQ, "key$_", $_) } 1..40)
+                                       . bp_get(GET, "nokey", 99));
+is($npkts, 1, "forty getq replies packed into one datagram");
+is(scalar @$replies, 41, "every hit and the final miss answered");
+is(join(",", map { $_->{opaque} } @$replies), join(",", 1..40, 99), "replies in request order");
+is(scalar(grep { $_->{value} eq "value$_->{opaque}" } @$replies[0..39]), 40, "values match");
+
+($npkts, $replies) = udp_request(2, join("", map { bp_get(GETQ, $_, 7) } qw(nokey key3 nokey2)));
+is(scalar @$replies, 1, "datagram of only getqs still answered");
+is($replies->[0]{value}, "value3", "getq hit in a datagram without a get");
+
+($npkts, $replies) = udp_request(3, join("", map { bp_get(GET, "key$_", $_) } 1..3));
+is($npkts, 1, "several gets answered in one datagram");
+is(join(",", map { $_->{opaque} } @$replies), "1,2,3", "every get answered");
+
+($npkts, $replies) = udp_request(4, bp_get(GETQ, "key1", 1) . bp_get(GETQ, "big", 2)
+                                    . bp_get(GET, "key2", 3));
+is($npkts, 3, "large reply split across datagrams");
+is(join(",", map { length $_->{value} } @$replies), "6,3000,6", "split reply reassembled");
+
+($npkts, $replies) = udp_request(5, bp_get(GETQ, "key4", 4) . substr(bp_get(GET, "key5", 5), 0, 6));
+is(join(",", map { $_->{opaque} } @$replies), "4", "truncated trailing request dropped");
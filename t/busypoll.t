@@ -0,0 +1,39 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 7;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-y 1000,50");
+my $sock = $server->sock;
+
+sub busy_poll_stats {
+    my $stats = {};
+    print $sock "stats busy_poll\r\n";
+    while (<$sock>) {
+        last if /^(\.|END)/;
+        /^STAT (\S+) (\S+)/ && ($stats->{$1} = $2);
+    }
+    return $stats;
+}
+
+print $sock "set foo 0 0 6\r\nfooval\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+mem_get_is($sock, "foo", "fooval");
+
+# let the workers go idle.
+sleep(1);
+
+my $stats = busy_poll_stats();
+is($stats->{busy_poll_usec}, 1000, "idle threshold");
+ok($stats->{polls} > 0, "polled");
+ok($stats->{empty_polls} > 0 && $stats->{spin_usec} > 0, "spin time counted");
+ok($stats->{sleeps} > 0, "idle threads sleep");
+
+# an idle server doesn't keep spinning.
+my $spin = $stats->{spin_usec};
+sleep(1);
+$stats = busy_poll_stats();
+ok($stats->{spin_usec} - $spin < 500000, "idle server mostly sleeps");
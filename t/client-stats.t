@@ -0,0 +1,62 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 14;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-T");
+my $sock = $server->sock;
+my $client = $server->new_sock;
+my $val = "x" x 10000;
+
+sub client_lines {
+    my ($cmd) = @_;
+    my @lines;
+    print $sock "$cmd\r\n";
+    while (<$sock>) {
+        last if /^(END|CLIENT_ERROR)/;
+        push @lines, $_;
+    }
+    return @lines;
+}
+
+print $client "set foo 0 0 10000\r\n$val\r\n";
+is(scalar <$client>, "STORED\r\n", "stored foo");
+mem_get_is($client, "foo", $val, "hit");
+mem_get_is($client, "bar", undef, "miss");
+print $client "delete foo\r\n";
+is(scalar <$client>, "DELETED\r\n", "deleted foo");
+print $client "incr foo 1\r\n";
+is(scalar <$client>, "NOT_FOUND\r\n", "incr missed");
+
+my @conns = client_lines("stats conns");
+ok(@conns >= 2, "open connections listed");
+like($conns[0], qr/^CONN \d+ 127\.0\.0\.1 age \d+ cmd 5 get 2 hit 1 miss 1 set 1 del 1 arith 1 read \d+ written \d+ busy_us \d+\r\n$/,
+     "busiest connection first, with its counters");
+
+@conns = client_lines("stats conns 1");
+is(scalar @conns, 1, "limit on the number of connections");
+
+print $sock "stats conns abc\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "bad limit rejected");
+
+my @clients = client_lines("stats clients");
+is(scalar @clients, 1, "one client address");
+like($clients[0], qr/^CLIENT 127\.0\.0\.1 conns [2-9] cmd \d+ get 2 hit 1 miss 1 set 1 del 1 arith 1 /,
+     "client sums its connections");
+
+# the closed connection's traffic stays with its client.
+my ($open) = $clients[0] =~ /conns (\d+)/;
+close($client);
+for (1..20) {
+    @clients = client_lines("stats clients");
+    last if $clients[0] =~ /conns @{[$open - 1]} /;
+    sleep(0.1);
+}
+like($clients[0], qr/^CLIENT 127\.0\.0\.1 conns @{[$open - 1]} cmd \d+ get 2 hit 1 miss 1 set 1 del 1 arith 1 /,
+     "closed connection's traffic kept");
+my ($read, $busy) = $clients[0] =~ / read (\d+) .* busy_us (\d+)/;
+ok($read > 10000, "bytes read counted");
+ok($busy > 0, "busy time counted");
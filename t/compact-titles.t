@@ -0,0 +1,60 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+if (mem_stats($sock)->{allocator} ne "flat-sk") {
+    plan skip_all => 'Skipping title chunk tests on slab allocator build';
+    exit 0;
+}
+plan tests => 7;
+
+sub flat_stats {
+    my $stats = {};
+    print $sock "stats flat_allocator\r\n";
+    while (<$sock>) {
+        last if /^END/;
+        /^STAT (\S+) (\S+)/ && ($stats->{$1} = $2);
+    }
+    return $stats;
+}
+
+my $stats = flat_stats();
+my $compact = defined $stats->{clock_hand};
+my $title_data = $stats->{small_chunk_sz} - 1 - $stats->{title_header_sz};
+is($stats->{title_header_sz}, $compact ? 27 : 38, "title header size");
+
+# the largest items that fit in a single small chunk.
+my $val = "x" x ($title_data - 1 - length("key000"));
+print $sock join("", map { sprintf("set key%03d 0 0 %d\r\n%s\r\n", $_, length($val), $val) } 1..100);
+<$sock> for 1..100;
+
+$stats = flat_stats();
+is($stats->{small_title_chunks}, 100, "one title per item");
+is($stats->{small_body_chunks}, 0, "no body chunks needed");
+mem_get_is($sock, "key042", $val, "item read back");
+
+print $sock "set expiring 0 1 3\r\nabc\r\n";
+<$sock>;
+mem_get_is($sock, "expiring", "abc", "expiring item stored");
+sleep(2.2);
+mem_get_is($sock, "expiring", undef, "item expires on time");
+
+# an expire time too far out for a compact title to keep doesn't come early.
+my $far = time() + 200 * 86400;
+print $sock "set faraway 0 $far 3\r\nabc\r\n";
+<$sock>;
+my $exptime;
+print $sock "dump_keys 1000000\r\n";
+while (<$sock>) {
+    last if /^END/;
+    $exptime = $1 if /^KEY faraway (\d+)/;
+}
+ok(defined $exptime && ($exptime == 0 || $exptime >= $far - 2),
+   "far expire time isn't cut short");
@@ -0,0 +1,76 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 10;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+sub conn_buffer_stats {
+    my $stats = {};
+    print $sock "stats conn_buffer\r\n";
+    while (<$sock>) {
+        last if /^(\.|END)/;
+        /^STAT (\S+) (\S+)/ && ($stats->{$1} = $2);
+    }
+    return $stats;
+}
+
+my $stats = conn_buffer_stats();
+is($stats->{class_0_size}, 4096, "smallest class");
+is($stats->{class_3_size}, 16 * 1024 * 1024, "largest class");
+is($stats->{grows}, 0, "nothing grown yet");
+
+# short commands are read into the buffer inside the conn; only their
+# responses take a connection buffer.
+foreach (1..10) {
+    print $sock "version\r\n";
+    <$sock>;
+}
+my $allocates = conn_buffer_stats()->{allocates} - $stats->{allocates};
+ok($allocates <= 11, "no connection buffer to read short commands into");
+
+# a command line longer than the smallest buffer, asking for more items than
+# its iovec list holds.
+my @keys = map { sprintf("a_rather_long_key_%04d", $_) } (1..400);
+foreach my $key (@keys) {
+    print $sock "set $key 0 0 " . length($key) . "\r\n$key\r\n";
+    <$sock>;
+}
+print $sock "get " . join(" ", @keys) . "\r\n";
+my @got;
+while (<$sock>) {
+    last if /^END/;
+    if (/^VALUE (\S+) 0 (\d+)\r\n$/) {
+        my $key = $1;
+        my $value = <$sock>;
+        push @got, $key if $value eq "$key\r\n";
+    }
+}
+is(scalar @got, 400, "long multiget answered in full");
+is_deeply(\@got, \@keys, "in order");
+
+# a value bigger than every class but the largest.
+my $big = "x" x (700 * 1024);
+print $sock "set big 0 0 " . length($big) . "\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored a big value");
+mem_get_is($sock, "big", $big);
+
+# pipelined commands that fill the read buffer several times over.  the data
+# of the smallest class is a multiple of this command's length.
+my $cmd = "get ab\r\n";
+my $count = int(4 * 4096 / length($cmd));
+print $sock $cmd x $count;
+my $misses = 0;
+while ($misses < $count) {
+    my $line = <$sock>;
+    last unless defined $line;
+    $misses ++ if $line eq "END\r\n";
+}
+is($misses, $count, "pipelined commands answered");
+
+$stats = conn_buffer_stats();
+ok($stats->{grows} > 0, "buffers grown on demand");
@@ -0,0 +1,56 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 9;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+$ENV{T_MEMD_SLABS_ALLOC} = 0;  # don't preallocate slabs
+
+my $val = "abcdefghij" x 1000;
+
+# stores a few keys and reads each of them a few times, then writes well past
+# the memory limit.  returns how many of the keys that were read survived.
+sub fill {
+    my $sock = shift;
+
+    print $sock join("", map { "set hot$_ 0 0 10000\r\n$val\r\n" } 1..5);
+    <$sock> for 1..5;
+    print $sock join("", map { "get hot$_\r\n" } (1..5) x 3);
+    <$sock> for 1..(15 * 3);
+
+    print $sock join("", map { "set cold$_ 0 0 10000\r\n$val\r\n" } 1..400);
+    <$sock> for 1..400;
+
+    my $found = 0;
+    for my $i (1..5) {
+        print $sock "get hot$i\r\n";
+        my $line = scalar <$sock>;
+        if ($line =~ /^VALUE/) {
+            $found++;
+            <$sock>; <$sock>;
+        }
+    }
+    return $found;
+}
+
+my $server = new_memcached("-m 2");
+my $sock = $server->sock;
+is(mem_stats($sock)->{evict_policy}, "lru", "lru by default");
+ok(fill($sock) < 5, "lru evicts old items that were read");
+
+$server = new_memcached("-m 2 -E gdsf");
+$sock = $server->sock;
+is(mem_stats($sock)->{evict_policy}, "gdsf", "gdsf selected");
+is(fill($sock), 5, "gdsf keeps items that were read");
+
+my $stats = mem_stats($sock);
+ok($stats->{evictions} > 0, "items were evicted");
+ok($stats->{evicted_bytes} >= $stats->{evictions} * 10000, "evicted bytes counted");
+
+print $sock "stats reset\r\n";
+is(scalar <$sock>, "RESET\r\n", "stats reset");
+$stats = mem_stats($sock);
+is($stats->{evicted_bytes}, 0, "evicted bytes reset");
+is($stats->{evictions}, 0, "evictions reset");
@@ -0,0 +1,60 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 12;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+$ENV{T_MEMD_SLABS_ALLOC} = 0;  # don't preallocate slabs
+
+my $server = new_memcached("-m 2");
+my $sock = $server->sock;
+my $flat = mem_stats($sock)->{allocator} eq "flat-sk";
+
+print $sock "set foo 0 0 6\r\nfooval\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+
+print $sock "metaget foo\r\n";
+like(scalar <$sock>, qr/^META foo .*; hits: 0; idle: \d+\r\n/, "new item has no hits");
+<$sock>;
+
+mem_get_is($sock, "foo", "fooval") for 1..3;
+
+print $sock "metaget foo\r\n";
+like(scalar <$sock>, qr/^META foo .*; hits: 3; idle: [01]\r\n/, "gets counted, metaget isn't");
+<$sock>;
+
+# find the item in the cache dump.
+my $dump = "";
+for my $class ($flat ? ("small") : (1..10)) {
+    print $sock "stats cachedump $class 0\r\n";
+    while (<$sock>) {
+        last if /^END/;
+        $dump .= $_;
+    }
+}
+like($dump, qr/^ITEM foo \[6 b; \d+ s; 3 hits; last access \d+ s\]/m,
+     "cachedump shows hits and last access");
+
+print $sock "delete foo\r\n";
+<$sock>;
+
+# fill the cache past its limit.  only the first of every ten keys is read.
+my $val = "x" x 1000;
+for my $i (1..4000) {
+    print $sock "set key$i 0 0 1000\r\n$val\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key$i") if $i == 4000;
+    <$sock> unless $i == 4000;
+    if ($i % 10 == 1) {
+        print $sock "get key$i\r\n";
+        <$sock>; <$sock>; <$sock>;
+    }
+}
+
+my $stats = mem_stats($sock);
+ok($stats->{evictions} > 0, "items were evicted");
+ok($stats->{evicted_unfetched} > 0, "unread items evicted");
+ok($stats->{evicted_unfetched} < $stats->{evictions}, "read items are not counted as unfetched");
+is($stats->{evicted_hits}, $stats->{evictions} - $stats->{evicted_unfetched},
+   "each evicted read item had one hit");
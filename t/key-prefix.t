@@ -0,0 +1,89 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+if (mem_stats($sock)->{allocator} !~ /^flat/) {
+    plan skip_all => 'Skipping key prefix tests on slab allocator build';
+    exit 0;
+}
+plan tests => 16;
+
+$server = new_memcached("-K 2");
+$sock = $server->sock;
+
+sub key_prefix_stats {
+    my $stats = {};
+    print $sock "stats key_prefixes\r\n";
+    while (<$sock>) {
+        last if /^END/;
+        /^STAT (\S+) (\S+)/ && ($stats->{$1} = $2);
+    }
+    return $stats;
+}
+
+sub set_key {
+    my ($key, $value) = @_;
+    print $sock "set $key 0 0 " . length($value) . "\r\n$value\r\n";
+    return scalar <$sock>;
+}
+
+# the first stores of a prefix go in whole; the rest get its id.
+my @keys = map { "svc:feed:v3:user:$_" } (1..20);
+foreach my $key (@keys) {
+    set_key($key, "value of $key");
+}
+my $stats = key_prefix_stats();
+is($stats->{key_prefix_max_entries}, 2, "max entries");
+is($stats->{key_prefix_entries}, 1, "prefix given an id");
+is($stats->{key_prefix_stores}, 5, "stores with the id");
+is($stats->{key_prefix_bytes_saved}, 5 * (length("svc:feed:v3:user:") - 2), "bytes saved");
+
+mem_get_is($sock, $_, "value of $_") foreach ($keys[0], $keys[19]);
+
+print $sock "get " . join(" ", @keys) . "\r\n";
+my @got;
+while (<$sock>) {
+    last if /^END/;
+    if (/^VALUE (\S+) 0 (\d+)\r\n$/) {
+        my $key = $1;
+        my $value = <$sock>;
+        push @got, $key if $value eq "value of $key\r\n";
+    }
+}
+is_deeply(\@got, \@keys, "keys come back whole");
+
+# a key that shares the stored bytes of a prefixed key but not its prefix.
+mem_get_is($sock, "svc:feed:v3:user:20x", undef);
+
+# commands that work on the stored item in place, or make a new one.
+set_key($keys[19], "41");
+print $sock "incr $keys[19] 1\r\n";
+is(scalar <$sock>, "42\r\n", "incr on a prefixed key");
+print $sock "incr $keys[19] 999999\r\n";
+is(scalar <$sock>, "1000041\r\n", "incr that grows the value");
+mem_get_is($sock, $keys[19], "1000041");
+
+print $sock "delete $keys[18]\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted a prefixed key");
+mem_get_is($sock, $keys[18], undef);
+
+# a long prefix: keys stored before it has an id span several chunks.
+my $long = ("x" x 200) . ":";
+foreach (1..20) {
+    set_key("$long$_", "long $_");
+}
+mem_get_is($sock, "${long}1", "long 1");
+mem_get_is($sock, "${long}20", "long 20");
+
+# no room left for another prefix.
+foreach (1..20) {
+    set_key("other:namespace:$_", "other $_");
+}
+is(key_prefix_stats()->{key_prefix_entries}, 2, "dictionary full");
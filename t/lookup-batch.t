@@ -0,0 +1,59 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 10;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-B -t 1");
+my $sock = $server->sock;
+my @socks = map { $server->new_sock } 1..8;
+
+for my $i (1..8) {
+    print $sock "set key$i 0 0 6\r\nvalue$i\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key$i") if $i == 8;
+    <$sock> if $i != 8;
+}
+
+# send a get on every connection before reading any of the responses, so that
+# the worker finds them all ready in one pass.
+for my $i (0..$#socks) {
+    my $s = $socks[$i];
+    my $n = $i + 1;
+    print $s "get key$n nokey\r\n";
+}
+my $ok = 0;
+for my $i (0..$#socks) {
+    my $s = $socks[$i];
+    my $n = $i + 1;
+    my $resp = <$s> . <$s> . <$s>;
+    $ok++ if $resp eq "VALUE key$n 0 6\r\nvalue$n\r\nEND\r\n";
+}
+is($ok, scalar(@socks), "batched gets answered on every connection");
+
+mem_get_is($sock, "key3", "value3", "single get");
+mem_get_is($sock, "nokey", undef, "single miss");
+
+print $sock "get key1 key2 key3 key4\r\n";
+my $resp = join("", map { scalar <$sock> } 1..9);
+is($resp, join("", map { "VALUE key$_ 0 6\r\nvalue$_\r\n" } 1..4) . "END\r\n",
+   "get of four keys batched");
+
+print $sock "get key1 key2 key3 key4 key5 key6\r\n";
+$resp = join("", map { scalar <$sock> } 1..13);
+is($resp, join("", map { "VALUE key$_ 0 6\r\nvalue$_\r\n" } 1..6) . "END\r\n",
+   "get of more keys than a batch holds");
+
+# pipelined commands keep their order around a batched get.
+print $sock "get key1\r\nset key1 0 0 3\r\nnew\r\nget key1\r\n";
+$resp = join("", map { scalar <$sock> } 1..7);
+is($resp, "VALUE key1 0 6\r\nvalue1\r\nEND\r\nSTORED\r\nVALUE key1 0 3\r\nnew\r\nEND\r\n",
+   "pipelined commands answered in order");
+
+print $sock "get " . ("a" x 300) . "\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "long key rejected");
+
+my $stats = mem_stats($sock);
+is($stats->{get_hits}, 8 + 1 + 4 + 6 + 2, "hits counted");
+is($stats->{get_misses}, 8 + 1, "misses counted");
@@ -0,0 +1,58 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 9;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+sub maintenance_stats {
+    my $stats = {};
+    print $sock "stats maintenance\r\n";
+    while (<$sock>) {
+        last if /^(\.|END)/;
+        /^STAT (\S+) (\S+)/ && ($stats->{$1} = $2);
+    }
+    return $stats;
+}
+
+foreach my $n (1..200) {
+    print $sock "set key$n 0 0 5\r\nvalue\r\nset other$n 0 0 10\r\n0123456789\r\n";
+    <$sock>;
+    <$sock>;
+}
+
+my %sizes;
+print $sock "stats sizes\r\n";
+while (<$sock>) {
+    last if /^END/;
+    $sizes{$1} += $2 if /^(\d+) (\d+)\r\n$/;
+}
+my $total = 0;
+$total += $_ foreach values %sizes;
+is($total, 400, "stats sizes counts every item");
+is(scalar(grep { $_ % 32 } keys %sizes), 0, "in 32-byte buckets");
+
+# commands sent behind an admin command are answered after it.
+print $sock "flush_regex ^key1\r\nget key1 key2 other1\r\n";
+is(scalar <$sock>, "DELETED\r\n", "flush_regex");
+my @got;
+while (<$sock>) {
+    last if /^END/;
+    push @got, $1 if /^VALUE (\S+)/;
+}
+is("@got", "key2 other1", "pipelined get sees the flush");
+mem_get_is($sock, "key150", undef);
+mem_get_is($sock, "key50", "value");
+
+print $sock "flush_regex (\r\n";
+is(scalar <$sock>, "CLIENT_ERROR Bad regular expression (or regex not supported)\r\n",
+   "bad regex");
+
+my $stats = maintenance_stats();
+is($stats->{maintenance_jobs}, 2, "jobs run on the maintenance thread");
+# the default table has 65536 buckets, walked 1024 at a time.
+ok($stats->{maintenance_lock_slices} >= 2 * 64, "walks let go of the lock");
@@ -0,0 +1,76 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 15;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+$ENV{T_MEMD_SLABS_ALLOC} = 0;  # don't preallocate slabs
+
+my $server = new_memcached("-m 4");
+my $sock = $server->sock;
+my $val = "x" x 100000;
+
+print $sock "maxbytes abc\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "bad limit rejected");
+
+print $sock "maxbytes 0\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "zero limit rejected");
+
+print $sock "maxbytes 1073741824\r\n";
+like(scalar <$sock>, qr/^SERVER_ERROR/, "limit past what items can reach refused");
+
+print $sock "maxbytes 16\r\n";
+is(scalar <$sock>, "OK\r\n", "limit raised");
+
+my $stats = mem_stats($sock);
+is($stats->{limit_maxbytes}, 16 * 1024 * 1024, "raised limit reported");
+
+for my $i (1..120) {
+    print $sock "set key$i 0 0 100000\r\n$val\r\n";
+    <$sock>;
+}
+$stats = mem_stats($sock);
+ok($stats->{item_allocated} > 8 * 1024 * 1024, "cache grew past the old limit");
+
+print $sock "maxbytes 4\r\n";
+is(scalar <$sock>, "OK\r\n", "limit lowered");
+
+# memory is given back a little at a time in the background.
+my $resident;
+for (1..20) {
+    sleep(1);
+    $stats = mem_stats($sock);
+    $resident = $stats->{item_allocated} - $stats->{item_released};
+    last if $resident <= 4 * 1024 * 1024;
+}
+ok($resident <= 4 * 1024 * 1024, "cache shrank to the new limit");
+
+print $sock "set newkey 0 0 100000\r\n$val\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored after shrinking");
+mem_get_is($sock, "newkey", $val);
+
+# the pages freed by shrinking are used again.
+print $sock "maxbytes 16\r\n";
+is(scalar <$sock>, "OK\r\n", "limit raised again");
+
+my $stored = 0;
+for my $i (1..80) {
+    print $sock "set again$i 0 0 100000\r\n$val\r\n";
+    $stored++ if scalar <$sock> eq "STORED\r\n";
+}
+is($stored, 80, "stored after growing again");
+mem_get_is($sock, "again1", $val);
+
+# the flat allocator can only be raised as far as its -g ceiling.
+SKIP: {
+    skip "the ceiling is for the flat allocator", 2
+        unless $stats->{allocator} =~ /^flat/;
+    my $capped = new_memcached("-m 4 -g 8");
+    my $csock = $capped->sock;
+    print $csock "maxbytes 16\r\n";
+    like(scalar <$csock>, qr/^SERVER_ERROR/, "limit past the ceiling refused");
+    print $csock "maxbytes 8\r\n";
+    is(scalar <$csock>, "OK\r\n", "limit raised to the ceiling");
+}
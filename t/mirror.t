@@ -0,0 +1,112 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 16;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $bport = free_port();
+my $secondary = new_memcached("-n $bport");
+my $ssock = $secondary->sock;
+my $primary = new_memcached("-O 127.0.0.1:$bport");
+my $sock = $primary->sock;
+
+sub mirror_stats {
+    my $stats = {};
+    print $sock "stats mirror\r\n";
+    while (<$sock>) {
+        last if /^(\.|END)/;
+        /^STAT (\S+) (\S+)/ && ($stats->{$1} = $2);
+    }
+    return $stats;
+}
+
+# waits for the secondary to catch up with the request just sent.
+sub wait_for {
+    my ($key, $expected) = @_;
+    my $got;
+    for (1..50) {
+        print $ssock "get $key\r\n";
+        my $line = <$ssock>;
+        $got = undef;
+        if ($line =~ /^VALUE \S+ \d+ (\d+)/) {
+            $got = <$ssock>;
+            $got =~ s/\r\n$//;
+            <$ssock>;
+        }
+        last if (defined $got ? $got : "") eq (defined $expected ? $expected : "");
+        sleep(0.1);
+    }
+    return $got;
+}
+
+my $stats = mirror_stats();
+for (1..50) {
+    last if $stats->{mirror_connected};
+    sleep(0.1);
+    $stats = mirror_stats();
+}
+is($stats->{mirror_connected}, 1, "connected to the secondary");
+
+print $sock "set foo 5 0 3\r\nbar\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+is(wait_for("foo", "bar"), "bar", "set mirrored");
+print $ssock "get foo\r\n";
+is(scalar <$ssock>, "VALUE foo 5 3\r\n", "flags mirrored");
+<$ssock>; <$ssock>;
+
+my $big = "x" x 50000;
+print $sock "add big 0 0 50000\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "added big");
+is(wait_for("big", $big), $big, "large add mirrored");
+
+print $sock "set num 0 0 2\r\n10\r\n";
+<$sock>;
+print $sock "incr num 5\r\n";
+is(scalar <$sock>, "15\r\n", "incremented");
+is(wait_for("num", "15"), "15", "incr mirrored");
+
+# the incremented value is sent, not the delta, so a secondary that went
+# astray gets the primary's value back.
+print $ssock "set num 0 0 3\r\n100\r\n";
+<$ssock>;
+print $sock "incr num 1\r\n";
+<$sock>;
+is(wait_for("num", "16"), "16", "incr sends the new value");
+
+print $sock "delete foo\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted foo");
+is(wait_for("foo", undef), undef, "delete mirrored");
+
+print $sock "flush_all\r\n";
+is(scalar <$sock>, "OK\r\n", "flushed");
+is(wait_for("num", undef), undef, "flush mirrored");
+
+$stats = mirror_stats();
+ok($stats->{mirror_sent} >= 6 && $stats->{mirror_dropped_full} == 0,
+   "mirrored requests counted");
+
+# a secondary that stops reading is given up on rather than waited for.
+my $stuck = IO::Socket::INET->new(LocalAddr => "127.0.0.1", Listen => 5,
+                                  ReuseAddr => 1) or die "can't listen: $!";
+my $primary2 = new_memcached("-O 127.0.0.1:" . $stuck->sockport);
+$sock = $primary2->sock;
+for (1..50) {
+    last if mirror_stats()->{mirror_connected};
+    sleep(0.1);
+}
+my $chunk = "x" x 100000;
+for my $i (1..200) {
+    print $sock "set stuck$i 0 0 100000\r\n$chunk\r\n";
+    <$sock>;
+}
+# it is connected to again after a while, so look for the reconnect.
+$stats = mirror_stats();
+for (1..50) {
+    last if $stats->{mirror_connects} > 1;
+    sleep(0.1);
+    $stats = mirror_stats();
+}
+ok($stats->{mirror_connects} > 1, "secondary that doesn't read disconnected");
+ok($stats->{mirror_dropped_down} > 0, "its writes counted as dropped");
@@ -0,0 +1,110 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 18;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+my $val = "x" x 100;
+
+print $sock "stats detail quota foo\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "quota without byte count rejected");
+
+print $sock "stats detail quota foo:bar 1000\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "quota on prefix with delimiter rejected");
+
+print $sock "stats detail quota foo abc\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "quota with bad byte count rejected");
+
+print $sock "stats detail quota foo 1000\r\n";
+is(scalar <$sock>, "OK\r\n", "quota set on foo");
+
+my $evictions = mem_stats($sock)->{evictions};
+
+# fill up foo well past its quota; bar is not limited.
+for my $i (1..20) {
+    print $sock "set foo:$i 0 0 100\r\n$val\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored foo:$i") if $i == 20;
+    <$sock> if $i != 20;
+    print $sock "set bar:$i 0 0 100\r\n$val\r\n";
+    <$sock>;
+}
+
+# with compact titles, the flat allocator evicts by CLOCK rather than LRU, so
+# the items the quota evicts aren't the oldest ones.
+my $clock = 0;
+print $sock "stats flat_allocator\r\n";
+while (<$sock>) {
+    last if /^(END|ERROR)/;
+    $clock = 1 if /^STAT clock_hand /;
+}
+if ($clock) {
+    my $kept = 0;
+    for my $i (1..20) {
+        print $sock "get foo:$i\r\n";
+        my $line = <$sock>;
+        if ($line =~ /^VALUE/) {
+            $kept++;
+            <$sock>; <$sock>;
+        }
+    }
+    ok($kept < 20, "foo items evicted by quota");
+} else {
+    mem_get_is($sock, "foo:1", undef, "oldest foo item evicted by quota");
+}
+mem_get_is($sock, "foo:20", $val, "newest foo item kept");
+mem_get_is($sock, "bar:1", $val, "unlimited prefix untouched");
+
+print $sock "stats detail dump\r\n";
+my ($limit, $charged, $evict);
+while (<$sock>) {
+    last if /^END/;
+    ($limit, $charged, $evict) = ($1, $2, $3)
+        if /^QUOTA foo limit (\d+) charged (\d+) evict (\d+)\r\n/;
+}
+is($limit, 1000, "quota reported in detail dump");
+ok($charged <= 1000, "charged bytes within quota");
+ok($evict > 0, "quota evictions reported");
+is(mem_stats($sock)->{evictions} - $evictions, $evict, "quota evictions counted in stats");
+
+print $sock "delete foo:20 0\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted foo:20");
+
+print $sock "stats detail dump\r\n";
+my $charged_after;
+while (<$sock>) {
+    last if /^END/;
+    $charged_after = $1 if /^QUOTA foo limit \d+ charged (\d+)/;
+}
+is($charged_after, $charged - 106, "delete returns bytes to the quota");
+
+print $sock "stats detail quota foo 0\r\n";
+is(scalar <$sock>, "OK\r\n", "quota removed");
+
+print $sock "stats detail dump\r\n";
+my $quota_lines = 0;
+while (<$sock>) {
+    last if /^END/;
+    $quota_lines++ if /^QUOTA/;
+}
+is($quota_lines, 0, "no quota reported after removal");
+
+# a quota set on a prefix that already has items starts out charged with them.
+print $sock "stats detail on\r\n";
+is(scalar <$sock>, "OK\r\n", "detail on");
+for my $i (1..5) {
+    print $sock "set baz:$i 0 0 100\r\n$val\r\n";
+    <$sock>;
+}
+print $sock "stats detail quota baz 1000\r\n";
+<$sock>;
+print $sock "stats detail dump\r\n";
+my $charged_existing;
+while (<$sock>) {
+    last if /^END/;
+    $charged_existing = $1 if /^QUOTA baz limit \d+ charged (\d+)/;
+}
+is($charged_existing, 5 * 105, "existing items charged when the quota is set");
@@ -0,0 +1,53 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 7;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+$ENV{T_MEMD_SLABS_ALLOC} = 0;  # don't preallocate slabs
+
+my $val = "abcdefghij" x 1000;
+
+# waits for the reclaimer to stop evicting, and returns the stats.
+sub settle {
+    my $sock = shift;
+    my $stats = mem_stats($sock);
+    for (1..30) {
+        select(undef, undef, undef, 0.1);
+        my $next = mem_stats($sock);
+        return $next if $next->{reclaimed_items} == $stats->{reclaimed_items} &&
+            $next->{reclaimed_items} > 0;
+        $stats = $next;
+    }
+    return $stats;
+}
+
+my $server = new_memcached("-m 2");
+my $sock = $server->sock;
+print $sock join("", map { "set key$_ 0 0 10000\r\n$val\r\n" } 1..400);
+<$sock> for 1..400;
+my $stats = mem_stats($sock);
+ok($stats->{evictions} > 0, "items evicted without the reclaimer");
+is($stats->{reclaimed_items}, 0, "nothing reclaimed without the reclaimer");
+
+$server = new_memcached("-m 2 -W 20");
+$sock = $server->sock;
+print $sock join("", map { "set key$_ 0 0 10000\r\n$val\r\n" } 1..400);
+my $stored = grep { $_ eq "STORED\r\n" } map { scalar <$sock> } 1..400;
+is($stored, 400, "all items stored with the reclaimer");
+
+$stats = settle($sock);
+ok($stats->{reclaimed_items} > 0, "reclaimer evicted items");
+ok($stats->{evictions} >= $stats->{reclaimed_items}, "reclaimed items count as evictions");
+
+# with the reserve topped up, a few sets don't evict anything themselves.
+my $foreground = $stats->{evictions} - $stats->{reclaimed_items};
+print $sock join("", map { "set more$_ 0 0 10000\r\n$val\r\n" } 1..5);
+<$sock> for 1..5;
+$stats = settle($sock);
+is($stats->{evictions} - $stats->{reclaimed_items}, $foreground,
+   "sets found memory free");
+
+mem_get_is($sock, "more5", $val, "item stored from the reserve");
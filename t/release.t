@@ -0,0 +1,37 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 5;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-Z 1");
+my $sock = $server->sock;
+my $val = "x" x 100000;
+
+my $stats = mem_stats($sock);
+ok(exists $stats->{item_released}, "item_released reported");
+ok(exists $stats->{rss}, "rss reported");
+
+for my $i (1..40) {
+    print $sock "set key$i 0 0 100000\r\n$val\r\n";
+    <$sock>;
+}
+for my $i (1..40) {
+    print $sock "delete key$i\r\n";
+    <$sock>;
+}
+
+sleep(3);
+
+$stats = mem_stats($sock);
+ok($stats->{item_released} > 0, "idle free memory released");
+
+# memory is faulted back in when it is needed again.
+for my $i (1..40) {
+    print $sock "set key$i 0 0 100000\r\n$val\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored after release") if $i == 40;
+    <$sock> if $i != 40;
+}
+mem_get_is($sock, "key40", $val);
@@ -0,0 +1,101 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 19;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $up1 = new_memcached();
+my $up2 = new_memcached();
+my $router = new_memcached("-X 127.0.0.1:" . $up1->port . ",127.0.0.1:" . $up2->port);
+my $sock = $router->sock;
+
+sub router_stats {
+    my $stats = {};
+    print $sock "stats router\r\n";
+    while (<$sock>) {
+        last if /^(\.|END)/;
+        /^STAT (\S+) (\S+)/ && ($stats->{$1} = $2);
+    }
+    return $stats;
+}
+
+# the keys an upstream holds, out of the ones given.
+sub held_keys {
+    my ($upstream, @keys) = @_;
+    my $usock = $upstream->sock;
+    my @held;
+    print $usock "get @keys\r\n";
+    while (<$usock>) {
+        last if /^END/;
+        if (/^VALUE (\S+) \d+ (\d+)/) {
+            push @held, $1;
+            <$usock>;
+        }
+    }
+    return @held;
+}
+
+my @keys = map { "key$_" } (1..40);
+my $stored = 0;
+foreach my $key (@keys) {
+    print $sock "set $key 7 0 " . length($key) . "\r\n$key\r\n";
+    $stored++ if scalar <$sock> eq "STORED\r\n";
+}
+is($stored, 40, "stored through the router");
+
+my @held1 = held_keys($up1, @keys);
+my @held2 = held_keys($up2, @keys);
+is(@held1 + @held2, 40, "every key is on one upstream");
+ok(@held1 > 0 && @held2 > 0, "keys spread over both upstreams");
+
+my %got;
+print $sock "get @keys nosuchkey\r\n";
+while (<$sock>) {
+    last if /^END/;
+    if (/^VALUE (\S+) (\d+) (\d+)/) {
+        my ($key, $flags) = ($1, $2);
+        my $data = <$sock>;
+        $data =~ s/\r\n$//;
+        $got{$key} = $data if $flags == 7;
+    }
+}
+is(scalar keys %got, 40, "multiget found every key");
+is(scalar(grep { $got{$_} eq $_ } @keys), 40, "multiget values are right");
+
+mem_get_is({ sock => $sock, flags => 7 }, "key1", "key1");
+
+my $longkey = "a" x 256;
+print $sock "get key1 $longkey key2\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n", "long key refused like a local get");
+print $sock "get @keys $longkey\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n", "long key past the first tokens refused");
+mem_get_is({ sock => $sock, flags => 7 }, "key2", "key2");
+
+print $sock "add key1 0 0 1\r\nx\r\n";
+is(scalar <$sock>, "NOT_STORED\r\n", "add answered by the upstream");
+
+print $sock "set num 0 0 2\r\n10\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored num");
+print $sock "incr num 5\r\n";
+is(scalar <$sock>, "15\r\n", "incremented through the router");
+
+print $sock "delete key1\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted through the router");
+mem_get_is($sock, "key1", undef);
+
+print $sock "flush_all\r\n";
+is(scalar <$sock>, "OK\r\n", "flushed through the router");
+is(held_keys($up1, @keys) + held_keys($up2, @keys), 0, "flush reached both upstreams");
+
+my $stats = router_stats();
+ok($stats->{upstream_0_requests} > 0 && $stats->{upstream_1_requests} > 0 &&
+   $stats->{upstream_0_failures} == 0, "router stats");
+
+# an upstream that isn't there.
+my $dead = new_memcached("-X 127.0.0.1:" . free_port());
+my $dsock = $dead->sock;
+mem_get_is($dsock, "foo", undef);
+print $dsock "set foo 0 0 3\r\nbar\r\n";
+is(scalar <$dsock>, "SERVER_ERROR upstream unavailable\r\n", "set to a dead upstream fails");
@@ -37,7 +37,7 @@ my $sock = $server->sock;
 my $stats = mem_stats($sock);
 
 # Test number of keys
-is(scalar(keys(%$stats)), 31, "31 stats values");
+is(scalar(keys(%$stats)), 39, "39 stats values");
 
 # Test initial state
 foreach my $key (qw(curr_items total_items item_total_size cmd_get cmd_set get_hits evictions get_misses bytes_written)) {
@@ -0,0 +1,77 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 16;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached("-t 4");
+my $sock = $server->sock;
+my @socks = map { $server->new_sock } 1..6;
+
+for my $i (0..$#socks) {
+    my $s = $socks[$i];
+    print $s "set key$i 0 0 6\r\nvalue$i\r\n";
+    <$s>;
+}
+
+my $stats = mem_stats($sock);
+is($stats->{threads}, 5, "four worker threads");
+is($stats->{threads_retiring}, 0, "no threads retiring");
+
+print $sock "threads abc\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "bad thread count rejected");
+
+print $sock "threads 0\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "zero threads rejected");
+
+print $sock "threads 1000\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "too many threads rejected");
+
+print $sock "threads 2\r\n";
+is(scalar <$sock>, "OK\r\n", "lowered to two worker threads");
+is(mem_stats($sock)->{threads}, 3, "thread count lowered");
+
+# idle connections are handed off right away; give the threads a moment.
+my $retiring;
+for (1..20) {
+    $retiring = mem_stats($sock)->{threads_retiring};
+    last if $retiring == 0;
+    sleep(0.1);
+}
+is($retiring, 0, "retired threads have exited");
+
+my $ok = 0;
+for my $i (0..$#socks) {
+    my $s = $socks[$i];
+    print $s "get key$i\r\n";
+    my $line = <$s>;
+    $ok++ if defined $line && $line eq "VALUE key$i 0 6\r\n";
+    <$s>; <$s>;
+}
+is($ok, scalar(@socks), "connections survive retiring their thread");
+
+my $new = $server->new_sock;
+print $new "set fresh 0 0 5\r\nhello\r\n";
+is(scalar <$new>, "STORED\r\n", "new connection served by remaining threads");
+
+print $sock "threads 6\r\n";
+is(scalar <$sock>, "OK\r\n", "raised to six worker threads");
+$stats = mem_stats($sock);
+is($stats->{threads}, 7, "thread count raised");
+ok(defined $stats->{thread_cq_depth_6}, "queue depth reported for new thread");
+
+my @more = map { $server->new_sock } 1..8;
+$ok = 0;
+for my $s (@more) {
+    mem_get_is($s, "fresh", "hello") if $s == $more[0];
+    print $s "get key0\r\n";
+    my $line = <$s>;
+    $ok++ if defined $line && $line eq "VALUE key0 0 6\r\n";
+    <$s>; <$s>;
+}
+is($ok, scalar(@more), "new threads serve connections");
+
+print $sock "threads 4\r\n";
+is(scalar <$sock>, "OK\r\n", "lowered to four worker threads with busy clients");
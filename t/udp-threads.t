@@ -0,0 +1,58 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+plan skip_all => "UDP not supported" unless MemcachedTest::supports_udp();
+plan tests => 7;
+
+my $server = new_memcached("-t 4");
+my $sock = $server->sock;
+
+print $sock "set foo 0 0 6\r\nfooval\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+
+# each client socket has its own source port, which the kernel uses to pick
+# one of the worker threads' udp sockets.
+sub udp_gets {
+    my $ok = 0;
+    for my $i (1..16) {
+        my $usock = $server->new_udp_sock or die "Can't bind : $@\n";
+        my $pkt = pack("nnnn", $i, 0, 1, 0) . "get foo\r\n";
+        send($usock, $pkt, 0) or next;
+
+        my $rin = '';
+        vec($rin, fileno($usock), 1) = 1;
+        next unless select(my $rout = $rin, undef, undef, 1.5);
+
+        my $res;
+        $usock->recv($res, 1500, 0);
+        my ($resid) = unpack("n", $res);
+        $ok++ if $resid == $i && substr($res, 8) eq "VALUE foo 0 6\r\nfooval\r\nEND\r\n";
+    }
+    return $ok;
+}
+
+is(udp_gets(), 16, "every udp client answered by four threads");
+
+print $sock "threads 2\r\n";
+is(scalar <$sock>, "OK\r\n", "lowered to two worker threads");
+for (1..20) {
+    last if mem_stats($sock)->{threads_retiring} == 0;
+    sleep(0.1);
+}
+is(udp_gets(), 16, "every udp client answered after threads retired");
+
+print $sock "threads 6\r\n";
+is(scalar <$sock>, "OK\r\n", "raised to six worker threads");
+is(udp_gets(), 16, "every udp client answered by six threads");
+
+# the port can't be shared with a second server by accident.
+my $exe = "$Bin/../memcached-debug";
+my $user = $< == 0 ? "-u root" : "";
+my $rc = system("timeout 5 $exe -l 127.0.0.1 -p " . free_port() . " -U " .
+                $server->udpport . " $user 2>/dev/null") >> 8;
+is($rc, 1, "second server on the same udp port refuses to start");
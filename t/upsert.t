@@ -0,0 +1,33 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 8;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+# overwrite every key a few times; the hash table must keep one item per key.
+for my $round (1..3) {
+    print $sock join("", map { "set key$_ 0 0 5\r\nv$round$_" . ("x" x (4 - length("$round$_"))) . "\r\n" } 1..200);
+    <$sock> for 1..200;
+}
+my $stats = mem_stats($sock);
+is($stats->{curr_items}, 200, "overwrites replace the old items");
+mem_get_is($sock, "key7", "v37xx", "latest value served");
+
+print $sock "replace key7 0 0 3\r\nnew\r\n";
+is(scalar <$sock>, "STORED\r\n", "replace stored");
+mem_get_is($sock, "key7", "new", "replaced value served");
+
+print $sock "set num 0 0 1\r\n9\r\n";
+<$sock>;
+print $sock "incr num 1\r\n";
+is(scalar <$sock>, "10\r\n", "incr that grows the value");
+mem_get_is($sock, "num", "10", "grown value linked in place of the old one");
+
+print $sock "delete key7 0\r\n";
+is(scalar <$sock>, "DELETED\r\n", "replaced item can be deleted");
+is(mem_stats($sock)->{curr_items}, 200, "item counts stay consistent");
@@ -0,0 +1,63 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 15;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+$ENV{T_MEMD_SLABS_ALLOC} = 0;  # don't preallocate slabs
+
+my $server = new_memcached("-m 2 -V 50");
+my $sock = $server->sock;
+my $val = "abcdefghij" x 1000;
+
+sub victim_stats {
+    my $stats = {};
+    print $sock "stats victim\r\n";
+    while (<$sock>) {
+        last if /^(\.|END)/;
+        /^STAT (\S+) (\S+)/ && ($stats->{$1} = $2);
+    }
+    return $stats;
+}
+
+my $stats = victim_stats();
+is($stats->{victim_limit}, 1024 * 1024, "victim tier is half the memory limit");
+is($stats->{victim_items}, 0, "victim tier starts empty");
+
+# write well past the memory limit so that the oldest keys are evicted.
+print $sock join("", map { "set key$_ 0 0 10000\r\n$val\r\n" } 1..400);
+<$sock> for 1..400;
+
+$stats = mem_stats($sock);
+ok($stats->{evictions} > 0, "items were evicted");
+
+$stats = victim_stats();
+ok($stats->{victim_items} > 0, "evicted items kept in the victim tier");
+
+mem_get_is($sock, "key1", $val, "evicted item served from the victim tier");
+
+$stats = victim_stats();
+is($stats->{victim_hits}, 1, "victim hit counted");
+ok($stats->{victim_stored_bytes} <= $stats->{victim_value_bytes},
+   "victim values are not stored larger than they are");
+
+print $sock "delete key2 0\r\n";
+is(scalar <$sock>, "NOT_FOUND\r\n", "deleting an evicted item is a miss");
+mem_get_is($sock, "key2", undef, "deleted item not brought back");
+
+# stores don't bring evicted items back, but do drop them.
+print $sock "add key4 0 0 3\r\nnew\r\n";
+is(scalar <$sock>, "STORED\r\n", "evicted key can be added");
+print $sock "set key5 0 0 3\r\nnew\r\n";
+is(scalar <$sock>, "STORED\r\n", "evicted key can be set");
+is(victim_stats()->{victim_hits}, 1, "stores don't promote victims");
+mem_get_is($sock, "key4", "new", "added value served");
+print $sock "delete key5 0\r\n";
+<$sock>;
+mem_get_is($sock, "key5", undef, "overwritten victim not brought back");
+
+print $sock "flush_all\r\n";
+<$sock>;
+mem_get_is($sock, "key3", undef, "flush_all empties the victim tier");
@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 13;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $peer = new_memcached();
+my $psock = $peer->sock;
+
+foreach my $n (1..50) {
+    print $psock "set key$n $n 0 6\r\nval$n" . ("x" x (3 - length($n))) . "\r\n";
+    <$psock>;
+}
+print $psock "set expiring 0 1000 4\r\nsoon\r\n";
+<$psock>;
+
+# make key1 the most recently used.
+sleep(2);
+mem_get_is({ sock => $psock, flags => 1 }, "key1", "val1xx");
+
+print $psock "dump_keys 1000000\r\n";
+my @keys;
+while (<$psock>) {
+    last if /^END/;
+    push @keys, $1 if /^KEY (\S+) \d+\r\n$/;
+}
+is(scalar @keys, 51, "dump_keys lists every item");
+is($keys[0], "key1", "most recently used first");
+
+print $psock "dump_keys 1\r\n";
+is(scalar <$psock>, "END\r\n", "budget too small for any item");
+
+print $psock "dump_keys foo\r\n";
+is(scalar <$psock>, "CLIENT_ERROR bad command line format\r\n", "bad budget");
+
+my $server = new_memcached("-A 127.0.0.1:" . $peer->port);
+my $sock = $server->sock;
+
+sub warmup_stats {
+    my $stats = {};
+    print $sock "stats warmup\r\n";
+    while (<$sock>) {
+        last if /^(\.|END)/;
+        /^STAT (\S+) (\S+)/ && ($stats->{$1} = $2);
+    }
+    return $stats;
+}
+
+my $stats = warmup_stats();
+for (1..50) {
+    last if $stats->{warmup_state} eq "done" || $stats->{warmup_state} eq "failed";
+    sleep(0.1);
+    $stats = warmup_stats();
+}
+is($stats->{warmup_state}, "done", "warm-up finished");
+is($stats->{warmup_keys}, 51, "keys listed");
+is($stats->{warmup_loaded}, 51, "items loaded");
+mem_get_is({ sock => $sock, flags => 7 }, "key7", "val7xx");
+mem_get_is({ sock => $sock, flags => 42 }, "key42", "val42x");
+mem_get_is($sock, "expiring", "soon");
+
+# a peer that isn't there.
+my $lonely = new_memcached("-A 127.0.0.1:" . free_port());
+$sock = $lonely->sock;
+$stats = warmup_stats();
+for (1..50) {
+    last if $stats->{warmup_state} eq "failed";
+    sleep(0.1);
+    $stats = warmup_stats();
+}
+is($stats->{warmup_state}, "failed", "unreachable peer");
+print $sock "set foo 0 0 3\r\nbar\r\n";
+is(scalar <$sock>, "STORED\r\n", "serves traffic anyway");
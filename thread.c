@@ -14,6 +14,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
 
 #include "memcached.h"
 #include "assoc.h"
@@ -23,6 +25,9 @@
 
 #define ITEMS_PER_ALLOC 64
 
+#define RECLAIM_INTERVAL_MS 100     /* how often the reclaimer checks for free
+                                     * memory when nobody wakes it up */
+
 /* An item in the connection queue. */
 typedef struct conn_queue_item CQ_ITEM;
 struct conn_queue_item {
@@ -65,6 +70,14 @@ static pthread_mutex_t gstats_lock;
 /* Lock for global stats */
 static pthread_mutex_t conn_buffer_lock;
 
+/* Lock for starting and retiring worker threads, and for dispatching
+ * connections to them */
+static pthread_mutex_t threads_lock;
+
+/* Wakes up the reclaimer thread.  Used with cache_lock. */
+static pthread_cond_t reclaim_cond;
+static bool reclaimer_running = false;
+
 /* Free list of CQ_ITEM structs */
 static CQ_ITEM *cqi_freelist;
 static pthread_mutex_t cqi_freelist_lock;
@@ -82,6 +95,26 @@ typedef struct {
     int notify_receive_fd;      /* receiving end of notify pipe */
     int notify_send_fd;         /* sending end of notify pipe */
     CQ  new_conn_queue;         /* queue of new connections to handle */
+    bool running;               /* thread has started and not yet exited */
+    bool retiring;              /* thread is handing off its connections so
+                                 * it can exit */
+    conn *conns;                /* connections handled by this thread */
+    pthread_mutex_t conns_lock; /* held while conns changes, so that other
+                                 * threads can walk it */
+    conn *busy_conn;            /* connection being served, with -T */
+    struct timeval busy_start;  /* when the worker started serving it */
+    struct event lookup_event;  /* runs the queued lookups */
+    conn *lookup_head;          /* connections waiting for lookups */
+    conn *lookup_tail;
+    conn *maint_done;           /* connections whose admin commands the
+                                 * maintenance thread has finished */
+    pthread_mutex_t maint_lock; /* protects maint_done */
+    bool loop_exit;             /* the event loop is to stop, with -y */
+    uint64_t poll_events;       /* events handled, with -y */
+    uint64_t polls;             /* non-blocking event loop passes, with -y */
+    uint64_t empty_polls;       /* passes that found nothing to do */
+    uint64_t spin_usec;         /* time spent in those */
+    uint64_t sleeps;            /* times the thread gave up and blocked */
 } LIBEVENT_THREAD;
 
 static LIBEVENT_THREAD *threads;
@@ -95,6 +128,8 @@ static pthread_cond_t init_cond;
 
 
 static void thread_libevent_process(int fd, short which, void *arg);
+static void thread_retire_conns(LIBEVENT_THREAD *me);
+static void thread_lookup_batch(int fd, short which, void *arg);
 
 /*
  * Initializes a connection queue.
@@ -277,28 +312,110 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         exit(1);
     }
 
+    /* Run the lookups queued up during an event loop pass */
+    event_set(&me->lookup_event, -1, 0, thread_lookup_batch, me);
+    event_base_set(me->base, &me->lookup_event);
+    me->lookup_head = me->lookup_tail = NULL;
+
     cq_init(&me->new_conn_queue);
     me->timer_initialized = false;
 }
 
+static int64_t usec_between(const struct timeval* from, const struct timeval* to) {
+    return (to->tv_sec - from->tv_sec) * 1000000LL + (to->tv_usec - from->tv_usec);
+}
+
+/*
+ * Busy-polling event loop (-y).  Runs the event loop without blocking over
+ * and over, so that a request is served as soon as it arrives rather than
+ * once the kernel has woken the thread up.  After settings.busy_poll_usec
+ * without an event, blocks until the next one, so that an idle server
+ * doesn't keep its cores spinning.
+ */
+static int worker_busy_poll(LIBEVENT_THREAD *me) {
+    struct timeval idle_since, last, now;
+    uint64_t events = me->poll_events;
+
+    gettimeofday(&last, NULL);
+    idle_since = last;
+    while (! me->loop_exit) {
+        if (event_base_loop(me->base, EVLOOP_NONBLOCK) == -1) {
+            return -1;
+        }
+        me->polls++;
+        gettimeofday(&now, NULL);
+
+        if (me->poll_events != events) {
+            events = me->poll_events;
+            idle_since = now;
+        } else {
+            me->empty_polls++;
+            me->spin_usec += usec_between(&last, &now);
+
+            if (usec_between(&idle_since, &now) >= settings.busy_poll_usec &&
+                ! me->loop_exit) {
+                me->sleeps++;
+                if (event_base_loop(me->base, EVLOOP_ONCE) == -1) {
+                    return -1;
+                }
+                events = me->poll_events;
+                gettimeofday(&now, NULL);
+                idle_since = now;
+            }
+        }
+        last = now;
+    }
+    return 0;
+}
+
 /*
  * Worker thread: main event loop
  */
 static void *worker_libevent(void *arg) {
     LIBEVENT_THREAD *me = arg;
+    int ret;
 
     /* Any per-thread setup can happen here; thread_init() will block until
      * all threads have finished initializing.
      */
 
+    STATS_SET_TLS(me - threads); /* set thread specific stats structure */
     pthread_mutex_lock(&init_lock);
     init_count++;
     pthread_cond_signal(&init_cond);
     pthread_mutex_unlock(&init_lock);
-    STATS_SET_TLS(me - threads); /* set thread specific stats structure */
     clock_handler(0, 0, me);
 
-    return (void*) (intptr_t) event_base_loop(me->base, 0);
+    if (settings.busy_poll_usec > 0) {
+        ret = worker_busy_poll(me);
+    } else {
+        ret = event_base_loop(me->base, 0);
+    }
+
+    /* the event loop only stops once a retiring thread has handed off all
+     * its connections.  give up the thread's resources so that the slot can
+     * be used by a thread started later. */
+    event_del(&me->notify_event);
+    event_del(&me->timer_event);
+    event_del(&me->lookup_event);
+    router_thread_exit(me - threads);
+    event_base_free(me->base);
+    close(me->notify_receive_fd);
+    close(me->notify_send_fd);
+
+    pthread_mutex_lock(&threads_lock);
+    release_conn_buffer_group(me - threads - 1);
+    me->base = NULL;
+    me->retiring = false;
+    me->running = false;
+    pthread_mutex_unlock(&threads_lock);
+
+    if (settings.verbose > 0) {
+        fprintf(stderr, "worker thread %d retired\n", (int) (me - threads));
+    }
+
+    pthread_detach(pthread_self());
+    return (void*) (intptr_t) ret;
 }
 
 
@@ -309,11 +426,13 @@ static void *worker_libevent(void *arg) {
 static void thread_libevent_process(int fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
     CQ_ITEM *item;
+    conn *done, *next;
     char buf[1];
 
     if (read(fd, buf, 1) != 1)
         if (settings.verbose > 0)
             fprintf(stderr, "Can't read from libevent pipe\n");
+    me->poll_events++;
 
     item = cq_peek(&me->new_conn_queue);
 
@@ -322,7 +441,17 @@ static void thread_libevent_process(int fd, short which, void *arg) {
                            item->cbg, item->is_udp,
                            item->is_binary, &item->addr, item->addrlen,
                            me->base);
-        if (c == NULL) {
+        if (c != NULL) {
+            c->thread = me;
+            c->thread_prev = NULL;
+            pthread_mutex_lock(&me->conns_lock);
+            c->thread_next = me->conns;
+            if (me->conns != NULL) {
+                me->conns->thread_prev = c;
+            }
+            me->conns = c;
+            pthread_mutex_unlock(&me->conns_lock);
+        } else {
             if (item->is_udp) {
                 fprintf(stderr, "Can't listen for events on UDP socket\n");
                 exit(1);
@@ -336,26 +465,55 @@ static void thread_libevent_process(int fd, short which, void *arg) {
         }
         cqi_free(item);
     }
+
+    pthread_mutex_lock(&me->maint_lock);
+    done = me->maint_done;
+    me->maint_done = NULL;
+    pthread_mutex_unlock(&me->maint_lock);
+    for (; done != NULL; done = next) {
+        next = done->maint_next;
+        conn_complete_maintenance(done, done->maint_buf, done->maint_len);
+    }
+
+    if (me->retiring) {
+        thread_retire_conns(me);
+    }
+}
+
+/*
+ * Hands the response to an admin command back to the worker thread of the
+ * connection that asked for it.  Called by the maintenance thread; buf is
+ * freed once it is written.
+ */
+void thread_maintenance_done(conn* c, char* buf, const size_t len) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    c->maint_buf = buf;
+    c->maint_len = len;
+    pthread_mutex_lock(&me->maint_lock);
+    c->maint_next = me->maint_done;
+    me->maint_done = c;
+    pthread_mutex_unlock(&me->maint_lock);
+
+    if (write(me->notify_send_fd, "", 1) != 1) {
+        perror("Writing to thread notify pipe");
+    }
 }
 
 /* Which thread we assigned a connection to most recently. */
 static int last_thread = 0;
 
 /*
- * Dispatches a new connection to another thread. This is only ever called
- * from the main thread, either during initialization (for UDP) or because
- * of an incoming connection.
+ * Queues a new connection on a worker thread and wakes it up.  The threads
+ * lock must be held.
  */
-void dispatch_conn_new(int sfd, int init_state, int event_flags,
-                       conn_buffer_group_t* cbg, const bool is_udp, const bool is_binary,
-                       const struct sockaddr* const addr, socklen_t addrlen) {
+static void dispatch_conn_to(const int tix, int sfd, int init_state, int event_flags,
+                             conn_buffer_group_t* cbg, const bool is_udp, const bool is_binary,
+                             const struct sockaddr* const addr, socklen_t addrlen) {
     CQ_ITEM *item = cqi_new();
-    /* Count threads from 1..N to skip the dispatch thread.*/
-    int tix = (last_thread % (settings.num_threads - 1)) + 1;
     LIBEVENT_THREAD *thread = threads+tix;
 
     assert(tix != 0); /* Never dispatch to thread 0 */
-    last_thread = tix;
 
     item->sfd = sfd;
     item->init_state = init_state;
@@ -377,6 +535,37 @@ void dispatch_conn_new(int sfd, int init_state, int event_flags,
     }
 }
 
+/*
+ * Dispatches a new connection to another thread. This is called from the main
+ * thread, either during initialization (for UDP) or because of an incoming
+ * connection, and from retiring threads handing off their connections.
+ */
+void dispatch_conn_new(int sfd, int init_state, int event_flags,
+                       conn_buffer_group_t* cbg, const bool is_udp, const bool is_binary,
+                       const struct sockaddr* const addr, socklen_t addrlen) {
+    int tix;
+
+    pthread_mutex_lock(&threads_lock);
+    /* Count threads from 1..N to skip the dispatch thread.*/
+    tix = (last_thread % (settings.num_threads - 1)) + 1;
+    last_thread = tix;
+    dispatch_conn_to(tix, sfd, init_state, event_flags, cbg, is_udp, is_binary,
+                     addr, addrlen);
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/*
+ * Dispatches a connection to a particular worker thread.  This is how each
+ * worker starts listening on the shared UDP sockets.
+ */
+void dispatch_conn_new_to_thread(const int thread, int sfd, int init_state, int event_flags,
+                                 const bool is_udp, const bool is_binary) {
+    pthread_mutex_lock(&threads_lock);
+    dispatch_conn_to(thread, sfd, init_state, event_flags, NULL, is_udp, is_binary,
+                     NULL, 0);
+    pthread_mutex_unlock(&threads_lock);
+}
+
 /*
  * Returns true if this is the thread that listens for new TCP connections.
  */
@@ -408,6 +597,360 @@ void mt_clock_handler(int fd, short which, void *arg)
         set_current_time();
     }
     update_stats();
+
+    /* connections that were busy last time may be idle by now. */
+    if (me->retiring) {
+        thread_retire_conns(me);
+    }
+}
+
+/*
+ * Queues up the keys of a connection's get, to be looked up along with those
+ * of the other connections that are ready in this event loop pass.  The
+ * lookup event is activated behind the connections that are already active,
+ * so it runs once they have all had their turn.
+ */
+void thread_queue_lookup(conn* c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    c->lookup_next = NULL;
+    if (me->lookup_head == NULL) {
+        me->lookup_head = c;
+        event_active(&me->lookup_event, EV_TIMEOUT, 1);
+    } else {
+        me->lookup_tail->lookup_next = c;
+    }
+    me->lookup_tail = c;
+}
+
+/*
+ * Looks up all the queued keys under one acquisition of the cache lock, then
+ * sends the responses.  The keys were hashed when they were queued; the hash
+ * buckets are prefetched first so that the lookups don't wait on each other's
+ * cache misses.
+ */
+static void thread_lookup_batch(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    conn *c, *next, *head = me->lookup_head;
+    int k;
+
+    me->poll_events++;
+
+    /* connections may queue up lookups again as they carry on. */
+    me->lookup_head = me->lookup_tail = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    for (c = head; c != NULL; c = c->lookup_next) {
+        for (k = 0; k < c->lookup_count; k++) {
+            assoc_prefetch(c->lookup_hvs[k]);
+        }
+    }
+    for (c = head; c != NULL; c = c->lookup_next) {
+        for (k = 0; k < c->lookup_count; k++) {
+            item *it = do_item_get_promote(c->lookup_keys[k], c->lookup_nkeys[k],
+                                           c->lookup_hvs[k]);
+            if (it != NULL) {
+                do_item_update(it);
+            }
+            c->lookup_items[k] = it;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    for (c = head; c != NULL; c = next) {
+        next = c->lookup_next;
+        conn_complete_lookup(c);
+    }
+}
+
+/*
+ * Adds the time since the worker started serving its current connection to
+ * the connection's busy time.
+ */
+static void thread_account_busy(LIBEVENT_THREAD *me) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    me->busy_conn->traffic.busy_usec +=
+        (now.tv_sec - me->busy_start.tv_sec) * 1000000LL +
+        (now.tv_usec - me->busy_start.tv_usec);
+    me->busy_conn = NULL;
+}
+
+/*
+ * Notes that the worker thread is starting to serve a connection (-T).
+ */
+void thread_conn_busy(conn* c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    me->busy_conn = c;
+    gettimeofday(&me->busy_start, NULL);
+}
+
+/*
+ * Notes that the worker thread is done serving the connection passed to
+ * thread_conn_busy, unless the connection was closed in the meantime.
+ */
+void thread_conn_idle(void* thread) {
+    LIBEVENT_THREAD *me = thread;
+
+    if (me->busy_conn != NULL) {
+        thread_account_busy(me);
+    }
+}
+
+/*
+ * Notes that the worker thread handled an event, so that a busy-polling
+ * thread knows it isn't idle (-y).
+ */
+void thread_poll_event(void* thread) {
+    ((LIBEVENT_THREAD*) thread)->poll_events++;
+}
+
+/*
+ * Reports what busy-polling costs (-y): for each worker thread, how many
+ * times it polled for events, how many of those found none, and how much
+ * time those took, which is the CPU time spent spinning; and how often it
+ * gave up and slept.
+ */
+char* thread_busy_poll_stats(size_t* result_size) {
+    size_t bufsize = 256 + settings.max_threads * 256, offset = 0;
+    char* buffer = malloc(bufsize);
+    char terminator[] = "END\r\n";
+    uint64_t polls = 0, empty_polls = 0, spin_usec = 0, sleeps = 0;
+    int ix;
+
+    if (buffer == NULL) {
+        *result_size = 0;
+        return NULL;
+    }
+
+    offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                              "STAT busy_poll_usec %d\r\n"
+                              "STAT busy_poll_sock_usec %d\r\n",
+                              settings.busy_poll_usec,
+                              settings.busy_poll_sock_usec);
+
+    pthread_mutex_lock(&threads_lock);
+    for (ix = 1; ix < settings.max_threads; ix++) {
+        LIBEVENT_THREAD *me = &threads[ix];
+
+        if (! me->running) {
+            continue;
+        }
+        offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                                  "STAT thread_%d_polls %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT thread_%d_empty_polls %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT thread_%d_spin_usec %" PRINTF_INT64_MODIFIER "u\r\n"
+                                  "STAT thread_%d_sleeps %" PRINTF_INT64_MODIFIER "u\r\n",
+                                  ix, me->polls,
+                                  ix, me->empty_polls,
+                                  ix, me->spin_usec,
+                                  ix, me->sleeps);
+        polls += me->polls;
+        empty_polls += me->empty_polls;
+        spin_usec += me->spin_usec;
+        sleeps += me->sleeps;
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                              "STAT polls %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT empty_polls %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT spin_usec %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT sleeps %" PRINTF_INT64_MODIFIER "u\r\n",
+                              polls, empty_polls, spin_usec, sleeps);
+    offset = append_to_buffer(buffer, bufsize, offset, 0, terminator);
+
+    *result_size = offset;
+    return buffer;
+}
+
+/*
+ * Returns the slot of the thread serving a connection; 0 for the dispatcher.
+ */
+int thread_index(const conn* c) {
+    return c->thread == NULL ? 0 : (LIBEVENT_THREAD*) c->thread - threads;
+}
+
+/*
+ * Takes a connection off its thread's list when it is closed or handed to
+ * another thread, and keeps its traffic for "stats clients".
+ */
+void thread_conn_closed(conn* c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (me == NULL) {
+        return;
+    }
+
+    if (me->busy_conn == c) {
+        thread_account_busy(me);
+    }
+    if (settings.client_stats && ! c->udp) {
+        stats_client_fold(c);
+    }
+
+    pthread_mutex_lock(&me->conns_lock);
+    if (c->thread_prev != NULL) {
+        c->thread_prev->thread_next = c->thread_next;
+    } else {
+        me->conns = c->thread_next;
+    }
+    if (c->thread_next != NULL) {
+        c->thread_next->thread_prev = c->thread_prev;
+    }
+    pthread_mutex_unlock(&me->conns_lock);
+    c->thread = NULL;
+    c->thread_next = c->thread_prev = NULL;
+}
+
+/*
+ * Calls visit on every connection the worker threads are serving.  The
+ * connections can't go away during the call, but their owners keep serving
+ * them, so visit should only copy out what it needs.
+ */
+void thread_conns_visit(void (*visit)(const conn* c, void* arg), void* arg) {
+    conn *c;
+    int ix;
+
+    pthread_mutex_lock(&threads_lock);
+    for (ix = 1; ix < settings.max_threads; ix++) {
+        LIBEVENT_THREAD *me = &threads[ix];
+
+        if (! me->running) {
+            continue;
+        }
+        pthread_mutex_lock(&me->conns_lock);
+        for (c = me->conns; c != NULL; c = c->thread_next) {
+            visit(c, arg);
+        }
+        pthread_mutex_unlock(&me->conns_lock);
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/*
+ * Hands a retiring thread's idle connections to the remaining worker threads.
+ * Connections in the middle of a request are left alone until the next
+ * call.  Once the thread has no connections left, its event loop is stopped
+ * and the thread exits.
+ */
+static void thread_retire_conns(LIBEVENT_THREAD *me) {
+    conn *c, *next;
+    size_t queued;
+
+    for (c = me->conns; c != NULL; c = next) {
+        next = c->thread_next;
+        if (conn_is_idle(c)) {
+            thread_conn_closed(c);
+            conn_migrate(c);
+        }
+    }
+
+    /* no new connections are dispatched to a retiring thread, but some may
+     * have been queued before it started retiring. */
+    pthread_mutex_lock(&me->new_conn_queue.lock);
+    queued = me->new_conn_queue.count;
+    pthread_mutex_unlock(&me->new_conn_queue.lock);
+
+    if (me->conns == NULL && queued == 0) {
+        me->loop_exit = true;
+        event_base_loopexit(me->base, NULL);
+    }
+}
+
+/*
+ * Starts a worker thread in an unused slot and waits for it to set itself up.
+ * The threads lock must be held.
+ */
+static void thread_start(const int ix) {
+    LIBEVENT_THREAD *me = &threads[ix];
+    int fds[2];
+    int target;
+
+    if (pipe(fds)) {
+        perror("Can't create notify pipe");
+        exit(1);
+    }
+
+    me->notify_receive_fd = fds[0];
+    me->notify_send_fd = fds[1];
+    me->conns = NULL;
+    me->retiring = false;
+    me->loop_exit = false;
+    setup_thread(me);
+    me->running = true;
+
+    pthread_mutex_lock(&init_lock);
+    target = init_count + 1;
+    pthread_mutex_unlock(&init_lock);
+
+    create_worker(ix, worker_libevent, me);
+
+    pthread_mutex_lock(&init_lock);
+    while (init_count < target) {
+        pthread_cond_wait(&init_cond, &init_lock);
+    }
+    pthread_mutex_unlock(&init_lock);
+}
+
+/*
+ * Changes the number of worker threads.  New threads are started right away.
+ * Threads being retired stop getting new connections at once, hand their idle
+ * connections to the remaining threads, and exit once they have none left.
+ *
+ * Returns the previous number of libevent threads (including the dispatcher),
+ * -1 if nworkers is out of range, or -2 if a thread that would have to be
+ * started again hasn't finished retiring yet.
+ */
+int thread_set_workers(const int nworkers) {
+    int ix, old, target = nworkers + 1;
+
+    if (nworkers < 1 || target > settings.max_threads) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&threads_lock);
+    old = settings.num_threads;
+
+    for (ix = old; ix < target; ix++) {
+        if (threads[ix].running) {
+            pthread_mutex_unlock(&threads_lock);
+            return -2;
+        }
+    }
+
+    for (ix = old; ix < target; ix++) {
+        thread_start(ix);
+    }
+    for (ix = target; ix < old; ix++) {
+        threads[ix].retiring = true;
+        if (write(threads[ix].notify_send_fd, "", 1) != 1) {
+            perror("Writing to thread notify pipe");
+        }
+    }
+    settings.num_threads = target;
+    pthread_mutex_unlock(&threads_lock);
+
+    return old;
+}
+
+/*
+ * Returns the number of worker threads that are retiring but haven't exited.
+ */
+int thread_retiring_count(void) {
+    int ix, count = 0;
+
+    pthread_mutex_lock(&threads_lock);
+    for (ix = settings.num_threads; ix < settings.max_threads; ix++) {
+        if (threads[ix].running) {
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&threads_lock);
+
+    return count;
 }
 
 /********************************* ITEM ACCESS *******************************/
@@ -438,9 +981,23 @@ item *mt_item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int n
  * lazy-expiring as needed.
  */
 item *mt_item_get_notedeleted(const char *key, const size_t nkey, bool *delete_locked) {
+    const uint32_t hv = hash(key, nkey, 0);
+    item *it;
+    pthread_mutex_lock(&cache_lock);
+    it = do_item_get_notedeleted(key, nkey, hv, delete_locked);
+    pthread_mutex_unlock(&cache_lock);
+    return it;
+}
+
+/*
+ * Returns an item for a get, moving it back from the victim tier if it was
+ * evicted.
+ */
+item *mt_item_get_promote(const char *key, const size_t nkey) {
+    const uint32_t hv = hash(key, nkey, 0);
     item *it;
     pthread_mutex_lock(&cache_lock);
-    it = do_item_get_notedeleted(key, nkey, delete_locked);
+    it = do_item_get_promote(key, nkey, hv);
     pthread_mutex_unlock(&cache_lock);
     return it;
 }
@@ -490,10 +1047,11 @@ int mt_defer_delete(item *item, time_t exptime) {
  */
 char *mt_add_delta(const char* key, const size_t nkey, const int incr, const unsigned int delta,
                    char *buf, uint32_t *res, const struct in_addr addr) {
+    const uint32_t hv = hash(key, nkey, 0);
     char *ret;
 
     pthread_mutex_lock(&cache_lock);
-    ret = do_add_delta(key, nkey, incr, delta, buf, res, addr);
+    ret = do_add_delta(key, nkey, hv, incr, delta, buf, res, addr);
     pthread_mutex_unlock(&cache_lock);
     return ret;
 }
@@ -502,10 +1060,11 @@ char *mt_add_delta(const char* key, const size_t nkey, const int incr, const uns
  * Stores an item in the cache (high level, obeys set/add/replace semantics)
  */
 int mt_store_item(item *item, int comm, const char* key) {
+    const uint32_t hv = hash(key, ITEM_nkey(item), 0);
     int ret;
 
     pthread_mutex_lock(&cache_lock);
-    ret = do_store_item(item, comm, key);
+    ret = do_store_item(item, comm, key, hv);
     pthread_mutex_unlock(&cache_lock);
     return ret;
 }
@@ -520,42 +1079,76 @@ void mt_item_flush_expired() {
 }
 
 /*
- * Dumps part of the cache
+ * Returns idle free item memory to the OS
  */
-char *mt_item_cachedump(unsigned int slabs_clsid, unsigned int limit, unsigned int *bytes) {
-    char *ret;
+void item_release_memory(void) {
+    pthread_mutex_lock(&cache_lock);
+    do_item_release_memory();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Changes the item memory limit
+ */
+bool item_set_maxbytes(const size_t maxbytes) {
+    bool ret;
 
     pthread_mutex_lock(&cache_lock);
-    ret = do_item_cachedump(slabs_clsid, limit, bytes);
+    ret = do_item_set_maxbytes(maxbytes);
     pthread_mutex_unlock(&cache_lock);
     return ret;
 }
 
-#if defined(USE_SLAB_ALLOCATOR)
 /*
- * Dumps statistics about slab classes
+ * Drops a key from the victim tier
  */
-char *mt_item_stats(int *bytes) {
+bool victim_delete(const char* key, const size_t nkey) {
+    const uint32_t hv = hash(key, nkey, 0);
+    bool ret;
+
+    pthread_mutex_lock(&cache_lock);
+    ret = do_victim_delete(key, nkey, hv);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+/*
+ * Dumps the victim tier stats
+ */
+char* victim_stats(size_t* result_size) {
+    char* ret;
+
+    pthread_mutex_lock(&cache_lock);
+    ret = do_victim_stats(result_size);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+/*
+ * Dumps part of the cache
+ */
+char *mt_item_cachedump(unsigned int slabs_clsid, unsigned int limit, unsigned int *bytes) {
     char *ret;
 
     pthread_mutex_lock(&cache_lock);
-    ret = do_item_stats(bytes);
+    ret = do_item_cachedump(slabs_clsid, limit, bytes);
     pthread_mutex_unlock(&cache_lock);
     return ret;
 }
-#endif /* #if defined(USE_SLAB_ALLOCATOR) */
 
+#if defined(USE_SLAB_ALLOCATOR)
 /*
- * Dumps a list of objects of each size in 32-byte increments
+ * Dumps statistics about slab classes
  */
-char *mt_item_stats_sizes(int *bytes) {
+char *mt_item_stats(int *bytes) {
     char *ret;
 
     pthread_mutex_lock(&cache_lock);
-    ret = do_item_stats_sizes(bytes);
+    ret = do_item_stats(bytes);
     pthread_mutex_unlock(&cache_lock);
     return ret;
 }
+#endif /* #if defined(USE_SLAB_ALLOCATOR) */
 
 /*
  * Dumps connect-queue depths for each thread
@@ -587,6 +1180,16 @@ int mt_assoc_expire_regex(char *pattern) {
     return ret;
 }
 
+bool assoc_walk(assoc_cursor_t* cursor, const uint32_t buckets,
+                item_visitor_t visit, void* arg) {
+    bool ret;
+
+    pthread_mutex_lock(&cache_lock);
+    ret = do_assoc_walk(cursor, buckets, visit, arg);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
 void mt_assoc_move_next_bucket() {
     pthread_mutex_lock(&cache_lock);
     do_assoc_move_next_bucket();
@@ -634,6 +1237,34 @@ void mt_slabs_rebalance() {
     do_slabs_rebalance();
     pthread_mutex_unlock(&slabs_lock);
 }
+
+void mt_slabs_release_memory(const rel_time_t idle) {
+    pthread_mutex_lock(&slabs_lock);
+    do_slabs_release_memory(idle);
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+bool mt_slabs_set_limit(const size_t limit) {
+    bool ret;
+
+    pthread_mutex_lock(&slabs_lock);
+    ret = do_slabs_set_limit(limit);
+    pthread_mutex_unlock(&slabs_lock);
+    return ret;
+}
+
+void mt_slabs_shrink(void) {
+    pthread_mutex_lock(&slabs_lock);
+    do_slabs_shrink();
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+void mt_slabs_free_shortfall(const unsigned int percent, unsigned int *shortfall,
+                             const unsigned int nclasses) {
+    pthread_mutex_lock(&slabs_lock);
+    do_slabs_free_shortfall(percent, shortfall, nclasses);
+    pthread_mutex_unlock(&slabs_lock);
+}
 #endif /* #if defined(USE_SLAB_ALLOCATOR) */
 
 #if defined(USE_FLAT_ALLOCATOR)
@@ -646,6 +1277,15 @@ char* flat_allocator_stats(size_t* result_size) {
     pthread_mutex_unlock(&cache_lock);
     return ret;
 }
+
+char* key_prefix_stats(size_t* result_size) {
+    char* ret;
+
+    pthread_mutex_lock(&cache_lock);
+    ret = do_key_prefix_stats(result_size);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
 #endif /* #if defined(USE_FLAT_ALLOCATOR) */
 
 /******************************* GLOBAL STATS ******************************/
@@ -712,6 +1352,8 @@ void mt_stats_reset(void) {
         STATS_LOCK(stats);
         stats->total_items = stats->total_conns = 0;
         stats->get_cmds = stats->set_cmds = stats->get_hits = stats->get_misses = stats->evictions = 0;
+        stats->evicted_bytes = stats->reclaimed_items = 0;
+        stats->evicted_unfetched = stats->evicted_hits = 0;
         stats->arith_cmds = stats->arith_hits = 0;
         stats->bytes_read = stats->bytes_written = 0;
         STATS_UNLOCK(stats);
@@ -732,6 +1374,7 @@ void mt_stats_aggregate(stats_t *accum) {
         _AGGREGATE(curr_items);
         _AGGREGATE(total_items);
         _AGGREGATE(item_storage_allocated);
+        _AGGREGATE(item_storage_released);
         _AGGREGATE(item_total_size);
         _AGGREGATE(curr_conns);
         _AGGREGATE(total_conns);
@@ -743,6 +1386,10 @@ void mt_stats_aggregate(stats_t *accum) {
         _AGGREGATE(arith_cmds);
         _AGGREGATE(arith_hits);
         _AGGREGATE(evictions);
+        _AGGREGATE(evicted_bytes);
+        _AGGREGATE(evicted_unfetched);
+        _AGGREGATE(evicted_hits);
+        _AGGREGATE(reclaimed_items);
         _AGGREGATE(bytes_read);
         _AGGREGATE(bytes_written);
         _AGGREGATE(get_bytes);
@@ -768,6 +1415,50 @@ void mt_stats_aggregate(stats_t *accum) {
 #undef _AGGREGATE
 }
 
+/*
+ * Keeps settings.reclaim_percent of the item memory free by evicting ahead of
+ * the sets that would otherwise have to.  The cache lock is let go between
+ * batches, and the CPU yielded, so that the workers don't wait long behind
+ * us.
+ */
+static void *reclaimer_loop(void *arg) {
+    STATS_SET_TLS(0);   /* shares the main thread's stats */
+
+    pthread_mutex_lock(&cache_lock);
+    while (1) {
+        if (do_item_reclaim()) {
+            pthread_mutex_unlock(&cache_lock);
+            /* the lock is adaptive; without this we'd usually get it straight
+             * back ahead of the workers spinning on it. */
+            sched_yield();
+            pthread_mutex_lock(&cache_lock);
+        } else {
+            struct timeval now;
+            struct timespec until;
+
+            gettimeofday(&now, NULL);
+            until.tv_sec = now.tv_sec;
+            until.tv_nsec = (now.tv_usec + RECLAIM_INTERVAL_MS * 1000) * 1000;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec ++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&reclaim_cond, &cache_lock, &until);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Wakes up the reclaimer when an allocation finds free memory running low.
+ * Must be called with the cache lock held.
+ */
+void thread_wake_reclaimer(void) {
+    if (reclaimer_running) {
+        pthread_cond_signal(&reclaim_cond);
+    }
+}
+
 /*
  * Initializes the thread subsystem, creating various worker threads.
  *
@@ -795,7 +1486,10 @@ void thread_init(int nthreads, struct event_base *main_base) {
     pthread_mutex_init(&cqi_freelist_lock, NULL);
     cqi_freelist = NULL;
 
-    threads = calloc(nthreads, sizeof(LIBEVENT_THREAD));
+    pthread_mutex_init(&threads_lock, NULL);
+
+    /* leave room for threads started later by thread_set_workers. */
+    threads = calloc(settings.max_threads, sizeof(LIBEVENT_THREAD));
     if (! threads) {
         perror("Can't allocate thread descriptors");
         exit(1);
@@ -803,6 +1497,10 @@ void thread_init(int nthreads, struct event_base *main_base) {
 
     threads[0].base = main_base;
     threads[0].thread_id = pthread_self();
+    for (i = 0; i < settings.max_threads; i++) {
+        pthread_mutex_init(&threads[i].conns_lock, NULL);
+        pthread_mutex_init(&threads[i].maint_lock, NULL);
+    }
 
     for (i = 0; i < nthreads; i++) {
         int fds[2];
@@ -815,6 +1513,7 @@ void thread_init(int nthreads, struct event_base *main_base) {
         threads[i].notify_send_fd = fds[1];
 
         setup_thread(&threads[i]);
+        threads[i].running = true;
     }
 
     /* Create threads after we've done all the libevent setup. */
@@ -829,4 +1528,16 @@ void thread_init(int nthreads, struct event_base *main_base) {
         pthread_cond_wait(&init_cond, &init_lock);
     }
     pthread_mutex_unlock(&init_lock);
+
+    if (settings.reclaim_percent != 0) {
+        pthread_t thread;
+        int ret;
+
+        pthread_cond_init(&reclaim_cond, NULL);
+        reclaimer_running = true;
+        if ((ret = pthread_create(&thread, NULL, reclaimer_loop, NULL)) != 0) {
+            fprintf(stderr, "Can't create reclaimer thread: %s\n", strerror(ret));
+            exit(1);
+        }
+    }
 }
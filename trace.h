@@ -0,0 +1,76 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#if !defined(_trace_h_)
+#define _trace_h_
+
+/*
+ * static tracepoints for perf, bpftrace and systemtap.  when sys/sdt.h is
+ * found at configure time, each TRACE_* macro becomes a USDT probe in the
+ * "memcached" provider: a single nop in the code plus a note in the binary
+ * that tools use to find it, e.g.
+ *
+ *     bpftrace -e 'usdt:./memcached:memcached:item_get_miss
+ *                  { @[str(arg0, arg1)] = count(); }'
+ *
+ * otherwise they compile to nothing, and so do their arguments.
+ */
+
+#if defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+
+#define TRACE_ENABLED 1
+
+/* a connection moved from one conn_states_t state to another. */
+#define TRACE_CONN_STATE(fd, from, to)                          \
+    DTRACE_PROBE3(memcached, conn_state, fd, from, to)
+
+/* a get found a key, or didn't.  the key isn't NUL-terminated. */
+#define TRACE_ITEM_GET_HIT(key, nkey, nbytes)                   \
+    DTRACE_PROBE3(memcached, item_get_hit, key, nkey, nbytes)
+#define TRACE_ITEM_GET_MISS(key, nkey)                          \
+    DTRACE_PROBE2(memcached, item_get_miss, key, nkey)
+
+/* an item was allocated (ok is 1) or couldn't be (0), after evicting that
+ * many items. */
+#define TRACE_ITEM_ALLOC(key, nkey, nbytes, ok, evictions)      \
+    DTRACE_PROBE5(memcached, item_alloc, key, nkey, nbytes, ok, evictions)
+
+/* the hash table started growing to 2^hashpower buckets, and finished
+ * moving the items over. */
+#define TRACE_ASSOC_EXPAND_START(hashpower, items)              \
+    DTRACE_PROBE2(memcached, assoc_expand_start, hashpower, items)
+#define TRACE_ASSOC_EXPAND_DONE(hashpower, items)               \
+    DTRACE_PROBE2(memcached, assoc_expand_done, hashpower, items)
+
+/* the flat allocator coalesced free small chunks into large ones. */
+#define TRACE_FLAT_COALESCE_START(small_free, large_free)       \
+    DTRACE_PROBE2(memcached, flat_coalesce_start, small_free, large_free)
+#define TRACE_FLAT_COALESCE_DONE(small_free, large_free)        \
+    DTRACE_PROBE2(memcached, flat_coalesce_done, small_free, large_free)
+
+/* a slab page moved from one slab class to another. */
+#define TRACE_SLABS_REASSIGN(srcid, dstid)                      \
+    DTRACE_PROBE2(memcached, slabs_reassign, srcid, dstid)
+
+/* a free connection buffer was given back to the OS. */
+#define TRACE_CONN_BUFFER_RECLAIM(max_rusage, total_rsize)      \
+    DTRACE_PROBE2(memcached, conn_buffer_reclaim, max_rusage, total_rsize)
+
+#else
+
+#define TRACE_ENABLED 0
+
+#define TRACE_CONN_STATE(fd, from, to)
+#define TRACE_ITEM_GET_HIT(key, nkey, nbytes)
+#define TRACE_ITEM_GET_MISS(key, nkey)
+#define TRACE_ITEM_ALLOC(key, nkey, nbytes, ok, evictions)
+#define TRACE_ASSOC_EXPAND_START(hashpower, items)
+#define TRACE_ASSOC_EXPAND_DONE(hashpower, items)
+#define TRACE_FLAT_COALESCE_START(small_free, large_free)
+#define TRACE_FLAT_COALESCE_DONE(small_free, large_free)
+#define TRACE_SLABS_REASSIGN(srcid, dstid)
+#define TRACE_CONN_BUFFER_RECLAIM(max_rusage, total_rsize)
+
+#endif /* #if defined(HAVE_SYS_SDT_H) */
+
+#endif /* #if !defined(_trace_h_) */
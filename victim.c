@@ -0,0 +1,391 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Victim tier.  Items evicted from the cache are copied here, compressed, and
+ * kept in their own hash table and LRU until the tier fills up.  Many evicted
+ * items are asked for again a little later; a get that misses the main hash
+ * table finds them here and moves them back into the cache.
+ *
+ * The tier is sized as a percentage of the memory limit (-V), and is kept in
+ * addition to it.  Values are compressed with zlib when it is available, and
+ * stored as is otherwise or when compression doesn't save anything.
+ */
+#include "generic.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_LIBZ)
+#include <zlib.h>
+#endif /* #if defined(HAVE_LIBZ) */
+
+#include "memcached.h"
+#include "assoc.h"
+
+typedef struct victim_s victim_t;
+struct victim_s {
+    victim_t*    h_next;        /* hash chain next */
+    victim_t*    next;          /* towards the LRU tail */
+    victim_t*    prev;          /* towards the LRU head */
+    rel_time_t   time;          /* last access before the item was evicted */
+    rel_time_t   exptime;       /* expire time */
+    unsigned int flags;         /* flags field */
+    uint32_t     nbytes;        /* size of the value */
+    uint32_t     nstored;       /* size of the value as stored; equal to
+                                 * nbytes if it isn't compressed. */
+    uint8_t      nkey;          /* key length */
+    char         data[];        /* key, with a terminating null, then value */
+};
+
+#define VICTIM_HASHSIZE    (1 << VICTIM_HASHPOWER)
+#define VICTIM_HASHMASK    (VICTIM_HASHSIZE - 1)
+
+static struct {
+    victim_t**   hashtable;
+    victim_t*    head;
+    victim_t*    tail;
+    size_t       bytes;         /* memory taken by victims, headers included */
+    size_t       count;
+    uint64_t     value_bytes;   /* sizes of the resident values, uncompressed */
+    uint64_t     stored_bytes;  /* sizes of the resident values, as stored */
+
+    char*        raw;           /* scratch space for uncompressed values */
+    size_t       raw_size;
+    char*        packed;        /* scratch space for compressed values */
+    size_t       packed_size;
+    char*        out;           /* scratch space for values being promoted */
+    size_t       out_size;
+
+    struct {
+        uint64_t inserts;
+        uint64_t evictions;
+        uint64_t rejects;
+        uint64_t hits;
+        uint64_t misses;
+    } stats;
+} vi;
+
+
+void victim_init(void) {
+    if (settings.victim_percent == 0) {
+        return;
+    }
+
+    vi.hashtable = calloc(VICTIM_HASHSIZE, sizeof(victim_t*));
+    if (vi.hashtable == NULL) {
+        fprintf(stderr, "Failed to init victim tier.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static size_t victim_limit(void) {
+    return (uint64_t) settings.maxbytes * settings.victim_percent / 100;
+}
+
+
+static size_t victim_size(const victim_t* v) {
+    return sizeof(victim_t) + v->nkey + 1 + v->nstored;
+}
+
+
+static bool scratch_reserve(char** buf, size_t* size, const size_t needed) {
+    char* newbuf;
+
+    if (*size >= needed) {
+        return true;
+    }
+    if ((newbuf = realloc(*buf, needed)) == NULL) {
+        return false;
+    }
+    *buf = newbuf;
+    *size = needed;
+    return true;
+}
+
+
+/* the tier hashes keys the same way as the main hash table, so a lookup that
+ * missed there reuses its hash value. */
+static victim_t** victim_bucket(const uint32_t hv) {
+    return &vi.hashtable[hv & VICTIM_HASHMASK];
+}
+
+
+static victim_t** victim_find(const char* key, const size_t nkey, const uint32_t hv) {
+    victim_t** pos = victim_bucket(hv);
+
+    while (*pos != NULL &&
+           ((*pos)->nkey != nkey || memcmp((*pos)->data, key, nkey) != 0)) {
+        pos = &(*pos)->h_next;
+    }
+    return pos;
+}
+
+
+/* removes a victim from the hash table and LRU, and frees it. */
+static void victim_free(victim_t** pos) {
+    victim_t* v = *pos;
+
+    *pos = v->h_next;
+
+    if (v->prev != NULL) {
+        v->prev->next = v->next;
+    } else {
+        vi.head = v->next;
+    }
+    if (v->next != NULL) {
+        v->next->prev = v->prev;
+    } else {
+        vi.tail = v->prev;
+    }
+
+    vi.bytes -= victim_size(v);
+    vi.count --;
+    vi.value_bytes -= v->nbytes;
+    vi.stored_bytes -= v->nstored;
+    free(v);
+}
+
+
+void do_victim_insert(item* it, const char* key) {
+    const size_t nkey = ITEM_nkey(it), nbytes = ITEM_nbytes(it);
+    const size_t limit = victim_limit();
+    uint32_t hv;
+    const char* value;
+    size_t nstored;
+    victim_t** pos;
+    victim_t* v;
+
+    if (limit == 0) {
+        return;
+    }
+
+    hv = hash(key, nkey, 0);
+    pos = victim_find(key, nkey, hv);
+    if (*pos != NULL) {
+        victim_free(pos);
+    }
+
+    if (! scratch_reserve(&vi.raw, &vi.raw_size, nbytes)) {
+        vi.stats.rejects ++;
+        return;
+    }
+    item_memcpy_from(vi.raw, it, 0, nbytes, false);
+    value = vi.raw;
+    nstored = nbytes;
+
+#if defined(HAVE_LIBZ)
+    if (nbytes >= VICTIM_MIN_NBYTES &&
+        scratch_reserve(&vi.packed, &vi.packed_size, compressBound(nbytes))) {
+        uLongf packed = vi.packed_size;
+
+        if (compress2((Bytef*) vi.packed, &packed, (const Bytef*) vi.raw, nbytes,
+                      Z_BEST_SPEED) == Z_OK &&
+            packed < nbytes) {
+            value = vi.packed;
+            nstored = packed;
+        }
+    }
+#endif /* #if defined(HAVE_LIBZ) */
+
+    if (sizeof(victim_t) + nkey + 1 + nstored > limit ||
+        (v = malloc(sizeof(victim_t) + nkey + 1 + nstored)) == NULL) {
+        vi.stats.rejects ++;
+        return;
+    }
+
+    v->time = ITEM_time(it);
+    v->exptime = ITEM_exptime(it);
+    v->flags = ITEM_flags(it);
+    v->nbytes = nbytes;
+    v->nstored = nstored;
+    v->nkey = nkey;
+    memcpy(v->data, key, nkey);
+    v->data[nkey] = '\0';
+    memcpy(v->data + nkey + 1, value, nstored);
+
+    /* make room, oldest victims first. */
+    while (vi.tail != NULL && vi.bytes + victim_size(v) > limit) {
+        victim_free(victim_find(vi.tail->data, vi.tail->nkey,
+                                hash(vi.tail->data, vi.tail->nkey, 0)));
+        vi.stats.evictions ++;
+    }
+
+    v->h_next = *victim_bucket(hv);
+    *victim_bucket(hv) = v;
+    v->prev = NULL;
+    v->next = vi.head;
+    if (vi.head != NULL) {
+        vi.head->prev = v;
+    }
+    vi.head = v;
+    if (vi.tail == NULL) {
+        vi.tail = v;
+    }
+
+    vi.bytes += victim_size(v);
+    vi.count ++;
+    vi.value_bytes += nbytes;
+    vi.stored_bytes += nstored;
+    vi.stats.inserts ++;
+}
+
+
+item* do_victim_promote(const char* key, const size_t nkey, const uint32_t hv) {
+    static const struct in_addr no_addr;
+    const char* value;
+    victim_t** pos;
+    victim_t* v;
+    unsigned int flags;
+    rel_time_t exptime;
+    size_t nbytes;
+    item* it;
+
+    if (vi.count == 0) {
+        if (vi.hashtable != NULL) {
+            vi.stats.misses ++;
+        }
+        return NULL;
+    }
+
+    pos = victim_find(key, nkey, hv);
+    v = *pos;
+    if (v == NULL) {
+        vi.stats.misses ++;
+        return NULL;
+    }
+
+    /* the same lazy expiration as the main hash table. */
+    if ((settings.oldest_live != 0 && settings.oldest_live <= current_time &&
+         v->time <= settings.oldest_live) ||
+        (v->exptime != 0 && v->exptime <= current_time) ||
+        ! scratch_reserve(&vi.out, &vi.out_size, v->nbytes)) {
+        victim_free(pos);
+        vi.stats.misses ++;
+        return NULL;
+    }
+
+    /* copy the value out and drop the victim before allocating, since the
+     * allocation may evict items into the tier. */
+    value = v->data + v->nkey + 1;
+    if (v->nstored == v->nbytes) {
+        memcpy(vi.out, value, v->nbytes);
+    } else {
+#if defined(HAVE_LIBZ)
+        uLongf unpacked = v->nbytes;
+
+        if (uncompress((Bytef*) vi.out, &unpacked, (const Bytef*) value,
+                       v->nstored) != Z_OK ||
+            unpacked != v->nbytes) {
+            victim_free(pos);
+            vi.stats.misses ++;
+            return NULL;
+        }
+#else
+        assert(0);
+#endif /* #if defined(HAVE_LIBZ) */
+    }
+
+    flags = v->flags;
+    exptime = v->exptime;
+    nbytes = v->nbytes;
+    victim_free(pos);
+
+    it = do_item_alloc(key, nkey, flags, exptime, nbytes, no_addr);
+    if (it == NULL) {
+        vi.stats.misses ++;
+        return NULL;
+    }
+    item_memcpy_to(it, 0, vi.out, nbytes, false);
+    do_item_link(it, key, hv);
+    vi.stats.hits ++;
+
+    /* do_item_alloc left the caller's reference on the item. */
+    return it;
+}
+
+
+bool do_victim_delete(const char* key, const size_t nkey, const uint32_t hv) {
+    victim_t** pos;
+
+    if (vi.count == 0) {
+        return false;
+    }
+
+    pos = victim_find(key, nkey, hv);
+    if (*pos == NULL) {
+        return false;
+    }
+    victim_free(pos);
+    return true;
+}
+
+
+void do_victim_flush_expired(void) {
+    victim_t *v, *prev;
+
+    /* victims are kept in eviction order, not access order, so we have to
+     * look at all of them. */
+    for (v = vi.tail; v != NULL; v = prev) {
+        prev = v->prev;
+        if (v->time >= settings.oldest_live) {
+            victim_free(victim_find(v->data, v->nkey, hash(v->data, v->nkey, 0)));
+        }
+    }
+}
+
+
+#if defined(HAVE_REGEX_H)
+void do_victim_expire_regex(const regex_t* regex) {
+    victim_t *v, *prev;
+
+    for (v = vi.tail; v != NULL; v = prev) {
+        prev = v->prev;
+        if (regexec(regex, v->data, 0, NULL, 0) == 0) {
+            victim_free(victim_find(v->data, v->nkey, hash(v->data, v->nkey, 0)));
+        }
+    }
+}
+#endif /* #if defined(HAVE_REGEX_H) */
+
+
+char* do_victim_stats(size_t* result_size) {
+    size_t bufsize = 1024, offset = 0;
+    char* buffer = malloc(bufsize);
+    char terminator[] = "END\r\n";
+    const uint64_t lookups = vi.stats.hits + vi.stats.misses;
+
+    if (buffer == NULL) {
+        *result_size = 0;
+        return NULL;
+    }
+
+    offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                              "STAT victim_limit %lu\r\n"
+                              "STAT victim_bytes %lu\r\n"
+                              "STAT victim_items %lu\r\n"
+                              "STAT victim_inserts %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT victim_evictions %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT victim_rejects %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT victim_hits %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT victim_misses %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT victim_hit_rate %g%%\r\n"
+                              "STAT victim_value_bytes %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT victim_stored_bytes %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT victim_compression_ratio %.2f\r\n",
+                              (unsigned long) victim_limit(),
+                              (unsigned long) vi.bytes,
+                              (unsigned long) vi.count,
+                              vi.stats.inserts,
+                              vi.stats.evictions,
+                              vi.stats.rejects,
+                              vi.stats.hits,
+                              vi.stats.misses,
+                              lookups == 0 ? 0.0 : (double) vi.stats.hits * 100 / lookups,
+                              vi.value_bytes,
+                              vi.stored_bytes,
+                              vi.stored_bytes == 0 ? 1.0 : (double) vi.value_bytes / vi.stored_bytes);
+    offset = append_to_buffer(buffer, bufsize, offset, 0, terminator);
+
+    *result_size = offset;
+    return buffer;
+}
@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#if !defined(_victim_h_)
+#define _victim_h_
+
+#include "generic.h"
+
+#if defined(HAVE_REGEX_H)
+#include <regex.h>
+#endif /* #if defined(HAVE_REGEX_H) */
+
+/*
+ * the victim tier keeps recently evicted items, compressed, in memory set aside
+ * with the -V option.  a get that misses the hash table looks here and moves
+ * the item back into the cache.  all of these must be called with the cache
+ * lock held.
+ */
+
+#define VICTIM_HASHPOWER   16     /* number of hash buckets, as a power of 2 */
+#define VICTIM_MIN_NBYTES  64     /* values smaller than this are stored as is. */
+
+extern void victim_init(void);
+
+/* copies an item that is being evicted into the victim tier, evicting the
+ * oldest victims if the tier is full. */
+extern void do_victim_insert(item* it, const char* key);
+
+/* looks for a key, whose hash value is hv, in the victim tier.  on a hit, the
+ * item is removed from the tier, allocated and linked again, and returned with
+ * a reference held. */
+extern item* do_victim_promote(const char* key, const size_t nkey, const uint32_t hv);
+
+/* drops the key's victim, if it has one, so that a later get doesn't bring
+ * back a value that was deleted or overwritten.  returns true if there was
+ * one. */
+extern bool do_victim_delete(const char* key, const size_t nkey, const uint32_t hv);
+extern bool victim_delete(const char* key, const size_t nkey);
+
+/* drops the victims that flush_all made invalid.  older ones are dropped
+ * lazily by do_victim_promote. */
+extern void do_victim_flush_expired(void);
+
+#if defined(HAVE_REGEX_H)
+/* drops every victim whose key matches the regex. */
+extern void do_victim_expire_regex(const regex_t* regex);
+#endif /* #if defined(HAVE_REGEX_H) */
+
+DECL_MT_FUNC(char*, victim_stats, (size_t* result_size));
+
+#endif /* #if !defined(_victim_h_) */
@@ -0,0 +1,552 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Warm-up from a peer.  Both halves live here: "dump_keys", which a peer
+ * answers, and the loader thread of a server started with -A.
+ *
+ * The peer walks its cache on the maintenance thread, a slice of the hash
+ * table at a time under the cache lock, copying each item's key, size, expiry
+ * and last access, then sorts the copies by last access with the lock let go.
+ * The loader then fetches the values with plain gets, so that the peer never
+ * holds the cache lock for long, and items it has dropped or changed since
+ * the dump are simply missed or fetched as they are now.
+ */
+#include "generic.h"
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "memcached.h"
+
+#define WARMUP_READ_SIZE 16384
+
+/* an item listed by dump_keys. */
+typedef struct warmup_entry_s warmup_entry_t;
+struct warmup_entry_s {
+    rel_time_t atime;
+    time_t     exptime;     /* absolute; 0 for never */
+    size_t     ntotal;
+    size_t     key;         /* offset of the key in the key buffer */
+    size_t     nkey;
+};
+
+typedef struct warmup_list_s warmup_list_t;
+struct warmup_list_s {
+    warmup_entry_t* entries;
+    size_t          count;
+    size_t          size;
+    char*           keys;   /* the keys, each NUL-terminated */
+    size_t          keys_used;
+    size_t          keys_size;
+    bool            oom;
+};
+
+typedef struct warmup_reader_s warmup_reader_t;
+struct warmup_reader_s {
+    int    fd;
+    char   buf[WARMUP_READ_SIZE];
+    size_t pos;
+    size_t used;
+};
+
+static struct {
+    struct sockaddr_in addr;
+    size_t             budget;
+
+    pthread_mutex_t    lock;    /* guards the fields below */
+    const char*        state;
+    uint64_t           keys;    /* listed by the peer */
+    uint64_t           loaded;
+    uint64_t           skipped; /* already in the cache, or no room */
+    uint64_t           missed;  /* gone from the peer by the time we asked */
+    uint64_t           bytes;
+} wu;
+
+
+/******************************** DUMP_KEYS **********************************/
+
+static bool warmup_list_add(warmup_list_t* list, const char* key, const size_t nkey,
+                            const rel_time_t atime, const time_t exptime,
+                            const size_t ntotal) {
+    warmup_entry_t* e;
+
+    if (list->count == list->size) {
+        size_t size = list->size == 0 ? 1024 : list->size * 2;
+        warmup_entry_t* entries = realloc(list->entries, size * sizeof(warmup_entry_t));
+
+        if (entries == NULL) {
+            return false;
+        }
+        list->entries = entries;
+        list->size = size;
+    }
+    if (list->keys_used + nkey + 1 > list->keys_size) {
+        size_t size = list->keys_size == 0 ? 65536 : list->keys_size * 2;
+        char* keys = realloc(list->keys, size);
+
+        if (keys == NULL) {
+            return false;
+        }
+        list->keys = keys;
+        list->keys_size = size;
+    }
+
+    e = &list->entries[list->count++];
+    e->atime = atime;
+    e->exptime = exptime;
+    e->ntotal = ntotal;
+    e->key = list->keys_used;
+    e->nkey = nkey;
+    memcpy(list->keys + list->keys_used, key, nkey);
+    list->keys[list->keys_used + nkey] = '\0';
+    list->keys_used += nkey + 1;
+    return true;
+}
+
+
+/* runs with the cache lock held. */
+static void warmup_collect(item* it, const char* key, void* arg) {
+    warmup_list_t* list = arg;
+    const size_t nkey = ITEM_nkey(it);
+    size_t i;
+
+    if (list->oom || ITEM_is_deleted(it) ||
+        (ITEM_exptime(it) != 0 && ITEM_exptime(it) <= current_time) ||
+        (settings.oldest_live != 0 && settings.oldest_live <= current_time &&
+         ITEM_time(it) <= settings.oldest_live)) {
+        return;
+    }
+    /* keys stored over the binary protocol may not be fetchable with a get. */
+    for (i = 0; i < nkey; i++) {
+        if ((unsigned char) key[i] <= ' ') {
+            return;
+        }
+    }
+
+    if (! warmup_list_add(list, key, nkey, item_last_access(it),
+                          ITEM_exptime(it) == 0 ? 0 : started + ITEM_exptime(it),
+                          ITEM_ntotal(it))) {
+        list->oom = true;
+    }
+}
+
+
+static int warmup_entry_compare(const void* a, const void* b) {
+    const warmup_entry_t *ea = a, *eb = b;
+
+    /* most recent first. */
+    return ea->atime > eb->atime ? -1 : ea->atime < eb->atime ? 1 : 0;
+}
+
+
+char* warmup_dump_keys(const size_t budget, size_t* result_size) {
+    warmup_list_t list;
+    size_t count, total = 0, bufsize = sizeof("END\r\n"), offset = 0;
+    char* buffer;
+
+    memset(&list, 0, sizeof(list));
+    maintenance_walk(warmup_collect, &list);
+    if (list.oom) {
+        free(list.entries);
+        free(list.keys);
+        *result_size = 0;
+        return NULL;
+    }
+
+    qsort(list.entries, list.count, sizeof(warmup_entry_t), warmup_entry_compare);
+    for (count = 0; count < list.count; count++) {
+        if (total + list.entries[count].ntotal > budget) {
+            break;
+        }
+        total += list.entries[count].ntotal;
+        /* KEY <key> <exptime>\r\n */
+        bufsize += list.entries[count].nkey + 4 + 1 + 20 + 2;
+    }
+
+    if ((buffer = malloc(bufsize)) != NULL) {
+        size_t ix;
+
+        for (ix = 0; ix < count; ix++) {
+            const warmup_entry_t* e = &list.entries[ix];
+
+            offset += sprintf(buffer + offset, "KEY %s %lu\r\n", list.keys + e->key,
+                              (unsigned long) e->exptime);
+        }
+        memcpy(buffer + offset, "END\r\n", 5);
+        offset += 5;
+    }
+
+    free(list.entries);
+    free(list.keys);
+    *result_size = offset;
+    return buffer;
+}
+
+
+/********************************* LOADER ************************************/
+
+static void warmup_set_state(const char* state) {
+    pthread_mutex_lock(&wu.lock);
+    wu.state = state;
+    pthread_mutex_unlock(&wu.lock);
+
+    if (settings.verbose > 0) {
+        fprintf(stderr, "warm-up from %s: %s\n", settings.warmup, state);
+    }
+}
+
+
+static bool warmup_write(const int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t res = send(fd, buf, len, MSG_NOSIGNAL);
+
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            return false;
+        }
+        buf += res;
+        len -= res;
+    }
+    return true;
+}
+
+
+static bool warmup_fill(warmup_reader_t* r) {
+    ssize_t res;
+
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->used - r->pos);
+        r->used -= r->pos;
+        r->pos = 0;
+    }
+    do {
+        res = read(r->fd, r->buf + r->used, sizeof(r->buf) - r->used);
+    } while (res < 0 && errno == EINTR);
+    if (res <= 0) {
+        return false;
+    }
+    r->used += res;
+    return true;
+}
+
+
+/* returns the next line, NUL-terminated without its CR-LF, or NULL if the
+ * connection failed. */
+static char* warmup_read_line(warmup_reader_t* r) {
+    while (1) {
+        char* el = memchr(r->buf + r->pos, '\n', r->used - r->pos);
+
+        if (el != NULL) {
+            char* line = r->buf + r->pos;
+
+            r->pos = el - r->buf + 1;
+            if (el > line && el[-1] == '\r') {
+                el--;
+            }
+            *el = '\0';
+            return line;
+        }
+        if ((r->pos == 0 && r->used == sizeof(r->buf)) || ! warmup_fill(r)) {
+            return NULL;
+        }
+    }
+}
+
+
+static bool warmup_read_bytes(warmup_reader_t* r, char* dst, size_t len) {
+    while (len > 0) {
+        size_t avail = r->used - r->pos;
+
+        if (avail == 0) {
+            if (! warmup_fill(r)) {
+                return false;
+            }
+            continue;
+        }
+        if (avail > len) {
+            avail = len;
+        }
+        memcpy(dst, r->buf + r->pos, avail);
+        r->pos += avail;
+        dst += avail;
+        len -= avail;
+    }
+    return true;
+}
+
+
+static bool warmup_read_keys(warmup_reader_t* r, warmup_list_t* list) {
+    char request[64];
+    char* line;
+
+    snprintf(request, sizeof(request), "dump_keys %lu\r\n", (unsigned long) wu.budget);
+    if (! warmup_write(r->fd, request, strlen(request))) {
+        return false;
+    }
+
+    while ((line = warmup_read_line(r)) != NULL) {
+        char* key;
+        char* space;
+
+        if (strcmp(line, "END") == 0) {
+            return true;
+        }
+        if (strncmp(line, "KEY ", 4) != 0 || (space = strchr(line + 4, ' ')) == NULL) {
+            return false;
+        }
+        key = line + 4;
+        *space = '\0';
+        if (! warmup_list_add(list, key, space - key, 0,
+                              (time_t) strtoul(space + 1, NULL, 10), 0)) {
+            return false;
+        }
+        pthread_mutex_lock(&wu.lock);
+        wu.keys++;
+        pthread_mutex_unlock(&wu.lock);
+    }
+    return false;
+}
+
+
+/* adds a value the peer sent, unless a client has stored the key since. */
+static void warmup_store(warmup_entry_t* e, char* key, const int flags,
+                         const char* data, const size_t nbytes) {
+    const rel_time_t exptime = realtime(e->exptime);
+    bool stored = false;
+    item* it;
+
+    if (exptime != 0 && exptime <= current_time) {
+        pthread_mutex_lock(&wu.lock);
+        wu.missed++;
+        pthread_mutex_unlock(&wu.lock);
+        return;
+    }
+
+    it = item_alloc(key, e->nkey, flags, exptime, nbytes, wu.addr.sin_addr);
+    if (it != NULL) {
+        item_memcpy_to(it, 0, data, nbytes, false);
+        stored = store_item(it, NREAD_ADD, key);
+        item_deref(it);
+    }
+
+    pthread_mutex_lock(&wu.lock);
+    if (stored) {
+        wu.loaded++;
+        wu.bytes += nbytes;
+    } else {
+        wu.skipped++;
+    }
+    pthread_mutex_unlock(&wu.lock);
+}
+
+
+/* fetches the keys from first on, and adds them.  returns the number of keys
+ * dealt with, or 0 if the connection failed. */
+static size_t warmup_load_batch(warmup_reader_t* r, warmup_list_t* list,
+                                const size_t first, char** data, size_t* data_size) {
+    const size_t last = first + WARMUP_BATCH_KEYS < list->count ?
+        first + WARMUP_BATCH_KEYS : list->count;
+    char request[4 + WARMUP_BATCH_KEYS * (KEY_MAX_LENGTH + 1) + 2];
+    size_t len = 3, next = first, ix;
+    char* line;
+
+    memcpy(request, "get", 3);
+    for (ix = first; ix < last; ix++) {
+        request[len++] = ' ';
+        memcpy(request + len, list->keys + list->entries[ix].key, list->entries[ix].nkey);
+        len += list->entries[ix].nkey;
+    }
+    memcpy(request + len, "\r\n", 2);
+    if (! warmup_write(r->fd, request, len + 2)) {
+        return 0;
+    }
+
+    while ((line = warmup_read_line(r)) != NULL) {
+        char key[KEY_MAX_LENGTH + 1];
+        unsigned int flags;
+        unsigned long nbytes;
+
+        if (strcmp(line, "END") == 0) {
+            pthread_mutex_lock(&wu.lock);
+            wu.missed += last - next;
+            pthread_mutex_unlock(&wu.lock);
+            return last - first;
+        }
+        if (sscanf(line, "VALUE %250s %u %lu", key, &flags, &nbytes) != 3) {
+            return 0;
+        }
+
+        if (nbytes + 2 > *data_size) {
+            char* newdata = realloc(*data, nbytes + 2);
+
+            if (newdata == NULL) {
+                return 0;
+            }
+            *data = newdata;
+            *data_size = nbytes + 2;
+        }
+        if (! warmup_read_bytes(r, *data, nbytes + 2)) {
+            return 0;
+        }
+
+        /* the values come back in the order they were asked for, without the
+         * misses. */
+        while (next < last && strcmp(list->keys + list->entries[next].key, key) != 0) {
+            next++;
+            pthread_mutex_lock(&wu.lock);
+            wu.missed++;
+            pthread_mutex_unlock(&wu.lock);
+        }
+        if (next == last) {
+            return 0;
+        }
+        warmup_store(&list->entries[next], list->keys + list->entries[next].key,
+                     flags, *data, nbytes);
+        next++;
+    }
+    return 0;
+}
+
+
+static void* warmup_loop(void* arg) {
+    warmup_reader_t* r = malloc(sizeof(warmup_reader_t));
+    warmup_list_t list;
+    char* data = NULL;
+    size_t data_size = 0, done = 0;
+    int flags = 1;
+
+    STATS_SET_TLS(0);   /* shares the main thread's stats */
+    memset(&list, 0, sizeof(list));
+
+    if (r == NULL || (r->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        free(r);
+        warmup_set_state("failed");
+        return NULL;
+    }
+    r->pos = r->used = 0;
+    if (connect(r->fd, (struct sockaddr*) &wu.addr, sizeof(wu.addr)) != 0) {
+        close(r->fd);
+        free(r);
+        warmup_set_state("failed");
+        return NULL;
+    }
+    setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, (void*) &flags, sizeof(flags));
+
+    warmup_set_state("listing");
+    if (! warmup_read_keys(r, &list)) {
+        warmup_set_state("failed");
+    } else {
+        size_t res = 1;
+
+        warmup_set_state("loading");
+        while (done < list.count && (res = warmup_load_batch(r, &list, done, &data, &data_size)) > 0) {
+            done += res;
+        }
+        warmup_set_state(res > 0 ? "done" : "failed");
+    }
+
+    close(r->fd);
+    free(r);
+    free(data);
+    free(list.entries);
+    free(list.keys);
+    return NULL;
+}
+
+
+void warmup_init(void) {
+    char spec[256];
+    char* comma;
+    char* colon;
+    struct addrinfo hints, *ai;
+    pthread_t thread;
+    int port, ret;
+
+    pthread_mutex_init(&wu.lock, NULL);
+    if (settings.warmup == NULL) {
+        wu.state = "off";
+        return;
+    }
+
+    /* <host>:<port>[,<megabytes>] */
+    if (strlen(settings.warmup) >= sizeof(spec)) {
+        fprintf(stderr, "Bad warm-up peer %s\n", settings.warmup);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(spec, settings.warmup);
+    wu.budget = settings.maxbytes / 100 * WARMUP_BUDGET_PERCENT;
+    if ((comma = strchr(spec, ',')) != NULL) {
+        *comma = '\0';
+        wu.budget = (size_t) strtoul(comma + 1, NULL, 10) * 1024 * 1024;
+    }
+    colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec || (port = atoi(colon + 1)) <= 0 ||
+        port > 65535 || wu.budget == 0) {
+        fprintf(stderr, "Bad warm-up peer %s; use <host>:<port>[,<megabytes>]\n",
+                settings.warmup);
+        exit(EXIT_FAILURE);
+    }
+    *colon = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(spec, NULL, &hints, &ai) != 0) {
+        fprintf(stderr, "Can't resolve warm-up peer %s\n", settings.warmup);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&wu.addr, ai->ai_addr, sizeof(wu.addr));
+    wu.addr.sin_port = htons(port);
+    freeaddrinfo(ai);
+
+    wu.state = "starting";
+    if ((ret = pthread_create(&thread, NULL, warmup_loop, NULL)) != 0) {
+        fprintf(stderr, "Can't create warm-up thread: %s\n", strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+char* warmup_stats(size_t* result_size) {
+    size_t bufsize = 1024, offset = 0;
+    char* buffer = malloc(bufsize);
+    char terminator[] = "END\r\n";
+
+    if (buffer == NULL) {
+        *result_size = 0;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&wu.lock);
+    offset = append_to_buffer(buffer, bufsize, offset, sizeof(terminator),
+                              "STAT warmup_peer %s\r\n"
+                              "STAT warmup_state %s\r\n"
+                              "STAT warmup_budget %lu\r\n"
+                              "STAT warmup_keys %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT warmup_loaded %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT warmup_loaded_bytes %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT warmup_skipped %" PRINTF_INT64_MODIFIER "u\r\n"
+                              "STAT warmup_missed %" PRINTF_INT64_MODIFIER "u\r\n",
+                              settings.warmup == NULL ? "none" : settings.warmup,
+                              wu.state,
+                              (unsigned long) wu.budget,
+                              wu.keys,
+                              wu.loaded,
+                              wu.bytes,
+                              wu.skipped,
+                              wu.missed);
+    pthread_mutex_unlock(&wu.lock);
+    offset = append_to_buffer(buffer, bufsize, offset, 0, terminator);
+
+    *result_size = offset;
+    return buffer;
+}
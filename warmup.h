@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#if !defined(_warmup_h_)
+#define _warmup_h_
+
+#include "generic.h"
+
+/*
+ * warm-up (-A) fills a new server from a peer, so that a replacement node
+ * doesn't have to be filled from the database.  a loader thread asks the
+ * peer for the keys of its most recently used items with "dump_keys", most
+ * recent first and up to a memory budget, then fetches them with gets in
+ * batches and adds them to the cache.  live traffic is served all along; an
+ * item that a client has stored in the meantime is left alone.
+ */
+
+#define WARMUP_BUDGET_PERCENT 90    /* default budget, in percent of the
+                                     * memory limit */
+#define WARMUP_BATCH_KEYS     100   /* keys fetched per get */
+
+/* starts the loader thread if a peer is configured.  must be called once the
+ * worker threads are running. */
+extern void warmup_init(void);
+
+/* lists the keys of the most recently used items, most recent first, until
+ * the items add up to budget bytes, in the form of the "dump_keys"
+ * command's response.  runs on the maintenance thread. */
+extern char* warmup_dump_keys(const size_t budget, size_t* result_size);
+
+extern char* warmup_stats(size_t* result_size);
+
+#endif /* #if !defined(_warmup_h_) */